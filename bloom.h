@@ -0,0 +1,317 @@
+/*
+ * Copyright (c) Seungyeob Choi
+ *
+ * Bloom filters of the tokens of stored streams, for the query command (see query.h) to rule
+ * out the parts of a stream that cannot hold what it looks for. A token is a run of letters,
+ * digits and bytes above 127; whitespace, punctuation and control bytes split them. Tokens
+ * longer than BLOOM_TOKEN_MAX bytes, which no query string holds, are left out.
+ *
+ * A filter has BLOOM_BITS bits in 64-bit words. A token sets BLOOM_HASHES bits of one word,
+ * all taken from a 64-bit hash of the token, case and all: the word first, and then 6 bits
+ * for each bit in it. Looking a token up, or adding it, touches that word only, at the cost
+ * of a few more false positives than bits spread over the whole filter.
+ *
+ * A filter is built as the bytes come: bloom_scan() adds the tokens they complete, and keeps
+ * the one they end in for the bytes that follow. The bytes are classified 64 at a time into a
+ * mask of those that are part of tokens, with AVX2 where the CPU has it, and where tokens start
+ * and end is found with bit scans rather than a branch per byte. A filter of all zeros, as a
+ * hole in a file of them reads, rules nothing out.
+ */
+#ifndef BLOOM_H
+#define BLOOM_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>     // memcpy()
+
+#if defined(__x86_64__)
+#include <immintrin.h>  // _mm256_movemask_epi8()
+#endif
+
+#define BLOOM_WORD_SHIFT 8
+#define BLOOM_WORDS (1 << BLOOM_WORD_SHIFT)
+#define BLOOM_BITS (64 * BLOOM_WORDS)
+#define BLOOM_BYTES (BLOOM_BITS / 8)
+#define BLOOM_HASHES 4
+#define BLOOM_TOKEN_MAX 256
+
+// the token the bytes scanned so far end in
+struct bloom_token
+{
+    uint32_t len;                   // up to BLOOM_TOKEN_MAX + 1, for one too long
+    char bytes[BLOOM_TOKEN_MAX];
+};
+
+static unsigned char bloom_token_byte[256];
+
+// the bytes of n that are part of tokens, a bit each
+static inline uint64_t bloom_mask_sw(const unsigned char *p, size_t n)
+{
+    uint64_t mask = 0;
+    for ( size_t k = 0; k < n; k++ )
+        mask |= (uint64_t) bloom_token_byte[p[k]] << k;
+    return mask;
+}
+
+static uint64_t (*bloom_mask)(const unsigned char *p) = NULL;
+
+#if defined(__x86_64__)
+// 32 bytes: digits and letters by unsigned range, moved to the bottom of the signed range, and
+// bytes above 127 by their top bit
+__attribute__((target("avx2")))
+static inline uint32_t bloom_mask32(const unsigned char *p)
+{
+    __m256i c = _mm256_loadu_si256((const __m256i *) p);
+    __m256i digit = _mm256_add_epi8(c, _mm256_set1_epi8((char) ( 128 - '0' )));
+    __m256i letter = _mm256_add_epi8(_mm256_or_si256(c, _mm256_set1_epi8(0x20)), _mm256_set1_epi8((char) ( 128 - 'a' )));
+    __m256i token = _mm256_or_si256(_mm256_cmpgt_epi8(_mm256_set1_epi8(-128 + 10), digit),
+        _mm256_cmpgt_epi8(_mm256_set1_epi8(-128 + 26), letter));
+
+    return (uint32_t) _mm256_movemask_epi8(_mm256_or_si256(token, c));
+}
+
+__attribute__((target("avx2")))
+static uint64_t bloom_mask_avx2(const unsigned char *p)
+{
+    return bloom_mask32(p) | (uint64_t) bloom_mask32(p + 32) << 32;
+}
+#endif
+
+static uint64_t bloom_mask64_sw(const unsigned char *p)
+{
+    return bloom_mask_sw(p, 64);
+}
+
+// fills the table of the bytes tokens are made of, and picks the fastest way to classify them
+static inline void bloom_init(void)
+{
+    for ( int c = 0; c < 256; c++ )
+        bloom_token_byte[c] = ( ( 'a' <= c && c <= 'z' ) || ( 'A' <= c && c <= 'Z' ) || ( '0' <= c && c <= '9' ) || 128 <= c );
+
+    bloom_mask = bloom_mask64_sw;
+#if defined(__x86_64__)
+    if ( __builtin_cpu_supports("avx2") )
+        bloom_mask = bloom_mask_avx2;
+#endif
+}
+
+static inline uint64_t bloom_mix(uint64_t h, uint64_t v)
+{
+    h = ( h ^ v ) * 0xbf58476d1ce4e5b9ull;
+    return h ^ ( h >> 31 );
+}
+
+static inline uint64_t bloom_final(uint64_t h)
+{
+    h *= 0x94d049bb133111ebull;
+    return h ^ ( h >> 32 );
+}
+
+// the bytes of a word that the first n bytes of memory are in, on a little-endian host
+static const uint64_t bloom_first[9] =
+{
+    0, 0xff, 0xffff, 0xffffff, 0xffffffff, 0xffffffffffull, 0xffffffffffffull, 0xffffffffffffffull, ~0ull
+};
+
+// The hash of a token of len bytes, 1 or more, taken 8 at a time, the last ones padded with
+// zeros, and in two words at least.
+static inline uint64_t bloom_hash(const char *p, size_t len)
+{
+    uint64_t h = len * 0x9e3779b97f4a7c15ull;
+    uint64_t v;
+    size_t n = len;
+
+    for ( ; 8 < n; p += 8, n -= 8 )
+    {
+        memcpy(&v, p, 8);
+        h = bloom_mix(h, v);
+    }
+
+    v = 0;
+    memcpy(&v, p, n);
+    h = bloom_mix(h, v);
+    if ( len <= 8 )
+        h = bloom_mix(h, 0);
+    return bloom_final(h);
+}
+
+// bloom_hash() of a token of 1 to 16 bytes that 16 bytes can be read from, with no branch on
+// its length; on a little-endian host only
+static inline uint64_t bloom_hash16(const char *p, size_t len)
+{
+    uint64_t a, b;
+
+    memcpy(&a, p, 8);
+    memcpy(&b, p + 8, 8);
+    a &= bloom_first[len < 8 ? len : 8];
+    b &= bloom_first[len > 8 ? len - 8 : 0];
+    return bloom_final(bloom_mix(bloom_mix(len * 0x9e3779b97f4a7c15ull, a), b));
+}
+
+// the word of a filter a hash sets bits of, and the bits
+static inline uint64_t bloom_bits(uint64_t h, size_t *word)
+{
+    uint64_t bits = 0;
+
+    *word = h & ( BLOOM_WORDS - 1 );
+    h >>= BLOOM_WORD_SHIFT;
+    for ( int i = 0; i < BLOOM_HASHES; i++, h >>= 6 )
+        bits |= 1ull << ( h & 63 );
+    return bits;
+}
+
+static inline void bloom_add(unsigned char *filter, uint64_t h)
+{
+    size_t word;
+    uint64_t bits = bloom_bits(h, &word);
+    uint64_t v;
+
+    memcpy(&v, filter + 8 * word, 8);
+    v |= bits;
+    memcpy(filter + 8 * word, &v, 8);
+}
+
+static inline int bloom_may_hold(const unsigned char *filter, uint64_t h)
+{
+    size_t word;
+    uint64_t bits = bloom_bits(h, &word);
+    uint64_t v;
+
+    memcpy(&v, filter + 8 * word, 8);
+    return bits == ( v & bits );
+}
+
+// of no token, or never written
+static inline int bloom_empty(const unsigned char *filter)
+{
+    uint64_t any = 0;
+    for ( size_t i = 0; i < BLOOM_BYTES; i += 8 )
+    {
+        uint64_t v;
+        memcpy(&v, filter + i, 8);
+        any |= v;
+    }
+
+    return 0 == any;
+}
+
+// whether a filter rules out a part of a stream that holds all of n tokens
+static inline int bloom_rules_out(const unsigned char *filter, const uint64_t *hashes, size_t n)
+{
+    for ( size_t i = 0; i < n; i++ )
+    {
+        if ( !bloom_may_hold(filter, hashes[i]) )
+            return !bloom_empty(filter);
+    }
+
+    return 0;
+}
+
+// adds the token t holds, if it is not too long, and starts the next one
+static inline void bloom_end_token(unsigned char *filter, struct bloom_token *t)
+{
+    if ( 0 != t->len && t->len <= BLOOM_TOKEN_MAX )
+        bloom_add(filter, bloom_hash(t->bytes, t->len));
+    t->len = 0;
+}
+
+// adds n bytes to the token t holds
+static inline void bloom_extend(struct bloom_token *t, const char *p, size_t n)
+{
+    if ( t->len + n > BLOOM_TOKEN_MAX )
+    {
+        t->len = BLOOM_TOKEN_MAX + 1;
+        return;
+    }
+
+    memcpy(t->bytes + t->len, p, n);
+    t->len += n;
+}
+
+// adds the token that runs from start to end of the len bytes of data, the bytes t holds
+// before it if carried
+static inline void bloom_token(unsigned char *filter, struct bloom_token *t, int carried,
+    const char *data, size_t len, size_t start, size_t end)
+{
+    if ( carried )
+    {
+        bloom_extend(t, data, end);
+        bloom_end_token(filter, t);
+    }
+    else if ( __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__ && end - start <= 16 && start + 16 <= len )
+        bloom_add(filter, bloom_hash16(data + start, end - start));
+    else if ( end - start <= BLOOM_TOKEN_MAX )
+        bloom_add(filter, bloom_hash(data + start, end - start));
+}
+
+// adds the tokens that len bytes of data complete to the filter, and keeps the one they end in
+static inline void bloom_scan(unsigned char *filter, struct bloom_token *t, const char *data, size_t len)
+{
+    const unsigned char *p = (const unsigned char *) data;
+    int carried = ( 0 != t->len );
+    uint64_t in_token = carried;
+    size_t start = 0;
+
+    for ( size_t base = 0; base < len; base += 64 )
+    {
+        size_t n = ( len - base < 64 ) ? len - base : 64;
+        uint64_t mask = ( 64 == n ) ? bloom_mask(p + base) : bloom_mask_sw(p + base, n);
+
+        uint64_t valid = ( 64 == n ) ? ~0ull : ( 1ull << n ) - 1;
+        uint64_t before = mask << 1 | in_token;
+        uint64_t starts = mask & ~before;
+        uint64_t ends = ~mask & before & valid;
+
+        while ( 0 != ( starts | ends ) )
+        {
+            if ( in_token )
+            {
+                bloom_token(filter, t, carried, data, len, start, base + __builtin_ctzll(ends));
+                ends &= ends - 1;
+                carried = 0;
+                in_token = 0;
+            }
+            else
+            {
+                start = base + __builtin_ctzll(starts);
+                starts &= starts - 1;
+                in_token = 1;
+            }
+        }
+    }
+
+    // the token the bytes end in goes on into those after
+    if ( in_token )
+    {
+        if ( !carried )
+            t->len = 0;
+        bloom_extend(t, data + start, len - start);
+    }
+}
+
+// Hashes the tokens that every match of a query string holds whole: all of them for a match of
+// whole tokens, and otherwise those with a separator on both sides in the string.
+// returns how many, up to max
+static inline size_t bloom_tokens(const char *s, size_t len, int whole, uint64_t *hashes, size_t max)
+{
+    const unsigned char *p = (const unsigned char *) s;
+    size_t n = 0;
+    size_t i = 0;
+
+    while ( i < len && n < max )
+    {
+        while ( i < len && !bloom_token_byte[p[i]] )
+            i++;
+
+        size_t start = i;
+        while ( i < len && bloom_token_byte[p[i]] )
+            i++;
+
+        if ( start != i && ( whole || ( 0 != start && i != len ) ) )
+            hashes[n++] = bloom_hash(s + start, i - start);
+    }
+
+    return n;
+}
+
+#endif
@@ -0,0 +1,174 @@
+/*
+ * Copyright (c) Seungyeob Choi
+ *
+ * Content-defined chunking, FastCDC style, and chunk fingerprints, shared by the server's
+ * dedup stage (server -D) and anything that has to cut the same chunks.
+ *
+ * A gear hash rolls over the bytes of the chunk, one shift and one table lookup per byte,
+ * and the chunk ends where the top bits of the hash are all zero. The first CDC_MIN bytes
+ * are skipped, up to CDC_AVG a stricter mask makes a cut less likely and past it a looser one
+ * more likely, so chunk sizes gather around CDC_AVG, and CDC_MAX ends the chunk regardless.
+ * As the hash depends on the last 64 bytes only, an insertion moves the cuts near it and
+ * leaves the others where they were.
+ *
+ * The fingerprint of a chunk is its 128-bit MurmurHash3 (x64 variant).
+ */
+#ifndef CDC_H
+#define CDC_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>     // memcpy()
+
+#define CDC_MIN 2048
+#define CDC_AVG 8192
+#define CDC_MAX 65536
+
+// the top 15 bits below CDC_AVG, the top 11 above; 13 bits would give CDC_AVG on average
+#define CDC_MASK_S 0xfffe000000000000ull
+#define CDC_MASK_L 0xffe0000000000000ull
+
+static uint64_t cdc_gear[256];
+
+// fills the gear table; the same everywhere, so that every side cuts the same chunks
+static inline void cdc_init(void)
+{
+    uint64_t x = 0x6364632d67656172ull;    // "cdc-gear"
+
+    for ( int i = 0; i < 256; i++ )
+    {
+        // splitmix64
+        uint64_t z = ( x += 0x9e3779b97f4a7c15ull );
+        z = ( z ^ ( z >> 30 ) ) * 0xbf58476d1ce4e5b9ull;
+        z = ( z ^ ( z >> 27 ) ) * 0x94d049bb133111ebull;
+        cdc_gear[i] = z ^ ( z >> 31 );
+    }
+}
+
+// where a chunk cut so far has got to, so that it can be carried on with the next bytes
+struct cdc_state
+{
+    uint64_t hash;
+    size_t size;                    // bytes of the chunk so far
+};
+
+// Scans data for the end of the current chunk. Returns the number of bytes of data that
+// complete it, with *cut set, or len with *cut clear if the chunk goes on past data.
+// The state is reset after a cut.
+static inline size_t cdc_scan(struct cdc_state *st, const unsigned char *data, size_t len, int *cut)
+{
+    uint64_t hash = st->hash;
+    size_t size = st->size;
+    size_t i = 0;
+
+    *cut = 0;
+
+    // the first CDC_MIN bytes of a chunk never end it, and are not even hashed
+    if ( size < CDC_MIN )
+    {
+        size_t skip = CDC_MIN - size;
+        if ( skip >= len )
+        {
+            st->size = size + len;
+            return len;
+        }
+        i = skip;
+        size = CDC_MIN;
+    }
+
+    for ( ; i < len; i++ )
+    {
+        hash = ( hash << 1 ) + cdc_gear[data[i]];
+        size++;
+
+        if ( !( hash & ( size < CDC_AVG ? CDC_MASK_S : CDC_MASK_L ) ) || CDC_MAX <= size )
+        {
+            *cut = 1;
+            st->hash = 0;
+            st->size = 0;
+            return i + 1;
+        }
+    }
+
+    st->hash = hash;
+    st->size = size;
+    return len;
+}
+
+static inline uint64_t cdc_rotl(uint64_t x, int r)
+{
+    return ( x << r ) | ( x >> ( 64 - r ) );
+}
+
+static inline uint64_t cdc_fmix(uint64_t k)
+{
+    k ^= k >> 33;
+    k *= 0xff51afd7ed558ccdull;
+    k ^= k >> 33;
+    k *= 0xc4ceb9fe1a85ec53ull;
+    k ^= k >> 33;
+    return k;
+}
+
+// the 128-bit MurmurHash3 of a chunk
+static inline void cdc_fingerprint(const void *chunk, size_t len, uint64_t fp[2])
+{
+    const unsigned char *data = (const unsigned char *) chunk;
+    const uint64_t c1 = 0x87c37b91114253d5ull;
+    const uint64_t c2 = 0x4cf5ad432745937full;
+    uint64_t h1 = 0;
+    uint64_t h2 = 0;
+    size_t blocks = len / 16;
+
+    for ( size_t i = 0; i < blocks; i++ )
+    {
+        uint64_t k1, k2;
+        memcpy(&k1, data + i * 16, 8);
+        memcpy(&k2, data + i * 16 + 8, 8);
+
+        k1 *= c1; k1 = cdc_rotl(k1, 31); k1 *= c2; h1 ^= k1;
+        h1 = cdc_rotl(h1, 27); h1 += h2; h1 = h1 * 5 + 0x52dce729;
+        k2 *= c2; k2 = cdc_rotl(k2, 33); k2 *= c1; h2 ^= k2;
+        h2 = cdc_rotl(h2, 31); h2 += h1; h2 = h2 * 5 + 0x38495ab5;
+    }
+
+    const unsigned char *tail = data + blocks * 16;
+    uint64_t k1 = 0;
+    uint64_t k2 = 0;
+
+    switch ( len & 15 )
+    {
+        case 15: k2 ^= (uint64_t) tail[14] << 48; // fall through
+        case 14: k2 ^= (uint64_t) tail[13] << 40; // fall through
+        case 13: k2 ^= (uint64_t) tail[12] << 32; // fall through
+        case 12: k2 ^= (uint64_t) tail[11] << 24; // fall through
+        case 11: k2 ^= (uint64_t) tail[10] << 16; // fall through
+        case 10: k2 ^= (uint64_t) tail[9] << 8;   // fall through
+        case 9:  k2 ^= (uint64_t) tail[8];
+                 k2 *= c2; k2 = cdc_rotl(k2, 33); k2 *= c1; h2 ^= k2;
+                 // fall through
+        case 8:  k1 ^= (uint64_t) tail[7] << 56;  // fall through
+        case 7:  k1 ^= (uint64_t) tail[6] << 48;  // fall through
+        case 6:  k1 ^= (uint64_t) tail[5] << 40;  // fall through
+        case 5:  k1 ^= (uint64_t) tail[4] << 32;  // fall through
+        case 4:  k1 ^= (uint64_t) tail[3] << 24;  // fall through
+        case 3:  k1 ^= (uint64_t) tail[2] << 16;  // fall through
+        case 2:  k1 ^= (uint64_t) tail[1] << 8;   // fall through
+        case 1:  k1 ^= (uint64_t) tail[0];
+                 k1 *= c1; k1 = cdc_rotl(k1, 31); k1 *= c2; h1 ^= k1;
+    }
+
+    h1 ^= len;
+    h2 ^= len;
+    h1 += h2;
+    h2 += h1;
+    h1 = cdc_fmix(h1);
+    h2 = cdc_fmix(h2);
+    h1 += h2;
+    h2 += h1;
+
+    fp[0] = h1;
+    fp[1] = h2;
+}
+
+#endif
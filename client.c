@@ -2,116 +2,2657 @@
  * Copyright (c) Seungyeob Choi
  *
  * A TCP client that manages multiple connections to a server and handles
- * all read and write operations in a single thread using epoll.
+ * all read and write operations in a single thread using epoll (see reactor.h).
+ *
+ * Usage: client [-u socket_path [-m] | -d] [-r count] [-e | -p channel | -C | -z] [filename]...
+ *        client -i count [-s step] [-P server_pid | -S channel]
+ *        client [-u socket_path] -f stream [-o offset] [-n bytes] filename
+ *        client [-u socket_path] -D filename...
+ *        client [-u socket_path] -V stream filename
+ *        client [-u socket_path] -q string | -Q string
+ *
+ *   -u socket_path  connect to the server's Unix-domain socket instead of HOST:PORT
+ *   -m              offer the server a shared-memory ring per connection (see shmring.h);
+ *                   connections whose offer is refused keep writing the socket
+ *   -d              send the files as UDP datagrams of DGRAM_LEN bytes to HOST:PORT instead,
+ *                   DGRAM_BATCH per sendmmsg(), and report the rate and the acknowledgements
+ *   -r count        churn benchmark: while the files are uploaded, a child process opens count
+ *                   more connections, CHURN_WINDOW at a time, and resets each one mid-stream
+ *   -p channel      publish the files on the channel (server -p), see pubsub.h
+ *   -S channel      with -i, subscribe the connections to the channel and report what they
+ *                   receive every second instead of measuring plateaus
+ *   -e              the server echoes (server -e): count what comes back instead of waiting
+ *                   for acknowledgements, and close a connection once all of it is back
+ *   -C              send the files as frames that carry their CRC32C (see frame.h), for the
+ *                   server to check, and compare the digest each file is acknowledged with
+ *                   to its own; over stream sockets only
+ *   -z              as -C, with the frames compressed if the server takes the codec (see lz.h),
+ *                   harder while the send queue stays full and less while it drains (see
+ *                   LZ_LEVELS), and report the compression ratio and the rate of file bytes
+ *   -i count        density test: ramp up to count idle connections to HOST:PORT and hold them
+ *                   until interrupted; the source address moves along 127.0.0.0/8 every
+ *                   IDLE_PER_SOURCE connections, as one address has only so many ephemeral ports
+ *   -s step         ramp step at a time, and report at every plateau the connect rate, the
+ *                   resident memory per connection, the round trip of a byte and its
+ *                   acknowledgement, and the throughput of a few busy connections among the idle
+ *   -P server_pid   also report the resident memory of the server, and have it print its
+ *                   counters (SIGUSR1) at every plateau
+ *   -f stream       fetch mode: read a stream stored by the server (server -w) into filename,
+ *                   from offset (-o) and up to bytes (-n), or all of it, with one fetch
+ *                   command per FETCH_CHUNK (see fetch.h), and report the throughput
+ *   -D              dedup upload (server -w -D): cut each file into chunks, send the server
+ *                   their fingerprints first and then only the chunks it asks for, one batch
+ *                   at a time (see upload.h), and report the bytes that crossed the wire
+ *   -V stream       delta upload (server -w): send filename as a new version of the stream,
+ *                   rsync style, as the blocks it shares with the old version and the bytes
+ *                   in between (see delta.h), and report the bytes that crossed the wire and
+ *                   the CPU time
+ *   -q string       query (server -w): print the lines of the stored streams that hold the
+ *                   string, as stream:offset:line (see query.h), and report how many bytes the
+ *                   server searched and how fast
+ *   -Q string       as -q, for the string as whole tokens, which lets the server skip what its
+ *                   Bloom filters rule out
+ *
+ * A connection that fails is closed and reported on its own; the others carry on.
+ * The upload throughput is reported at the end.
  */
+#define _GNU_SOURCE     // memfd_create(), sendmmsg(), recvmmsg(), memmem()
+
 #include <arpa/inet.h>  // inet_addr()
 #include <errno.h>
-#include <fcntl.h>
+#include <fcntl.h>      // F_ADD_SEALS
+#include <inttypes.h>   // SCNu64
+#include <netinet/in.h> // IP_BIND_ADDRESS_NO_PORT
+#include <signal.h>     // signal()
 #include <stdio.h>
 #include <stdlib.h>     // exit()
-#include <string.h>     // strncmp()
+#include <string.h>     // strncmp(), strlen(), strcpy()
 #include <sys/epoll.h>
-#include <unistd.h>     // read(), write(), close()
+#include <sys/eventfd.h>
+#include <sys/mman.h>   // memfd_create(), mmap()
+#include <sys/resource.h>   // setrlimit()
+#include <sys/socket.h> // sendmsg()
+#include <sys/stat.h>   // fstat()
+#include <sys/time.h>   // struct timeval
+#include <sys/un.h>     // struct sockaddr_un
+#include <sys/wait.h>   // waitpid()
+#include <time.h>       // clock_gettime()
+#include <unistd.h>     // read(), write(), close(), getopt(), ftruncate()
+
+#include "cdc.h"
+#include "crc32c.h"
+#include "delta.h"
+#include "fetch.h"
+#include "frame.h"
+#include "lz.h"
+#include "pubsub.h"
+#include "query.h"
+#include "reactor.h"
+#include "shmring.h"
+#include "upload.h"
+
+// bytes read from a file and written to the socket at a time; small writes cost a system call
+// each on both sides of the connection
+#define BUFLEN 16384
+#define PORT 8080
+#define HOST "127.0.0.1"
+
+// max number of events that can be returned by epoll at a time
+#define MAX_EVENTS 20
+
+// a datagram payload that fits an Ethernet frame with the IP and UDP headers,
+// and the number of datagrams handed to the kernel per system call
+#define DGRAM_LEN 1400
+#define DGRAM_BATCH 64
+
+// connections of the churn benchmark that are open at a time, and what each sends before its reset
+#define CHURN_WINDOW 256
+#define CHURN_BYTES 4096
+
+// connections of the density test per source address, well within ip_local_port_range,
+// and connects in flight at a time
+#define IDLE_PER_SOURCE 20000
+#define IDLE_CONNECTING 1024
+
+// at every plateau of the density test, IDLE_SAMPLE of the connections measure IDLE_ROUNDS
+// round trips and then load the server for IDLE_LOAD_SECONDS; the next step waits
+// IDLE_PLATEAU_SECONDS more
+#define IDLE_SAMPLE 256
+#define IDLE_ROUNDS 20
+#define IDLE_LOAD_SECONDS 2
+#define IDLE_PLATEAU_SECONDS 1
+
+// bytes asked for per fetch command, and read from the socket at a time
+#define FETCH_CHUNK (64 << 20)
+#define FETCH_BUFLEN (1 << 18)
+
+// Delta blocks are about as long as the square root of the file, as rsync has them, up to
+// DELTA_BLOCK_CAP: every scattered edit spoils a block, which costs more past that length
+// than the signatures of shorter blocks do.
+#define DELTA_BLOCK_CAP (8 << 10)
+
+// with -C, bytes of the file per frame, so that the frame and the one ending the file fit BUFLEN
+#define FRAME_PAYLOAD (BUFLEN - 2 * sizeof(struct frame_header))
+
+// With -z, frames are compressed at one of LZ_LEVELS levels, the acceleration of lz_compress()
+// at each, 0 not compressing at all. Every time the socket is writable again, a connection
+// moves up a level if it waited for the kernel to drain the send queue longer than it took to
+// fill it, as the link is the bottleneck, and down a level if it waited less than 1/LZ_IDLE of
+// that, as the link is waiting for it.
+#define LZ_LEVELS 4
+#define LZ_LEVEL_START 2
+#define LZ_IDLE 4
+static const unsigned lz_acceleration[LZ_LEVELS] = { 0, 32, 8, 1 };
+
+static size_t total_bytes_sent = 0;
+static size_t total_bytes_echoed = 0;
+static int failed_connections = 0;
+
+// uploads whose connection is still open
+static int live_connections = 0;
+
+// the server sends back everything (server -e) instead of acknowledging
+static int echo = 0;
+
+// the files go as frames checked by the server (-C)
+static int framed = 0;
+static int verified_files = 0;
+
+// and compressed, if the server takes the codec (-z)
+static int compress_frames = 0;
+static size_t total_file_bytes = 0;
+static size_t frames_at_level[LZ_LEVELS];
+static char frame_plain[FRAME_PAYLOAD];     // the file bytes of the frame being compressed
+
+struct shm_producer;
+
+struct connection_ctx
+{
+    struct endpoint ep;             // the socket, -1 once closed
+    FILE* fp;
+    char buffer[BUFLEN];
+    struct shm_producer *shm;       // set if the server accepted a shared-memory ring
+    size_t sent;                    // bytes written to the socket or the ring, and in echo mode,
+    size_t echoed;                  // how many of them have come back
+    uint64_t acked;                 // how many of them the server said it took care of
+    int counted;                    // its acknowledgements count the bytes; a durable server's do
+    int ack_state;                  // of the acknowledgement being read: the bytes of "Ack " matched,
+    uint64_t ack_count;             // and then the count so far
+    uint32_t crc;                   // with -C, of the file so far
+    int last_frame;                 // the frame in buffer ends the file
+    size_t frame_len;               // bytes of the frames in buffer
+    size_t frame_sent;              // how many of them have been written to the socket
+    int lz;                         // with -z, the server took the codec
+    unsigned level;                 // of the next frame, 0 for none
+    uint64_t filled_at;             // when the kernel last pushed back
+    uint64_t fill_ns;               // how long it took to fill the send queue then
+    struct connection_ctx *next;
+};
+
+// producer side of a shared-memory ring; the eventfd of ep is rung by the server after consuming
+struct shm_producer
+{
+    struct endpoint ep;
+    int data_fd;
+    struct shm_ring *ring;
+    size_t map_len;
+    unsigned spin;
+    struct connection_ctx *conn;
+};
+
+// the handlers of the endpoints of an upload
+static void handle_connection(int epollfd, struct endpoint *ep, uint32_t events);
+static void handle_doorbell(int epollfd, struct endpoint *ep, uint32_t events);
+
+static void release_shm_producer(int epollfd, struct shm_producer *shm)
+{
+    if ( NULL == shm->ring )
+        return;
+
+    if ( -1 != epollfd )
+        reactor_remove(epollfd, &shm->ep);
+
+    close(shm->data_fd);
+    close(shm->ep.fd);
+    shm->ep.fd = -1;
+    munmap(shm->ring, shm->map_len);
+    shm->ring = NULL;
+}
+
+static void clear_connection_ctx_list(struct connection_ctx *head)
+{
+    while ( NULL != head )
+    {
+        struct connection_ctx *next = head->next;
+
+        if ( -1 != head->ep.fd )
+        {
+            if ( -1 == close(head->ep.fd) )
+            {
+                switch ( errno )
+                {
+                    case EBADF:
+                    case EINTR:
+                    case EIO:
+                    default:
+                        fprintf(stderr, "socket close error (%d)\n", errno);
+                        break;
+                }
+            }
+        }
+
+        if ( NULL != head->fp )
+            fclose(head->fp);
+
+        if ( NULL != head->shm )
+        {
+            release_shm_producer(-1, head->shm);
+            free(head->shm);
+        }
+
+        free(head);
+
+        head = next;
+    }
+}
+
+// failures are reported but not fatal, as they concern this connection only
+static int close_connection(int epollfd, struct connection_ctx *conn)
+{
+    if ( NULL != conn->shm )
+        release_shm_producer(epollfd, conn->shm);
+
+    live_connections--;
+    return reactor_close(epollfd, &conn->ep);
+}
+
+// closes a connection that failed, leaving the others alone
+static void fail_connection(int epollfd, struct connection_ctx *conn, const char *what, int err)
+{
+    fprintf(stderr, "sock:%d, %s error (%d), connection closed\n", conn->ep.fd, what, err);
+
+    close_connection(epollfd, conn);
+    failed_connections++;
+}
+
+// closes the socket with a reset instead of an orderly shutdown
+static void reset_socket(int sockfd)
+{
+    struct linger linger;
+    linger.l_onoff = 1;
+    linger.l_linger = 0;
+
+    setsockopt(sockfd, SOL_SOCKET, SO_LINGER, &linger, sizeof(linger));
+    close(sockfd);
+}
+
+// opens count connections, CHURN_WINDOW at a time, and resets each of them once it has
+// sent CHURN_BYTES, so that the server keeps losing peers in the middle of their streams
+static void churn_connections(const struct sockaddr *servaddr, socklen_t servaddr_len, long count)
+{
+    static char payload[CHURN_BYTES];
+    memset(payload, 'r', sizeof(payload));
+
+    int window[CHURN_WINDOW];
+    for ( int i = 0; i < CHURN_WINDOW; i++ )
+        window[i] = -1;
+
+    long failed = 0;
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    for ( long i = 0; i < count; i++ )
+    {
+        int slot = i % CHURN_WINDOW;
+        if ( -1 != window[slot] )
+            reset_socket(window[slot]);
+
+        window[slot] = socket(servaddr->sa_family, SOCK_STREAM, 0);
+        if ( -1 == window[slot] )
+        {
+            failed++;
+            continue;
+        }
+
+        if ( -1 == connect(window[slot], servaddr, servaddr_len)
+            || -1 == send(window[slot], payload, sizeof(payload), MSG_NOSIGNAL) )
+        {
+            close(window[slot]);
+            window[slot] = -1;
+            failed++;
+        }
+    }
+
+    for ( int i = 0; i < CHURN_WINDOW; i++ )
+    {
+        if ( -1 != window[i] )
+            reset_socket(window[i]);
+    }
+
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    double elapsed = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    if ( elapsed <= 0 )
+        elapsed = 1e-9;
+
+    fprintf(stderr, "churn: %ld connections reset in %.3f s (%.0f/s), %ld failed\n",
+        count - failed, elapsed, (count - failed) / elapsed, failed);
+}
+
+// offers the server a shared-memory ring for this connection; must be called while the
+// socket is still blocking
+// returns NULL if the server refused it, in which case the socket is used as usual
+static struct shm_producer *offer_shm(int sockfd)
+{
+    size_t map_len = sizeof(struct shm_ring) + SHM_RING_SIZE;
+
+    int memfd = memfd_create("shmring", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if ( -1 == memfd )
+    {
+        fprintf(stderr, "memfd_create error (%d)\n", errno);
+        return NULL;
+    }
+
+    // sealed at its size, as the server will not map memory that could be cut from under it
+    struct shm_ring *ring = MAP_FAILED;
+    if ( 0 == ftruncate(memfd, map_len) && 0 == fcntl(memfd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW) )
+        ring = (struct shm_ring *) mmap(NULL, map_len, PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+
+    if ( MAP_FAILED == ring )
+    {
+        fprintf(stderr, "shared memory mapping error (%d)\n", errno);
+        close(memfd);
+        return NULL;
+    }
+
+    ring->magic = SHM_RING_MAGIC;
+    ring->size = SHM_RING_SIZE;
+
+    // the server sleeps until the first write
+    atomic_store(&ring->consumer_waiting, 1);
+
+    int fds[3];
+    fds[0] = memfd;
+    fds[1] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    fds[2] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+    char reply[SHM_REPLY_LEN];
+    size_t replied = 0;
+
+    if ( -1 != fds[1] && -1 != fds[2] )
+    {
+        char control[CMSG_SPACE(sizeof(fds))];
+        memset(control, 0, sizeof(control));
+
+        struct iovec iov;
+        iov.iov_base = (void *) SHM_OFFER;
+        iov.iov_len = SHM_OFFER_LEN;
+
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+        memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+        if ( SHM_OFFER_LEN == sendmsg(sockfd, &msg, MSG_NOSIGNAL) )
+        {
+            // a server that does not know the offer never answers it
+            struct timeval timeout = { 1, 0 };
+            setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+            while ( replied < SHM_REPLY_LEN )
+            {
+                ssize_t received = recv(sockfd, reply + replied, SHM_REPLY_LEN - replied, 0);
+                if ( 0 >= received )
+                    break;
+                replied += received;
+            }
+
+            timeout.tv_sec = 0;
+            setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        }
+    }
+
+    // the server holds its own reference to the memory if it took the ring
+    close(memfd);
+
+    if ( SHM_REPLY_LEN != replied || 0 != memcmp(reply, SHM_ACCEPT, SHM_REPLY_LEN) )
+    {
+        fprintf(stderr, "sock:%d, shared memory refused, using the socket\n", sockfd);
+
+        if ( -1 != fds[1] ) close(fds[1]);
+        if ( -1 != fds[2] ) close(fds[2]);
+        munmap(ring, map_len);
+        return NULL;
+    }
+
+    struct shm_producer *shm = (struct shm_producer *) calloc(1, sizeof(struct shm_producer));
+    if ( NULL == shm )
+    {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+
+    shm->ep.handle = handle_doorbell;
+    shm->ep.fd = fds[2];
+    shm->data_fd = fds[1];
+    shm->ring = ring;
+    shm->map_len = map_len;
+    shm->spin = SHM_SPIN_MIN;
+
+    return shm;
+}
+
+// Takes the acknowledgements in what the server sent: "Ack" alone, from a server that takes
+// care of bytes as they arrive, or with the count of bytes it took care of so far. One may be
+// cut across reads, so what was read of it is kept.
+// returns 1 if an acknowledgement without a count was among them
+static int take_acks(struct connection_ctx *conn, const char *data, size_t len)
+{
+    static const char ack[] = "Ack ";
+    int bare = 0;
+
+    for ( size_t i = 0; i < len; i++ )
+    {
+        char c = data[i];
+
+        if ( conn->ack_state < 3 )
+            conn->ack_state = ( ack[conn->ack_state] == c ) ? conn->ack_state + 1 : ( 'A' == c );
+        else if ( 3 == conn->ack_state && '\n' == c )
+        {
+            bare = 1;
+            conn->ack_state = 0;
+        }
+        else if ( 3 == conn->ack_state && ' ' == c )
+        {
+            conn->ack_count = 0;
+            conn->ack_state = 4;
+        }
+        else if ( 4 <= conn->ack_state && '0' <= c && '9' >= c )
+        {
+            conn->ack_count = conn->ack_count * 10 + (uint64_t) ( c - '0' );
+            conn->ack_state = 5;
+        }
+        else if ( 5 == conn->ack_state && '\n' == c )
+        {
+            conn->acked = conn->ack_count;
+            conn->counted = 1;
+            conn->ack_state = 0;
+        }
+        else
+            conn->ack_state = ( 'A' == c );
+    }
+
+    return bare;
+}
+
+// moves the file straight into the shared ring until the file ends or the ring is full
+// returns 1 once the whole file has been written, and acknowledged by the server as taken
+static int fill_ring(struct connection_ctx *conn)
+{
+    struct shm_producer *shm = conn->shm;
+    struct shm_ring *ring = shm->ring;
+    uint64_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    uint64_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+
+    while ( NULL != conn->fp )
+    {
+        size_t room = SHM_RING_SIZE - (head - tail);
+
+        if ( 0 == room )
+        {
+            if ( !shm_spin(&ring->tail, tail, &shm->spin)
+                && shm_arm(&ring->producer_waiting, &ring->tail, tail) )
+            {
+                // the server rings ep.fd of the ring once it has consumed something
+                return 0;
+            }
+
+            tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+            continue;
+        }
+
+        size_t offset = head & (SHM_RING_SIZE - 1);
+        if ( room > SHM_RING_SIZE - offset )
+            room = SHM_RING_SIZE - offset;
+
+        size_t nbytes = fread(ring->data + offset, sizeof(char), room, conn->fp);
+        if ( 0 != nbytes )
+        {
+            head += nbytes;
+            atomic_store(&ring->head, head);
+            total_bytes_sent += nbytes;
+            conn->sent += nbytes;
+            shm_doorbell(&ring->consumer_waiting, shm->data_fd);
+
+            fprintf(stderr, "sock:%d, fread:%lu, ring:%lu\n", conn->ep.fd, nbytes, head - tail);
+        }
+
+        if ( nbytes < room )
+        {
+            // reached to end-of-file
+            fclose(conn->fp);
+            conn->fp = NULL;
+        }
+    }
+
+    // every acknowledgement over a ring has the count, which the last one may have had already
+    return ( conn->acked == conn->sent );
+}
+
+// With -C, starts the connection with the frame verb, and with -z, names the codec and waits
+// for the server to take it, while the socket is still blocking.
+// returns 1 if the frames are to be compressed, 0 if not, or -1 if the connection failed
+static int start_frames(int sockfd)
+{
+    char line[FRAME_LINE_MAX];
+    int len = snprintf(line + FRAME_VERB_LEN, sizeof(line) - FRAME_VERB_LEN, "%s\n",
+        compress_frames ? " " FRAME_CODEC_LZ : "") + FRAME_VERB_LEN;
+    memcpy(line, FRAME_VERB, FRAME_VERB_LEN);
+
+    if ( len != send(sockfd, line, len, MSG_NOSIGNAL) )
+    {
+        fprintf(stderr, "socket send error (%d)\n", errno);
+        return -1;
+    }
+
+    if ( !compress_frames )
+        return 0;
+
+    // a server that does not know the verb never answers it
+    struct timeval timeout = { 1, 0 };
+    setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+    len = 0;
+    while ( len < FRAME_LINE_MAX - 1 && ( 0 == len || '\n' != line[len - 1] ) )
+    {
+        if ( 1 != recv(sockfd, line + len, 1, 0) )
+        {
+            fprintf(stderr, "sock:%d, frame verb not answered (%d)\n", sockfd, errno);
+            return -1;
+        }
+        len++;
+    }
+    line[len] = '\0';
+
+    timeout.tv_sec = 0;
+    setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+    if ( 0 == strcmp(line, FRAME_REPLY FRAME_CODEC_LZ "\n") )
+        return 1;
+
+    fprintf(stderr, "sock:%d, compression refused, sending the frames as they are\n", sockfd);
+    return 0;
+}
+
+// with -z, compresses harder while the link is the bottleneck, and less while it is not
+static void adapt_level(struct connection_ctx *conn, uint64_t now)
+{
+    uint64_t waited = now - conn->filled_at;
+
+    if ( 0 == conn->filled_at )
+        return;
+
+    if ( waited > conn->fill_ns && conn->level < LZ_LEVELS - 1 )
+        conn->level++;
+    else if ( waited * LZ_IDLE < conn->fill_ns && 0 < conn->level )
+        conn->level--;
+}
+
+// with -C, reads the next frame of the file into buffer, followed by the frame that ends the
+// file if the file ends there; with -z, compressed unless that does not make it shorter
+static void fill_frame(struct connection_ctx *conn)
+{
+    struct frame_header header;
+    char *payload = conn->buffer + sizeof(header);
+    char *plain = 0 != conn->level ? frame_plain : payload;
+    size_t nbytes = fread(plain, sizeof(char), FRAME_PAYLOAD, conn->fp);
+
+    conn->frame_len = 0;
+    conn->frame_sent = 0;
+
+    if ( 0 != nbytes )
+    {
+        conn->crc = crc32c(conn->crc, plain, nbytes);
+        header.len = (uint32_t) nbytes;
+        header.crc = conn->crc;
+
+        if ( 0 != conn->level )
+        {
+            size_t packed = lz_compress((const unsigned char *) plain, nbytes, (unsigned char *) payload, nbytes - 1,
+                lz_acceleration[conn->level]);
+            if ( 0 != packed )
+                header.len = (uint32_t) packed | FRAME_LZ;
+            else
+                memcpy(payload, plain, nbytes);
+        }
+
+        memcpy(conn->buffer, &header, sizeof(header));
+        conn->frame_len = sizeof(header) + ( header.len & ~FRAME_LZ );
+        total_file_bytes += nbytes;
+        frames_at_level[conn->level]++;
+    }
+
+    if ( nbytes < FRAME_PAYLOAD )
+    {
+        // reached to end-of-file; a frame of 0 bytes would end it, so there is none for the
+        // corner case of the previous frame ending exactly at the end-of-file
+        header.len = 0;
+        header.crc = conn->crc;
+        memcpy(conn->buffer + conn->frame_len, &header, sizeof(header));
+        conn->frame_len += sizeof(header);
+        conn->last_frame = 1;
+    }
+}
+
+// With -C, compares the digest the server acknowledged the file with, in the len bytes at ack,
+// with the CRC of what was sent, and closes the connection.
+static void check_digest(int epollfd, struct connection_ctx *conn, const char *ack, size_t len)
+{
+    char digest[9] = "";
+    if ( 4 + 8 <= len )
+        memcpy(digest, ack + 4, 8);
+
+    char *end;
+    unsigned long crc = strtoul(digest, &end, 16);
+
+    if ( end == digest + 8 && crc == conn->crc )
+    {
+        verified_files++;
+        close_connection(epollfd, conn);
+        return;
+    }
+
+    fprintf(stderr, "sock:%d, the server took the file as %s rather than %08" PRIx32 "\n",
+        conn->ep.fd, digest, conn->crc);
+    fail_connection(epollfd, conn, "digest", EBADMSG);
+}
+
+// counts the acknowledgements that have arrived so far, without blocking
+static size_t receive_datagram_acks(int sockfd)
+{
+    char acks[DGRAM_BATCH][8];
+    struct iovec iovs[DGRAM_BATCH];
+    struct mmsghdr msgs[DGRAM_BATCH];
+    size_t total = 0;
+
+    memset(msgs, 0, sizeof(msgs));
+    for ( int i = 0; i < DGRAM_BATCH; i++ )
+    {
+        iovs[i].iov_base = acks[i];
+        iovs[i].iov_len = sizeof(acks[i]);
+        msgs[i].msg_hdr.msg_iov = &iovs[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    int received;
+    while ( 0 < ( received = recvmmsg(sockfd, msgs, DGRAM_BATCH, MSG_DONTWAIT, NULL) ) )
+        total += received;
+
+    return total;
+}
+
+// sends every file as datagrams of up to DGRAM_LEN bytes, DGRAM_BATCH at a time
+// UDP has no flow control; whatever the server cannot keep up with is dropped and
+// shows up in its statistics.
+static void send_datagrams(char *files[], int nfiles)
+{
+    int sockfd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+    if ( -1 == sockfd )
+    {
+        fprintf(stderr, "socket creation error (%d)\n", errno);
+        exit(1);
+    }
+
+    struct sockaddr_in servaddr;
+    servaddr.sin_family = AF_INET;
+    servaddr.sin_port = htons(PORT);
+    servaddr.sin_addr.s_addr = inet_addr(HOST);
+
+    // a connected datagram socket needs no address per message
+    if ( -1 == connect(sockfd, (struct sockaddr*) &servaddr, sizeof(servaddr)) )
+    {
+        fprintf(stderr, "socket connect error (%d)\n", errno);
+        exit(1);
+    }
+
+    int epollfd = reactor_create();
+
+    struct epoll_event ev;
+    ev.events = EPOLLOUT;
+    ev.data.fd = sockfd;
+
+    if ( -1 == epoll_ctl(epollfd, EPOLL_CTL_ADD, sockfd, &ev) )
+    {
+        fprintf(stderr, "epoll_ctl error (%d)\n", errno);
+        exit(1);
+    }
+
+    static char buffers[DGRAM_BATCH][DGRAM_LEN];
+    struct iovec iovs[DGRAM_BATCH];
+    struct mmsghdr msgs[DGRAM_BATCH];
+
+    memset(msgs, 0, sizeof(msgs));
+    for ( int i = 0; i < DGRAM_BATCH; i++ )
+    {
+        iovs[i].iov_base = buffers[i];
+        msgs[i].msg_hdr.msg_iov = &iovs[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    size_t datagrams = 0;
+    size_t bytes = 0;
+    size_t acks = 0;
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    for ( int f = 0; f < nfiles; f++ )
+    {
+        FILE* fp = fopen(files[f], "r");
+        if ( NULL == fp )
+            continue;
+
+        while ( 1 )
+        {
+            int batch = 0;
+            size_t nbytes;
+
+            while ( batch < DGRAM_BATCH && 0 < ( nbytes = fread(buffers[batch], sizeof(char), DGRAM_LEN, fp) ) )
+                iovs[batch++].iov_len = nbytes;
+
+            if ( 0 == batch )
+                break;
+
+            int sent = 0;
+            while ( sent < batch )
+            {
+                int n = sendmmsg(sockfd, msgs + sent, batch - sent, 0);
+                if ( -1 == n )
+                {
+                    switch ( errno )
+                    {
+                        case EAGAIN:
+                        case ENOBUFS:
+                        {
+                            // the send buffer is full; wait until it drains
+                            struct epoll_event event;
+                            epoll_wait(epollfd, &event, 1, 10);
+                            continue;
+                        }
+
+                        case ECONNREFUSED:
+                            fprintf(stderr, "connection refused.\n");
+                            exit(1);
+
+                        default:
+                            fprintf(stderr, "socket sendmmsg error (%d)\n", errno);
+                            exit(1);
+                    }
+                }
+
+                for ( int i = sent; i < sent + n; i++ )
+                    bytes += iovs[i].iov_len;
+
+                sent += n;
+            }
+
+            datagrams += batch;
+            acks += receive_datagram_acks(sockfd);
+        }
+
+        fclose(fp);
+    }
+
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    // give the acknowledgements still in flight a moment to arrive
+    for ( int i = 0; i < 10 && acks < datagrams; i++ )
+    {
+        usleep(10000);
+        acks += receive_datagram_acks(sockfd);
+    }
+
+    double elapsed = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    if ( elapsed <= 0 )
+        elapsed = 1e-9;
+
+    fprintf(stderr, "datagram: %zu sent, %zu bytes in %.3f s (%.0f/s, %.1f MB/s), %zu acked\n",
+        datagrams, bytes, elapsed, datagrams / elapsed, bytes / elapsed / 1e6, acks);
+
+    close(epollfd);
+    close(sockfd);
+}
+
+// resident set size of a process in bytes, or 0 if it cannot be read
+static size_t resident_bytes(pid_t pid)
+{
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/%d/statm", (int) pid);
+
+    long pages = 0;
+    long resident = 0;
+    FILE *statm = fopen(path, "r");
+    if ( NULL != statm )
+    {
+        if ( 2 != fscanf(statm, "%ld %ld", &pages, &resident) )
+            resident = 0;
+        fclose(statm);
+    }
+
+    return resident * sysconf(_SC_PAGESIZE);
+}
+
+// the n-th source address of the density test: 127.0.0.1, 127.0.0.2, ..., skipping
+// network and broadcast-looking host parts
+static in_addr_t idle_source_address(long n)
+{
+    long host = n / IDLE_PER_SOURCE;
+    return htonl(0x7f000001 + host + 2 * (host / 254));
+}
+
+static volatile sig_atomic_t interrupted = 0;
+
+// makes pause() and epoll_wait() return
+static void idle_interrupted(int signo)
+{
+    (void) signo;
+    interrupted = 1;
+}
+
+// raises the descriptor limit for count connections; a privileged process may raise
+// the hard limit too
+// returns how many connections fit in the limit
+static long raise_nofile(long count)
+{
+    struct rlimit nofile;
+    if ( 0 == getrlimit(RLIMIT_NOFILE, &nofile) )
+    {
+        if ( (rlim_t) count + 16 > nofile.rlim_max )
+        {
+            struct rlimit raised = { count + 16, count + 16 };
+            if ( 0 == setrlimit(RLIMIT_NOFILE, &raised) )
+                nofile = raised;
+        }
+
+        nofile.rlim_cur = nofile.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &nofile);
+
+        if ( (rlim_t) count + 16 > nofile.rlim_cur )
+        {
+            fprintf(stderr, "descriptor limit %lu is too low for %ld connections\n",
+                (unsigned long) nofile.rlim_cur, count);
+            count = nofile.rlim_cur - 16;
+        }
+    }
+
+    return count;
+}
+
+// nanoseconds on the monotonic clock
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static int compare_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *) a;
+    uint64_t y = *(const uint64_t *) b;
+    return ( x > y ) - ( x < y );
+}
+
+// reads and throws away whatever the server has sent so far
+static void drain_socket(int fd)
+{
+    char buffer[BUFLEN];
+    while ( 0 < recv(fd, buffer, sizeof(buffer), MSG_DONTWAIT) )
+        ;
+}
+
+// connects fds[from] up to fds[to - 1], IDLE_CONNECTING at a time; a connection that
+// fails is left as -1
+// returns the number of connections established
+static long connect_idle(int epollfd, const struct sockaddr_in *servaddr, int *fds, long from, long to)
+{
+    long opened = 0;
+    long connecting = 0;
+    long next = from;
+
+    while ( next < to || 0 < connecting )
+    {
+        while ( next < to && connecting < IDLE_CONNECTING )
+        {
+            int sockfd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+            if ( -1 == sockfd )
+            {
+                fprintf(stderr, "socket creation error (%d)\n", errno);
+                while ( next < to )
+                    fds[next++] = -1;
+                break;
+            }
+
+            // let connect() pick the port, so that ports are only unique per destination
+            int on = 1;
+            setsockopt(sockfd, IPPROTO_IP, IP_BIND_ADDRESS_NO_PORT, &on, sizeof(on));
+
+            struct sockaddr_in srcaddr;
+            memset(&srcaddr, 0, sizeof(srcaddr));
+            srcaddr.sin_family = AF_INET;
+            srcaddr.sin_addr.s_addr = idle_source_address(next);
+
+            struct epoll_event ev;
+            ev.events = EPOLLOUT;
+            ev.data.u64 = next;
+
+            if ( -1 == bind(sockfd, (struct sockaddr*) &srcaddr, sizeof(srcaddr))
+                || ( -1 == connect(sockfd, (struct sockaddr*) servaddr, sizeof(*servaddr)) && EINPROGRESS != errno )
+                || -1 == epoll_ctl(epollfd, EPOLL_CTL_ADD, sockfd, &ev) )
+            {
+                close(sockfd);
+                fds[next++] = -1;
+                continue;
+            }
+
+            fds[next++] = sockfd;
+            connecting++;
+        }
+
+        struct epoll_event events[MAX_EVENTS];
+        int nfds = epoll_wait(epollfd, events, MAX_EVENTS, 1000);
+        if ( -1 == nfds )
+        {
+            if ( EINTR == errno )
+                continue;
+            fprintf(stderr, "epoll_wait error (%d)\n", errno);
+            exit(1);
+        }
+
+        for ( int i = 0; i < nfds; i++ )
+        {
+            long n = (long) events[i].data.u64;
+
+            int err = 0;
+            socklen_t len = sizeof(err);
+            getsockopt(fds[n], SOL_SOCKET, SO_ERROR, &err, &len);
+
+            // established or failed, the connection needs no more events
+            epoll_ctl(epollfd, EPOLL_CTL_DEL, fds[n], NULL);
+            connecting--;
+
+            if ( 0 != err )
+            {
+                close(fds[n]);
+                fds[n] = -1;
+                continue;
+            }
+
+            opened++;
+        }
+    }
+
+    return opened;
+}
+
+// up to IDLE_SAMPLE established connections, spread evenly over fds[0] .. fds[n - 1]
+// returns the number picked
+static int pick_sample(const int *fds, long n, int *sample)
+{
+    int picked = 0;
+    long stride = n / IDLE_SAMPLE + 1;
+
+    for ( long i = 0; i < n && picked < IDLE_SAMPLE; i += stride )
+    {
+        if ( -1 != fds[i] )
+            sample[picked++] = fds[i];
+    }
+
+    return picked;
+}
+
+// round trips of one byte and its acknowledgement over every sampled connection at once,
+// IDLE_ROUNDS times; the server has to find these few among all the idle ones
+// returns the number of round trips measured into rtt
+static int measure_latency(int epollfd, const int *sample, int n, uint64_t *rtt)
+{
+    uint64_t sent_at[IDLE_SAMPLE];
+    int measured = 0;
+
+    for ( int i = 0; i < n; i++ )
+    {
+        struct epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.u64 = i;
+        epoll_ctl(epollfd, EPOLL_CTL_ADD, sample[i], &ev);
+    }
+
+    for ( int round = 0; round < IDLE_ROUNDS; round++ )
+    {
+        int pending = 0;
+        for ( int i = 0; i < n; i++ )
+        {
+            sent_at[i] = 0;
+            if ( 1 == send(sample[i], "p", 1, MSG_NOSIGNAL) )
+            {
+                sent_at[i] = now_ns();
+                pending++;
+            }
+        }
+
+        while ( 0 < pending )
+        {
+            struct epoll_event events[MAX_EVENTS];
+            int nfds = epoll_wait(epollfd, events, MAX_EVENTS, 1000);
+            if ( 0 == nfds )
+                break;  // an acknowledgement got lost with its connection
+            if ( -1 == nfds )
+            {
+                if ( EINTR == errno )
+                    continue;
+                fprintf(stderr, "epoll_wait error (%d)\n", errno);
+                exit(1);
+            }
+
+            uint64_t now = now_ns();
+            for ( int i = 0; i < nfds; i++ )
+            {
+                int k = (int) events[i].data.u64;
+                drain_socket(sample[k]);
+
+                if ( 0 != sent_at[k] )
+                {
+                    rtt[measured++] = now - sent_at[k];
+                    sent_at[k] = 0;
+                    pending--;
+                }
+            }
+        }
+    }
+
+    for ( int i = 0; i < n; i++ )
+        epoll_ctl(epollfd, EPOLL_CTL_DEL, sample[i], NULL);
+
+    return measured;
+}
+
+// bytes per second the sampled connections get through while all the others sit idle
+static double measure_throughput(int epollfd, const int *sample, int n)
+{
+    char chunk[CHURN_BYTES];
+    memset(chunk, 'x', sizeof(chunk));
+
+    for ( int i = 0; i < n; i++ )
+    {
+        struct epoll_event ev;
+        ev.events = EPOLLIN | EPOLLOUT;
+        ev.data.u64 = i;
+        epoll_ctl(epollfd, EPOLL_CTL_ADD, sample[i], &ev);
+    }
+
+    size_t bytes = 0;
+    uint64_t start = now_ns();
+    uint64_t deadline = start + IDLE_LOAD_SECONDS * 1000000000ull;
+
+    while ( now_ns() < deadline )
+    {
+        struct epoll_event events[MAX_EVENTS];
+        int nfds = epoll_wait(epollfd, events, MAX_EVENTS, 100);
+        if ( -1 == nfds )
+        {
+            if ( EINTR == errno )
+                continue;
+            fprintf(stderr, "epoll_wait error (%d)\n", errno);
+            exit(1);
+        }
+
+        for ( int i = 0; i < nfds; i++ )
+        {
+            int fd = sample[events[i].data.u64];
+
+            // the acknowledgements must not fill the receive buffer
+            if ( events[i].events & EPOLLIN )
+                drain_socket(fd);
+
+            if ( events[i].events & EPOLLOUT )
+            {
+                ssize_t sent = send(fd, chunk, sizeof(chunk), MSG_NOSIGNAL | MSG_DONTWAIT);
+                if ( 0 < sent )
+                    bytes += sent;
+            }
+        }
+    }
+
+    double elapsed = (now_ns() - start) / 1e9;
+
+    for ( int i = 0; i < n; i++ )
+        epoll_ctl(epollfd, EPOLL_CTL_DEL, sample[i], NULL);
+
+    return bytes / elapsed;
+}
+
+// Ramps up to count connections that never send anything, step at a time. At every plateau
+// it reports the connect rate, the resident memory per connection, the round trip through
+// the server's event loop and the throughput of a few busy connections among the idle ones.
+// The connections are held until interrupted.
+static void hold_idle_connections(long count, long step, pid_t server_pid)
+{
+    count = raise_nofile(count);
+
+    if ( step <= 0 || step > count )
+        step = count;
+
+    int *fds = (int *) malloc(count * sizeof(int));
+    uint64_t *rtt = (uint64_t *) malloc(IDLE_SAMPLE * IDLE_ROUNDS * sizeof(uint64_t));
+    if ( NULL == fds || NULL == rtt )
+    {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+
+    int epollfd = reactor_create();
+
+    struct sockaddr_in servaddr;
+    servaddr.sin_family = AF_INET;
+    servaddr.sin_port = htons(PORT);
+    servaddr.sin_addr.s_addr = inet_addr(HOST);
+
+    size_t server_before = ( 0 < server_pid ) ? resident_bytes(server_pid) : 0;
+    size_t client_before = resident_bytes(getpid());
+
+    fprintf(stderr, "%10s %10s %10s %12s %12s %10s %10s %10s %10s\n", "open", "failed",
+        "connect/s", "server B/c", "client B/c", "rtt p50", "rtt p99", "rtt max", "MB/s");
+
+    long opened = 0;
+    for ( long from = 0; from < count; from += step )
+    {
+        long to = ( count - from < step ) ? count : from + step;
+
+        uint64_t start = now_ns();
+        opened += connect_idle(epollfd, &servaddr, fds, from, to);
+        double elapsed = (now_ns() - start) / 1e9;
+
+        // give the server a moment to accept the last ones
+        sleep(1);
+
+        int sample[IDLE_SAMPLE];
+        int n = pick_sample(fds, to, sample);
+
+        // acknowledgements still on their way from the previous plateau would pass for
+        // the answers to this one's probes
+        for ( int i = 0; i < n; i++ )
+            drain_socket(sample[i]);
+
+        int measured = measure_latency(epollfd, sample, n, rtt);
+        qsort(rtt, measured, sizeof(uint64_t), compare_u64);
+
+        double throughput = measure_throughput(epollfd, sample, n);
+
+        // user space only; the kernel's socket buffers and epoll items are not in the RSS
+        size_t client_now = resident_bytes(getpid());
+        size_t server_now = ( 0 < server_pid ) ? resident_bytes(server_pid) : 0;
+
+        fprintf(stderr, "%10ld %10ld %10.0f %12zu %12zu %8.0fus %8.0fus %8.0fus %10.1f\n",
+            opened, to - opened, (to - from) / ( elapsed > 0 ? elapsed : 1e-9 ),
+            0 == opened || server_now < server_before ? 0 : (server_now - server_before) / opened,
+            0 == opened || client_now < client_before ? 0 : (client_now - client_before) / opened,
+            0 == measured ? 0.0 : rtt[measured / 2] / 1e3,
+            0 == measured ? 0.0 : rtt[measured * 99 / 100] / 1e3,
+            0 == measured ? 0.0 : rtt[measured - 1] / 1e3,
+            throughput / 1e6);
+
+        // the server's own view of the plateau, its accept counters and loop latency
+        if ( 0 < server_pid )
+            kill(server_pid, SIGUSR1);
+
+        sleep(IDLE_PLATEAU_SECONDS);
+    }
+
+    fprintf(stderr, "idle: holding %ld connections, interrupt to close them\n", opened);
+    pause();
+
+    for ( long i = 0; i < count; i++ )
+    {
+        if ( -1 != fds[i] )
+            close(fds[i]);
+    }
+
+    free(rtt);
+    free(fds);
+    close(epollfd);
+}
+
+// Opens count subscribers of a channel (server -p) and reports every second what they have
+// received, until interrupted.
+static void hold_subscribers(long count, const char *channel)
+{
+    count = raise_nofile(count);
+
+    int *fds = (int *) malloc(count * sizeof(int));
+    if ( NULL == fds )
+    {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+
+    int epollfd = reactor_create();
+
+    struct sockaddr_in servaddr;
+    servaddr.sin_family = AF_INET;
+    servaddr.sin_port = htons(PORT);
+    servaddr.sin_addr.s_addr = inet_addr(HOST);
+
+    long opened = connect_idle(epollfd, &servaddr, fds, 0, count);
+
+    char line[PUBSUB_VERB_LEN + CHANNEL_NAME_MAX + 1];
+    memcpy(line, PUBSUB_SUBSCRIBE, PUBSUB_VERB_LEN);
+    size_t len = strlen(channel);
+    memcpy(line + PUBSUB_VERB_LEN, channel, len);
+    line[PUBSUB_VERB_LEN + len] = '\n';
+    len += PUBSUB_VERB_LEN + 1;
+
+    long subscribed = 0;
+    for ( long i = 0; i < count; i++ )
+    {
+        if ( -1 == fds[i] )
+            continue;
+
+        struct epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.u64 = i;
+
+        if ( (ssize_t) len != send(fds[i], line, len, MSG_NOSIGNAL)
+            || -1 == epoll_ctl(epollfd, EPOLL_CTL_ADD, fds[i], &ev) )
+        {
+            close(fds[i]);
+            fds[i] = -1;
+            continue;
+        }
+
+        subscribed++;
+    }
+
+    fprintf(stderr, "subscribe: %ld of %ld connections subscribed to %s\n", subscribed, opened, channel);
+
+    size_t received = 0;
+    size_t last_received = 0;
+    long closed = 0;
+    uint64_t last = now_ns();
+
+    while ( !interrupted && closed < subscribed )
+    {
+        struct epoll_event events[MAX_EVENTS];
+        int nfds = epoll_wait(epollfd, events, MAX_EVENTS, 1000);
+        if ( -1 == nfds && EINTR != errno )
+        {
+            fprintf(stderr, "epoll_wait error (%d)\n", errno);
+            exit(1);
+        }
+
+        for ( int i = 0; i < nfds; i++ )
+        {
+            long n = (long) events[i].data.u64;
+
+            char buffer[BUFLEN];
+            ssize_t got;
+            while ( 0 < ( got = recv(fds[n], buffer, sizeof(buffer), MSG_DONTWAIT) ) )
+                received += got;
+
+            if ( 0 == got || ( -1 == got && EAGAIN != errno && EINTR != errno ) )
+            {
+                // the server has let go of this one, slow or not
+                close(fds[n]);
+                fds[n] = -1;
+                closed++;
+            }
+        }
+
+        uint64_t now = now_ns();
+        if ( now - last >= 1000000000ull )
+        {
+            fprintf(stderr, "subscribe: %zu bytes (%.1f MB/s), %ld connections closed by the server\n",
+                received, (received - last_received) * 1e3 / (now - last), closed);
+            last_received = received;
+            last = now;
+        }
+    }
+
+    fprintf(stderr, "subscribe: %zu bytes received, %ld connections closed by the server\n", received, closed);
+
+    for ( long i = 0; i < count; i++ )
+    {
+        if ( -1 != fds[i] )
+            close(fds[i]);
+    }
+
+    free(fds);
+    close(epollfd);
+}
+
+// reads a fetch answer into out; returns the number of bytes it announced
+static uint64_t receive_fetch(int sockfd, int out, char *buffer)
+{
+    // the answer line comes first; what follows it in the same read is data
+    size_t got = 0;
+    char *eol = NULL;
+    while ( NULL == eol )
+    {
+        ssize_t n = recv(sockfd, buffer + got, FETCH_LINE_MAX - got, 0);
+        if ( 0 >= n )
+        {
+            fprintf(stderr, "fetch: connection lost (%d)\n", 0 == n ? 0 : errno);
+            exit(1);
+        }
+        got += n;
+        eol = (char *) memchr(buffer, '\n', got);
+
+        if ( NULL == eol && FETCH_LINE_MAX == got )
+            break;
+    }
+
+    uint64_t len;
+    if ( NULL == eol || 0 != memcmp(buffer, FETCH_REPLY, FETCH_REPLY_LEN)
+        || 1 != sscanf(buffer + FETCH_REPLY_LEN, "%" SCNu64, &len) )
+    {
+        fprintf(stderr, "fetch: not an answer from the server\n");
+        exit(1);
+    }
+
+    size_t head = eol + 1 - buffer;
+    uint64_t left = len;
+    size_t pending = got - head;
+    char *data = buffer + head;
+
+    while ( 1 )
+    {
+        if ( pending > left )
+            pending = left;
+
+        while ( 0 != pending )
+        {
+            ssize_t written = write(out, data, pending);
+            if ( -1 == written )
+            {
+                if ( EINTR == errno )
+                    continue;
+                fprintf(stderr, "fetch: write error (%d)\n", errno);
+                exit(1);
+            }
+            data += written;
+            pending -= written;
+            left -= written;
+        }
+
+        if ( 0 == left )
+            return len;
+
+        ssize_t n = recv(sockfd, buffer, left < FETCH_BUFLEN ? left : FETCH_BUFLEN, 0);
+        if ( 0 >= n )
+        {
+            if ( -1 == n && EINTR == errno )
+                continue;
+            fprintf(stderr, "fetch: connection lost (%d)\n", 0 == n ? 0 : errno);
+            exit(1);
+        }
+        data = buffer;
+        pending = n;
+    }
+}
+
+static void fetch_stream(const struct sockaddr *servaddr, socklen_t servaddr_len,
+    uint32_t stream, uint64_t offset, uint64_t count, const char *filename)
+{
+    int out = open(filename, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if ( -1 == out )
+    {
+        fprintf(stderr, "cannot create %s (%d)\n", filename, errno);
+        exit(1);
+    }
+
+    int sockfd = socket(servaddr->sa_family, SOCK_STREAM, 0);
+    if ( -1 == sockfd || -1 == connect(sockfd, servaddr, servaddr_len) )
+    {
+        fprintf(stderr, "cannot connect to the server (%d)\n", errno);
+        exit(1);
+    }
+
+    char *buffer = (char *) malloc(FETCH_BUFLEN);
+    if ( NULL == buffer )
+    {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+
+    uint64_t start = now_ns();
+    uint64_t fetched = 0;
+    int commands = 0;
+
+    while ( fetched < count )
+    {
+        uint64_t max = ( count - fetched < FETCH_CHUNK ) ? count - fetched : FETCH_CHUNK;
+
+        char line[FETCH_LINE_MAX];
+        memcpy(line, FETCH_VERB, FETCH_VERB_LEN);
+        int len = FETCH_VERB_LEN + snprintf(line + FETCH_VERB_LEN, sizeof(line) - FETCH_VERB_LEN,
+            "%" PRIu32 " %" PRIu64 " %" PRIu64 "\n", stream, offset + fetched, max);
+
+        if ( len != send(sockfd, line, len, MSG_NOSIGNAL) )
+        {
+            fprintf(stderr, "fetch: send error (%d)\n", errno);
+            exit(1);
+        }
+        commands++;
+
+        uint64_t got = receive_fetch(sockfd, out, buffer);
+        if ( 0 == got )
+            break;
+        fetched += got;
+    }
+
+    double elapsed = (now_ns() - start) / 1e9;
+    fprintf(stderr, "fetch: %" PRIu64 " bytes of stream %" PRIu32 " from offset %" PRIu64 " in %d commands, %.3f s (%.1f MB/s)\n",
+        fetched, stream, offset, commands, elapsed, 0 == elapsed ? 0.0 : fetched / elapsed / 1e6);
+
+    free(buffer);
+    close(sockfd);
+    close(out);
+}
+
+static void query_streams(const struct sockaddr *servaddr, socklen_t servaddr_len, const char *string, int whole)
+{
+    int sockfd = socket(servaddr->sa_family, SOCK_STREAM, 0);
+    if ( -1 == sockfd || -1 == connect(sockfd, servaddr, servaddr_len) )
+    {
+        fprintf(stderr, "cannot connect to the server (%d)\n", errno);
+        exit(1);
+    }
+
+    char line[QUERY_COMMAND_MAX];
+    memcpy(line, whole ? QUERY_TOKEN_VERB : QUERY_VERB, QUERY_VERB_LEN);
+    int len = QUERY_VERB_LEN + snprintf(line + QUERY_VERB_LEN, sizeof(line) - QUERY_VERB_LEN, "%s\n", string);
+
+    uint64_t start = now_ns();
+    if ( len != send(sockfd, line, len, MSG_NOSIGNAL) )
+    {
+        fprintf(stderr, "query: send error (%d)\n", errno);
+        exit(1);
+    }
+
+    // the answer is lines and the bytes they announce, read through stdio
+    FILE *in = fdopen(sockfd, "r");
+    char *found = (char *) malloc(QUERY_LINE_MAX);
+    if ( NULL == in || NULL == found )
+    {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+
+    size_t matches = 0;
+    uint64_t searched = 0;
+    while ( 1 )
+    {
+        char header[QUERY_HEADER_MAX];
+        uint32_t stream;
+        uint64_t offset;
+        size_t found_len;
+
+        if ( NULL == fgets(header, sizeof(header), in) )
+        {
+            fprintf(stderr, "query: connection lost (%d)\n", ferror(in) ? errno : 0);
+            exit(1);
+        }
+
+        if ( 0 == memcmp(header, QUERY_DONE, QUERY_DONE_LEN) )
+        {
+            sscanf(header + QUERY_DONE_LEN, "%zu %" SCNu64, &matches, &searched);
+            break;
+        }
+
+        if ( 0 != memcmp(header, QUERY_MATCH, QUERY_MATCH_LEN)
+            || 3 != sscanf(header + QUERY_MATCH_LEN, "%" SCNu32 " %" SCNu64 " %zu", &stream, &offset, &found_len)
+            || QUERY_LINE_MAX < found_len
+            || found_len != fread(found, 1, found_len, in) )
+        {
+            fprintf(stderr, "query: unexpected answer\n");
+            exit(1);
+        }
+
+        printf("%" PRIu32 ":%" PRIu64 ":", stream, offset);
+        fwrite(found, 1, found_len, stdout);
+        if ( 0 == found_len || '\n' != found[found_len - 1] )
+            putchar('\n');
+    }
+
+    double elapsed = (now_ns() - start) / 1e9;
+    fflush(stdout);
+    fprintf(stderr, "query: %zu lines found in %" PRIu64 " bytes, %.3f s (%.2f GB/s)\n",
+        matches, searched, elapsed, 0 == elapsed ? 0.0 : searched / elapsed / 1e9);
+
+    free(found);
+    fclose(in);
+}
+
+// sends all of iovcnt pieces, resuming after partial writes; exits on failure
+static void send_all(int sockfd, struct iovec *iov, int iovcnt)
+{
+    while ( 0 < iovcnt )
+    {
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = iovcnt;        // at most UPLOAD_CHUNKS, well within IOV_MAX
+
+        ssize_t sent = sendmsg(sockfd, &msg, MSG_NOSIGNAL);
+        if ( -1 == sent )
+        {
+            if ( EINTR == errno )
+                continue;
+            fprintf(stderr, "upload: send error (%d)\n", errno);
+            exit(1);
+        }
+
+        while ( 0 < iovcnt && (size_t) sent >= iov->iov_len )
+        {
+            sent -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+
+        if ( 0 < iovcnt )
+        {
+            iov->iov_base = (char *) iov->iov_base + sent;
+            iov->iov_len -= sent;
+        }
+    }
+}
+
+// receives exactly len bytes; exits if the connection is lost
+static void receive_all(int sockfd, void *buffer, size_t len)
+{
+    size_t got = 0;
+
+    while ( got < len )
+    {
+        ssize_t n = recv(sockfd, (char *) buffer + got, len - got, 0);
+        if ( 0 >= n )
+        {
+            if ( -1 == n && EINTR == errno )
+                continue;
+            fprintf(stderr, "upload: connection lost (%d)\n", 0 == n ? 0 : errno);
+            exit(1);
+        }
+        got += n;
+    }
+}
+
+// Receives the next answer line of the server, newline excluded. The lines are short and come
+// once per batch, so they are read a byte at a time, which leaves what follows on the socket.
+// Acknowledgements end with a NUL byte, skipped at the start of a line.
+static void receive_line(int sockfd, char *line, size_t size)
+{
+    size_t len = 0;
+
+    while ( 1 )
+    {
+        char c;
+        receive_all(sockfd, &c, 1);
+
+        if ( '\n' == c )
+            break;
+        if ( '\0' == c && 0 == len )
+            continue;
+
+        if ( len == size - 1 )
+        {
+            fprintf(stderr, "upload: not an answer from the server\n");
+            exit(1);
+        }
+        line[len++] = c;
+    }
+
+    line[len] = '\0';
+}
+
+// Closes a connection after the last acknowledgement. This ends with a byte that is still to
+// be read, and closing with it unread would reset the connection.
+static void close_after_ack(int sockfd)
+{
+    shutdown(sockfd, SHUT_WR);
+    char rest[16];
+    while ( 0 < recv(sockfd, rest, sizeof(rest), 0) )
+        ;
+    close(sockfd);
+}
+
+// Uploads a file by chunk, one batch at a time. A batch is done when the server acknowledges
+// it, after asking for the chunks it did not hold, possibly more than once.
+static void upload_file(const struct sockaddr *servaddr, socklen_t servaddr_len, const char *filename)
+{
+    int fd = open(filename, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if ( -1 == fd || -1 == fstat(fd, &st) )
+    {
+        fprintf(stderr, "cannot open %s (%d)\n", filename, errno);
+        failed_connections++;
+        if ( -1 != fd )
+            close(fd);
+        return;
+    }
+
+    size_t size = st.st_size;
+    const unsigned char *data = NULL;
+    if ( 0 != size )
+    {
+        data = (const unsigned char *) mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if ( MAP_FAILED == data )
+        {
+            fprintf(stderr, "cannot map %s (%d)\n", filename, errno);
+            failed_connections++;
+            close(fd);
+            return;
+        }
+    }
+    close(fd);
+
+    int sockfd = socket(servaddr->sa_family, SOCK_STREAM, 0);
+    if ( -1 == sockfd || -1 == connect(sockfd, servaddr, servaddr_len) )
+    {
+        fprintf(stderr, "cannot connect to the server (%d)\n", errno);
+        exit(1);
+    }
+
+    static struct upload_chunk chunks[UPLOAD_CHUNKS];
+    static struct iovec iov[UPLOAD_CHUNKS];
+    const unsigned char *starts[UPLOAD_CHUNKS];
+    uint32_t missing[UPLOAD_CHUNKS];
+
+    uint64_t start = now_ns();
+    size_t wire = 0;
+    size_t nchunks = 0;
+    size_t sent_chunks = 0;
+    int batches = 0;
+    size_t pos = 0;
+
+    while ( pos < size )
+    {
+        uint32_t n = 0;
+        size_t bytes = 0;
+
+        while ( n < UPLOAD_CHUNKS && pos < size )
+        {
+            // every chunk is cut afresh, and the end of the file ends the last one
+            struct cdc_state cut_state = { 0, 0 };
+            int cut;
+            size_t len = cdc_scan(&cut_state, data + pos, size - pos, &cut);
+            if ( 0 != n && bytes + len > UPLOAD_BYTES )
+                break;
+
+            cdc_fingerprint(data + pos, len, chunks[n].fingerprint);
+            chunks[n].len = (uint32_t) len;
+            chunks[n].reserved = 0;
+            starts[n] = data + pos;
+            pos += len;
+            bytes += len;
+            n++;
+        }
+
+        char line[UPLOAD_LINE_MAX];
+        memcpy(line, UPLOAD_VERB, UPLOAD_VERB_LEN);
+        int len = UPLOAD_VERB_LEN + snprintf(line + UPLOAD_VERB_LEN, sizeof(line) - UPLOAD_VERB_LEN, "%" PRIu32 "\n", n);
+
+        iov[0].iov_base = line;
+        iov[0].iov_len = len;
+        iov[1].iov_base = chunks;
+        iov[1].iov_len = n * sizeof(struct upload_chunk);
+        send_all(sockfd, iov, 2);
+        wire += len + n * sizeof(struct upload_chunk);
+        nchunks += n;
+        batches++;
+
+        // the list is always answered, at least with "Missing 0"; a server that acknowledges
+        // it straight away took it for data and does not take uploads
+        for ( int round = 0; ; round++ )
+        {
+            uint32_t count;
+            int end = 0;
+
+            receive_line(sockfd, line, sizeof(line));
+            if ( 0 != round && 0 == strcmp(line, "Ack") )
+                break;
+
+            if ( 0 == round && 0 == strcmp(line, "Ack") )
+            {
+                fprintf(stderr, "upload: the server does not take uploads (server -w -D)\n");
+                exit(1);
+            }
+
+            if ( 0 != memcmp(line, UPLOAD_REPLY, UPLOAD_REPLY_LEN)
+                || 1 != sscanf(line + UPLOAD_REPLY_LEN, "%" SCNu32 "%n", &count, &end) || '\0' != line[UPLOAD_REPLY_LEN + end]
+                || ( 0 == count && 0 != round ) || n < count )
+            {
+                fprintf(stderr, "upload: not an answer from the server: %s\n", line);
+                exit(1);
+            }
+            if ( 0 == count )
+                continue;
+
+            receive_all(sockfd, missing, count * sizeof(uint32_t));
+            for ( uint32_t i = 0; i < count; i++ )
+            {
+                if ( n <= missing[i] )
+                {
+                    fprintf(stderr, "upload: the server asked for chunk %" PRIu32 " of %" PRIu32 "\n", missing[i], n);
+                    exit(1);
+                }
+                iov[i].iov_base = (void *) starts[missing[i]];
+                iov[i].iov_len = chunks[missing[i]].len;
+                wire += chunks[missing[i]].len;
+            }
+
+            send_all(sockfd, iov, count);
+            sent_chunks += count;
+        }
+    }
+
+    double elapsed = (now_ns() - start) / 1e9;
+    fprintf(stderr, "upload: %s, %zu bytes in %zu chunks and %d batches, %zu chunks sent, "
+        "%zu bytes on the wire (%.2f%%), %.3f s (%.1f MB/s)\n",
+        filename, size, nchunks, batches, sent_chunks, wire, 0 == size ? 0.0 : wire * 100.0 / size,
+        elapsed, 0 == elapsed ? 0.0 : size / elapsed / 1e6);
+
+    close_after_ack(sockfd);
+
+    total_bytes_sent += wire;
+    if ( 0 != size )
+        munmap((void *) data, size);
+}
+
+// the blocks of a delta and the ops queued for one sendmsg()
+#define DELTA_IOV 256
+
+// where a delta is in the new version, and what is queued to send
+struct delta_writer
+{
+    int sockfd;
+    const unsigned char *data;      // the new version
+    size_t literal_start;           // of the bytes not sent yet, matched by no block
+    struct delta_op run;            // the run of blocks not sent yet, if its count is not 0
+    struct delta_op ops[DELTA_IOV];
+    struct iovec iov[DELTA_IOV];
+    int nops;
+    int niov;
+    size_t wire;
+    size_t literal_bytes;
+};
+
+static void delta_flush(struct delta_writer *w)
+{
+    send_all(w->sockfd, w->iov, w->niov);
+    w->nops = 0;
+    w->niov = 0;
+}
+
+// queues an op, followed by len bytes of the new version from data if it takes literal bytes
+static void delta_queue(struct delta_writer *w, uint32_t block, uint32_t count, const unsigned char *data, size_t len)
+{
+    if ( DELTA_IOV - 2 < w->niov )
+        delta_flush(w);
+
+    struct delta_op *op = &w->ops[w->nops++];
+    op->block = block;
+    op->count = count;
+    w->iov[w->niov].iov_base = op;
+    w->iov[w->niov++].iov_len = sizeof(struct delta_op);
+    w->wire += sizeof(struct delta_op);
+
+    if ( 0 != len )
+    {
+        w->iov[w->niov].iov_base = (void *) data;
+        w->iov[w->niov++].iov_len = len;
+        w->wire += len;
+    }
+}
+
+// queues the run of blocks and the literal bytes before end that are still pending, in order
+static void delta_pending(struct delta_writer *w, size_t end)
+{
+    if ( 0 != w->run.count )
+    {
+        delta_queue(w, w->run.block, w->run.count, NULL, 0);
+        w->run.count = 0;
+    }
+
+    while ( w->literal_start < end )
+    {
+        size_t len = end - w->literal_start;
+        if ( DELTA_RUN_MAX < len )
+            len = DELTA_RUN_MAX;
+
+        delta_queue(w, DELTA_LITERAL, (uint32_t) len, w->data + w->literal_start, len);
+        w->literal_start += len;
+        w->literal_bytes += len;
+    }
+}
+
+// The blocks of the old version by weak checksum: open addressing with linear probing, at most
+// half full, behind a filter of 1 << DELTA_FILTER_SHIFT bits per slot, small enough to stay in
+// the cache, which turns away most offsets of the new version without touching the table. The
+// weak checksum is poorly spread over its low bits, so both take the high bits of its product
+// with the golden ratio. Slots carry the weak checksum, so that probing reads no signature.
+#define DELTA_FILTER_SHIFT 3
+
+struct delta_slot
+{
+    uint32_t weak;
+    uint32_t block;                 // + 1, or 0 if free
+};
+
+struct delta_index
+{
+    const struct delta_signature *signatures;
+    uint32_t count;
+    int bits;                       // of the slots of the table
+    struct delta_slot *table;
+    uint64_t *filter;               // 1 << ( bits + DELTA_FILTER_SHIFT ) bits
+};
+
+static inline uint64_t delta_spread(uint32_t weak)
+{
+    return weak * 0x9e3779b97f4a7c15ull;
+}
+
+static void delta_index_init(struct delta_index *x, const struct delta_signature *signatures, uint32_t count)
+{
+    x->signatures = signatures;
+    x->count = count;
+    x->bits = 1;
+    while ( ( (size_t) 1 << x->bits ) < 2 * (size_t) count )
+        x->bits++;
+
+    x->table = (struct delta_slot *) calloc((size_t) 1 << x->bits, sizeof(struct delta_slot));
+    x->filter = (uint64_t *) calloc(( ( (size_t) 1 << ( x->bits + DELTA_FILTER_SHIFT ) ) + 63 ) / 64, sizeof(uint64_t));
+    if ( NULL == x->table || NULL == x->filter )
+    {
+        fprintf(stderr, "out of memory for %" PRIu32 " signatures\n", count);
+        exit(1);
+    }
+
+    size_t mask = ( (size_t) 1 << x->bits ) - 1;
+    for ( uint32_t i = 0; i < count; i++ )
+    {
+        uint64_t h = delta_spread(signatures[i].weak);
+        uint64_t bit = h >> ( 64 - ( x->bits + DELTA_FILTER_SHIFT ) );
+        x->filter[bit / 64] |= 1ull << ( bit % 64 );
+
+        size_t slot = h >> ( 64 - x->bits );
+        while ( 0 != x->table[slot].block )
+            slot = ( slot + 1 ) & mask;
+        x->table[slot].weak = signatures[i].weak;
+        x->table[slot].block = i + 1;
+    }
+}
+
+// whether a block of the old version may have the weak checksum
+static inline int delta_filter_has(const struct delta_index *x, uint32_t weak)
+{
+    uint64_t bit = delta_spread(weak) >> ( 64 - ( x->bits + DELTA_FILTER_SHIFT ) );
+    return 0 != ( x->filter[bit / 64] & ( 1ull << ( bit % 64 ) ) );
+}
+
+// Finds the block of the old version that the window at data matches, trying first the one
+// after the last block matched, or returns UINT32_MAX.
+static uint32_t delta_match(const struct delta_index *x, uint32_t expected,
+    const unsigned char *data, uint32_t block_len, uint32_t weak)
+{
+    const struct delta_signature *signatures = x->signatures;
+    uint64_t strong[2];
+    int strong_known = 0;
+
+    if ( expected < x->count && signatures[expected].weak == weak )
+    {
+        cdc_fingerprint(data, block_len, strong);
+        strong_known = 1;
+        if ( signatures[expected].strong[0] == strong[0] && signatures[expected].strong[1] == strong[1] )
+            return expected;
+    }
+
+    if ( !delta_filter_has(x, weak) )
+        return UINT32_MAX;
+
+    size_t mask = ( (size_t) 1 << x->bits ) - 1;
+    for ( size_t slot = delta_spread(weak) >> ( 64 - x->bits ); 0 != x->table[slot].block; slot = ( slot + 1 ) & mask )
+    {
+        if ( x->table[slot].weak != weak )
+            continue;
+
+        const struct delta_signature *sig = &signatures[x->table[slot].block - 1];
+        if ( !strong_known )
+        {
+            cdc_fingerprint(data, block_len, strong);
+            strong_known = 1;
+        }
+        if ( sig->strong[0] == strong[0] && sig->strong[1] == strong[1] )
+            return x->table[slot].block - 1;
+    }
+
+    return UINT32_MAX;
+}
+
+// Looks for the blocks of the old version at every offset of the new one, of size bytes, and
+// queues the runs of blocks it finds, and the literal bytes between them. Returns the number
+// of blocks matched.
+static size_t delta_scan(struct delta_writer *w, const struct delta_index *x, size_t size, uint32_t block_len)
+{
+    const unsigned char *data = w->data;
+    size_t matched = 0;
+    size_t pos = 0;
+    size_t last = size - block_len;     // the last offset a block fits at
+    uint32_t a, b;
+    uint32_t expected = UINT32_MAX;
+
+    if ( 0 == x->count || size < block_len )
+        return 0;
+
+    delta_sums(data, block_len, &a, &b);
+
+    while ( 1 )
+    {
+        uint32_t block = delta_match(x, expected, data + pos, block_len, delta_weak(a, b));
+
+        if ( UINT32_MAX != block )
+        {
+            // a run goes on while the blocks follow one another in both versions
+            if ( 0 != w->run.count && block == w->run.block + w->run.count
+                && (uint64_t) ( w->run.count + 1 ) * block_len <= DELTA_RUN_MAX )
+                w->run.count++;
+            else
+            {
+                delta_pending(w, pos);
+                w->run.block = block;
+                w->run.count = 1;
+            }
+
+            matched++;
+            expected = block + 1;
+            pos += block_len;
+            w->literal_start = pos;
+
+            if ( last < pos )
+                break;
+            delta_sums(data + pos, block_len, &a, &b);
+            continue;
+        }
+
+        if ( last == pos )
+            break;
+
+        // a byte that ends up in no block is literal
+        if ( 0 != w->run.count )
+            delta_pending(w, pos);
+
+        // the offsets the filter turns away, most of them, are rolled past in a tight loop
+        uint32_t ra = a;
+        uint32_t rb = b;
+        do
+        {
+            delta_roll(&ra, &rb, block_len, data[pos], data[pos + block_len]);
+            pos++;
+        }
+        while ( pos < last && !delta_filter_has(x, delta_weak(ra, rb)) );
+        a = ra;
+        b = rb;
+    }
+
+    return matched;
+}
+
+// Uploads a file as a new version of a stream the server stores (server -w), rsync style, with
+// the delta from the old version (see delta.h), and reports the bytes that crossed the wire and
+// the CPU time it took.
+static void delta_file(const struct sockaddr *servaddr, socklen_t servaddr_len, uint32_t base, const char *filename)
+{
+    int fd = open(filename, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if ( -1 == fd || -1 == fstat(fd, &st) )
+    {
+        fprintf(stderr, "cannot open %s (%d)\n", filename, errno);
+        exit(1);
+    }
+
+    size_t size = st.st_size;
+    const unsigned char *data = NULL;
+    if ( 0 != size )
+    {
+        data = (const unsigned char *) mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if ( MAP_FAILED == data )
+        {
+            fprintf(stderr, "cannot map %s (%d)\n", filename, errno);
+            exit(1);
+        }
+    }
+    close(fd);
+
+    uint32_t block_len = DELTA_BLOCK_MIN;
+    while ( block_len < DELTA_BLOCK_CAP && (uint64_t) block_len * block_len < size )
+        block_len *= 2;
+
+    int sockfd = socket(servaddr->sa_family, SOCK_STREAM, 0);
+    if ( -1 == sockfd || -1 == connect(sockfd, servaddr, servaddr_len) )
+    {
+        fprintf(stderr, "cannot connect to the server (%d)\n", errno);
+        exit(1);
+    }
+
+    uint64_t start = now_ns();
+    struct rusage usage_start, usage_end;
+    getrusage(RUSAGE_SELF, &usage_start);
+
+    char line[DELTA_LINE_MAX];
+    memcpy(line, DELTA_VERB, DELTA_VERB_LEN);
+    int len = DELTA_VERB_LEN + snprintf(line + DELTA_VERB_LEN, sizeof(line) - DELTA_VERB_LEN,
+        "%" PRIu32 " %" PRIu32 "\n", base, block_len);
+
+    struct delta_writer *w = (struct delta_writer *) calloc(1, sizeof(struct delta_writer));
+    if ( NULL == w )
+    {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+    w->sockfd = sockfd;
+    w->data = data;
+    w->iov[0].iov_base = line;
+    w->iov[0].iov_len = len;
+    w->niov = 1;
+    w->wire = len;
+    delta_flush(w);
+
+    // a server that is not in durable mode takes the command for data and acknowledges it
+    uint32_t stream;
+    uint32_t count;
+    int end = 0;
+    receive_line(sockfd, line, sizeof(line));
+    if ( 0 == strcmp(line, "Ack") )
+    {
+        fprintf(stderr, "delta: the server does not take deltas (server -w)\n");
+        exit(1);
+    }
+    if ( 0 != memcmp(line, DELTA_REPLY, DELTA_REPLY_LEN)
+        || 2 != sscanf(line + DELTA_REPLY_LEN, "%" SCNu32 " %" SCNu32 "%n", &stream, &count, &end)
+        || '\0' != line[DELTA_REPLY_LEN + end] )
+    {
+        fprintf(stderr, "delta: not an answer from the server: %s\n", line);
+        exit(1);
+    }
+
+    struct delta_signature *signatures = (struct delta_signature *) malloc(( 0 == count ? 1 : count ) * sizeof(struct delta_signature));
+    if ( NULL == signatures )
+    {
+        fprintf(stderr, "out of memory for %" PRIu32 " signatures\n", count);
+        exit(1);
+    }
+
+    receive_all(sockfd, signatures, count * sizeof(struct delta_signature));
+    struct delta_index index;
+    delta_index_init(&index, signatures, count);
+
+    size_t matched = delta_scan(w, &index, size, block_len);
+    delta_pending(w, size);
+    delta_queue(w, 0, 0, NULL, 0);
+    delta_flush(w);
+
+    receive_line(sockfd, line, sizeof(line));
+    if ( 0 != strcmp(line, "Ack") )
+    {
+        fprintf(stderr, "delta: not an answer from the server: %s\n", line);
+        exit(1);
+    }
+
+    getrusage(RUSAGE_SELF, &usage_end);
+    double elapsed = (now_ns() - start) / 1e9;
+    double cpu = ( usage_end.ru_utime.tv_sec - usage_start.ru_utime.tv_sec )
+        + ( usage_end.ru_stime.tv_sec - usage_start.ru_stime.tv_sec )
+        + ( usage_end.ru_utime.tv_usec - usage_start.ru_utime.tv_usec
+            + usage_end.ru_stime.tv_usec - usage_start.ru_stime.tv_usec ) / 1e6;
+
+    fprintf(stderr, "delta: %s, %zu bytes stored as stream %" PRIu32 " from stream %" PRIu32 ", blocks of %" PRIu32 ", "
+        "%zu of %" PRIu32 " matched, %zu literal bytes, %zu bytes sent (%.2f%%) and %zu received, "
+        "%.3f s, %.3f s of CPU (%.1f MB/s)\n",
+        filename, size, stream, base, block_len, matched, count, w->literal_bytes,
+        w->wire, 0 == size ? 0.0 : w->wire * 100.0 / size, count * sizeof(struct delta_signature),
+        elapsed, cpu, 0 == cpu ? 0.0 : size / cpu / 1e6);
+
+    close_after_ack(sockfd);
+
+    total_bytes_sent += w->wire;
+    free(index.table);
+    free(index.filter);
+    free(signatures);
+    free(w);
+    if ( 0 != size )
+        munmap((void *) data, size);
+}
+
+// the server has made room in a full ring
+static void handle_doorbell(int epollfd, struct endpoint *ep, uint32_t events)
+{
+    struct shm_producer *shm = (struct shm_producer *) ep;
+    struct connection_ctx *conn = shm->conn;
+    (void) events;
+
+    if ( -1 != conn->ep.fd && 0 != reactor_drain(&shm->ep) && fill_ring(conn) )
+        close_connection(epollfd, conn);
+}
+
+// the socket of an upload is readable, writable or failed
+static void handle_connection(int epollfd, struct endpoint *ep, uint32_t events)
+{
+    struct connection_ctx *conn = (struct connection_ctx *) ep;
+
+    // This is declared here to pass it from EPOLLIN to EPOLLOUT in this test implementation.
+    // In most other cases, it would likely be placed inside EPOLLIN block.
+    size_t total_bytes_in = 0;
+    int acknowledged = 0;
+
+    if ( events & EPOLLIN )
+    {
+        // socket has data to read
+
+        char buffer[BUFLEN];
+        ssize_t received;
+        size_t last_len = 0;
+
+        while ( 0 < ( received = recv(conn->ep.fd, buffer, sizeof(buffer), 0) )
+            || ( -1 == received && EINTR == errno ) )
+        {
+            if ( 0 < received )
+                last_len = received;
+
+            if ( 0 < received && echo )
+            {
+                conn->echoed += received;
+                total_bytes_echoed += received;
+                total_bytes_in += received;
+            }
+            else if ( 0 < received )
+            {
+                printf("sock:%d, %.*s", conn->ep.fd, (int) received, buffer);
+                fflush(stdout);
+
+                if ( !framed )
+                    acknowledged |= take_acks(conn, buffer, received);
+                total_bytes_in += received;
+            }
+        }
+
+        switch ( received )
+        {
+            case -1:
+                switch ( errno )
+                {
+                    case EAGAIN:
+                        // no data available right now, try again later...
+                        break;
+
+                    case ECONNRESET:
+                        // connection reset by the peer
+                        close_connection(epollfd, conn);
+                        break;
+
+                    case EBADF:
+                    case EFAULT:
+                    case EINVAL:
+                    case ENOTSOCK:
+                        // the client is broken, not the connection
+                        fprintf(stderr, "socket recv error (%d)\n", errno);
+                        exit(1);
+
+                    case ECONNREFUSED:
+                    case EHOSTUNREACH:
+                    case ENETUNREACH:
+                    case ENOMEM:
+                    case ENOTCONN:
+                    case ETIMEDOUT:
+                    default:
+                        fail_connection(epollfd, conn, "socket recv", errno);
+                        break;
+                }
+                break;
+
+            case 0:
+                if ( 0 == total_bytes_in )
+                {
+                    // The stream socket peer has performed an orderly shutdown.
+                    // recv returning 0 is a socket-closed notification.
 
-#define BUFLEN 64
-#define PORT 8080
-#define HOST "127.0.0.1"
+                    close_connection(epollfd, conn);
+                }
+        }
 
-// max number of events that can be returned by epoll at a time
-#define MAX_EVENTS 20
+        // we arrive at this point
+        // if recv() returned -1 with errno == EAGAIN
 
-struct connection_ctx
-{
-    int socket_fd;
-    FILE* fp;
-    char buffer[BUFLEN];
-    struct connection_ctx *next;
-};
+        if ( echo )
+        {
+            // everything sent has come back
+            if ( -1 != conn->ep.fd && NULL == conn->fp && conn->echoed == conn->sent )
+                close_connection(epollfd, conn);
+        }
+        else if ( framed )
+        {
+            // only the acknowledgement with the digest ends the file; it comes last
+            char *ack = ( -1 != conn->ep.fd && NULL == conn->fp )
+                ? (char *) memmem(buffer, last_len, "Ack ", 4) : NULL;
 
-static void clear_connection_ctx_list(struct connection_ctx *head)
-{
-    while ( NULL != head )
+            if ( NULL != ack )
+                check_digest(epollfd, conn, ack, buffer + last_len - ack);
+        }
+        else if ( -1 != conn->ep.fd && 0 != total_bytes_in && NULL == conn->fp )
+        {
+            // Everything has been sent: a server that counts is done once it counts all of it,
+            // and one that does not, with the first acknowledgement after the last byte.
+            if ( conn->counted ? conn->acked == conn->sent : acknowledged )
+                close_connection(epollfd, conn);
+        }
+    }
+
+    if ( events & EPOLLOUT && NULL != conn->shm )
     {
-        struct connection_ctx *next = head->next;
+        if ( NULL != conn->fp && -1 != conn->ep.fd && fill_ring(conn) )
+            close_connection(epollfd, conn);
+    }
+    else if ( events & EPOLLOUT )
+    {
+        // Edge-triggered: keep writing until the kernel pushes back, as EPOLLOUT is not
+        // reported again until then. Writing a chunk per event would leave the pace
+        // to whatever else wakes the connection, such as acknowledgements.
+        uint64_t woken_at = 0;
+        if ( conn->lz && NULL != conn->fp )
+        {
+            woken_at = now_ns();
+            adapt_level(conn, woken_at);
+        }
 
-        if ( 0 != head->socket_fd )
+        while ( NULL != conn->fp && -1 != conn->ep.fd )
         {
-            if ( -1 == close(head->socket_fd) )
+            size_t nbytes;
+            char *data = conn->buffer;
+
+            if ( framed )
             {
-                switch ( errno )
+                // what the kernel did not take of the frames is sent before the next ones
+                if ( conn->frame_sent == conn->frame_len )
+                    fill_frame(conn);
+                data += conn->frame_sent;
+                nbytes = conn->frame_len - conn->frame_sent;
+            }
+            else
+                nbytes = fread(conn->buffer, sizeof(char), BUFLEN, conn->fp);
+
+            if ( 0 != nbytes )
+            {
+                int sent = send(conn->ep.fd, data, nbytes, MSG_NOSIGNAL);
+                if ( -1 == sent )
                 {
-                    case EBADF:
-                    case EINTR:
-                    case EIO:
-                    default:
-                        fprintf(stderr, "socket close error (%d)", errno);
-                        exit(1);
+                    switch ( errno )
+                    {
+                        case EWOULDBLOCK:
+                        case EINTR:
+                            // nothing was sent; the chunk is read again on the next EPOLLOUT
+                            sent = 0;
+                            break;
+
+                        case EBADF:
+                        case EDESTADDRREQ:
+                        case EFAULT:
+                        case EINVAL:
+                        case EISCONN:
+                        case EMSGSIZE:
+                        case ENOTSOCK:
+                        case EOPNOTSUPP:
+                            // the client is broken, not the connection
+                            fprintf(stderr, "socket send error (%d)\n", errno);
+                            exit(1);
+
+                        case EACCES:
+                        case ECONNRESET:
+                        case ENOBUFS:
+                        case ENOMEM:
+                        case ENOTCONN:
+                        case EPIPE:
+                        default:
+                            fail_connection(epollfd, conn, "socket send", errno);
+                            break;
+                    }
+
+                    if ( -1 == conn->ep.fd )
+                        break;
+                }
+
+                total_bytes_sent += sent;
+                conn->sent += sent;
+
+                if ( !echo )
+                    fprintf(stderr, "sock:%d, fread:%lu, sent:%d\n", conn->ep.fd, nbytes, sent);
+
+                if ( framed )
+                {
+                    conn->frame_sent += sent;
+                    if ( (size_t) sent < nbytes )
+                        break;
+
+                    if ( conn->last_frame )
+                    {
+                        // the digest is waited for
+                        fclose(conn->fp);
+                        conn->fp = NULL;
+                    }
                 }
+                else if ( (size_t) sent < nbytes )
+                {
+                    // put back what the kernel did not take, for the next EPOLLOUT
+                    fseek(conn->fp, (long) sent - (long) nbytes, SEEK_CUR);
+                    break;
+                }
+                else if ( nbytes < BUFLEN )
+                {
+                    // reached to end-of-file
+                    // beware: there is corner case that the buffer ends exactly at the end-of-file
+                    // in that case, the end-of-file is not detected here, and will be taken care of
+                    // in the next round
+                    fclose(conn->fp);
+                    conn->fp = NULL;
+                }
+            }
+            else
+            {
+                // already end-of-file
+                // we reach here in case the send buffer ends exactly at the end-of-file
+                // and the end-of-file was not detected in the previous round
+
+                fclose(conn->fp);
+                conn->fp = NULL;
+
+                if ( ( conn->counted ? conn->acked == conn->sent : acknowledged )
+                    || ( echo && conn->echoed == conn->sent ) )
+                    close_connection(epollfd, conn);
             }
         }
 
-        if ( NULL != head->fp )
-            fclose(head->fp);
+        // the kernel pushed back: how long it takes to drain is compared to this
+        if ( 0 != woken_at && NULL != conn->fp )
+        {
+            conn->filled_at = now_ns();
+            conn->fill_ns = conn->filled_at - woken_at;
+        }
+    }
 
-        free(head);
+    if ( events & EPOLLERR && -1 != conn->ep.fd )
+    {
+        // error condition
+        int err = 0;
+        socklen_t len = sizeof(err);
+        getsockopt(conn->ep.fd, SOL_SOCKET, SO_ERROR, &err, &len);
 
-        head = next;
+        fail_connection(epollfd, conn, "EPOLLERR", err);
     }
 }
 
-static int close_connection(int epollfd, int connfd)
+int main(int argc, char* argv[])
 {
-    if ( -1 == epoll_ctl(epollfd, EPOLL_CTL_DEL, connfd, NULL) )
+    const char *unix_path = NULL;
+    int use_shm = 0;
+    int use_udp = 0;
+    long churn = 0;
+    long idle = 0;
+    long idle_step = 0;
+    pid_t server_pid = 0;
+    const char *publish = NULL;
+    const char *subscribe = NULL;
+    long long fetch = -1;
+    uint64_t fetch_offset = 0;
+    uint64_t fetch_count = UINT64_MAX;
+    int dedup_upload = 0;
+    long long delta_base = -1;
+    const char *query = NULL;
+    int query_whole = 0;
+
+    int opt;
+    while ( -1 != ( opt = getopt(argc, argv, "u:mdr:i:s:P:ep:S:f:o:n:DV:Czq:Q:") ) )
     {
-        switch ( errno )
+        switch ( opt )
         {
-            case EBADF:
-            case EEXIST:
-            case EINVAL:
-            case ENOENT:
-            case ENOMEM:
-            case ENOSPC:
-            case EPERM:
+            case 'u':
+                unix_path = optarg;
+                if ( sizeof(((struct sockaddr_un*) 0)->sun_path) <= strlen(unix_path) )
+                {
+                    fprintf(stderr, "socket path too long: %s\n", unix_path);
+                    exit(1);
+                }
+                break;
+
+            case 'm':
+                use_shm = 1;
+                break;
+
+            case 'd':
+                use_udp = 1;
+                break;
+
+            case 'r':
+                churn = strtol(optarg, NULL, 10);
+                break;
+
+            case 'e':
+                echo = 1;
+                break;
+
+            case 'p':
+            case 'S':
+                if ( 0 == strlen(optarg) || CHANNEL_NAME_MAX < strlen(optarg) || NULL != strchr(optarg, '\n') )
+                {
+                    fprintf(stderr, "channel name is 1 to %d characters: %s\n", CHANNEL_NAME_MAX, optarg);
+                    exit(1);
+                }
+                if ( 'p' == opt )
+                    publish = optarg;
+                else
+                    subscribe = optarg;
+                break;
+
+            case 'i':
+                idle = strtol(optarg, NULL, 10);
+                break;
+
+            case 's':
+                idle_step = strtol(optarg, NULL, 10);
+                break;
+
+            case 'P':
+                server_pid = (pid_t) strtol(optarg, NULL, 10);
+                break;
+
+            case 'f':
+                fetch = strtoll(optarg, NULL, 10);
+                break;
+
+            case 'o':
+                fetch_offset = strtoull(optarg, NULL, 10);
+                break;
+
+            case 'n':
+                fetch_count = strtoull(optarg, NULL, 10);
+                break;
+
+            case 'D':
+                dedup_upload = 1;
+                break;
+
+            case 'V':
+                delta_base = strtoll(optarg, NULL, 10);
+                break;
+
+            case 'q':
+            case 'Q':
+                if ( 0 == strlen(optarg) || QUERY_COMMAND_MAX - QUERY_VERB_LEN - 1 < strlen(optarg) || NULL != strchr(optarg, '\n') )
+                {
+                    fprintf(stderr, "query string is 1 to %d bytes on one line\n", QUERY_COMMAND_MAX - QUERY_VERB_LEN - 1);
+                    exit(1);
+                }
+                query = optarg;
+                query_whole = ( 'Q' == opt );
+                break;
+
+            case 'z':
+                compress_frames = 1;
+                // fall through
+
+            case 'C':
+                framed = 1;
+                break;
+
             default:
-                fprintf(stderr, "epoll_ctl error (%d)\n", errno);
+                fprintf(stderr, "Usage: %s [-u socket_path [-m] | -d] [-r count] [-e | -p channel | -C | -z] [filename]...\n", argv[0]);
+                fprintf(stderr, "       %s -i count [-s step] [-P server_pid | -S channel]\n", argv[0]);
+                fprintf(stderr, "       %s [-u socket_path] -f stream [-o offset] [-n bytes] filename\n", argv[0]);
+                fprintf(stderr, "       %s [-u socket_path] -D filename...\n", argv[0]);
+                fprintf(stderr, "       %s [-u socket_path] -V stream filename\n", argv[0]);
+                fprintf(stderr, "       %s [-u socket_path] -q string | -Q string\n", argv[0]);
                 exit(1);
         }
     }
 
-    if ( -1 == close(connfd) )
+    if ( 0 < idle )
     {
-        switch ( errno )
-        {
-            case EBADF:
-            case EINTR:
-            case EIO:
-            default:
-                fprintf(stderr, "socket close error (%d)\n", errno);
-                exit(1);
-        }
+        signal(SIGINT, idle_interrupted);
+        signal(SIGTERM, idle_interrupted);
+
+        if ( NULL != subscribe )
+            hold_subscribers(idle, subscribe);
+        else
+            hold_idle_connections(idle, idle_step, server_pid);
+        exit(0);
     }
 
-    return 0;
-}
+    if ( argc <= optind && NULL == query )
+    {
+        fprintf(stderr, "Usage: %s [-u socket_path [-m] | -d] [-r count] [-e | -p channel | -C | -z] [filename]...\n", argv[0]);
+        exit(0);
+    }
 
-int main(int argc, char* argv[])
-{
-    if ( argc <= 1 )
+    if ( ( echo || NULL != publish ) && ( use_shm || use_udp ) )
+    {
+        fprintf(stderr, "-e and -p work with stream sockets only\n");
+        exit(1);
+    }
+
+    if ( framed && ( echo || NULL != publish || use_shm || use_udp || dedup_upload || 0 <= delta_base || 0 <= fetch || NULL != query ) )
+    {
+        // the other modes have protocols of their own
+        fprintf(stderr, "-C and -z go with plain uploads over stream sockets only\n");
+        exit(1);
+    }
+
+    if ( framed )
+        crc32c_init();
+
+    if ( use_shm && NULL == unix_path )
+    {
+        // the ring is handed over with SCM_RIGHTS, which only AF_UNIX sockets can carry
+        fprintf(stderr, "-m requires -u\n");
+        exit(1);
+    }
+
+    if ( use_udp )
+    {
+        send_datagrams(argv + optind, argc - optind);
+        exit(0);
+    }
+
+    // the server address is the same for every connection
+
+    struct sockaddr_storage servaddr;
+    socklen_t servaddr_len;
+
+    if ( NULL != unix_path )
+    {
+        struct sockaddr_un *unixaddr = (struct sockaddr_un *) &servaddr;
+        unixaddr->sun_family = AF_UNIX;
+        strcpy(unixaddr->sun_path, unix_path);
+        servaddr_len = sizeof(struct sockaddr_un);
+    }
+    else
+    {
+        struct sockaddr_in *inaddr = (struct sockaddr_in *) &servaddr;
+        inaddr->sin_family = AF_INET;
+        inaddr->sin_port = htons(PORT);
+        inaddr->sin_addr.s_addr = inet_addr(HOST);
+        servaddr_len = sizeof(struct sockaddr_in);
+    }
+
+    // a peer that goes away must not take the process down with it;
+    // writing to it fails with EPIPE instead
+    signal(SIGPIPE, SIG_IGN);
+
+    if ( NULL != query )
+    {
+        query_streams((struct sockaddr*) &servaddr, servaddr_len, query, query_whole);
+        exit(0);
+    }
+
+    if ( 0 <= fetch )
+    {
+        fetch_stream((struct sockaddr*) &servaddr, servaddr_len, (uint32_t) fetch, fetch_offset, fetch_count, argv[optind]);
+        exit(0);
+    }
+
+    if ( 0 <= delta_base )
     {
-        fprintf(stderr, "Usage: %s [filename]...\n", argv[0]);
+        delta_file((struct sockaddr*) &servaddr, servaddr_len, (uint32_t) delta_base, argv[optind]);
         exit(0);
     }
 
+    if ( dedup_upload )
+    {
+        cdc_init();
+        for ( int i = optind; i < argc; i++ )
+            upload_file((struct sockaddr*) &servaddr, servaddr_len, argv[i]);
+        exit(0 == failed_connections ? 0 : 1);
+    }
+
+    pid_t churn_pid = -1;
+    if ( 0 < churn )
+    {
+        churn_pid = fork();
+        if ( 0 == churn_pid )
+        {
+            churn_connections((struct sockaddr*) &servaddr, servaddr_len, churn);
+            _exit(0);
+        }
+    }
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
     struct connection_ctx *connection_head = NULL;
     struct connection_ctx *connection_tail = NULL;
-    int conn_cnt = 0;
 
-    for ( int i = 1; i < argc; i++ )
+    for ( int i = optind; i < argc; i++ )
     {
         FILE* fp = fopen(argv[i], "r");
         if ( fp )
         {
-            int sockfd = socket(AF_INET, SOCK_STREAM, 0);
+            int sockfd = socket(servaddr.ss_family, SOCK_STREAM, 0);
             if ( -1 == sockfd )
             {
                 switch ( errno )
@@ -125,24 +2666,21 @@ int main(int argc, char* argv[])
                     case EPROTONOSUPPORT:
                     default:
                         fprintf(stderr, "socket creation error (%d)\n", errno);
-                        exit(1);
+                        fclose(fp);
+                        failed_connections++;
+                        continue;
                 }
             }
 
             // connect to the server
 
-            struct sockaddr_in servaddr;
-            servaddr.sin_family = AF_INET;
-            servaddr.sin_port = htons(PORT);
-            servaddr.sin_addr.s_addr = inet_addr(HOST);
-
-            if ( -1 == connect(sockfd, (struct sockaddr*) &servaddr, sizeof(servaddr) ))
+            if ( -1 == connect(sockfd, (struct sockaddr*) &servaddr, servaddr_len ))
             {
                 switch ( errno )
                 {
                     case ECONNREFUSED:
                         fprintf(stderr, "connection refused.\n");
-                        exit(1);
+                        break;
 
                     case EADDRNOTAVAIL:
                     case EAFNOSUPPORT:
@@ -170,47 +2708,61 @@ int main(int argc, char* argv[])
                     case EOPNOTSUPP:
                     default:
                         fprintf(stderr, "socket connect error (%d)\n", errno);
-                        exit(1);
+                        break;
                 }
+
+                // this file is skipped; the others are still uploaded
+                close(sockfd);
+                fclose(fp);
+                failed_connections++;
+                continue;
             }
 
-            // set non-blocking
+            struct shm_producer *shm = NULL;
+            if ( use_shm )
+                shm = offer_shm(sockfd);
 
-            int flags = fcntl(sockfd, F_GETFL, 0);
-            if ( -1 == flags )
+            if ( NULL != publish )
             {
-                switch ( errno )
+                // still blocking; the line goes out before any of the file
+                char line[PUBSUB_VERB_LEN + CHANNEL_NAME_MAX + 1];
+                size_t len = strlen(publish);
+                memcpy(line, PUBSUB_PUBLISH, PUBSUB_VERB_LEN);
+                memcpy(line + PUBSUB_VERB_LEN, publish, len);
+                line[PUBSUB_VERB_LEN + len] = '\n';
+
+                if ( (ssize_t) ( PUBSUB_VERB_LEN + len + 1 ) != send(sockfd, line, PUBSUB_VERB_LEN + len + 1, MSG_NOSIGNAL) )
                 {
-                    case EACCES:
-                    case EAGAIN:
-                    case EBADF:
-                    case EINTR:
-                    case EINVAL:
-                    case EMFILE:
-                    case ENOLCK:
-                    case EOVERFLOW:
-                    default:
-                        fprintf(stderr, "select fcntl error (%d)\n", errno);
-                        exit(1);
+                    fprintf(stderr, "socket send error (%d)\n", errno);
+                    close(sockfd);
+                    fclose(fp);
+                    failed_connections++;
+                    continue;
                 }
             }
 
-            if ( -1 == fcntl(sockfd, F_SETFL, flags | O_NONBLOCK) )
+            int lz = 0;
+            if ( framed && -1 == ( lz = start_frames(sockfd) ) )
             {
-                switch ( errno )
+                close(sockfd);
+                fclose(fp);
+                failed_connections++;
+                continue;
+            }
+
+            // set non-blocking
+
+            if ( -1 == reactor_nonblocking(sockfd) )
+            {
+                if ( NULL != shm )
                 {
-                    case EACCES:
-                    case EAGAIN:
-                    case EBADF:
-                    case EINTR:
-                    case EINVAL:
-                    case EMFILE:
-                    case ENOLCK:
-                    case EOVERFLOW:
-                    default:
-                        fprintf(stderr, "select fcntl error (%d)\n", errno);
-                        exit(1);
+                    release_shm_producer(-1, shm);
+                    free(shm);
                 }
+                close(sockfd);
+                fclose(fp);
+                failed_connections++;
+                continue;
             }
 
             // store the socket in connection_ctx
@@ -218,10 +2770,28 @@ int main(int argc, char* argv[])
             struct connection_ctx *new_conn = (struct connection_ctx *) malloc(sizeof(struct connection_ctx));
             if ( NULL != new_conn )
             {
-                new_conn->socket_fd = sockfd;
+                new_conn->ep.handle = handle_connection;
+                new_conn->ep.fd = sockfd;
                 new_conn->fp = fp;
+                new_conn->shm = shm;
+                new_conn->sent = 0;
+                new_conn->echoed = 0;
+                new_conn->acked = 0;
+                new_conn->counted = 0;
+                new_conn->ack_state = 0;
+                new_conn->crc = 0;
+                new_conn->last_frame = 0;
+                new_conn->frame_len = 0;
+                new_conn->frame_sent = 0;
+                new_conn->lz = lz;
+                new_conn->level = lz ? LZ_LEVEL_START : 0;
+                new_conn->filled_at = 0;
+                new_conn->fill_ns = 0;
                 new_conn->next = NULL;
 
+                if ( NULL != shm )
+                    shm->conn = new_conn;
+
                 if ( NULL != connection_tail )
                 {
                     connection_tail->next = new_conn;
@@ -232,234 +2802,75 @@ int main(int argc, char* argv[])
                     connection_head = new_conn;
             }
 
-            ++conn_cnt;
+            ++live_connections;
         }
     }
 
     // epoll
 
-    int epollfd = epoll_create1(0);
-    if ( -1 == epollfd )
-    {
-        switch ( errno )
-        {
-            case EINVAL:
-            case EMFILE:
-            case ENFILE:
-            case ENOMEM:
-            default:
-                fprintf(stderr, "epoll create1 error (%d)\n", errno);
-                exit(1);
-        }
-    }
+    int epollfd = reactor_create();
 
     // register sockets
 
-    struct epoll_event ev;
-
     for ( struct connection_ctx *conn = connection_head; conn != NULL; conn = conn->next )
     {
-        ev.events = EPOLLIN | EPOLLOUT | EPOLLET;
-        ev.data.ptr = conn;
-
-        if ( -1 == epoll_ctl(epollfd, EPOLL_CTL_ADD, conn->socket_fd, &ev) )
+        if ( -1 == reactor_add(epollfd, &conn->ep, EPOLLIN | EPOLLOUT | EPOLLET) )
         {
-            switch ( errno )
-            {
-                case EBADF:
-                case EEXIST:
-                case EINVAL:
-                case ENOENT:
-                case ENOMEM:
-                case ENOSPC:
-                case EPERM:
-                default:
-                    fprintf(stderr, "epoll_ctl error (%d)\n", errno);
-                    exit(1);
-            }
+            // out of memory or at max_user_watches; this connection has to go
+            if ( -1 == close(conn->ep.fd) )
+                fprintf(stderr, "socket close error (%d)\n", errno);
+            conn->ep.fd = -1;
+            failed_connections++;
+            live_connections--;
+            continue;
         }
+
+        if ( NULL != conn->shm && -1 == reactor_add(epollfd, &conn->shm->ep, EPOLLIN | EPOLLET) )
+            fail_connection(epollfd, conn, "epoll_ctl", errno);
     }
 
     struct epoll_event events[MAX_EVENTS];
 
-    while ( 0 < conn_cnt )
+    while ( 0 < live_connections )
     {
-        int nfds = epoll_wait(epollfd, events, MAX_EVENTS, -1);
+        int nfds = reactor_wait(epollfd, events, MAX_EVENTS, -1);
         if ( -1 == nfds )
         {
-            switch ( errno )
-            {
-                case EINTR:
-                    // A signal was caught
-                    fprintf(stderr, "shutting down...\n");
-                    clear_connection_ctx_list(connection_head);
-                    exit(0);
-
-                case EBADF:
-                case EFAULT:
-                case EINVAL:
-                default:
-                    fprintf(stderr, "epoll_wait error (%d)\n", errno);
-                    exit(1);
-            }
+            // A signal was caught
+            fprintf(stderr, "shutting down...\n");
+            clear_connection_ctx_list(connection_head);
+            exit(0);
         }
 
-        for ( int i = 0; i < nfds; i++ )
-        {
-            struct connection_ctx *conn = (struct connection_ctx *) events[i].data.ptr;
-
-            // This is declared here to pass it from EPOLLIN to EPOLLOUT in this test implementation.
-            // In most other cases, it would likely be placed inside EPOLLIN block.
-            size_t total_bytes_in = 0;
-            int acknowledged = 0;
-
-            if ( events[i].events & EPOLLIN )
-            {
-                // socket has data to read
-
-                char buffer[BUFLEN];
-                ssize_t received;
-
-                while ( 0 < ( received = recv(conn->socket_fd, buffer, sizeof(buffer), 0) ) )
-                {
-                    printf("sock:%d, %.*s", conn->socket_fd, (int) received, buffer);
-                    fflush(stdout);
-
-                    total_bytes_in += received;
-                }
-
-                switch ( received )
-                {
-                    case -1:
-                        switch ( errno )
-                        {
-                            case EAGAIN:
-                                // no data available right now, try again later...
-                                break;
-
-                            case ECONNRESET:
-                                // connection reset by the peer
-                                close_connection(epollfd, conn->socket_fd);
-                                conn->socket_fd = 0;
-                                conn_cnt--;
-                                break;
-
-                            case EBADF:
-                            case ECONNREFUSED:
-                            case EFAULT:
-                            case EINTR:
-                            case EINVAL:
-                            case ENOMEM:
-                            case ENOTCONN:
-                            case ENOTSOCK:
-                            default:
-                                fprintf(stderr, "socket recv error (%d)\n", errno);
-                                exit(1);
-                        }
-                        break;
-
-                    case 0:
-                        if ( 0 == total_bytes_in )
-                        {
-                            // The stream socket peer has performed an orderly shutdown.
-                            // recv returning 0 is a socket-closed notification.
-
-                            close_connection(epollfd, conn->socket_fd);
-                            conn->socket_fd = 0;
-                            conn_cnt--;
-                        }
-                }
-
-                // we arrive at this point
-                // if recv() returned -1 with errno == EAGAIN
-
-                if ( 0 == strncmp(buffer, "Ack\n", 4) )
-                {
-                    acknowledged = 1;
-
-                    // if this acknowledgement is after all data have been sent
-                    if ( NULL == conn->fp )
-                    {
-                        close_connection(epollfd, conn->socket_fd);
-                        conn->socket_fd = 0;
-                        conn_cnt--;
-                    }
-                }
-            }
-
-            if ( events[i].events & EPOLLOUT )
-            {
-                if ( NULL != conn->fp && 0 != conn->socket_fd )
-                {
-                    size_t nbytes;
-                    nbytes = fread(conn->buffer, sizeof(char), BUFLEN, conn->fp);
-                    if ( 0 != nbytes )
-                    {
-                        int sent = send(conn->socket_fd, conn->buffer, nbytes, 0);
-                        if ( -1 == sent )
-                        {
-                            switch ( errno )
-                            {
-                                case EACCES:
-                                case EWOULDBLOCK:
-                                case EBADF:
-                                case ECONNRESET:
-                                case EDESTADDRREQ:
-                                case EFAULT:
-                                case EINTR:
-                                case EINVAL:
-                                case EISCONN:
-                                case EMSGSIZE:
-                                case ENOBUFS:
-                                case ENOMEM:
-                                case ENOTCONN:
-                                case ENOTSOCK:
-                                case EOPNOTSUPP:
-                                case EPIPE:
-                                default:
-                                    fprintf(stderr, "socket send error (%d)\n", errno);
-                                    exit(1);
-                            }
-                        }
-
-                        // reached to end-of-file
-                        // beware: there is corner case that the buffer ends exactly at the end-of-file
-                        // in that case, the end-of-file is not detected here, and will be taken care of
-                        // in the next EPOLLOUT
-                        if ( nbytes < BUFLEN )
-                        {
-                            fclose(conn->fp);
-                            conn->fp = NULL;
-                        }
-
-                        fprintf(stderr, "sock:%d, fread:%lu, sent:%d\n", conn->socket_fd, nbytes, sent);
-                    }
-                    else
-                    {
-                        // already end-of-file
-                        // we reach here in case the send buffer ends exactly at the end-of-file
-                        // and the end-of-file was not detected in the previous EPOLLOUT
+        reactor_dispatch(epollfd, events, nfds);
+    }
 
-                        fclose(conn->fp);
-                        conn->fp = NULL;
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
 
-                        if ( 0 != acknowledged )
-                        {
-                            close_connection(epollfd, conn->socket_fd);
-                            conn->socket_fd = 0;
-                            conn_cnt--;
-                        }
-                    }
-                }
-            }
+    double elapsed = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    if ( elapsed <= 0 )
+        elapsed = 1e-9;
 
-            if ( events[i].events & EPOLLERR )
-            {
-                // error condition
-                fprintf(stderr, "EPOLLERR\n");
-            }
-        }
+    fprintf(stderr, "sent %zu bytes in %.3f s (%.1f MB/s), %d connections failed\n",
+        total_bytes_sent, elapsed, total_bytes_sent / elapsed / 1e6, failed_connections);
+    if ( echo )
+        fprintf(stderr, "echoed %zu bytes (%.1f MB/s)\n", total_bytes_echoed, total_bytes_echoed / elapsed / 1e6);
+    if ( framed )
+        fprintf(stderr, "%d files checked with %s, acknowledged with a matching digest\n", verified_files, crc32c_name);
+    if ( compress_frames )
+    {
+        // what the link carried against the files it delivered, headers included
+        fprintf(stderr, "lz: %zu bytes of files sent as %zu (%.1f%%), %.1f MB/s of files; frames at levels 0-%d:",
+            total_file_bytes, total_bytes_sent, 0 == total_file_bytes ? 0.0 : total_bytes_sent * 100.0 / total_file_bytes,
+            total_file_bytes / elapsed / 1e6, LZ_LEVELS - 1);
+        for ( int level = 0; level < LZ_LEVELS; level++ )
+            fprintf(stderr, " %zu", frames_at_level[level]);
+        fprintf(stderr, "\n");
     }
 
+    if ( -1 != churn_pid )
+        waitpid(churn_pid, NULL, 0);
+
     clear_connection_ctx_list(connection_head);
 }
@@ -0,0 +1,224 @@
+/*
+ * Copyright (c) Seungyeob Choi
+ *
+ * CRC32C (Castagnoli), the checksum of iSCSI, ext4 and SCTP, for the integrity checking of
+ * frames (see frame.h), computed the same way on both sides.
+ *
+ * Where the CPU has SSE4.2, its crc32 instruction takes 8 bytes at a time. It has a latency of
+ * 3 cycles but starts one every cycle, so the data is cut into three lanes that are computed at
+ * once, and the CRCs of the first two are then moved past the bytes of the lanes after them,
+ * with tables that apply the effect of that many zero bytes, and combined. Elsewhere, tables
+ * take 8 bytes at a time (slicing-by-8).
+ *
+ * crc32c() carries on from the CRC of the bytes before, 0 for none, so that the CRC of data
+ * that comes in pieces is that of the whole.
+ */
+#ifndef CRC32C_H
+#define CRC32C_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>     // memcpy()
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>  // _mm_crc32_u64()
+#endif
+
+// reversed Castagnoli polynomial
+#define CRC32C_POLY 0x82f63b78
+
+// the lanes of the hardware kernel: LONG bytes each while the data lasts, then SHORT
+#define CRC32C_LONG 4096
+#define CRC32C_SHORT 256
+
+static uint32_t crc32c_table[8][256];
+static uint32_t crc32c_long[4][256];
+static uint32_t crc32c_short[4][256];
+
+static uint32_t crc32c_sw(uint32_t crc, const void *data, size_t len);
+static uint32_t (*crc32c)(uint32_t crc, const void *data, size_t len) = crc32c_sw;
+
+// the implementation crc32c() was set to, for the reports
+static const char *crc32c_name = "slicing-by-8";
+
+// applies a 32x32 bit matrix over GF(2), a column per bit, to vec
+static inline uint32_t crc32c_apply(const uint32_t *mat, uint32_t vec)
+{
+    uint32_t sum = 0;
+
+    for ( ; 0 != vec; vec >>= 1, mat++ )
+    {
+        if ( vec & 1 )
+            sum ^= *mat;
+    }
+
+    return sum;
+}
+
+static inline void crc32c_square(uint32_t *square, const uint32_t *mat)
+{
+    for ( int n = 0; n < 32; n++ )
+        square[n] = crc32c_apply(mat, mat[n]);
+}
+
+// fills zeros with the operator that moves a CRC past len zero bytes, len being a power of two,
+// a table per byte of the CRC
+static inline void crc32c_zeros(uint32_t zeros[4][256], size_t len)
+{
+    uint32_t op[32];
+    uint32_t next[32];
+
+    // one zero bit
+    op[0] = CRC32C_POLY;
+    for ( int n = 1; n < 32; n++ )
+        op[n] = (uint32_t) 1 << ( n - 1 );
+
+    // squared up to one zero byte, and then up to len of them
+    for ( size_t bits = 1; bits < len * 8; bits <<= 1 )
+    {
+        crc32c_square(next, op);
+        memcpy(op, next, sizeof(op));
+    }
+
+    for ( uint32_t n = 0; n < 256; n++ )
+    {
+        zeros[0][n] = crc32c_apply(op, n);
+        zeros[1][n] = crc32c_apply(op, n << 8);
+        zeros[2][n] = crc32c_apply(op, n << 16);
+        zeros[3][n] = crc32c_apply(op, n << 24);
+    }
+}
+
+static inline uint32_t crc32c_shift(uint32_t zeros[4][256], uint32_t crc)
+{
+    return zeros[0][crc & 0xff] ^ zeros[1][( crc >> 8 ) & 0xff]
+        ^ zeros[2][( crc >> 16 ) & 0xff] ^ zeros[3][crc >> 24];
+}
+
+static uint32_t crc32c_sw(uint32_t crc, const void *data, size_t len)
+{
+    const unsigned char *p = (const unsigned char *) data;
+    uint64_t c = crc ^ 0xffffffff;
+
+    while ( 8 <= len )
+    {
+        uint64_t word;
+        memcpy(&word, p, 8);
+        word ^= c;
+
+        c = crc32c_table[7][word & 0xff] ^ crc32c_table[6][( word >> 8 ) & 0xff]
+            ^ crc32c_table[5][( word >> 16 ) & 0xff] ^ crc32c_table[4][( word >> 24 ) & 0xff]
+            ^ crc32c_table[3][( word >> 32 ) & 0xff] ^ crc32c_table[2][( word >> 40 ) & 0xff]
+            ^ crc32c_table[1][( word >> 48 ) & 0xff] ^ crc32c_table[0][word >> 56];
+
+        p += 8;
+        len -= 8;
+    }
+
+    while ( 0 != len-- )
+        c = ( c >> 8 ) ^ crc32c_table[0][( c ^ *p++ ) & 0xff];
+
+    return (uint32_t) c ^ 0xffffffff;
+}
+
+#if defined(__x86_64__)
+// three lanes of lane bytes each at a time, combined with zeros, the operator for lane bytes
+__attribute__((target("sse4.2")))
+static inline uint64_t crc32c_lanes(uint64_t c, const unsigned char **next, size_t *len, size_t lane, uint32_t zeros[4][256])
+{
+    const unsigned char *p = *next;
+
+    while ( 3 * lane <= *len )
+    {
+        uint64_t c1 = 0;
+        uint64_t c2 = 0;
+        const unsigned char *end = p + lane;
+
+        do
+        {
+            uint64_t w0, w1, w2;
+            memcpy(&w0, p, 8);
+            memcpy(&w1, p + lane, 8);
+            memcpy(&w2, p + 2 * lane, 8);
+
+            c = _mm_crc32_u64(c, w0);
+            c1 = _mm_crc32_u64(c1, w1);
+            c2 = _mm_crc32_u64(c2, w2);
+            p += 8;
+        } while ( p < end );
+
+        c = crc32c_shift(zeros, (uint32_t) c) ^ c1;
+        c = crc32c_shift(zeros, (uint32_t) c) ^ c2;
+
+        p += 2 * lane;
+        *len -= 3 * lane;
+    }
+
+    *next = p;
+    return c;
+}
+
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_hw(uint32_t crc, const void *data, size_t len)
+{
+    const unsigned char *p = (const unsigned char *) data;
+    uint64_t c = crc ^ 0xffffffff;
+
+    // up to a word boundary, so that the lanes load aligned words
+    while ( 0 != len && 0 != ( (uintptr_t) p & 7 ) )
+    {
+        c = _mm_crc32_u8((uint32_t) c, *p++);
+        len--;
+    }
+
+    c = crc32c_lanes(c, &p, &len, CRC32C_LONG, crc32c_long);
+    c = crc32c_lanes(c, &p, &len, CRC32C_SHORT, crc32c_short);
+
+    while ( 8 <= len )
+    {
+        uint64_t word;
+        memcpy(&word, p, 8);
+        c = _mm_crc32_u64(c, word);
+        p += 8;
+        len -= 8;
+    }
+
+    while ( 0 != len-- )
+        c = _mm_crc32_u8((uint32_t) c, *p++);
+
+    return (uint32_t) c ^ 0xffffffff;
+}
+#endif
+
+// fills the tables and picks the fastest implementation the CPU has
+static inline void crc32c_init(void)
+{
+    for ( uint32_t n = 0; n < 256; n++ )
+    {
+        uint32_t c = n;
+        for ( int k = 0; k < 8; k++ )
+            c = ( c & 1 ) ? ( c >> 1 ) ^ CRC32C_POLY : c >> 1;
+        crc32c_table[0][n] = c;
+    }
+
+    for ( uint32_t n = 0; n < 256; n++ )
+    {
+        for ( int k = 1; k < 8; k++ )
+        {
+            uint32_t c = crc32c_table[k - 1][n];
+            crc32c_table[k][n] = ( c >> 8 ) ^ crc32c_table[0][c & 0xff];
+        }
+    }
+
+#if defined(__x86_64__)
+    if ( __builtin_cpu_supports("sse4.2") )
+    {
+        crc32c_zeros(crc32c_long, CRC32C_LONG);
+        crc32c_zeros(crc32c_short, CRC32C_SHORT);
+        crc32c = crc32c_hw;
+        crc32c_name = "sse4.2";
+    }
+#endif
+}
+
+#endif
@@ -0,0 +1,89 @@
+/*
+ * Copyright (c) Seungyeob Choi
+ *
+ * The delta upload of durable mode (client -V, server -w), rsync style: a new version of a
+ * stream the server stores is sent as the difference from the old one. The client names the
+ * stream holding the old version and the block length it wants, a NUL byte first like the
+ * other handshakes:
+ *
+ *   "\0DELTA " stream " " block_len "\n"
+ *
+ * The server answers with the stream number the new version is stored as, and the signature
+ * of every whole block of the old version, in order; none if it does not store that stream:
+ *
+ *   "Signatures " stream " " count "\n"   then count delta_signature entries
+ *
+ * The client looks for these blocks at every byte offset of the new version, with the weak
+ * checksum rolled along one byte at a time and the strong one to confirm a match, and sends
+ * the new version as delta_op entries: a run of blocks of the old version, of DELTA_RUN_MAX
+ * bytes at most, or literal bytes, which follow the op. An op with a count of 0 ends the
+ * file, which the server acknowledges with "Ack" once it is in the log. Binary fields are in
+ * the byte order of the host.
+ */
+#ifndef DELTA_H
+#define DELTA_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define DELTA_VERB "\0DELTA "
+#define DELTA_VERB_LEN 7
+#define DELTA_REPLY "Signatures "
+#define DELTA_REPLY_LEN 11
+
+// longest command and answer line, newline included
+#define DELTA_LINE_MAX 64
+
+// block lengths the server accepts
+#define DELTA_BLOCK_MIN 512
+#define DELTA_BLOCK_MAX (1 << 20)
+
+// delta_op.block of literal bytes
+#define DELTA_LITERAL UINT32_MAX
+
+// longest run of blocks in one op, as the server copies a run at once
+#define DELTA_RUN_MAX (16 << 20)
+
+struct delta_signature
+{
+    uint64_t strong[2];             // cdc_fingerprint() of the block
+    uint32_t weak;                  // delta_weak() of the block
+    uint32_t reserved;              // zero
+};
+
+struct delta_op
+{
+    uint32_t block;                 // the first block of the run, or DELTA_LITERAL
+    uint32_t count;                 // blocks of the run, or literal bytes that follow
+};
+
+// The weak checksum of rsync: the sum of the bytes, and the sum of these sums, both modulo
+// 2^16. Kept apart in a and b, it moves along one byte with delta_roll().
+static inline void delta_sums(const unsigned char *data, size_t len, uint32_t *a, uint32_t *b)
+{
+    uint32_t s1 = 0;
+    uint32_t s2 = 0;
+
+    for ( size_t i = 0; i < len; i++ )
+    {
+        s1 += data[i];
+        s2 += s1;
+    }
+
+    *a = s1 & 0xffff;
+    *b = s2 & 0xffff;
+}
+
+// drops the byte out of the front of a window of len bytes and takes the byte in at its end
+static inline void delta_roll(uint32_t *a, uint32_t *b, size_t len, unsigned char out, unsigned char in)
+{
+    *a = ( *a - out + in ) & 0xffff;
+    *b = ( *b - (uint32_t) ( len * out ) + *a ) & 0xffff;
+}
+
+static inline uint32_t delta_weak(uint32_t a, uint32_t b)
+{
+    return a | ( b << 16 );
+}
+
+#endif
@@ -0,0 +1,31 @@
+/*
+ * Copyright (c) Seungyeob Choi
+ *
+ * The fetch command of durable mode (server -w). Besides the log, the server keeps what each
+ * connection sends in a file of its own, log_dir/streams/<stream>, named after the stream
+ * number of the connection. A connection that starts with the fetch verb, a NUL byte first
+ * like the other handshakes, reads them back:
+ *
+ *   "\0FETCH " stream " " offset " " max_bytes "\n"
+ *
+ * Each command is answered with a line giving the number of bytes that follow, at most
+ * max_bytes, and 0 past the end of the stream or for a stream that is not stored:
+ *
+ *   "Fetch " len "\n"   then len bytes of the stream from offset
+ *
+ * Commands can follow one another on the same connection; each is answered after the
+ * previous one. A server started with -z stores the files compressed, in blocks it decompresses
+ * as they are read; the answers are the same.
+ */
+#ifndef FETCH_H
+#define FETCH_H
+
+#define FETCH_VERB "\0FETCH "
+#define FETCH_VERB_LEN 7
+#define FETCH_REPLY "Fetch "
+#define FETCH_REPLY_LEN 6
+
+// longest command and answer line, newline included
+#define FETCH_LINE_MAX 80
+
+#endif
@@ -0,0 +1,56 @@
+/*
+ * Copyright (c) Seungyeob Choi
+ *
+ * Integrity checking of plain uploads (client -C), and their compression (client -z). The
+ * client starts the connection with the frame verb, a NUL byte first like the other
+ * handshakes, and sends its file as frames, each a frame_header followed by len bytes:
+ *
+ *   "\0CRC32C\n"   then frames
+ *
+ * The crc of a frame is the CRC32C (see crc32c.h) of the file from its start to the end of the
+ * frame, so that a frame that is lost, repeated or out of place fails as well as one that was
+ * damaged. The server checks every frame before it takes any of its bytes, and closes the
+ * connection on the first one that fails. A frame with a len of 0 ends the file, its crc being
+ * the digest of the whole file; once the file is taken care of, the server acknowledges it
+ * with the digest of what it took, for the client to compare:
+ *
+ *   "Ack " digest "\n"   digest as 8 hexadecimal digits
+ *
+ * Acknowledgements before that are the usual ones.
+ *
+ * A client that would rather compress its frames names the codec after the verb, and waits for
+ * the server to answer with the codec it takes, none for one it does not know:
+ *
+ *   "\0CRC32C " codec "\n"   answered with   "Codec " codec "\n"
+ *
+ * The only codec is "lz" (see lz.h). Frames then have FRAME_LZ set in len if their bytes are
+ * a compressed block of up to FRAME_MAX bytes of the file, and their crc is still that of the
+ * file itself. Binary fields are in the byte order of the host.
+ */
+#ifndef FRAME_H
+#define FRAME_H
+
+#include <stdint.h>
+
+#define FRAME_VERB "\0CRC32C"
+#define FRAME_VERB_LEN 7
+#define FRAME_REPLY "Codec "
+#define FRAME_REPLY_LEN 6
+#define FRAME_CODEC_LZ "lz"
+
+// longest verb and answer line, newline included
+#define FRAME_LINE_MAX 32
+
+// longest frame the server takes, and what a compressed frame may hold
+#define FRAME_MAX (64 << 10)
+
+// in frame_header.len, of a frame whose bytes are compressed
+#define FRAME_LZ 0x80000000u
+
+struct frame_header
+{
+    uint32_t len;                   // bytes that follow, 0 for the end of the file
+    uint32_t crc;                   // crc32c() of the file up to the end of the frame
+};
+
+#endif
@@ -0,0 +1,282 @@
+/*
+ * Copyright (c) Seungyeob Choi
+ *
+ * A fast LZ77 codec in the block format of LZ4, for the compressed frames of client -z (see
+ * frame.h). A block is a run of sequences, each a token, literal bytes and a match:
+ *
+ *   token            the literal length in the high 4 bits, the match length - LZ_MATCH_MIN
+ *                    in the low 4; 15 in either is carried on by bytes that follow, added up
+ *                    until one is not 255
+ *   literals
+ *   offset           2 bytes, little endian: how far back the match starts, 1 to 65535
+ *
+ * The last sequence has literals only, and ends the block.
+ *
+ * The compressor looks the next 4 bytes up in a hash table of the positions they were last
+ * seen at, and moves on faster the longer it goes without a match. acceleration scales how
+ * soon it does: 1 looks at every byte, and higher values trade ratio for speed.
+ */
+#ifndef LZ_H
+#define LZ_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>     // memcpy(), memset()
+
+#define LZ_MATCH_MIN 4
+
+// a match ends LZ_LAST_LITERALS bytes before the end at the latest, and starts LZ_MATCH_LIMIT
+// bytes before it, so that the decoder can copy words near the end
+#define LZ_LAST_LITERALS 5
+#define LZ_MATCH_LIMIT 12
+
+#define LZ_OFFSET_MAX 65535
+#define LZ_HASH_BITS 13
+
+// misses before the step grows, as a power of two
+#define LZ_SKIP_TRIGGER 6
+
+static inline uint32_t lz_read32(const unsigned char *p)
+{
+    uint32_t v;
+    memcpy(&v, p, 4);
+    return v;
+}
+
+static inline uint32_t lz_hash(uint32_t v)
+{
+    return ( v * 2654435761u ) >> ( 32 - LZ_HASH_BITS );
+}
+
+// bytes that p and q have in common, up to end
+static inline size_t lz_common(const unsigned char *p, const unsigned char *q, const unsigned char *end)
+{
+    const unsigned char *start = p;
+
+    while ( p + 8 <= end )
+    {
+        uint64_t a, b;
+        memcpy(&a, p, 8);
+        memcpy(&b, q, 8);
+        if ( a != b )
+            return p - start + ( __builtin_ctzll(a ^ b) >> 3 );
+        p += 8;
+        q += 8;
+    }
+
+    while ( p < end && *p == *q )
+    {
+        p++;
+        q++;
+    }
+
+    return p - start;
+}
+
+// writes len in the 255-run that follows a token field of 15; returns NULL past end
+static inline unsigned char *lz_put_length(unsigned char *op, const unsigned char *end, size_t len)
+{
+    for ( ; 255 <= len; len -= 255 )
+    {
+        if ( op >= end )
+            return NULL;
+        *op++ = 255;
+    }
+
+    if ( op >= end )
+        return NULL;
+    *op++ = (unsigned char) len;
+    return op;
+}
+
+// writes a sequence of the literals from anchor to ip, and a match of mlen bytes offset back
+// if mlen is not 0; returns NULL if it does not fit before end
+static inline unsigned char *lz_put_sequence(unsigned char *op, const unsigned char *end,
+    const unsigned char *anchor, const unsigned char *ip, size_t offset, size_t mlen)
+{
+    size_t lit = ip - anchor;
+
+    if ( op >= end )
+        return NULL;
+
+    unsigned char *token = op++;
+    *token = (unsigned char) ( ( lit < 15 ? lit : 15 ) << 4 );
+    if ( 15 <= lit && NULL == ( op = lz_put_length(op, end, lit - 15) ) )
+        return NULL;
+
+    if ( (size_t) ( end - op ) < lit )
+        return NULL;
+    memcpy(op, anchor, lit);
+    op += lit;
+
+    if ( 0 == mlen )
+        return op;
+
+    if ( end - op < 2 )
+        return NULL;
+    *op++ = (unsigned char) offset;
+    *op++ = (unsigned char) ( offset >> 8 );
+
+    mlen -= LZ_MATCH_MIN;
+    *token |= (unsigned char) ( mlen < 15 ? mlen : 15 );
+    if ( 15 <= mlen && NULL == ( op = lz_put_length(op, end, mlen - 15) ) )
+        return NULL;
+
+    return op;
+}
+
+// Compresses len bytes of src, at most 65536 of them, into dst.
+// returns the length of the block, or 0 if it does not fit in cap bytes
+static inline size_t lz_compress(const unsigned char *src, size_t len, unsigned char *dst, size_t cap, unsigned acceleration)
+{
+    uint16_t table[1 << LZ_HASH_BITS];
+    const unsigned char *ip = src;
+    const unsigned char *anchor = src;
+    const unsigned char *end = src + len;
+    unsigned char *op = dst;
+    unsigned char *op_end = dst + cap;
+
+    if ( LZ_MATCH_LIMIT + 1 < len )
+    {
+        const unsigned char *match_limit = end - LZ_MATCH_LIMIT;
+        const unsigned char *match_end = end - LZ_LAST_LITERALS;
+
+        // a stale entry is only a worse guess, as every match is compared
+        memset(table, 0, sizeof(table));
+        ip++;
+
+        while ( ip < match_limit )
+        {
+            const unsigned char *ref;
+            unsigned misses = acceleration << LZ_SKIP_TRIGGER;
+
+            for ( ;; )
+            {
+                uint32_t h = lz_hash(lz_read32(ip));
+                ref = src + table[h];
+                table[h] = (uint16_t) ( ip - src );
+
+                if ( ref < ip && ip - ref <= LZ_OFFSET_MAX && lz_read32(ref) == lz_read32(ip) )
+                    break;
+
+                ip += misses++ >> LZ_SKIP_TRIGGER;
+                if ( ip >= match_limit )
+                    goto last_literals;
+            }
+
+            while ( ip > anchor && ref > src && ip[-1] == ref[-1] )
+            {
+                ip--;
+                ref--;
+            }
+
+            size_t mlen = LZ_MATCH_MIN + lz_common(ip + LZ_MATCH_MIN, ref + LZ_MATCH_MIN, match_end);
+
+            op = lz_put_sequence(op, op_end, anchor, ip, ip - ref, mlen);
+            if ( NULL == op )
+                return 0;
+
+            ip += mlen;
+            anchor = ip;
+
+            if ( ip < match_limit )
+                table[lz_hash(lz_read32(ip - 2))] = (uint16_t) ( ip - 2 - src );
+        }
+    }
+
+last_literals:
+    op = lz_put_sequence(op, op_end, anchor, end, 0, 0);
+    return NULL == op ? 0 : (size_t) ( op - dst );
+}
+
+// Decompresses the block of len bytes at src into dst, checking every length and offset.
+// returns the length of what it holds, or -1 if it is damaged or longer than cap
+static inline long lz_decompress(const unsigned char *src, size_t len, unsigned char *dst, size_t cap)
+{
+    const unsigned char *ip = src;
+    const unsigned char *end = src + len;
+    unsigned char *op = dst;
+    unsigned char *op_end = dst + cap;
+
+    while ( ip < end )
+    {
+        unsigned token = *ip++;
+        size_t lit = token >> 4;
+        unsigned char more;
+
+        if ( 15 == lit )
+        {
+            do
+            {
+                if ( ip >= end )
+                    return -1;
+                more = *ip++;
+                lit += more;
+            } while ( 255 == more );
+        }
+
+        if ( (size_t) ( end - ip ) < lit || (size_t) ( op_end - op ) < lit )
+            return -1;
+        memcpy(op, ip, lit);
+        op += lit;
+        ip += lit;
+
+        if ( ip == end )
+            break;
+
+        if ( end - ip < 2 )
+            return -1;
+        size_t offset = ip[0] | (size_t) ip[1] << 8;
+        ip += 2;
+
+        size_t mlen = token & 15;
+        if ( 15 == mlen )
+        {
+            do
+            {
+                if ( ip >= end )
+                    return -1;
+                more = *ip++;
+                mlen += more;
+            } while ( 255 == more );
+        }
+        mlen += LZ_MATCH_MIN;
+
+        if ( 0 == offset || (size_t) ( op - dst ) < offset || (size_t) ( op_end - op ) < mlen )
+            return -1;
+
+        const unsigned char *ref = op - offset;
+        unsigned char *match_end = op + mlen;
+
+        // a period shorter than a word is doubled until words can be copied
+        while ( op - ref < 8 && op < match_end )
+        {
+            size_t n = op - ref;
+            if ( n > (size_t) ( match_end - op ) )
+                n = match_end - op;
+            memcpy(op, ref, n);
+            op += n;
+        }
+
+        // a multiple of the offset, and at least a word
+        size_t distance = op - ref;
+
+        if ( 8 <= op_end - match_end )
+        {
+            // words at a time, past the end of the match into room that follows it anyway
+            for ( ; op < match_end; op += 8 )
+                memcpy(op, op - distance, 8);
+        }
+        else
+        {
+            for ( ; op < match_end; op++ )
+                *op = *( op - distance );
+        }
+
+        op = match_end;
+    }
+
+    return op - dst;
+}
+
+#endif
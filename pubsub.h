@@ -0,0 +1,24 @@
+/*
+ * Copyright (c) Seungyeob Choi
+ *
+ * The handshake of the fan-out mode (server -p). A connection says what it is with a single
+ * line, which starts with a NUL byte like the shared-memory offer so that it cannot be taken
+ * for data:
+ *
+ *   "\0SUB " channel "\n"   receive everything published on the channel
+ *   "\0PUB " channel "\n"   publish on the channel whatever follows on this connection
+ *
+ * Subscribers receive the bytes of the publishers as they arrive, without framing, and
+ * nothing else. Publishers are acknowledged as any other connection.
+ */
+#ifndef PUBSUB_H
+#define PUBSUB_H
+
+#define PUBSUB_SUBSCRIBE "\0SUB "
+#define PUBSUB_PUBLISH "\0PUB "
+#define PUBSUB_VERB_LEN 5
+
+// longest channel name, not counting the newline
+#define CHANNEL_NAME_MAX 64
+
+#endif
@@ -0,0 +1,51 @@
+/*
+ * Copyright (c) Seungyeob Choi
+ *
+ * The query command of durable mode (server -w): searches the stream files the server keeps
+ * (see fetch.h) for the lines that hold a string. A connection that starts with the query
+ * verb, a NUL byte first like the other handshakes, names the string, its bytes as they are
+ * up to the newline:
+ *
+ *   "\0QUERY " string "\n"
+ *
+ * The server answers with every line that holds it, the line and its offset in the stream,
+ * and then with how many lines it found and how many bytes it searched:
+ *
+ *   "Match " stream " " offset " " len "\n"   then the len bytes of the line, newline included
+ *   "Done " matches " " bytes "\n"
+ *
+ * The streams are searched at once, so that the lines of a stream come in order but those of
+ * different streams interleave. Of a line longer than QUERY_LINE_MAX, that many bytes around
+ * the string are answered, with their offset, once for all the strings they hold; the string
+ * is found anywhere in the line. Queries can follow one another on the same connection; each
+ * is answered after the previous one.
+ *
+ * A query for whole tokens, runs of letters, digits and bytes above 127 (see bloom.h), names
+ * the string with the token verb instead, and is answered the same way; a line holds the
+ * string only where it does not start or end in the middle of a token:
+ *
+ *   "\0TOKEN " string "\n"
+ *
+ * The server skips the parts of the streams whose Bloom filters rule out the tokens that every
+ * match holds whole: with the token verb, all those of the string, and otherwise those the
+ * string has separators on both sides of, of which a single word has none.
+ */
+#ifndef QUERY_H
+#define QUERY_H
+
+#define QUERY_VERB "\0QUERY "
+#define QUERY_TOKEN_VERB "\0TOKEN "
+#define QUERY_VERB_LEN 7                // of both
+#define QUERY_MATCH "Match "
+#define QUERY_MATCH_LEN 6
+#define QUERY_DONE "Done "
+#define QUERY_DONE_LEN 5
+
+// longest command, a string of up to 256 bytes, and answer line, newline included
+#define QUERY_COMMAND_MAX (QUERY_VERB_LEN + 256 + 1)
+#define QUERY_HEADER_MAX 80
+
+// longest line answered whole
+#define QUERY_LINE_MAX 4096
+
+#endif
@@ -0,0 +1,280 @@
+/*
+ * Copyright (c) Seungyeob Choi
+ *
+ * The event loop the server and the client are built on: an epoll descriptor, and an endpoint
+ * for every descriptor registered to it, in data.ptr. An endpoint is the first member of the
+ * context of its descriptor, and names the function its events go to, so that a batch of
+ * events is dispatched with a call each and no lookup.
+ *
+ * The handler of an endpoint gets the events of a readiness notification together: EPOLLIN
+ * when the descriptor is readable, EPOLLOUT when it is writable, EPOLLERR and EPOLLHUP when
+ * it failed, as an edge-triggered connection takes care of all of them in one pass. Timers
+ * are timerfds and cross-thread wakeups are eventfds, readable when they expire or are rung;
+ * their handlers take the count with reactor_drain().
+ *
+ * An endpoint closed with reactor_close() has its fd set to -1, and the events left for it in
+ * the batch being dispatched are dropped. Its context has to outlive the batch.
+ */
+#ifndef REACTOR_H
+#define REACTOR_H
+
+#include <errno.h>
+#include <fcntl.h>      // fcntl()
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>     // exit()
+#include <string.h>     // memset()
+#include <unistd.h>     // read(), write(), close()
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+
+struct endpoint;
+
+// takes the events reported for the descriptor of an endpoint
+typedef void (*reactor_handler)(int epollfd, struct endpoint *ep, uint32_t events);
+
+struct endpoint
+{
+    reactor_handler handle;
+    int fd;                         // -1 once closed
+};
+
+static inline int reactor_create(void)
+{
+    int epollfd = epoll_create1(0);
+    if ( -1 == epollfd )
+    {
+        switch ( errno )
+        {
+            case EINVAL:
+            case EMFILE:
+            case ENFILE:
+            case ENOMEM:
+            default:
+                fprintf(stderr, "epoll create1 error (%d)\n", errno);
+                exit(1);
+        }
+    }
+
+    return epollfd;
+}
+
+// returns -1 if the kernel is out of memory or the user is at max_user_watches,
+// which only the descriptor being registered needs to pay for
+static inline int reactor_add(int epollfd, struct endpoint *ep, uint32_t events)
+{
+    struct epoll_event ev;
+    ev.events = events;
+    ev.data.ptr = ep;
+
+    if ( -1 == epoll_ctl(epollfd, EPOLL_CTL_ADD, ep->fd, &ev) )
+    {
+        switch ( errno )
+        {
+            case ENOMEM:
+            case ENOSPC:
+                fprintf(stderr, "epoll_ctl error (%d)\n", errno);
+                return -1;
+
+            case EBADF:
+            case EEXIST:
+            case EINVAL:
+            case ENOENT:
+            case EPERM:
+            default:
+                fprintf(stderr, "epoll_ctl error (%d)\n", errno);
+                exit(1);
+        }
+    }
+
+    return 0;
+}
+
+// changes the events of a registered endpoint, 0 for none but errors
+static inline void reactor_modify(int epollfd, struct endpoint *ep, uint32_t events)
+{
+    struct epoll_event ev;
+    ev.events = events;
+    ev.data.ptr = ep;
+
+    if ( -1 == epoll_ctl(epollfd, EPOLL_CTL_MOD, ep->fd, &ev) )
+    {
+        switch ( errno )
+        {
+            case EBADF:
+            case EEXIST:
+            case EINVAL:
+            case ENOENT:
+            case ENOMEM:
+            case ENOSPC:
+            case EPERM:
+            default:
+                fprintf(stderr, "epoll_ctl error (%d)\n", errno);
+                exit(1);
+        }
+    }
+}
+
+// Failures are reported but not fatal; they concern this endpoint only.
+static inline int reactor_remove(int epollfd, struct endpoint *ep)
+{
+    if ( -1 == epoll_ctl(epollfd, EPOLL_CTL_DEL, ep->fd, NULL) )
+    {
+        switch ( errno )
+        {
+            case EBADF:
+            case EEXIST:
+            case EINVAL:
+            case ENOENT:
+            case ENOMEM:
+            case ENOSPC:
+            case EPERM:
+            default:
+                fprintf(stderr, "epoll_ctl error (%d)\n", errno);
+                return -1;
+        }
+    }
+
+    return 0;
+}
+
+// Takes the endpoint out of the epoll and closes its descriptor. Failures are reported but
+// not fatal, and Linux releases the descriptor even when close() reports EINTR or EIO.
+static inline int reactor_close(int epollfd, struct endpoint *ep)
+{
+    int result = reactor_remove(epollfd, ep);
+
+    if ( -1 == close(ep->fd) )
+    {
+        switch ( errno )
+        {
+            case EBADF:
+            case EINTR:
+            case EIO:
+            default:
+                fprintf(stderr, "socket close error (%d)\n", errno);
+                result = -1;
+                break;
+        }
+    }
+
+    ep->fd = -1;
+    return result;
+}
+
+// for a descriptor that was not created non-blocking
+static inline int reactor_nonblocking(int fd)
+{
+    int flags = fcntl(fd, F_GETFL, 0);
+    if ( -1 == flags || -1 == fcntl(fd, F_SETFL, flags | O_NONBLOCK) )
+    {
+        fprintf(stderr, "fcntl error (%d)\n", errno);
+        return -1;
+    }
+
+    return 0;
+}
+
+// a timer, disarmed until reactor_set_timer(); returns -1 if none could be created
+static inline int reactor_timer(struct endpoint *ep, reactor_handler handle)
+{
+    ep->handle = handle;
+    ep->fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if ( -1 == ep->fd )
+    {
+        fprintf(stderr, "timerfd_create error (%d)\n", errno);
+        return -1;
+    }
+
+    return 0;
+}
+
+// expires after value_us and then every interval_us, if not 0; a value_us of 0 disarms it
+static inline void reactor_set_timer(struct endpoint *ep, long value_us, long interval_us)
+{
+    struct itimerspec its;
+    memset(&its, 0, sizeof(its));
+    its.it_value.tv_sec = value_us / 1000000;
+    its.it_value.tv_nsec = value_us % 1000000 * 1000;
+    its.it_interval.tv_sec = interval_us / 1000000;
+    its.it_interval.tv_nsec = interval_us % 1000000 * 1000;
+
+    if ( -1 == timerfd_settime(ep->fd, 0, &its, NULL) )
+    {
+        fprintf(stderr, "timerfd_settime error (%d)\n", errno);
+        exit(1);
+    }
+}
+
+// a wakeup other threads can ring; returns -1 if none could be created
+static inline int reactor_wakeup(struct endpoint *ep, reactor_handler handle)
+{
+    ep->handle = handle;
+    ep->fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    return ( -1 == ep->fd ) ? -1 : 0;
+}
+
+// rings a wakeup, from any thread
+static inline void reactor_wake(struct endpoint *ep)
+{
+    uint64_t one = 1;
+
+    // a counter that is not read yet wakes the loop up all the same
+    if ( -1 == write(ep->fd, &one, sizeof(one)) && EAGAIN != errno )
+        fprintf(stderr, "wakeup error (%d)\n", errno);
+}
+
+// the expirations of a timer or the rings of a wakeup since the last call, 0 for a spurious
+// wake-up
+static inline uint64_t reactor_drain(struct endpoint *ep)
+{
+    uint64_t count;
+
+    if ( sizeof(count) != read(ep->fd, &count, sizeof(count)) )
+    {
+        if ( EAGAIN != errno )
+            fprintf(stderr, "wakeup error (%d)\n", errno);
+        return 0;
+    }
+
+    return count;
+}
+
+// waits for up to max events, timeout_ms as epoll_wait() has it
+// returns -1 if a signal was caught, for the caller to act on
+static inline int reactor_wait(int epollfd, struct epoll_event *events, int max, int timeout_ms)
+{
+    int nfds = epoll_wait(epollfd, events, max, timeout_ms);
+    if ( -1 == nfds )
+    {
+        switch ( errno )
+        {
+            case EINTR:
+                return -1;
+
+            case EBADF:
+            case EFAULT:
+            case EINVAL:
+            default:
+                fprintf(stderr, "epoll_wait error (%d)\n", errno);
+                exit(1);
+        }
+    }
+
+    return nfds;
+}
+
+static inline void reactor_dispatch(int epollfd, struct epoll_event *events, int nfds)
+{
+    for ( int i = 0; i < nfds; i++ )
+    {
+        struct endpoint *ep = (struct endpoint *) events[i].data.ptr;
+
+        // closed earlier in this batch
+        if ( -1 != ep->fd )
+            ep->handle(epollfd, ep, events[i].events);
+    }
+}
+
+#endif
@@ -0,0 +1,80 @@
+/*
+ * Copyright (c) Seungyeob Choi
+ *
+ * Substring search, for the query command (see query.h).
+ *
+ * Where the CPU has AVX2, 32 positions are tried at once: the first byte of the needle is
+ * compared with the 32 bytes at the positions, and its last byte with the 32 bytes len - 1
+ * further on, and only the positions where both match are compared in full. Two bytes rule
+ * out nearly every position of text at the cost of two loads and three instructions, where
+ * one would stop at every occurrence of a common letter. Elsewhere, memmem() does.
+ */
+#ifndef SEARCH_H
+#define SEARCH_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>     // memmem(), memcmp()
+
+#if defined(__x86_64__)
+#include <immintrin.h>  // _mm256_cmpeq_epi8()
+#endif
+
+static const char *search_memmem(const char *hay, size_t len, const char *needle, size_t nlen)
+{
+    return (const char *) memmem(hay, len, needle, nlen);
+}
+
+// finds the first occurrence of needle in hay, or NULL
+static const char *(*search_find)(const char *hay, size_t len, const char *needle, size_t nlen) = search_memmem;
+
+// the implementation search_find() was set to, for the reports
+static const char *search_name = "memmem";
+
+#if defined(__x86_64__)
+__attribute__((target("avx2")))
+static const char *search_avx2(const char *hay, size_t len, const char *needle, size_t nlen)
+{
+    if ( nlen < 2 || len < nlen )
+        return search_memmem(hay, len, needle, nlen);
+
+    const __m256i first = _mm256_set1_epi8(needle[0]);
+    const __m256i last = _mm256_set1_epi8(needle[nlen - 1]);
+
+    // positions a match can start at
+    size_t end = len - nlen + 1;
+    size_t i = 0;
+
+    for ( ; i + 32 <= end; i += 32 )
+    {
+        __m256i a = _mm256_loadu_si256((const __m256i *) ( hay + i ));
+        __m256i b = _mm256_loadu_si256((const __m256i *) ( hay + i + nlen - 1 ));
+        uint32_t mask = (uint32_t) _mm256_movemask_epi8(
+            _mm256_and_si256(_mm256_cmpeq_epi8(a, first), _mm256_cmpeq_epi8(b, last)));
+
+        for ( ; 0 != mask; mask &= mask - 1 )
+        {
+            size_t at = i + __builtin_ctz(mask);
+            if ( 0 == memcmp(hay + at + 1, needle + 1, nlen - 2) )
+                return hay + at;
+        }
+    }
+
+    // fewer than 32 positions are left
+    return search_memmem(hay + i, len - i, needle, nlen);
+}
+#endif
+
+// picks the fastest implementation the CPU has
+static inline void search_init(void)
+{
+#if defined(__x86_64__)
+    if ( __builtin_cpu_supports("avx2") )
+    {
+        search_find = search_avx2;
+        search_name = "avx2";
+    }
+#endif
+}
+
+#endif
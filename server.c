@@ -2,20 +2,257 @@
  * Copyright (c) Seungyeob Choi
  *
  * A TCP server that manages client connections and handles all read and write operations
- * in a single thread using epoll.
+ * in a single thread using epoll (see reactor.h).
+ *
+ * Usage: server [-u socket_path] [-d [-a]] [-c max_connections] [-b] [-l | -L] [-w log_dir [-W usec] [-k MB] [-K seconds] [-z] [-M MB | -D]] [-e splice|copy | -p policy]
+ *
+ *   -u socket_path  also listen on a Unix-domain stream socket, served by the same event loop
+ *                   as the TCP listener; same-host clients skip the TCP/IP stack entirely
+ *   -d              also receive datagrams on UDP port PORT, up to DGRAM_BATCH per recvmmsg()
+ *   -a              acknowledge every datagram, with one sendmmsg() per received batch
+ *   -c count        stop accepting while count connections are open; the listeners are
+ *                   resumed as connections close, and pending clients wait in the backlog
+ *   -b              bulk mode: connections that read in bulk set SO_RCVLOWAT, so that they wake
+ *                   up once per half buffer rather than once per segment (see BULK_CLASS)
+ *   -l              line mode: write out complete lines only, so that the lines of concurrent
+ *                   connections never interleave (see LINE_CLASS)
+ *   -L              line mode, with every line prefixed with the connection it came from
+ *   -w log_dir      durable mode: append what stream connections send to a write-ahead log
+ *                   of segments in log_dir rather than stdout, and acknowledge it only once
+ *                   it is on disk, with "Ack" and the count of bytes on disk so far; the log
+ *                   carries on from what log_dir already holds, and what each connection
+ *                   sends is also kept in a file of its own, which connections can read
+ *                   back with the fetch command (see fetch.h), search
+ *                   with the query command (see query.h), or send a new version of as a delta
+ *                   from it (see delta.h)
+ *   -W usec         in durable mode, commit at most every usec microseconds rather than once
+ *                   per loop iteration, so that more connections share each fdatasync()
+ *   -k MB           in durable mode, retire the oldest segments beyond MB megabytes
+ *   -K seconds      in durable mode, roll the segment taking the appends once it is that old,
+ *                   and retire segments that many seconds after they were rolled
+ *   -z              in durable mode, store the stream files compressed, in blocks that a fetch
+ *                   command or a delta decompresses only as it reads them (see STORE_CLASS)
+ *   -M MB           in durable mode, keep up to MB megabytes of the stream files in memory,
+ *                   as they are written or fetched, and answer fetch commands from there
+ *   -D              in durable mode, cut what stream connections send into chunks by content
+ *                   and log a chunk the segment already holds as a reference to it (see
+ *                   DEDUP_SLOTS); the stream files are not kept, so fetch commands find nothing,
+ *                   and clients can upload files by chunk, sending only those the log does
+ *                   not hold yet (see upload.h)
+ *   -e splice|copy  echo mode: send back to every stream connection what it sends, through a
+ *                   pipe with splice(), or copied through a buffer with recv() and send();
+ *                   splice falls back to copying where the kernel cannot splice a socket
+ *   -p policy       fan-out mode: deliver what publishers send to every subscriber of their
+ *                   channel (see pubsub.h); a subscriber that is behind has new messages
+ *                   dropped (drop), is disconnected (disconnect), or has them queued up to
+ *                   PUBSUB_BACKLOG bytes before it is disconnected (buffer)
+ *
+ * SIGUSR1 prints the counters and the rates since the previous report to stderr.
+ *
+ * An idle connection holds nothing but its context, a few dozen bytes carved out of a slab.
+ * Read buffers belong to a pool and are lent to a connection only while it is readable,
+ * in a size class that follows how much its recent reads brought in.
+ *
+ * Clients on the Unix-domain socket may offer a shared-memory ring instead of writing the
+ * socket (see shmring.h). Its doorbell is registered to the same epoll, and the bytes taken
+ * from the ring go through the same sink as bytes received from a socket.
+ *
+ * A stream connection that starts with the frame verb sends its bytes as frames that carry
+ * a CRC32C (see frame.h). A frame that fails its check closes the connection before any of
+ * its bytes are taken, and the file is acknowledged with the digest of what was taken. Frames
+ * may be compressed with the codec of lz.h, if the client names it with the verb; they are
+ * decompressed before they are checked.
  */
+#define _GNU_SOURCE     // recvmmsg(), sendmmsg()
+
+#include <dirent.h>     // opendir()
 #include <errno.h>
-#include <fcntl.h>
+#include <fcntl.h>      // posix_fallocate(), posix_fadvise(), F_GET_SEALS
+#include <inttypes.h>   // PRIu64
 #include <netinet/in.h> // struct sockaddr_in
+#include <pthread.h>    // pthread_create()
 #include <signal.h>     // sigaction()
 #include <stdio.h>
 #include <stdlib.h>     // exit()
+#include <string.h>     // strlen(), strcpy(), memcmp()
 #include <sys/epoll.h>
-#include <unistd.h>     // read(), write(), close()
+#include <sys/ioctl.h>  // FIONREAD
+#include <sys/mman.h>   // mmap()
+#include <sys/resource.h> // setrlimit(), getrusage()
+#include <sys/sendfile.h>
+#include <sys/socket.h> // recvmsg()
+#include <sys/stat.h>   // fstat(), lstat(), mkdir()
+#include <sys/uio.h>    // writev()
+#include <sys/un.h>     // struct sockaddr_un
+#include <time.h>       // clock_gettime()
+#include <unistd.h>     // read(), write(), close(), getopt(), unlink()
+
+#include "bloom.h"
+#include "cdc.h"
+#include "crc32c.h"
+#include "delta.h"
+#include "fetch.h"
+#include "frame.h"
+#include "lz.h"
+#include "pubsub.h"
+#include "query.h"
+#include "reactor.h"
+#include "search.h"
+#include "shmring.h"
+#include "upload.h"
 
-#define BUFLEN 512
 #define PORT 8080
 
+// Read buffers come in size classes of BUFLEN_MIN << class bytes, 4 KB to 256 KB. A connection
+// starts with the smallest and moves up when a recv() fills the buffer while more is queued,
+// and back down when its reads stay well under the size of the buffer.
+#define BUFLEN_MIN 4096
+#define BUF_CLASSES 7
+#define BUFLEN(class) ((size_t) BUFLEN_MIN << (class))
+
+// In bulk mode (-b), a connection reading into buffers of BUFLEN(BULK_CLASS) or more asks the
+// kernel with SO_RCVLOWAT to wake it up only once half a buffer is queued. What stays below
+// the mark at the end of a burst is read by a timer every BULK_FLUSH_MS. Up to BULK_MAX
+// connections are in bulk mode at a time; the others wake up on every segment as before.
+#define BULK_CLASS 2
+#define BULK_FLUSH_MS 10
+#define BULK_MAX 1024
+
+// A connection reads up to READ_BUDGET bytes per wakeup, so that one that never runs dry does
+// not hold up the batch; it is read again on the next turn of the event loop, after the others.
+#define READ_BUDGET (1 << 20)
+
+// In echo mode (-e), the bytes of a connection are sent back to it rather than to the sink.
+// Pipes for splice() hold ECHO_PIPE_SIZE bytes; the copying fallback reads into buffers
+// of BUFLEN(ECHO_CLASS).
+#define ECHO_PIPE_SIZE (1 << 18)
+#define ECHO_CLASS (BUF_CLASSES - 1)
+
+// In fan-out mode (-p policy), what a publisher sends is stored once, in a reference-counted
+// message, and queued to every subscriber of its channel (see pubsub.h). A subscriber that
+// cannot take a message at once has it dropped, is disconnected, or has it queued, up to
+// PUBSUB_BACKLOG bytes. Queues are written with up to PUBSUB_IOV messages per writev().
+#define PUBSUB_BACKLOG (1 << 20)
+#define PUBSUB_IOV 64
+
+// queue entries are allocated this many at a time and recycled through free_queued
+#define QUEUED_SLAB 1024
+
+// In line mode (-l, -L), only complete lines are written out, each in one piece, so that the
+// lines of different connections never interleave. The start of a line still on its way is
+// carried in a buffer of BUFLEN(LINE_CLASS) borrowed from the pool; a line that outgrows it
+// is cut there. Lines are written with up to LINE_IOV pieces per writev().
+#define LINE_CLASS 4
+#define LINE_IOV 256
+
+// In durable mode (-w), what stream connections send is appended to a write-ahead log as
+// records of a wal_record header and the bytes. Records are collected in a buffer of WAL_BUFLEN
+// that is written out when it fills. Connections that sent something wait for the next group
+// commit, a single fdatasync() of the log, to be acknowledged.
+#define WAL_BUFLEN (1 << 20)
+
+// The log is a directory of segments of SEGMENT_SIZE bytes, named after the number of their
+// first record. A segment is allocated in full with fallocate() as it is created, so that
+// appends never change the size of the file and fdatasync() has no metadata to write; the
+// unwritten rest reads as zeros, which ends the records. Every INDEX_INTERVAL bytes or so, a
+// record is entered in the sparse index of its segment, kept in memory and written next to
+// it when the segment is rolled, after the highest stream number the segment holds, so that
+// stream numbers are not reused after a restart. Segments are read through a read-only mapping.
+#define SEGMENT_SIZE (64 << 20)
+#define INDEX_INTERVAL 4096
+
+// The stream files that fetch commands are served from are appended to through a cache of
+// STREAM_FILES descriptors, one per stream number modulo STREAM_FILES.
+#define STREAM_FILES 256
+
+// The cache of the stream files (-M) holds blocks of BUFLEN(CACHE_CLASS) bytes under S3-FIFO:
+// a block comes in on a small FIFO of CACHE_SMALL_PERCENT of the budget, and moves on to the
+// main FIFO only if it is hit again before it reaches the end; otherwise it leaves, and only
+// its key is remembered for as many blocks as the main FIFO holds. A block whose key is
+// remembered goes straight to the main FIFO, where blocks that were hit go around once more.
+// A fetch that reads through once leaves the main FIFO alone, and blocks hit at least twice
+// stay.
+#define CACHE_CLASS 4
+#define CACHE_BLOCK BUFLEN(CACHE_CLASS)
+#define CACHE_SMALL_PERCENT 10
+#define CACHE_FREQ_MAX 3
+
+// With -z, a stream file holds the stream in blocks of BUFLEN(STORE_CLASS) bytes, the size of a
+// cache block, each compressed on its own (see lz.h), or kept as it is if that does not make it
+// shorter; only the last block of a stream may be shorter. The index file next to it,
+// <stream>.idx, has a store_block per block, in order, so that the block holding an offset of
+// the stream is found with a single pread(), and a read decompresses only the blocks it touches,
+// straight into the cache if there is one. The block a stream is appending to is kept in memory
+// with the descriptor of its file, and stored once it is full or the descriptor is closed; a
+// stream that appends again takes a short last block back into memory first.
+#define STORE_CLASS CACHE_CLASS
+#define STORE_BLOCK BUFLEN(STORE_CLASS)
+#define STORE_ACCELERATION 1
+#define STORE_INDEX ".idx"
+
+// Next to every stream file, <stream>.bloom has a Bloom filter of the tokens (see bloom.h) of
+// each block of STORE_BLOCK bytes of the stream, in order, for queries to skip the blocks that
+// cannot hold what they look for. A token goes into the filter of the block it ends in, so a
+// query also reads the blocks on either side of one whose filter may hold its tokens. The
+// filter of the block a stream is appending to is built in memory as the bytes come, and
+// written once the block is full or the descriptor is closed; a stream that appends again
+// rebuilds it from the file. Filters are read by the queries as they go, never at startup, and
+// one that was never written, as after a crash, rules nothing out.
+#define BLOOM_FILE ".bloom"
+
+// With dedup (-D), what stream connections send is cut into chunks by content (see cdc.h). A
+// chunk that the segment taking the appends already holds is logged as a wal_ref to the record
+// holding it, any other as a record of its own. References never leave their segment, so that
+// a segment can still be read, recovered and retired on its own; a chunk that only an older
+// segment holds is copied, and the copy is referred to from then on. The chunks of the whole
+// log are found by fingerprint in an index, open addressing with linear probing, of DEDUP_SLOTS
+// entries at first, doubled whenever it is three quarters full, and rebuilt without the chunks
+// of the segments retired. What a connection sent is cut where it ends each time it is read
+// out, so that it is in the log before it is acknowledged. Chunks below DEDUP_MIN bytes are not
+// worth a reference.
+#define DEDUP_SLOTS (1 << 16)
+#define DEDUP_MIN 64
+
+// Whether the index holds a chunk is asked first of a cuckoo filter of as many 16-bit tags as
+// the index has slots, in buckets of CUCKOO_WAYS, a sixteenth of the size of the index: most
+// chunks it has not seen cost no probing of the index. An insertion that finds no room after
+// CUCKOO_KICKS moves has dropped a tag, and the filter is then bypassed until it is rebuilt.
+#define CUCKOO_WAYS 4
+#define CUCKOO_KICKS 500
+
+// A delta upload (see delta.h) is rebuilt from the file of the stream holding the old version:
+// the signatures of its blocks are computed as they are sent, DELTA_SIGN_SLICE bytes of it, or
+// a block, at a time, so that a large old version does not hold the event loop up; the rest
+// waits for the events of the other connections. The blocks the client refers to are read back
+// from it. Literal bytes and blocks go through a buffer of BUFLEN(DELTA_CLASS) borrowed from
+// the pool, and to the log as any other bytes.
+#define DELTA_CLASS (BUF_CLASSES - 1)
+#define DELTA_SIGN_SLICE (1 << 20)
+
+// The frames of a connection that compresses them (see frame.h) are decompressed into a buffer
+// of FRAME_PLAIN bytes, and checked there. It is taken at the end of every read, or as soon as
+// it may not have room for another frame.
+#define FRAME_PLAIN (4 * FRAME_MAX)
+
+// A query (see query.h) is searched off the event loop, by a pool of worker threads, one per
+// CPU up to QUERY_THREADS_MAX, that take the stream files one at a time. A worker reads a file
+// a block of QUERY_BLOCK at a time, decompressed with -z, and searches the lines it completes
+// with search_find(). The lines found are collected by the worker and added to the output of
+// the query a buffer at a time, which the event loop sends; a worker waits while QUERY_BACKLOG
+// bytes of it are not sent yet, so that a client that reads slowly only slows its own query.
+// Each query has an eventfd, registered to the epoll, that the workers wake the loop up with.
+// Blocks are only read if the filters (see BLOOM_FILE) let them or a block next to them hold
+// the tokens of the query, up to QUERY_TOKENS of them.
+#define QUERY_THREADS_MAX 64
+#define QUERY_BLOCK STORE_BLOCK
+#define QUERY_BACKLOG (256 << 10)
+#define QUERY_FOUND (64 << 10)
+#define QUERY_TOKENS 8
+
+// datagrams taken per recvmmsg() and the largest one accepted without truncation
+#define DGRAM_BATCH 64
+#define DGRAM_MAX 9000
+
 // max number of events that can be returned by epoll at a time
 #define MAX_EVENTS 20
 
@@ -27,7 +264,643 @@ void signal_handler(int signo);
 // receive an error with an indication of ECONNREFUSED or, if the
 // underlying protocol supports retransmission, the request may be
 // ignored so that a later reattempt at connection succeeds.
-#define MAX_BACKLOG 3
+// A TCP reattempt comes a second or more later, so a short queue stalls
+// clients whenever connections arrive faster than one loop iteration.
+// The kernel caps it at net.core.somaxconn.
+#define MAX_BACKLOG 1024
+
+// max number of connections accepted per readiness event of a listener
+#define ACCEPT_BATCH 64
+
+// how long the listeners stay paused when the server runs short of memory, unless a connection closes first
+#define ACCEPT_RETRY_US 100000
+
+struct shm_channel;
+struct echo_pipe;
+struct member;
+struct line_carry;
+struct fetch;
+struct upload;
+struct delta;
+struct query;
+
+// the handlers of the endpoints that are registered before they are defined
+static void handle_connection(int epollfd, struct endpoint *ep, uint32_t events);
+static void handle_doorbell(int epollfd, struct endpoint *ep, uint32_t events);
+static void handle_query_wakeup(int epollfd, struct endpoint *ep, uint32_t events);
+
+// Kept small, as there is one per connection and most connections are idle at any time:
+// half a cache line on a 64-bit host.
+struct connection_ctx
+{
+    struct endpoint ep;
+    uint16_t flags;                 // CONN_*
+    uint8_t buf_class;              // size class of the read buffer to borrow next
+    uint8_t lowat_class;            // buf_class the low-water mark was set for, 0 if not in bulk mode
+    uint32_t stream;                // serial number, which tags what the connection sends in the log
+    union
+    {
+        struct shm_channel *shm;    // set once a shared-memory ring is negotiated
+        struct echo_pipe *pipe;     // in echo mode, while bytes are on their way back
+        struct member *member;      // in fan-out mode, once the connection has said what it is
+        struct line_carry *line;    // in line mode, while the last line received is incomplete
+        struct fetch *fetch;        // in durable mode, while a fetch command is being answered
+        struct upload *upload;      // with dedup, once the connection started with the upload verb
+        struct delta *delta;        // in durable mode, once the connection started with the delta verb
+        struct framing *framing;    // once the connection started with the frame verb
+        struct query *query;        // in durable mode, while a query is being answered
+        uint64_t received;          // in durable mode, bytes a connection that streams has sent
+        struct connection_ctx *next;    // once closed, link in closed_connections or free_contexts
+    };
+};
+
+_Static_assert(sizeof(struct connection_ctx) <= 32, "the connection context has grown");
+
+#define CONN_UNIX       0x01        // accepted on the Unix-domain listener
+#define CONN_STARTED    0x02        // something has been received; too late for a shared-memory offer
+#define CONN_WOKEN      0x04        // readable since the last bulk flush
+#define CONN_SHM        0x08        // shm is set
+#define CONN_UNSYNCED   0x10        // in wal_waiting, to be acknowledged after the next commit
+#define CONN_FETCH      0x20        // started with the fetch verb; sends commands rather than data
+#define CONN_UPLOAD     0x40        // started with the upload verb; sends batches of chunks
+#define CONN_DELTA      0x80        // started with the delta verb; sends a file as a delta
+#define CONN_FRAMED     0x100       // started with the frame verb; sends its bytes as frames
+#define CONN_QUERY      0x200       // started with the query verb; sends commands rather than data
+#define CONN_UNREAD     0x400       // in unread_connections, having used up its read budget
+#define CONN_UNACKED    0x800       // owed a bare acknowledgement once its socket runs dry
+
+// contexts are allocated this many at a time and recycled through free_contexts
+#define CONN_SLAB 4096
+
+// read buffers lent to readable connections
+struct pool_buffer
+{
+    struct pool_buffer *next;       // link in free_buffers[class] while not lent
+};
+
+// Bytes on their way back to a connection in echo mode, lent to it only while there are any:
+// a pipe that splice() moves them through, or a buffer they are copied through.
+struct echo_pipe
+{
+    int fds[2];                     // read and write ends of the pipe, or -1 for a buffer
+    char *data;                     // the buffer, of BUFLEN(ECHO_CLASS) bytes
+    size_t queued;                  // bytes in the pipe or the buffer
+    size_t offset;                  // where the queued bytes start in the buffer
+    struct echo_pipe *next;         // link in free_pipes or free_copies while not lent
+};
+
+// the start of a line whose end has not been received yet, at the head of a pool buffer
+struct line_carry
+{
+    size_t len;
+    char data[];
+};
+
+#define LINE_CARRY_MAX (BUFLEN(LINE_CLASS) - sizeof(struct line_carry))
+
+// precedes every record in the write-ahead log
+struct wal_record
+{
+    uint32_t len;                   // of the bytes that follow, with WAL_REF if they are a wal_ref
+    uint32_t stream;                // of the connection they came from
+};
+
+#define WAL_REF 0x80000000u
+
+// stands for a chunk that an earlier record of the same segment holds, with dedup
+struct wal_ref
+{
+    uint32_t record;                // number, counted from the base of the segment
+    uint32_t len;                   // of the chunk
+};
+
+// a chunk of the log, in the dedup index
+struct dedup_entry
+{
+    uint64_t fingerprint[2];
+    uint64_t record;                // number of the last record holding the chunk
+    uint32_t position;              // of the record in its segment
+    uint32_t len;                   // of the chunk, 0 for a free slot
+};
+
+// where a record starts in its segment
+struct index_entry
+{
+    uint32_t record;                // number, counted from the base of the segment
+    uint32_t position;
+};
+
+// where a block of a stream file is, with -z
+struct store_block
+{
+    uint64_t position;              // in the file
+    uint32_t len;                   // in the file, the same as plain if it is not compressed
+    uint32_t plain;                 // bytes of the stream it holds
+};
+
+// a stream file open for reading, in blocks if it has an index
+struct stored_file
+{
+    int fd;
+    int index_fd;                   // -1 for a plain file
+    uint32_t stream;
+    uint64_t size;                  // of the stream, not of the file
+};
+
+struct segment
+{
+    uint64_t base;                  // number of the first record
+    uint32_t records;
+    uint32_t end;                   // of the records written to the file, not those in wal_buffer
+    uint32_t last_stream;           // the highest stream number among the records
+    int fd;
+    const char *map;                // SEGMENT_SIZE bytes
+    time_t created;
+    time_t rolled;                  // 0 while it takes the appends
+    uint32_t nindex;
+    uint32_t index_capacity;
+    struct index_entry *index;
+};
+
+enum cache_state
+{
+    CACHE_SMALL,
+    CACHE_MAIN,
+    CACHE_GHOST,                    // evicted from the small FIFO; no data
+};
+
+struct cache_block
+{
+    uint64_t key;                   // stream << 32 | number of the block in the stream
+    uint32_t len;                   // bytes held, from the start of the block
+    uint8_t state;                  // enum cache_state
+    uint8_t freq;                   // hits since it was queued, up to CACHE_FREQ_MAX
+    uint32_t ghost_slot;            // in cache_ghosts, while a ghost
+    char *data;
+    struct cache_block *next;       // in its FIFO
+};
+
+struct cache_fifo
+{
+    struct cache_block *head;       // evicted first
+    struct cache_block *tail;
+    size_t blocks;
+};
+
+// the answer to a fetch command, on its way
+struct fetch
+{
+    struct stored_file file;
+    uint64_t last_block;            // the block of the stream the answer touched last
+    int missed;                     // which the cache did not hold when the answer got to it
+    off_t offset;                   // of the next byte to send
+    size_t remaining;
+    uint32_t header_len;
+    uint32_t header_sent;
+    char header[FETCH_LINE_MAX];
+};
+
+enum upload_state
+{
+    UPLOAD_LINE,                    // waiting for the line that starts a batch
+    UPLOAD_LIST,                    // receiving its chunk list
+    UPLOAD_DATA,                    // receiving the chunks asked for
+};
+
+#define UPLOAD_NONE UINT32_MAX
+
+// the batch an uploading connection is sending, until it is logged
+struct upload
+{
+    uint32_t state;                 // enum upload_state
+    uint32_t nchunks;
+    uint32_t nmissing;
+    uint32_t data_len;              // bytes of the chunks received so far
+    size_t want;                    // bytes of the list or of the chunks being received, and
+    size_t got;                     // how many of them have arrived
+    char *data;                     // the chunks received, one after the other
+    uint32_t held[UPLOAD_CHUNKS];   // where the bytes of a chunk are in data, or UPLOAD_NONE
+    uint32_t missing[UPLOAD_CHUNKS];
+    struct upload_chunk chunks[UPLOAD_CHUNKS];
+};
+
+enum delta_state
+{
+    DELTA_LINE,                     // waiting for the command
+    DELTA_ANSWER,                   // sending the signatures
+    DELTA_OP,                       // receiving an op
+    DELTA_BYTES,                    // receiving the literal bytes of an op
+    DELTA_DONE,                     // the file is complete, and acknowledged after the next commit
+};
+
+// a file on its way as a delta from the old version
+struct delta
+{
+    uint32_t state;                 // enum delta_state
+    uint32_t block_len;
+    struct stored_file base;        // the old version
+    uint32_t blocks;                // whole blocks of the old version
+    uint32_t signed_blocks;         // of them, signed so far
+    struct delta_signature *signatures;
+    unsigned char *signing;         // the old version mapped, or with -z a block of it, until signed
+    size_t answer_sent;             // bytes of the header and the signatures
+    uint32_t header_len;
+    char header[DELTA_LINE_MAX];
+    struct delta_op op;
+    uint32_t op_got;                // bytes of the op received
+    size_t literal_left;
+};
+
+// a connection that sends its bytes as frames checked with CRC32C
+struct framing
+{
+    struct frame_header header;     // of the frame being received
+    uint32_t header_got;            // bytes of the header received
+    uint32_t payload_got;           // bytes of the payload, when it did not come in one read
+    uint32_t crc;                   // of the payloads of the frames taken
+    int ended;                      // the frame that ends the file has been taken
+    char *payload;                  // FRAME_MAX bytes, for a payload that spans reads
+    char *plain;                    // FRAME_PLAIN bytes, if the frames are compressed
+    size_t plain_len;               // bytes of plain checked and not taken yet
+    struct line_carry *line;        // in line mode, while the last line received is incomplete
+};
+
+// a stream file a query searches, as it was when the query was taken
+struct query_file
+{
+    uint32_t stream;
+    int blocks;                     // stored with -z
+    uint64_t size;                  // of the file, or with -z, blocks in the index
+    char *tail;                     // with -z, a copy of the block the stream was appending to
+    uint32_t tail_len;
+    int unfiltered;                 // the stream was appending without filters
+    unsigned char *bloom;           // a copy of the filter of the block it was appending to
+    uint64_t bloom_block;
+};
+
+// A query on its way. The connection and every worker searching one of its files hold it, and
+// the last to let go frees it; what the workers share is under query_lock.
+struct query
+{
+    struct endpoint ep;             // the eventfd the workers wake the event loop up with
+    struct connection_ctx *conn;    // NULL once the query has ended
+    uint32_t refs;
+    int cancelled;                  // the connection does not want the rest
+    size_t nfiles;
+    size_t next_file;               // to be taken by a worker
+    size_t files_done;
+    struct query_file *files;
+    char *out;                      // lines found, not taken to be sent yet; out and sending
+                                    // hold QUERY_BACKLOG + QUERY_FOUND bytes
+    size_t out_len;
+    pthread_cond_t room;            // signalled as out is taken
+    size_t matches;
+    uint64_t scanned;
+    char *sending;                  // taken from out, on its way; the event loop's own
+    size_t sending_len;
+    size_t sending_sent;
+    int finished;                   // sending holds the line that ends the answer
+    uint32_t needle_len;
+    char needle[QUERY_COMMAND_MAX];
+    int whole;                      // of whole tokens, with the token verb
+    size_t ntokens;                 // every match holds whole
+    uint64_t tokens[QUERY_TOKENS];  // their bloom_hash()
+    struct query *next;             // in query_queue, or in ended_queries
+};
+
+// what a worker thread searches with
+struct query_worker
+{
+    pthread_t thread;
+    char *window;                   // QUERY_LINE_MAX bytes of the line a block ends in, and the next block
+    unsigned char *packed;          // a block of the file, with -z
+    char *found;                    // QUERY_FOUND bytes of lines found
+    size_t found_len;
+    size_t matches;                 // of the file being searched
+    uint64_t scanned;
+    size_t skipped;                 // blocks
+    uint64_t answered;              // the offset of the stream the last line or piece answered ends at
+    unsigned char before;           // the byte before the window, a newline at the start of the file
+    unsigned char filter[BLOOM_BYTES];
+};
+
+// what a publisher sent, stored once for all the subscribers
+struct message
+{
+    uint32_t refs;                  // queue entries pointing at it, and the publisher while it fans out
+    uint32_t len;
+    char data[];
+};
+
+struct queued_message
+{
+    struct message *msg;
+    struct queued_message *next;    // link in a subscriber's queue or in free_queued
+};
+
+struct channel
+{
+    uint32_t hash;
+    uint32_t members;               // publishers and subscribers; the channel goes with the last one
+    uint32_t nsubscribers;
+    uint32_t capacity;
+    struct connection_ctx **subscribers;
+    char name[CHANNEL_NAME_MAX + 1];
+};
+
+// a connection in fan-out mode
+struct member
+{
+    struct channel *channel;
+    int publisher;
+    uint32_t index;                 // of a subscriber in channel->subscribers
+    uint32_t offset;                // bytes of the first queued message already sent
+    size_t queued;                  // bytes in the queue, not counting offset
+    struct queued_message *head;
+    struct queued_message *tail;
+};
+
+// consumer side of a shared-memory ring; ep.fd is the doorbell rung by the producer
+struct shm_channel
+{
+    struct endpoint ep;
+    int space_fd;                   // rung after consuming, for a producer waiting on a full ring
+    struct shm_ring *ring;
+    size_t map_len;
+    uint32_t size;                  // copied from the ring header, which the peer can still write
+    unsigned spin;
+    struct line_carry *line;        // in line mode, as for a connection
+    uint64_t received;              // bytes drained, which every acknowledgement counts
+    struct connection_ctx *conn;
+    struct shm_channel *next;       // in closed_channels
+};
+
+// Why a connection was closed. Errors that concern a single connection close that
+// connection only; the process exits only on errors that point at a bug in the server.
+enum close_reason
+{
+    CLOSE_ORDERLY,                  // the peer shut down its side
+    CLOSE_RESET,                    // the peer reset the connection
+    CLOSE_RECV_ERROR,
+    CLOSE_SEND_ERROR,
+    CLOSE_SHM_ERROR,                // the ring or a doorbell handed over by the peer failed
+    CLOSE_SLOW,                     // a subscriber too far behind, in fan-out mode
+    CLOSE_REASONS
+};
+
+static const char *close_reason_names[CLOSE_REASONS] =
+{
+    "orderly",
+    "reset",
+    "recv error",
+    "send error",
+    "shm error",
+    "slow subscriber",
+};
+
+// counters reported on SIGUSR1 and at shutdown
+struct server_stats
+{
+    size_t stream_bytes;            // from TCP, Unix-domain and shared-memory connections
+    size_t recv_calls;              // on stream sockets, including those that found nothing
+    size_t stream_wakeups;          // readiness events of stream connections
+    size_t echo_bytes;              // sent back in echo mode
+    size_t echo_calls;              // splice(), recv() and send() calls of echo mode
+    size_t messages_published;
+    size_t messages_queued;         // to subscribers
+    size_t messages_dropped;        // for subscribers that were behind
+    size_t subscribers_dropped;     // disconnected for being behind
+    size_t pubsub_writes;           // writev() calls to subscribers
+    size_t bulk_flushes;            // tails below the low-water mark read by the flush timer
+    size_t reads_cut;               // wakeups that ended at READ_BUDGET with more to read
+    size_t lines;                   // written out in line mode
+    size_t lines_cut;               // longer than LINE_CARRY_MAX, or not ended by the peer
+    size_t line_writes;             // writev() calls to stdout
+    size_t wal_bytes;               // appended to the log, headers included
+    size_t wal_writes;
+    size_t wal_commits;
+    size_t wal_acks;                // released by the commits
+    uint64_t wal_sync_ns;           // spent in fdatasync()
+    size_t segments_rolled;
+    size_t segments_retired;
+    size_t stream_opens;            // of stream files, for lack of a cached descriptor
+    size_t store_blocks;            // of stream files stored, with -z
+    size_t store_plain_bytes;       // of the streams in them
+    size_t store_bytes;             // written for them
+    size_t store_loads;             // read back from the files and decompressed
+    size_t bloom_filters;           // written
+    size_t fetches;
+    size_t fetch_bytes;
+    size_t sendfile_calls;
+    size_t cache_hit_bytes;         // of fetch answers, sent from the cache
+    size_t cache_miss_bytes;        // sent from blocks decompressed into it on a miss, with -z
+    size_t cache_evictions;
+    size_t cache_promotions;        // from the small FIFO to the main one
+    size_t cache_ghost_hits;        // blocks that came back soon after leaving the small FIFO
+    size_t dedup_chunks;
+    size_t dedup_bytes;             // cut into chunks
+    size_t dedup_hits;              // chunks logged as references
+    size_t dedup_hit_bytes;
+    size_t dedup_copies;            // chunks copied from an older segment
+    size_t filter_rejects;          // lookups answered by the cuckoo filter alone
+    size_t filter_false;            // lookups it let through for a chunk the index did not hold
+    size_t upload_batches;          // logged
+    size_t upload_chunks;
+    size_t upload_chunk_bytes;      // that the chunks of the batches stood for
+    size_t upload_sent_bytes;       // of the chunks asked for
+    size_t upload_bytes;            // received from uploading connections, lists included
+    size_t upload_answers;          // lists of missing chunks sent
+    size_t delta_files;             // acknowledged
+    size_t delta_signatures;
+    uint64_t delta_signature_ns;    // computing them
+    size_t delta_block_bytes;       // taken from old versions
+    size_t delta_literal_bytes;
+    size_t delta_bytes;             // received from delta connections, ops included
+    size_t frames;                  // checked and taken
+    size_t frame_bytes;             // of their payloads
+    size_t frames_rejected;
+    size_t frame_digests;           // of whole files, acknowledged
+    size_t frames_lz;               // compressed
+    size_t frame_lz_bytes;          // received for them
+    size_t frame_lz_plain;          // they held
+    size_t queries;
+    size_t query_matches;
+    size_t query_files;
+    size_t query_skipped;           // blocks the filters ruled out
+    uint64_t query_bytes;           // searched, by the workers, under query_lock
+    uint64_t query_ns;              // of CPU time of the workers searching them
+    size_t datagrams;
+    size_t datagram_bytes;
+    size_t datagrams_dropped;       // by the kernel for lack of receive buffer (SO_RXQ_OVFL)
+    size_t datagrams_truncated;     // longer than DGRAM_MAX
+    size_t datagram_acks;
+    size_t connections_accepted;
+    size_t connections_rejected;    // closed right after accept(), for lack of resources
+    size_t listener_pauses;
+    size_t connections_closed[CLOSE_REASONS];
+    size_t loop_batches;            // epoll_wait() calls that returned events
+    size_t loop_events;
+    uint64_t loop_busy_ns;          // handling the batches, i.e. what the last event of a batch waits
+    uint64_t loop_busy_max_ns;      // since the previous report
+};
+
+static struct server_stats stats;
+static struct timespec stats_since;
+
+static volatile sig_atomic_t stats_requested = 0;
+static volatile sig_atomic_t shutdown_requested = 0;
+
+static int ack_datagrams = 0;
+
+// durable mode
+static int wal_fd = -1;             // the segment taking the appends
+static char *wal_buffer = NULL;     // WAL_BUFLEN bytes
+static size_t wal_used = 0;
+static int log_dirfd = -1;
+static struct segment **segments = NULL;    // oldest first; the last one takes the appends
+static size_t nsegments = 0;
+static size_t segments_capacity = 0;
+static uint64_t next_record = 0;
+static int streams_dirfd = -1;
+
+// descriptors of the stream files, by stream number modulo STREAM_FILES
+static struct
+{
+    uint32_t stream;
+    int fd;
+    uint64_t size;                  // of the stream
+    int index_fd;                   // with -z
+    uint32_t tail_len;              // bytes of tail
+    uint64_t stored;                // bytes of the file, with -z
+    char *tail;                     // with -z, the block being appended to
+    int bloom_fd;
+    struct bloom_token token;       // the token the stream ends in
+    unsigned char bloom[BLOOM_BYTES];   // of the block being appended to
+} stream_files[STREAM_FILES];
+
+// with -z; a block to compress into or to read a compressed one into, and the block a read
+// decompressed last, by its key in the cache, for the reads that only take a part of it
+static int store_compressed = 0;
+static unsigned char store_packed[STORE_BLOCK];
+static char store_plain[STORE_BLOCK];
+static uint64_t store_plain_key = UINT64_MAX;
+static size_t store_plain_len = 0;
+
+// the cache of the stream files; blocks by key, open addressing with linear probing
+static size_t cache_capacity = 0;   // blocks with data, 0 without a cache
+static struct cache_block **cache_index = NULL;
+static size_t cache_slots = 0;      // a power of two, at least twice the blocks and ghosts
+static struct cache_fifo cache_small;
+static struct cache_fifo cache_main;
+static uint64_t *cache_ghosts = NULL;   // keys of the ghosts, a ring of cache_capacity
+static size_t cache_ghost_next = 0;
+
+// the worker threads of queries; queries with files no worker has taken yet are queued, oldest
+// first, and the queries that ended are let go of after the batch of events
+static pthread_mutex_t query_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t query_work = PTHREAD_COND_INITIALIZER;
+static struct query *query_queue = NULL;
+static struct query *ended_queries = NULL;
+static struct query_worker *query_workers = NULL;
+static int nquery_workers = 0;
+
+static int dedup_mode = 0;
+static struct dedup_entry *dedup_index = NULL;
+static size_t dedup_slots = 0;      // a power of two
+static size_t dedup_entries = 0;
+static int dedup_stale = 0;         // segments were retired since the index was last rebuilt
+static uint16_t (*cuckoo)[CUCKOO_WAYS] = NULL;  // dedup_slots / CUCKOO_WAYS buckets of tags, 0 for a free way
+static int cuckoo_overflow = 0;
+static unsigned cuckoo_victim = 0;
+static struct cdc_state chunker;
+static char *chunk = NULL;          // CDC_MAX bytes; the chunk being cut, once it spans two reads
+static size_t chunk_len = 0;
+
+static size_t keep_segments = 0;    // 0: no limit by size
+static long keep_seconds = 0;       // 0: no limit by age
+static long commit_window_us = 0;   // 0: commit at the end of every loop iteration
+static struct endpoint commit_timer = { NULL, -1 };
+static int commit_timer_armed = 0;
+static uint32_t last_stream = 0;
+
+// connections waiting for the next commit to be acknowledged
+static struct connection_ctx **wal_waiting = NULL;
+static size_t nwaiting = 0;
+static size_t waiting_capacity = 0;
+
+// 0: bytes are written out as received, 1: complete lines only, 2: lines prefixed with the connection
+static int line_mode = 0;
+
+static int bulk_mode = 0;
+static struct connection_ctx *bulk_connections[BULK_MAX];
+static int nbulk = 0;
+static struct endpoint flush_timer = { NULL, -1 };
+
+// connections to read again on the next turn of the event loop
+static struct connection_ctx **unread_connections = NULL;
+static size_t nunread = 0;
+static size_t unread_capacity = 0;
+
+enum echo_mode
+{
+    ECHO_OFF,
+    ECHO_SPLICE,
+    ECHO_COPY,
+};
+
+static enum echo_mode echo_mode = ECHO_OFF;
+static struct echo_pipe *free_pipes = NULL;
+static struct echo_pipe *free_copies = NULL;
+static size_t pooled_pipes = 0;     // allocated so far, lent or not
+static size_t pooled_copies = 0;
+
+enum pubsub_policy
+{
+    PUBSUB_OFF,
+    PUBSUB_DROP,                    // drop messages for a subscriber that is behind
+    PUBSUB_DISCONNECT,              // disconnect a subscriber that is behind
+    PUBSUB_BUFFER,                  // queue up to PUBSUB_BACKLOG bytes, then disconnect
+};
+
+static enum pubsub_policy pubsub_policy = PUBSUB_OFF;
+
+// channels by name; open addressing with linear probing, at most three quarters full
+static struct channel **channel_index = NULL;
+static size_t channel_slots = 0;    // a power of two
+static size_t nchannels = 0;
+static size_t nsubscribers = 0;
+
+static struct queued_message *free_queued = NULL;
+static size_t queued_slabs = 0;
+static size_t messages_live = 0;
+static size_t message_bytes_live = 0;
+
+// Admission control. The listeners are taken out of the epoll interest set, but kept
+// registered, while the server is at max_connections or out of descriptors.
+// spare_fd is held in reserve so that a connection can still be accepted and closed
+// when accept() fails with EMFILE, instead of leaving it to spin in the backlog.
+#define MAX_LISTENERS 2
+
+static struct endpoint *listeners[MAX_LISTENERS];
+static int nlisteners = 0;
+static int listeners_paused = 0;
+static size_t max_connections = 0;  // no limit
+static size_t active_connections = 0;
+static int spare_fd = -1;
+static struct endpoint accept_timer = { NULL, -1 };
+
+static struct connection_ctx *free_contexts = NULL;
+static size_t context_slabs = 0;
+
+static struct pool_buffer *free_buffers[BUF_CLASSES];
+static size_t pooled_buffers[BUF_CLASSES];  // allocated so far, lent or not
+
+// Connections closed while handling a batch of events. They are freed after the batch,
+// as events later in the same batch may still point at them.
+static struct connection_ctx *closed_connections = NULL;
+
+// and so are their shared-memory rings, whose doorbells events may point at as well
+static struct shm_channel *closed_channels = NULL;
 
 void signal_handler(int signo)
 {
@@ -73,429 +946,6296 @@ void signal_handler(int signo)
 
     switch ( signo )
     {
-        case SIGINT:
         case SIGUSR1:
+            // not a shutdown request; the event loop reports the statistics and carries on
+            stats_requested = 1;
+            break;
+
+        case SIGINT:
         case SIGUSR2:
         case SIGTERM:
         default:
             fprintf(stderr, "signal received: %d\n", signo);
+            shutdown_requested = 1;
             break;
     }
 }
 
-// should be called when the connection is closed by the peer
-static int handle_close(int epollfd, int connfd)
+// lends a read buffer of BUFLEN(class) bytes, to be given back with put_buffer()
+// as soon as the connection has nothing more to read
+static char *get_buffer(int class)
 {
-    if ( -1 == epoll_ctl(epollfd, EPOLL_CTL_DEL, connfd, NULL) )
-    {
-        switch ( errno )
-        {
-            case EBADF:
-            case EEXIST:
-            case EINVAL:
-            case ENOENT:
-            case ENOMEM:
-            case ENOSPC:
-            case EPERM:
-            default:
-                fprintf(stderr, "epoll_ctl error (%d)\n", errno);
-                exit(1);
-        }
-    }
+    struct pool_buffer *buffer = free_buffers[class];
 
-    if ( -1 == close(connfd) )
-    {
-        switch ( errno )
-        {
-            case EBADF:
-            case EINTR:
-            case EIO:
-            default:
-                fprintf(stderr, "socket close error (%d)\n", errno);
-                exit(1);
-        }
-    }
+    if ( NULL != buffer )
+        free_buffers[class] = buffer->next;
+    else if ( NULL != ( buffer = (struct pool_buffer *) malloc(BUFLEN(class)) ) )
+        pooled_buffers[class]++;
 
-    return 0;
+    return (char *) buffer;
 }
 
-int main(void)
+static void put_buffer(char *data, int class)
 {
-    signal(SIGINT,  signal_handler);
-    signal(SIGTERM, signal_handler);
-    signal(SIGUSR1, signal_handler);
-    signal(SIGUSR2, signal_handler);
+    struct pool_buffer *buffer = (struct pool_buffer *) data;
+    buffer->next = free_buffers[class];
+    free_buffers[class] = buffer;
+}
 
-    // create a listener socket
+// writes out iovcnt pieces of complete lines, resuming after partial writes
+static void write_lines(struct iovec *iov, int iovcnt)
+{
+    stats.line_writes++;
 
-    int listenfd = socket(AF_INET, SOCK_STREAM, 0);
-    if ( -1 == listenfd )
+    while ( 0 < iovcnt )
     {
-        switch ( errno )
+        ssize_t written = writev(STDOUT_FILENO, iov, iovcnt);
+        if ( -1 == written )
         {
-            case EACCES:
-            case EAFNOSUPPORT:
-            case EINVAL:
-            case ENFILE:
-            case ENOBUFS:
-            case ENOMEM:
-            case EPROTONOSUPPORT:
-            default:
-                fprintf(stderr, "socket creation error (%d)\n", errno);
-                exit(1);
+            switch ( errno )
+            {
+                case EINTR:
+                    continue;
+
+                case EAGAIN:
+                case EBADF:
+                case EFAULT:
+                case EINVAL:
+                case EIO:
+                case EPIPE:
+                case ENOSPC:
+                default:
+                    // the output is lost either way; the connections are still served
+                    fprintf(stderr, "stdout writev error (%d)\n", errno);
+                    return;
+            }
         }
-    }
 
-    int reuse = 1;
-    if ( -1 == setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse)) )
-    {
-        switch ( errno )
+        while ( 0 < iovcnt && (size_t) written >= iov->iov_len )
         {
-            case EBADF:
-            case EDOM:
-            case EINVAL:
-            case EISCONN:
-            case ENOPROTOOPT:
-            case ENOTSOCK:
-            case ENOMEM:
-            case ENOBUFS:
-            default:
-                fprintf(stderr, "socket setsockopt error (%d)\n", errno);
-                exit(1);
+            written -= iov->iov_len;
+            iov++;
+            iovcnt--;
         }
-    }
-
-    // bind
-
-    struct sockaddr_in servaddr;
-    servaddr.sin_family = AF_INET;
-    servaddr.sin_port = htons(PORT);
-    servaddr.sin_addr.s_addr = htonl(INADDR_ANY);
 
-    if ( -1 == bind(listenfd, (struct sockaddr*) &servaddr, sizeof(servaddr)) )
-    {
-        switch (errno )
+        if ( 0 < iovcnt )
         {
-            case EADDRINUSE:
-                fprintf(stderr, "The given address is already in use.\n");
-                exit(1);
-
-            case EACCES:
-            case EBADF:
-            case EINVAL:
-            case ENOTSOCK:
-            default:
-                fprintf(stderr, "socket bind error (%d)\n", errno);
-                exit(1);
+            iov->iov_base = (char *) iov->iov_base + written;
+            iov->iov_len -= written;
         }
     }
+}
 
-    // listen
+// Sanitizes received bytes in place and writes them to stdout.
+// In line mode, only the lines that end in buffer are written, all of them with one writev(),
+// each as the prefix, the start carried over from earlier reads and the rest in buffer. The
+// incomplete line at the end is appended to *carry, the only copy its bytes ever get. With no
+// carry, as for datagrams, or no room left in it, the incomplete line is ended where it stops.
+static void sink(struct line_carry **carry, int id, char *buffer, size_t len)
+{
+    char *p = buffer;
+    for ( size_t i = 0; i < len; i++ )
+    {
+        if ( *p < ' ' && *p != '\n' ) *p = '.';
+        p++;
+    }
 
-    if ( -1 == listen(listenfd, MAX_BACKLOG) )
+    if ( 0 == line_mode )
     {
-        switch ( errno )
-        {
-            case EADDRINUSE:
-            case EBADF:
-            case ENOTSOCK:
-            case EOPNOTSUPP:
-            default:
-                fprintf(stderr, "socket listen error (%d)\n", errno);
-                exit(1);
-        }
+        printf("%.*s", (int) len, buffer);
+        fflush(stdout);
+        return;
     }
 
-    // epoll
+    static char newline[] = "\n";
+    char prefix[32];
+    size_t prefix_len = 0;
+    if ( 2 == line_mode )
+        prefix_len = snprintf(prefix, sizeof(prefix), "sock:%d, ", id);
+
+    struct iovec iov[LINE_IOV];
+    int iovcnt = 0;
+    struct line_carry *written = NULL;  // given back once its bytes are out
+    char *end = buffer + len;
+    char *eol;
 
-    int epollfd = epoll_create1(0);
-    if ( -1 == epollfd )
+    p = buffer;
+
+    // memchr() is vectorized in glibc, so the scan takes a fraction of the time of the copy above
+    while ( p < end && NULL != ( eol = (char *) memchr(p, '\n', end - p) ) )
     {
-        switch ( errno )
+        if ( iovcnt > LINE_IOV - 3 )
         {
-            case EINVAL:
-            case EMFILE:
-            case ENFILE:
-            case ENOMEM:
-            default:
-                fprintf(stderr, "epoll create1 error (%d)\n", errno);
-                exit(1);
+            write_lines(iov, iovcnt);
+            iovcnt = 0;
         }
-    }
 
-    // register listener socket
+        if ( 0 != prefix_len )
+            iov[iovcnt++] = (struct iovec) { prefix, prefix_len };
 
-    struct epoll_event ev;
-    ev.events = EPOLLIN;
-    ev.data.fd = listenfd;
-
-    if ( -1 == epoll_ctl(epollfd, EPOLL_CTL_ADD, listenfd, &ev) )
-    {
-        switch ( errno )
+        if ( NULL != carry && NULL != *carry )
         {
-            case EBADF:
-            case EEXIST:
-            case EINVAL:
-            case ENOENT:
-            case ENOMEM:
-            case ENOSPC:
-            case EPERM:
-            default:
-                fprintf(stderr, "epoll_ctl error (%d)\n", errno);
-                exit(1);
+            // only the first line of the buffer can have started earlier
+            written = *carry;
+            *carry = NULL;
+            iov[iovcnt++] = (struct iovec) { written->data, written->len };
         }
+
+        iov[iovcnt++] = (struct iovec) { p, eol + 1 - p };
+        stats.lines++;
+        p = eol + 1;
     }
 
-    struct epoll_event events[MAX_EVENTS];
+    if ( p < end )
+    {
+        size_t rest = end - p;
 
-    // event loop
+        if ( NULL != carry && NULL == *carry && rest <= LINE_CARRY_MAX
+            && NULL != ( *carry = (struct line_carry *) get_buffer(LINE_CLASS) ) )
+            (*carry)->len = 0;
 
-    while ( 1 )
-    {
-        int nfds = epoll_wait(epollfd, events, MAX_EVENTS, -1);
-        if ( -1 == nfds )
+        if ( NULL != carry && NULL != *carry && (*carry)->len + rest <= LINE_CARRY_MAX )
+        {
+            memcpy((*carry)->data + (*carry)->len, p, rest);
+            (*carry)->len += rest;
+        }
+        else
+        {
+            if ( iovcnt > LINE_IOV - 4 )
+            {
+                write_lines(iov, iovcnt);
+                iovcnt = 0;
+            }
+
+            if ( 0 != prefix_len )
+                iov[iovcnt++] = (struct iovec) { prefix, prefix_len };
+
+            if ( NULL != carry && NULL != *carry )
+            {
+                // no line ended in buffer, so written is still free
+                written = *carry;
+                *carry = NULL;
+                iov[iovcnt++] = (struct iovec) { written->data, written->len };
+            }
+
+            iov[iovcnt++] = (struct iovec) { p, rest };
+            iov[iovcnt++] = (struct iovec) { newline, 1 };
+            stats.lines++;
+            if ( NULL != carry )
+                stats.lines_cut++;
+        }
+    }
+
+    if ( 0 != iovcnt )
+        write_lines(iov, iovcnt);
+
+    if ( NULL != written )
+        put_buffer((char *) written, LINE_CLASS);
+}
+
+// writes out the incomplete line left by a connection that is going away
+static void sink_carry(struct line_carry **carry, int id)
+{
+    struct line_carry *line = *carry;
+    *carry = NULL;
+
+    // ended where it stops, as the peer will not end it
+    sink(NULL, id, line->data, line->len);
+    stats.lines_cut++;
+
+    put_buffer((char *) line, LINE_CLASS);
+}
+
+// writes iovcnt pieces at the end of the segment taking the appends, resuming after partial writes
+// A failed write or sync is fatal: the kernel may already have dropped the pages it could not
+// write, and retrying would then acknowledge bytes that are not on disk.
+static void wal_writev(struct iovec *iov, int iovcnt)
+{
+    struct segment *seg = segments[nsegments - 1];
+
+    while ( 0 < iovcnt )
+    {
+        ssize_t written = pwritev(wal_fd, iov, iovcnt, seg->end);
+        if ( -1 == written )
         {
             switch ( errno )
             {
-                case EINTR:
-                    // A signal was caught
-                    fprintf(stderr, "shutting down...\n");
-                    if ( -1 == close(listenfd) )
-                    {
-                        switch ( errno )
-                        {
-                            case EBADF:
-                            case EINTR:
-                            case EIO:
-                            default:
-                                fprintf(stderr, "socket close error (%d)", errno);
-                                exit(1);
-                        }
-                    }
-                    exit(0);
+                case EINTR:
+                    continue;
+
+                case EBADF:
+                case EDQUOT:
+                case EFAULT:
+                case EFBIG:
+                case EINVAL:
+                case EIO:
+                case ENOSPC:
+                default:
+                    fprintf(stderr, "log write error (%d)\n", errno);
+                    exit(1);
+            }
+        }
+
+        stats.wal_writes++;
+        seg->end += written;
+
+        while ( 0 < iovcnt && (size_t) written >= iov->iov_len )
+        {
+            written -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+
+        if ( 0 < iovcnt )
+        {
+            iov->iov_base = (char *) iov->iov_base + written;
+            iov->iov_len -= written;
+        }
+    }
+}
+
+// writes out the records collected so far
+static void wal_write(void)
+{
+    if ( 0 == wal_used )
+        return;
+
+    struct iovec iov = { wal_buffer, wal_used };
+    wal_writev(&iov, 1);
+    wal_used = 0;
+}
+
+// makes what was written to a segment durable; fatal on failure, see wal_writev()
+static void sync_segment(int fd)
+{
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    while ( -1 == fdatasync(fd) )
+    {
+        switch ( errno )
+        {
+            case EINTR:
+                continue;
+
+            case EBADF:
+            case EDQUOT:
+            case EINVAL:
+            case EIO:
+            case ENOSPC:
+            default:
+                fprintf(stderr, "log fdatasync error (%d)\n", errno);
+                exit(1);
+        }
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    stats.wal_sync_ns += (end.tv_sec - start.tv_sec) * 1000000000ull + end.tv_nsec - start.tv_nsec;
+}
+
+// enters the next record of a segment, starting at position, in its index if it is due
+// An entry that finds no memory is skipped; lookups then walk a little further.
+static void index_record(struct segment *seg, uint32_t position)
+{
+    if ( 0 != seg->nindex && position - seg->index[seg->nindex - 1].position < INDEX_INTERVAL )
+        return;
+
+    if ( seg->nindex == seg->index_capacity )
+    {
+        uint32_t capacity = ( 0 == seg->index_capacity ) ? 256 : 2 * seg->index_capacity;
+        struct index_entry *index = (struct index_entry *) realloc(seg->index, capacity * sizeof(struct index_entry));
+        if ( NULL == index )
+            return;
+
+        seg->index = index;
+        seg->index_capacity = capacity;
+    }
+
+    seg->index[seg->nindex].record = seg->records;
+    seg->index[seg->nindex].position = position;
+    seg->nindex++;
+}
+
+static void segment_name(char *name, size_t size, uint64_t base, const char *suffix)
+{
+    snprintf(name, size, "%020" PRIu64 "%s", base, suffix);
+}
+
+// writes the index of a segment next to it
+// Failures are reported but not fatal; a missing index is rebuilt from the segment.
+static void write_index(struct segment *seg)
+{
+    char name[32];
+    segment_name(name, sizeof(name), seg->base, ".index");
+
+    int fd = openat(log_dirfd, name, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if ( -1 == fd )
+    {
+        fprintf(stderr, "cannot create index %s (%d)\n", name, errno);
+        return;
+    }
+
+    uint64_t header = seg->last_stream;
+    struct iovec iov[2] = { { &header, sizeof(header) }, { seg->index, seg->nindex * sizeof(struct index_entry) } };
+    if ( (ssize_t) ( iov[0].iov_len + iov[1].iov_len ) != writev(fd, iov, 2) )
+    {
+        fprintf(stderr, "index write error (%d)\n", errno);
+        unlinkat(log_dirfd, name, 0);
+    }
+
+    close(fd);
+}
+
+// Walks the records of a segment through its mapping, from its last index entry to the
+// first header that is zeroed or does not fit, and indexes them on the way. This is how
+// the end of the segment that was taking the appends is found after a restart.
+static void scan_segment(struct segment *seg)
+{
+    uint32_t position = 0;
+
+    if ( 0 != seg->nindex )
+    {
+        seg->records = seg->index[seg->nindex - 1].record;
+        position = seg->index[seg->nindex - 1].position;
+    }
+
+    struct wal_record record;
+    while ( position + sizeof(record) <= SEGMENT_SIZE )
+    {
+        memcpy(&record, seg->map + position, sizeof(record));
+        uint32_t len = record.len & ~WAL_REF;
+        if ( 0 == len || len > SEGMENT_SIZE - position - sizeof(record) )
+            break;
+
+        index_record(seg, position);
+        seg->records++;
+        if ( record.stream > seg->last_stream )
+            seg->last_stream = record.stream;
+        position += sizeof(record) + len;
+    }
+
+    seg->end = position;
+}
+
+// opens the segment starting at record base, creating it if create is set
+// returns NULL if it cannot be opened
+static struct segment *open_segment(uint64_t base, int create)
+{
+    char name[32];
+    segment_name(name, sizeof(name), base, ".log");
+
+    struct segment *seg = (struct segment *) calloc(1, sizeof(struct segment));
+    if ( NULL == seg )
+        return NULL;
+
+    seg->base = base;
+    seg->fd = openat(log_dirfd, name, O_RDWR | O_CLOEXEC | ( create ? O_CREAT | O_EXCL : 0 ), 0644);
+    if ( -1 == seg->fd )
+    {
+        fprintf(stderr, "cannot open segment %s (%d)\n", name, errno);
+        free(seg);
+        return NULL;
+    }
+
+    struct stat st;
+    if ( -1 == fstat(seg->fd, &st) )
+        st.st_size = 0;
+
+    // a segment that was being created when the server stopped may be short
+    if ( st.st_size < SEGMENT_SIZE && 0 != ( errno = posix_fallocate(seg->fd, 0, SEGMENT_SIZE) ) )
+    {
+        fprintf(stderr, "cannot allocate segment %s (%d)\n", name, errno);
+        close(seg->fd);
+        if ( create )
+            unlinkat(log_dirfd, name, 0);
+        free(seg);
+        return NULL;
+    }
+
+    seg->map = (const char *) mmap(NULL, SEGMENT_SIZE, PROT_READ, MAP_SHARED, seg->fd, 0);
+    if ( MAP_FAILED == seg->map )
+    {
+        fprintf(stderr, "cannot map segment %s (%d)\n", name, errno);
+        close(seg->fd);
+        free(seg);
+        return NULL;
+    }
+
+    seg->created = create ? time(NULL) : st.st_mtime;
+    if ( create )
+        return seg;
+
+    // the index written when the segment was rolled, if any; scan_segment() does the rest
+    segment_name(name, sizeof(name), base, ".index");
+    int fd = openat(log_dirfd, name, O_RDONLY | O_CLOEXEC);
+    if ( -1 != fd )
+    {
+        uint64_t header;
+        size_t len = 0;
+        if ( 0 == fstat(fd, &st) && (size_t) st.st_size > sizeof(header) )
+            len = st.st_size - sizeof(header);
+
+        if ( 0 != len && 0 == len % sizeof(struct index_entry)
+            && sizeof(header) == read(fd, &header, sizeof(header))
+            && NULL != ( seg->index = (struct index_entry *) malloc(len) )
+            && (ssize_t) len == read(fd, seg->index, len) )
+        {
+            seg->last_stream = header;
+            seg->nindex = seg->index_capacity = len / sizeof(struct index_entry);
+
+            // anything out of order, and the segment is indexed again from its start
+            for ( uint32_t i = 0; i < seg->nindex; i++ )
+            {
+                if ( seg->index[i].position >= SEGMENT_SIZE
+                    || ( 0 < i && seg->index[i].position <= seg->index[i - 1].position ) )
+                {
+                    seg->nindex = 0;
+                    break;
+                }
+            }
+        }
+        close(fd);
+    }
+
+    scan_segment(seg);
+    return seg;
+}
+
+static void close_segment(struct segment *seg)
+{
+    munmap((void *) seg->map, SEGMENT_SIZE);
+    close(seg->fd);
+    free(seg->index);
+    free(seg);
+}
+
+// appends a segment to the log; fatal if there is no memory for it
+static void add_segment(struct segment *seg)
+{
+    if ( nsegments == segments_capacity )
+    {
+        size_t capacity = ( 0 == segments_capacity ) ? 16 : 2 * segments_capacity;
+        struct segment **grown = (struct segment **) realloc(segments, capacity * sizeof(struct segment *));
+        if ( NULL == grown )
+        {
+            fprintf(stderr, "out of memory for the segments\n");
+            exit(1);
+        }
+
+        segments = grown;
+        segments_capacity = capacity;
+    }
+
+    segments[nsegments++] = seg;
+    wal_fd = seg->fd;
+}
+
+// deletes the oldest segments beyond keep_segments, or rolled more than keep_seconds ago
+// The segment taking the appends is never retired.
+static void retire_segments(time_t now)
+{
+    size_t retired = 0;
+
+    while ( retired < nsegments - 1 )
+    {
+        struct segment *seg = segments[retired];
+        if ( !( 0 != keep_segments && nsegments - retired > keep_segments )
+            && !( 0 != keep_seconds && now - seg->rolled > keep_seconds ) )
+            break;
+
+        char name[32];
+        segment_name(name, sizeof(name), seg->base, ".log");
+        unlinkat(log_dirfd, name, 0);
+        segment_name(name, sizeof(name), seg->base, ".index");
+        unlinkat(log_dirfd, name, 0);
+
+        close_segment(seg);
+        retired++;
+    }
+
+    if ( 0 != retired )
+    {
+        memmove(segments, segments + retired, (nsegments - retired) * sizeof(struct segment *));
+        nsegments -= retired;
+        stats.segments_retired += retired;
+        dedup_stale = 1;
+    }
+}
+
+// Closes the segment taking the appends and starts the next one. The records of the closed
+// segment are made durable first, as later commits only sync the new one, and its pages
+// are dropped from the page cache: it is written once and seldom read, and would otherwise
+// push out the pages of the segment being written.
+static void roll_segment(void)
+{
+    struct segment *seg = segments[nsegments - 1];
+
+    wal_write();
+    sync_segment(seg->fd);
+    write_index(seg);
+    posix_fadvise(seg->fd, 0, seg->end, POSIX_FADV_DONTNEED);
+    seg->rolled = time(NULL);
+
+    struct segment *next = open_segment(next_record, 1);
+    if ( NULL == next )
+        exit(1);
+
+    add_segment(next);
+    stats.segments_rolled++;
+
+    retire_segments(seg->rolled);
+}
+
+static size_t cache_slot(uint64_t key)
+{
+    size_t mask = cache_slots - 1;
+    size_t i = (size_t) ( ( key * 0x9e3779b97f4a7c15ull ) >> 32 ) & mask;
+
+    while ( NULL != cache_index[i] && cache_index[i]->key != key )
+        i = ( i + 1 ) & mask;
+
+    return i;
+}
+
+static struct cache_block *cache_find(uint32_t stream, uint64_t block)
+{
+    return cache_index[cache_slot((uint64_t) stream << 32 | block)];
+}
+
+static void cache_remove(struct cache_block *b)
+{
+    size_t mask = cache_slots - 1;
+    size_t hole = cache_slot(b->key);
+    cache_index[hole] = NULL;
+
+    for ( size_t j = ( hole + 1 ) & mask; NULL != cache_index[j]; j = ( j + 1 ) & mask )
+    {
+        size_t home = (size_t) ( ( cache_index[j]->key * 0x9e3779b97f4a7c15ull ) >> 32 ) & mask;
+
+        // an entry whose home lies cyclically in (hole, j] has to stay where it is
+        int stays = ( hole <= j ) ? ( hole < home && home <= j ) : ( hole < home || home <= j );
+        if ( !stays )
+        {
+            cache_index[hole] = cache_index[j];
+            cache_index[j] = NULL;
+            hole = j;
+        }
+    }
+
+    if ( NULL != b->data )
+        put_buffer(b->data, CACHE_CLASS);
+    free(b);
+}
+
+static void fifo_push(struct cache_fifo *q, struct cache_block *b)
+{
+    b->next = NULL;
+    if ( NULL == q->tail )
+        q->head = b;
+    else
+        q->tail->next = b;
+    q->tail = b;
+    q->blocks++;
+}
+
+static struct cache_block *fifo_pop(struct cache_fifo *q)
+{
+    struct cache_block *b = q->head;
+    q->head = b->next;
+    if ( NULL == q->head )
+        q->tail = NULL;
+    q->blocks--;
+    return b;
+}
+
+// turns a block that leaves the small FIFO without a hit into a ghost
+// The key it displaces from the ring is forgotten, unless that block came back since.
+static void cache_ghost(struct cache_block *b)
+{
+    put_buffer(b->data, CACHE_CLASS);
+    b->data = NULL;
+    b->len = 0;
+    b->state = CACHE_GHOST;
+
+    uint64_t old = cache_ghosts[cache_ghost_next];
+    struct cache_block *g = ( UINT64_MAX == old ) ? NULL : cache_index[cache_slot(old)];
+    if ( NULL != g && CACHE_GHOST == g->state && g->ghost_slot == cache_ghost_next )
+        cache_remove(g);
+
+    cache_ghosts[cache_ghost_next] = b->key;
+    b->ghost_slot = cache_ghost_next;
+    cache_ghost_next = ( cache_ghost_next + 1 ) % cache_capacity;
+}
+
+// makes room for one more block
+static void cache_evict(void)
+{
+    while ( cache_small.blocks + cache_main.blocks >= cache_capacity )
+    {
+        if ( cache_small.blocks * 100 >= cache_capacity * CACHE_SMALL_PERCENT || 0 == cache_main.blocks )
+        {
+            struct cache_block *b = fifo_pop(&cache_small);
+            if ( 0 != b->freq )
+            {
+                b->freq = 0;
+                b->state = CACHE_MAIN;
+                fifo_push(&cache_main, b);
+                stats.cache_promotions++;
+            }
+            else
+            {
+                cache_ghost(b);
+                stats.cache_evictions++;
+            }
+        }
+        else
+        {
+            struct cache_block *b = fifo_pop(&cache_main);
+            if ( 0 != b->freq )
+            {
+                b->freq--;
+                fifo_push(&cache_main, b);
+            }
+            else
+            {
+                cache_remove(b);
+                stats.cache_evictions++;
+            }
+        }
+    }
+}
+
+// takes in a block of a stream, with no bytes yet
+// returns NULL if there is no memory for it
+static struct cache_block *cache_insert(uint32_t stream, uint64_t block)
+{
+    uint64_t key = (uint64_t) stream << 32 | block;
+
+    cache_evict();
+
+    char *data = get_buffer(CACHE_CLASS);
+    if ( NULL == data )
+        return NULL;
+
+    size_t slot = cache_slot(key);
+    struct cache_block *b = cache_index[slot];
+    if ( NULL != b )
+    {
+        // a ghost; the block was needed again soon after it left
+        b->state = CACHE_MAIN;
+        b->data = data;
+        fifo_push(&cache_main, b);
+        stats.cache_ghost_hits++;
+        return b;
+    }
+
+    b = (struct cache_block *) calloc(1, sizeof(struct cache_block));
+    if ( NULL == b )
+    {
+        put_buffer(data, CACHE_CLASS);
+        return NULL;
+    }
+
+    b->key = key;
+    b->state = CACHE_SMALL;
+    b->data = data;
+    cache_index[slot] = b;
+    fifo_push(&cache_small, b);
+    return b;
+}
+
+// Copies what is appended at offset of a stream into the blocks it falls in. The tail block
+// of a stream is extended while it is cached, and a new block comes in as it is started.
+static void cache_write(uint32_t stream, uint64_t offset, const char *data, size_t len)
+{
+    while ( 0 != len )
+    {
+        uint64_t block = offset / CACHE_BLOCK;
+        size_t start = offset % CACHE_BLOCK;
+        size_t n = ( len < CACHE_BLOCK - start ) ? len : CACHE_BLOCK - start;
+
+        struct cache_block *b = cache_find(stream, block);
+        if ( ( NULL == b || CACHE_GHOST == b->state ) && 0 == start )
+            b = cache_insert(stream, block);
+
+        if ( NULL != b && CACHE_GHOST != b->state && b->len == start )
+        {
+            memcpy(b->data + start, data, n);
+            b->len += n;
+        }
+
+        offset += n;
+        data += n;
+        len -= n;
+    }
+}
+
+// sizes the cache for a budget of mb megabytes
+static void cache_init(size_t mb)
+{
+    cache_capacity = mb * (1 << 20) / CACHE_BLOCK;
+    if ( 0 == cache_capacity )
+        return;
+
+    // every block, and as many ghosts, with the index at most half full
+    cache_slots = 1;
+    while ( cache_slots < 4 * cache_capacity )
+        cache_slots *= 2;
+
+    cache_index = (struct cache_block **) calloc(cache_slots, sizeof(struct cache_block *));
+    cache_ghosts = (uint64_t *) malloc(cache_capacity * sizeof(uint64_t));
+    if ( NULL == cache_index || NULL == cache_ghosts )
+    {
+        fprintf(stderr, "out of memory for the cache\n");
+        exit(1);
+    }
+
+    for ( size_t i = 0; i < cache_capacity; i++ )
+        cache_ghosts[i] = UINT64_MAX;
+}
+
+// Reads a block of a file stored with -z into dst, of STORE_BLOCK bytes, decompressed through
+// packed, of as many; it touches nothing else, for the workers of queries as well.
+// returns the bytes of the stream it holds, 0 past the end of the file, or -1 if it is damaged
+static ssize_t read_block(int fd, int index_fd, uint64_t block, char *dst, unsigned char *packed)
+{
+    struct store_block entry;
+    ssize_t got = pread(index_fd, &entry, sizeof(entry), block * sizeof(entry));
+    if ( 0 == got )
+        return 0;
+
+    if ( sizeof(entry) != got || STORE_BLOCK < entry.plain || entry.plain < entry.len )
+        return -1;
+
+    if ( entry.len == entry.plain )
+        return ( (ssize_t) entry.len == pread(fd, dst, entry.len, entry.position) ) ? (ssize_t) entry.plain : -1;
+
+    if ( (ssize_t) entry.len != pread(fd, packed, entry.len, entry.position)
+        || entry.plain != lz_decompress(packed, entry.len, (unsigned char *) dst, STORE_BLOCK) )
+        return -1;
+
+    return entry.plain;
+}
+
+// Reads a block of a stream stored with -z into dst, of STORE_BLOCK bytes: the tail in memory
+// if the stream is appending to it, and otherwise from the file.
+// returns the bytes it holds, 0 past the end of the file, or -1 if it is damaged
+static ssize_t load_block(const struct stored_file *f, uint64_t block, char *dst)
+{
+    int slot = f->stream % STREAM_FILES;
+
+    if ( stream_files[slot].stream == f->stream && -1 != stream_files[slot].fd
+        && 0 != stream_files[slot].tail_len && block == stream_files[slot].size / STORE_BLOCK )
+    {
+        memcpy(dst, stream_files[slot].tail, stream_files[slot].tail_len);
+        return stream_files[slot].tail_len;
+    }
+
+    ssize_t got = read_block(f->fd, f->index_fd, block, dst, store_packed);
+    if ( 0 < got )
+        stats.store_loads++;
+
+    return got;
+}
+
+// the block of a stream stored with -z, decompressed into store_plain unless it is there already
+// returns NULL if the file is damaged
+static const char *scratch_block(const struct stored_file *f, uint64_t block, size_t *len)
+{
+    uint64_t key = (uint64_t) f->stream << 32 | block;
+
+    if ( key != store_plain_key )
+    {
+        ssize_t got = load_block(f, block, store_plain);
+        if ( -1 == got )
+        {
+            store_plain_key = UINT64_MAX;
+            return NULL;
+        }
+
+        store_plain_key = key;
+        store_plain_len = got;
+    }
+
+    *len = store_plain_len;
+    return store_plain;
+}
+
+// Opens the file of a stream for reading, with its index if it was stored with -z, and finds
+// the size of the stream; a stream that is appending has its tail in memory.
+// returns -1 if the stream is not stored
+static int open_stored(uint32_t stream, struct stored_file *f)
+{
+    char name[32];
+    struct stat st;
+
+    f->stream = stream;
+    f->size = 0;
+    f->index_fd = -1;
+
+    snprintf(name, sizeof(name), "%" PRIu32, stream);
+    f->fd = openat(streams_dirfd, name, O_RDONLY | O_CLOEXEC);
+    if ( -1 == f->fd || -1 == fstat(f->fd, &st) )
+        return -1;
+    f->size = st.st_size;
+
+    snprintf(name, sizeof(name), "%" PRIu32 STORE_INDEX, stream);
+    f->index_fd = openat(streams_dirfd, name, O_RDONLY | O_CLOEXEC);
+    if ( -1 == f->index_fd )
+        return ( ENOENT == errno ) ? 0 : -1;
+
+    int slot = stream % STREAM_FILES;
+    if ( stream_files[slot].stream == stream && -1 != stream_files[slot].fd )
+    {
+        f->size = stream_files[slot].size;
+        return 0;
+    }
+
+    if ( -1 == fstat(f->index_fd, &st) )
+        return -1;
+
+    // every block but the last is a whole one
+    struct store_block last;
+    uint64_t blocks = st.st_size / sizeof(last);
+    f->size = 0;
+    if ( 0 != blocks )
+    {
+        if ( sizeof(last) != pread(f->index_fd, &last, sizeof(last), ( blocks - 1 ) * sizeof(last)) )
+            return -1;
+        f->size = ( blocks - 1 ) * STORE_BLOCK + last.plain;
+    }
+
+    return 0;
+}
+
+static void close_stored(struct stored_file *f)
+{
+    if ( -1 != f->fd )
+        close(f->fd);
+    if ( -1 != f->index_fd )
+        close(f->index_fd);
+    f->fd = -1;
+    f->index_fd = -1;
+}
+
+// reads up to len bytes of a stream from offset, as pread() does from a plain stream file
+static ssize_t read_stored(const struct stored_file *f, char *buf, size_t len, uint64_t offset)
+{
+    if ( -1 == f->index_fd )
+        return pread(f->fd, buf, len, offset);
+
+    size_t done = 0;
+    while ( done < len && offset < f->size )
+    {
+        uint64_t block = offset / STORE_BLOCK;
+        size_t start = offset % STORE_BLOCK;
+        ssize_t n;
+
+        if ( 0 == start && STORE_BLOCK <= len - done )
+        {
+            // a whole block goes straight where it is wanted
+            n = load_block(f, block, buf + done);
+        }
+        else
+        {
+            size_t held;
+            const char *data = scratch_block(f, block, &held);
+            n = ( NULL == data ) ? -1 : ( held <= start ) ? 0 : (ssize_t) ( held - start );
+            if ( (size_t) n > len - done )
+                n = len - done;
+            if ( 0 < n )
+                memcpy(buf + done, data + start, n);
+        }
+
+        if ( -1 == n )
+        {
+            errno = EIO;
+            return -1;
+        }
+
+        if ( 0 == n )
+            break;
+
+        done += n;
+        offset += n;
+    }
+
+    return done;
+}
+
+// takes in a block of a stream that a fetch command missed, read from the file
+static struct cache_block *cache_admit(const struct stored_file *f, uint64_t block)
+{
+    struct cache_block *b = cache_insert(f->stream, block);
+    if ( NULL == b )
+        return NULL;
+
+    ssize_t got = ( -1 == f->index_fd ) ? pread(f->fd, b->data, CACHE_BLOCK, block * CACHE_BLOCK)
+        : load_block(f, block, b->data);
+    b->len = ( 0 < got ) ? got : 0;
+    return b;
+}
+
+// Stores the block a stream is appending to, with -z. A block the file cannot take is lost to
+// it, as bytes a plain file cannot take are; the log still has them.
+static void store_tail(int slot)
+{
+    struct store_block entry = { stream_files[slot].stored, 0, stream_files[slot].tail_len };
+    const void *data = store_packed;
+
+    entry.len = lz_compress((const unsigned char *) stream_files[slot].tail, entry.plain,
+        store_packed, entry.plain - 1, STORE_ACCELERATION);
+    if ( 0 == entry.len )
+    {
+        entry.len = entry.plain;
+        data = stream_files[slot].tail;
+    }
+
+    stream_files[slot].tail_len = 0;
+
+    if ( (ssize_t) entry.len != write(stream_files[slot].fd, data, entry.len)
+        || sizeof(entry) != write(stream_files[slot].index_fd, &entry, sizeof(entry)) )
+    {
+        fprintf(stderr, "stream file write error (%d)\n", errno);
+        return;
+    }
+
+    stream_files[slot].stored += entry.len;
+    stats.store_blocks++;
+    stats.store_plain_bytes += entry.plain;
+    stats.store_bytes += entry.len;
+}
+
+// With -z, opens the index of the file just opened in a slot, and takes a short last block
+// back into memory to append to; the file was closed while the stream was still appending.
+// returns -1 if it cannot
+static int open_store(int slot)
+{
+    char name[32];
+    snprintf(name, sizeof(name), "%" PRIu32 STORE_INDEX, stream_files[slot].stream);
+
+    struct stat st;
+    struct stored_file f = { stream_files[slot].fd, -1, stream_files[slot].stream, 0 };
+    f.index_fd = openat(streams_dirfd, name, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if ( -1 == f.index_fd || -1 == fstat(f.index_fd, &st) )
+        goto failed;
+
+    stream_files[slot].stored = stream_files[slot].size;
+    stream_files[slot].tail_len = 0;
+    stream_files[slot].tail = get_buffer(STORE_CLASS);
+    if ( NULL == stream_files[slot].tail )
+    {
+        errno = ENOMEM;
+        goto failed;
+    }
+
+    struct store_block last = { 0, 0, STORE_BLOCK };
+    uint64_t blocks = st.st_size / sizeof(last);
+    if ( 0 != blocks && sizeof(last) != pread(f.index_fd, &last, sizeof(last), ( blocks - 1 ) * sizeof(last)) )
+        goto failed;
+
+    stream_files[slot].size = blocks * STORE_BLOCK;
+
+    if ( last.plain < STORE_BLOCK )
+    {
+        ssize_t got = load_block(&f, blocks - 1, stream_files[slot].tail);
+        if ( (ssize_t) last.plain != got || -1 == ftruncate(f.index_fd, ( blocks - 1 ) * sizeof(last))
+            || -1 == ftruncate(f.fd, last.position) )
+        {
+            errno = EIO;
+            goto failed;
+        }
+
+        stream_files[slot].tail_len = got;
+        stream_files[slot].stored = last.position;
+        stream_files[slot].size = ( blocks - 1 ) * STORE_BLOCK + got;
+    }
+
+    stream_files[slot].index_fd = f.index_fd;
+    return 0;
+
+failed:
+    if ( -1 != f.index_fd )
+        close(f.index_fd);
+    if ( NULL != stream_files[slot].tail )
+        put_buffer(stream_files[slot].tail, STORE_CLASS);
+    stream_files[slot].tail = NULL;
+    return -1;
+}
+
+// Writes the filter of the block a stream is appending to as its descriptor is closed, with
+// the token the stream ends in; if it goes on as the stream appends again, the filter only
+// rules out less. A token that ends a full block goes into the filter of that block on file.
+static void write_bloom(int slot)
+{
+    uint64_t block = stream_files[slot].size / STORE_BLOCK;
+    unsigned char *filter = stream_files[slot].bloom;
+
+    if ( 0 == stream_files[slot].size % STORE_BLOCK )
+    {
+        // a filter that was not written is left so
+        if ( 0 == stream_files[slot].token.len || 0 == block--
+            || BLOOM_BYTES != pread(stream_files[slot].bloom_fd, filter, BLOOM_BYTES, block * BLOOM_BYTES) )
+            return;
+    }
+
+    bloom_end_token(filter, &stream_files[slot].token);
+    if ( BLOOM_BYTES != pwrite(stream_files[slot].bloom_fd, filter, BLOOM_BYTES, block * BLOOM_BYTES) )
+    {
+        fprintf(stderr, "bloom filter write error (%d)\n", errno);
+        return;
+    }
+
+    stats.bloom_filters++;
+}
+
+// Adds what a stream appends to the filter of the block it is appending to, and writes the
+// filter of each block it fills; a token that goes on into the next block goes into its filter.
+static void append_bloom(int slot, const char *data, size_t len)
+{
+    uint64_t position = stream_files[slot].size;
+
+    while ( 0 != len )
+    {
+        size_t n = STORE_BLOCK - position % STORE_BLOCK;
+        if ( n > len )
+            n = len;
+
+        bloom_scan(stream_files[slot].bloom, &stream_files[slot].token, data, n);
+        position += n;
+        data += n;
+        len -= n;
+
+        if ( 0 == position % STORE_BLOCK )
+        {
+            uint64_t block = position / STORE_BLOCK - 1;
+            if ( BLOOM_BYTES != pwrite(stream_files[slot].bloom_fd, stream_files[slot].bloom, BLOOM_BYTES, block * BLOOM_BYTES) )
+                fprintf(stderr, "bloom filter write error (%d)\n", errno);
+            else
+                stats.bloom_filters++;
+            memset(stream_files[slot].bloom, 0, BLOOM_BYTES);
+        }
+    }
+}
+
+// Opens the filters of the file just opened in a slot, and rebuilds the filter of the block
+// the stream is appending to from the file, and the token it ends in from the bytes before.
+// Without them, the stream goes on unfiltered, which the queries see as filters never written.
+static void open_bloom(int slot)
+{
+    char name[32];
+    snprintf(name, sizeof(name), "%" PRIu32 BLOOM_FILE, stream_files[slot].stream);
+
+    memset(stream_files[slot].bloom, 0, BLOOM_BYTES);
+    stream_files[slot].token.len = 0;
+    stream_files[slot].bloom_fd = openat(streams_dirfd, name, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if ( -1 == stream_files[slot].bloom_fd )
+    {
+        fprintf(stderr, "cannot open %s (%d)\n", name, errno);
+        return;
+    }
+
+    uint64_t size = stream_files[slot].size;
+    uint64_t from = size - size % STORE_BLOCK;
+    size_t lead = ( from < BLOOM_TOKEN_MAX + 1 ) ? from : BLOOM_TOKEN_MAX + 1;
+    if ( 0 == size )
+        return;
+
+    // a token that started further back is too long anyway
+    struct stored_file f = { stream_files[slot].fd, stream_files[slot].index_fd, stream_files[slot].stream, size };
+    unsigned char scratch[BLOOM_BYTES];
+    char before[BLOOM_TOKEN_MAX + 1];
+    char *block = get_buffer(STORE_CLASS);
+
+    if ( NULL == block || (ssize_t) lead != read_stored(&f, before, lead, from - lead)
+        || (ssize_t) ( size - from ) != read_stored(&f, block, size - from, from) )
+    {
+        fprintf(stderr, "cannot read stream file %" PRIu32 " back (%d)\n", stream_files[slot].stream, errno);
+        close(stream_files[slot].bloom_fd);
+        stream_files[slot].bloom_fd = -1;
+    }
+    else
+    {
+        bloom_scan(scratch, &stream_files[slot].token, before, lead);
+        bloom_scan(stream_files[slot].bloom, &stream_files[slot].token, block, size - from);
+    }
+
+    if ( NULL != block )
+        put_buffer(block, STORE_CLASS);
+}
+
+// closes the descriptors of the file in a slot, the block it was appending to stored first
+static void release_stream_file(int slot)
+{
+    if ( 0 != stream_files[slot].tail_len )
+        store_tail(slot);
+
+    if ( -1 != stream_files[slot].bloom_fd )
+    {
+        write_bloom(slot);
+        close(stream_files[slot].bloom_fd);
+        stream_files[slot].bloom_fd = -1;
+    }
+
+    close(stream_files[slot].fd);
+    stream_files[slot].fd = -1;
+
+    if ( -1 != stream_files[slot].index_fd )
+    {
+        close(stream_files[slot].index_fd);
+        stream_files[slot].index_fd = -1;
+    }
+
+    if ( NULL != stream_files[slot].tail )
+    {
+        put_buffer(stream_files[slot].tail, STORE_CLASS);
+        stream_files[slot].tail = NULL;
+    }
+}
+
+// Appends to the file of a stream. The file is a copy for the fetch command, written through
+// the page cache and never synced, as the log is what makes the bytes durable; it can miss
+// what the server wrote just before a crash, with -z the block it was appending to.
+static void append_stream(uint32_t stream, const char *data, size_t len)
+{
+    int slot = stream % STREAM_FILES;
+
+    if ( stream_files[slot].stream != stream || -1 == stream_files[slot].fd )
+    {
+        if ( -1 != stream_files[slot].fd )
+            release_stream_file(slot);
+
+        char name[16];
+        snprintf(name, sizeof(name), "%" PRIu32, stream);
+
+        // the block the filters are rebuilt from is read back, and with -z, a short last block
+        stream_files[slot].stream = stream;
+        stream_files[slot].fd = openat(streams_dirfd, name, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+        stats.stream_opens++;
+
+        struct stat st;
+        int opened = ( -1 != stream_files[slot].fd && 0 == fstat(stream_files[slot].fd, &st) );
+        if ( opened )
+            stream_files[slot].size = st.st_size;
+
+        if ( !opened || ( store_compressed && -1 == open_store(slot) ) )
+        {
+            fprintf(stderr, "cannot open stream file %s (%d)\n", name, errno);
+            if ( -1 != stream_files[slot].fd )
+                close(stream_files[slot].fd);
+            stream_files[slot].fd = -1;
+            return;
+        }
+
+        open_bloom(slot);
+    }
+
+    if ( -1 != stream_files[slot].bloom_fd )
+        append_bloom(slot, data, len);
+
+    if ( store_compressed )
+    {
+        // what a read decompressed of the stream may have been its tail
+        if ( ( store_plain_key >> 32 ) == stream )
+            store_plain_key = UINT64_MAX;
+
+        while ( 0 != len )
+        {
+            size_t n = STORE_BLOCK - stream_files[slot].tail_len;
+            if ( n > len )
+                n = len;
+
+            memcpy(stream_files[slot].tail + stream_files[slot].tail_len, data, n);
+            if ( 0 != cache_capacity )
+                cache_write(stream, stream_files[slot].size, data, n);
+
+            stream_files[slot].tail_len += n;
+            stream_files[slot].size += n;
+            data += n;
+            len -= n;
+
+            if ( STORE_BLOCK == stream_files[slot].tail_len )
+                store_tail(slot);
+        }
+        return;
+    }
+
+    while ( 0 != len )
+    {
+        ssize_t written = write(stream_files[slot].fd, data, len);
+        if ( -1 == written )
+        {
+            if ( EINTR == errno )
+                continue;
+
+            // the log still has them
+            fprintf(stderr, "stream file write error (%d)\n", errno);
+            return;
+        }
+
+        if ( 0 != cache_capacity )
+            cache_write(stream, stream_files[slot].size, data, written);
+
+        stream_files[slot].size += written;
+        data += written;
+        len -= written;
+    }
+}
+
+// closes the cached descriptor of the file of a stream that has ended
+static void close_stream_file(uint32_t stream)
+{
+    int slot = stream % STREAM_FILES;
+
+    if ( stream_files[slot].stream == stream && -1 != stream_files[slot].fd )
+        release_stream_file(slot);
+}
+
+// gives back what the answer to a fetch command holds, sent or not
+static void end_fetch(struct connection_ctx *conn)
+{
+    close_stored(&conn->fetch->file);
+    free(conn->fetch);
+    conn->fetch = NULL;
+}
+
+// returns the segment taking the appends, rolled first if a record of size bytes would not fit
+// Records never straddle two segments.
+static struct segment *wal_room(size_t size)
+{
+    struct segment *seg = segments[nsegments - 1];
+    if ( seg->end + wal_used + size > SEGMENT_SIZE )
+    {
+        roll_segment();
+        seg = segments[nsegments - 1];
+    }
+
+    return seg;
+}
+
+// appends a record of len bytes, tagged with WAL_REF in tag for a reference
+// returns the position of the record in its segment
+static uint32_t wal_put(uint32_t stream, uint32_t tag, const void *data, size_t len)
+{
+    struct wal_record record = { tag, stream };
+    size_t size = sizeof(record) + len;
+    stats.wal_bytes += size;
+
+    struct segment *seg = wal_room(size);
+
+    if ( wal_used + size > WAL_BUFLEN )
+        wal_write();
+
+    uint32_t position = seg->end + wal_used;
+    index_record(seg, position);
+    seg->records++;
+    if ( stream > seg->last_stream )
+        seg->last_stream = stream;
+    next_record++;
+
+    if ( size > WAL_BUFLEN )
+    {
+        // as large as a whole shared-memory ring; not worth a copy
+        struct iovec iov[2] = { { &record, sizeof(record) }, { (char *) data, len } };
+        wal_writev(iov, 2);
+        return position;
+    }
+
+    memcpy(wal_buffer + wal_used, &record, sizeof(record));
+    memcpy(wal_buffer + wal_used + sizeof(record), data, len);
+    wal_used += size;
+    return position;
+}
+
+// the entry of a chunk in the dedup index, or the free slot where it would go
+static struct dedup_entry *dedup_find(const uint64_t fingerprint[2], uint32_t len)
+{
+    size_t slot = fingerprint[0] & (dedup_slots - 1);
+
+    while ( 0 != dedup_index[slot].len
+        && ( dedup_index[slot].len != len
+            || dedup_index[slot].fingerprint[0] != fingerprint[0]
+            || dedup_index[slot].fingerprint[1] != fingerprint[1] ) )
+        slot = (slot + 1) & (dedup_slots - 1);
+
+    return &dedup_index[slot];
+}
+
+// whether an entry holds a chunk that is still in the log
+static int dedup_live(const struct dedup_entry *e)
+{
+    return 0 != e->len && e->record >= segments[0]->base;
+}
+
+// The tag of a chunk in the cuckoo filter and its first bucket come from other bits of the
+// fingerprint than its slot in the index; its other bucket is the first one moved by a hash
+// of the tag, so that a tag can be moved between the two without the fingerprint.
+static uint16_t cuckoo_tag(const uint64_t fingerprint[2])
+{
+    uint16_t tag = (uint16_t) ( fingerprint[1] >> 48 );
+    return ( 0 == tag ) ? 1 : tag;
+}
+
+static size_t cuckoo_other(size_t bucket, uint16_t tag)
+{
+    return ( bucket ^ ( tag * 0x5bd1e995u ) ) & (dedup_slots / CUCKOO_WAYS - 1);
+}
+
+static int cuckoo_has(size_t bucket, uint16_t tag)
+{
+    for ( int w = 0; w < CUCKOO_WAYS; w++ )
+        if ( cuckoo[bucket][w] == tag )
+            return 1;
+    return 0;
+}
+
+static int cuckoo_put(size_t bucket, uint16_t tag)
+{
+    for ( int w = 0; w < CUCKOO_WAYS; w++ )
+    {
+        if ( 0 == cuckoo[bucket][w] )
+        {
+            cuckoo[bucket][w] = tag;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// returns 0 if the index cannot hold the chunk
+static int cuckoo_may_hold(const uint64_t fingerprint[2])
+{
+    if ( cuckoo_overflow )
+        return 1;
+
+    uint16_t tag = cuckoo_tag(fingerprint);
+    size_t bucket = fingerprint[1] & (dedup_slots / CUCKOO_WAYS - 1);
+    return cuckoo_has(bucket, tag) || cuckoo_has(cuckoo_other(bucket, tag), tag);
+}
+
+// makes room for a tag by moving others to their other bucket, one after the other
+static void cuckoo_insert(const uint64_t fingerprint[2])
+{
+    if ( cuckoo_overflow )
+        return;
+
+    uint16_t tag = cuckoo_tag(fingerprint);
+    size_t bucket = fingerprint[1] & (dedup_slots / CUCKOO_WAYS - 1);
+    if ( cuckoo_put(bucket, tag) || cuckoo_put(cuckoo_other(bucket, tag), tag) )
+        return;
+
+    for ( int i = 0; i < CUCKOO_KICKS; i++ )
+    {
+        int w = cuckoo_victim++ % CUCKOO_WAYS;
+        uint16_t victim = cuckoo[bucket][w];
+        cuckoo[bucket][w] = tag;
+
+        tag = victim;
+        bucket = cuckoo_other(bucket, tag);
+        if ( cuckoo_put(bucket, tag) )
+            return;
+    }
+
+    cuckoo_overflow = 1;
+}
+
+// Moves the index and its filter to tables of slots entries, leaving out the chunks of the
+// segments retired. Returns -1, with the index as it was, if there is no memory for it.
+static int dedup_rebuild(size_t slots)
+{
+    struct dedup_entry *index = (struct dedup_entry *) calloc(slots, sizeof(struct dedup_entry));
+    uint16_t (*filter)[CUCKOO_WAYS] = (uint16_t (*)[CUCKOO_WAYS]) calloc(slots / CUCKOO_WAYS, sizeof(*filter));
+    if ( NULL == index || NULL == filter )
+    {
+        free(index);
+        free(filter);
+        return -1;
+    }
+
+    struct dedup_entry *old = dedup_index;
+    size_t old_slots = dedup_slots;
+
+    free(cuckoo);
+    dedup_index = index;
+    cuckoo = filter;
+    dedup_slots = slots;
+    dedup_entries = 0;
+    dedup_stale = 0;
+    cuckoo_overflow = 0;
+
+    for ( size_t i = 0; i < old_slots; i++ )
+    {
+        if ( !dedup_live(&old[i]) )
+            continue;
+
+        *dedup_find(old[i].fingerprint, old[i].len) = old[i];
+        dedup_entries++;
+        cuckoo_insert(old[i].fingerprint);
+    }
+
+    free(old);
+    return 0;
+}
+
+// the entry of a chunk that the log holds, or NULL
+static struct dedup_entry *dedup_lookup(const uint64_t fingerprint[2], uint32_t len)
+{
+    if ( !cuckoo_may_hold(fingerprint) )
+    {
+        stats.filter_rejects++;
+        return NULL;
+    }
+
+    struct dedup_entry *e = dedup_find(fingerprint, len);
+    if ( !dedup_live(e) )
+    {
+        stats.filter_false++;
+        return NULL;
+    }
+
+    return e;
+}
+
+// enters a chunk in the index, or moves its entry to a newer record holding it
+// A chunk that finds the index full and no memory to grow it is left out.
+static void dedup_enter(const uint64_t fingerprint[2], uint64_t record, uint32_t position, uint32_t len)
+{
+    struct dedup_entry *e = dedup_find(fingerprint, len);
+
+    if ( 0 == e->len )
+    {
+        if ( dedup_entries >= dedup_slots / 4 * 3 )
+        {
+            // the chunks of retired segments leave first, and the index grows if that is not enough
+            if ( dedup_stale )
+                dedup_rebuild(dedup_slots);
+            if ( dedup_entries >= dedup_slots / 2 && -1 == dedup_rebuild(2 * dedup_slots) )
+                return;
+            e = dedup_find(fingerprint, len);
+        }
+
+        e->fingerprint[0] = fingerprint[0];
+        e->fingerprint[1] = fingerprint[1];
+        e->len = len;
+        dedup_entries++;
+        cuckoo_insert(fingerprint);
+    }
+
+    e->record = record;
+    e->position = position;
+}
+
+// logs a reference to a chunk of the segment taking the appends
+static void dedup_ref(uint32_t stream, const struct dedup_entry *e)
+{
+    struct wal_ref ref = { (uint32_t) ( e->record - segments[nsegments - 1]->base ), e->len };
+    wal_put(stream, WAL_REF | sizeof(ref), &ref, sizeof(ref));
+    stats.dedup_hits++;
+    stats.dedup_hit_bytes += e->len;
+}
+
+// the segment holding a record of the log
+static struct segment *segment_of(uint64_t record)
+{
+    size_t lo = 0;
+    size_t hi = nsegments;
+
+    while ( hi - lo > 1 )
+    {
+        size_t mid = lo + ( hi - lo ) / 2;
+        if ( segments[mid]->base <= record )
+            lo = mid;
+        else
+            hi = mid;
+    }
+
+    return segments[lo];
+}
+
+// logs a chunk, as a reference if the segment taking the appends already holds it
+static void dedup_chunk(uint32_t stream, const char *data, size_t len)
+{
+    stats.dedup_chunks++;
+    stats.dedup_bytes += len;
+
+    // rolled now if need be, as a reference must land in the segment it refers to
+    struct segment *seg = wal_room(sizeof(struct wal_record) + len);
+
+    if ( len < DEDUP_MIN )
+    {
+        wal_put(stream, len, data, len);
+        return;
+    }
+
+    uint64_t fingerprint[2];
+    cdc_fingerprint(data, len, fingerprint);
+
+    struct dedup_entry *e = dedup_find(fingerprint, len);
+    if ( dedup_live(e) )
+    {
+        if ( e->record >= seg->base )
+        {
+            dedup_ref(stream, e);
+            return;
+        }
+        stats.dedup_copies++;
+    }
+
+    uint32_t position = wal_put(stream, len, data, len);
+    dedup_enter(fingerprint, next_record - 1, position, len);
+}
+
+// logs the chunk being cut where it is, as the connection sending it has nothing more for now
+static void dedup_flush(uint32_t stream)
+{
+    if ( 0 != chunker.size )
+        dedup_chunk(stream, chunk, chunk_len);
+
+    chunker.hash = 0;
+    chunker.size = 0;
+    chunk_len = 0;
+}
+
+// cuts what a connection sent into chunks; the chunk it ends with waits for more, or dedup_flush()
+// A chunk found whole in data is logged from there, and only one that spans two reads is copied.
+static void dedup_append(uint32_t stream, const char *data, size_t len)
+{
+    while ( 0 != len )
+    {
+        int cut;
+        size_t n = cdc_scan(&chunker, (const unsigned char *) data, len, &cut);
+
+        if ( cut && 0 == chunk_len )
+            dedup_chunk(stream, data, n);
+        else
+        {
+            memcpy(chunk + chunk_len, data, n);
+            chunk_len += n;
+
+            if ( cut )
+            {
+                dedup_chunk(stream, chunk, chunk_len);
+                chunk_len = 0;
+            }
+        }
+
+        data += n;
+        len -= n;
+    }
+}
+
+// Enters the records of a segment in the dedup index, after a restart. Any record short enough
+// to be a chunk will do, whether it was cut as one or not.
+static void dedup_index_segment(struct segment *seg)
+{
+    uint32_t position = 0;
+
+    for ( uint32_t i = 0; i < seg->records; i++ )
+    {
+        struct wal_record record;
+        memcpy(&record, seg->map + position, sizeof(record));
+        position += sizeof(record);
+
+        if ( !( record.len & WAL_REF ) && DEDUP_MIN <= record.len && record.len <= CDC_MAX )
+        {
+            uint64_t fingerprint[2];
+            cdc_fingerprint(seg->map + position, record.len, fingerprint);
+            dedup_enter(fingerprint, seg->base + i, position - sizeof(record), record.len);
+        }
+
+        position += record.len & ~WAL_REF;
+    }
+}
+
+static void dedup_init(void)
+{
+    cdc_init();
+
+    chunk = (char *) malloc(CDC_MAX);
+    if ( NULL == chunk || -1 == dedup_rebuild(DEDUP_SLOTS) )
+    {
+        fprintf(stderr, "out of memory for dedup\n");
+        exit(1);
+    }
+
+    // oldest first, so that the newest copy of a chunk is the one entered
+    for ( size_t i = 0; i < nsegments; i++ )
+        dedup_index_segment(segments[i]);
+}
+
+// gives back what an uploading connection holds
+static void end_upload(struct connection_ctx *conn)
+{
+    free(conn->upload->data);
+    free(conn->upload);
+    conn->upload = NULL;
+}
+
+// lets go of the old version as it was read to be signed
+static void end_signing(struct delta *d)
+{
+    if ( NULL == d->signing )
+        return;
+
+    if ( -1 == d->base.index_fd )
+        munmap(d->signing, (size_t) d->blocks * d->block_len);
+    else
+        free(d->signing);
+    d->signing = NULL;
+}
+
+// gives back what a connection sending a delta holds
+static void end_delta(struct connection_ctx *conn)
+{
+    end_signing(conn->delta);
+    close_stored(&conn->delta->base);
+    free(conn->delta->signatures);
+    free(conn->delta);
+    conn->delta = NULL;
+}
+
+// gives back what a framed connection holds; in line mode, its incomplete line is written out
+static void end_framing(struct connection_ctx *conn)
+{
+    struct framing *f = conn->framing;
+
+    if ( NULL != f->line )
+        sink_carry(&f->line, conn->ep.fd);
+
+    free(f->payload);
+    free(f->plain);
+    free(f);
+    conn->framing = NULL;
+}
+
+// lets go of a query, with query_lock held; the last one to let go frees it
+static void put_query(struct query *q)
+{
+    if ( 0 != --q->refs )
+        return;
+
+    for ( size_t i = 0; i < q->nfiles; i++ )
+    {
+        free(q->files[i].tail);
+        free(q->files[i].bloom);
+    }
+    free(q->files);
+    free(q->out);
+    free(q->sending);
+    pthread_cond_destroy(&q->room);
+    if ( -1 != q->ep.fd )
+        close(q->ep.fd);
+    free(q);
+}
+
+// Lets go of the query of a connection, answered or not. The workers drop what is left of it,
+// and it is let go of by the loop after the batch of events, as an event may still point at it.
+static void end_query(int epollfd, struct connection_ctx *conn)
+{
+    struct query *q = conn->query;
+
+    reactor_remove(epollfd, &q->ep);
+
+    pthread_mutex_lock(&query_lock);
+    __atomic_store_n(&q->cancelled, 1, __ATOMIC_RELAXED);
+    if ( q->next_file < q->nfiles )
+    {
+        // no worker is to take the rest of its files
+        struct query **link = &query_queue;
+        while ( *link != q )
+            link = &(*link)->next;
+        *link = q->next;
+        q->next_file = q->nfiles;
+    }
+    pthread_cond_broadcast(&q->room);
+    pthread_mutex_unlock(&query_lock);
+
+    q->conn = NULL;
+    q->next = ended_queries;
+    ended_queries = q;
+    conn->query = NULL;
+}
+
+// appends what a connection sent to the log; it is durable after the next commit
+static void wal_append(struct connection_ctx *conn, const char *data, size_t len)
+{
+    if ( dedup_mode )
+    {
+        dedup_append(conn->stream, data, len);
+        return;
+    }
+
+    append_stream(conn->stream, data, len);
+    wal_put(conn->stream, (uint32_t) len, data, len);
+}
+
+static int compare_bases(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *) a;
+    uint64_t y = *(const uint64_t *) b;
+    return ( x > y ) - ( x < y );
+}
+
+// opens the log in dir, creating it if need be, and carries on after its last record
+static void open_log(const char *dir)
+{
+    if ( -1 == mkdir(dir, 0755) && EEXIST != errno )
+    {
+        fprintf(stderr, "cannot create %s (%d)\n", dir, errno);
+        exit(1);
+    }
+
+    log_dirfd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    DIR *d = opendir(dir);
+    if ( -1 == log_dirfd || NULL == d )
+    {
+        fprintf(stderr, "cannot open %s (%d)\n", dir, errno);
+        exit(1);
+    }
+
+    if ( ( -1 == mkdirat(log_dirfd, "streams", 0755) && EEXIST != errno )
+        || -1 == ( streams_dirfd = openat(log_dirfd, "streams", O_RDONLY | O_DIRECTORY | O_CLOEXEC) ) )
+    {
+        fprintf(stderr, "cannot open %s/streams (%d)\n", dir, errno);
+        exit(1);
+    }
+
+    for ( int i = 0; i < STREAM_FILES; i++ )
+    {
+        stream_files[i].fd = -1;
+        stream_files[i].index_fd = -1;
+        stream_files[i].bloom_fd = -1;
+    }
+
+    uint64_t *bases = NULL;
+    size_t nbases = 0;
+    size_t capacity = 0;
+
+    struct dirent *entry;
+    while ( NULL != ( entry = readdir(d) ) )
+    {
+        uint64_t base;
+        int len = 0;
+        if ( 1 != sscanf(entry->d_name, "%20" SCNu64 ".log%n", &base, &len) || '\0' != entry->d_name[len] )
+            continue;
+
+        if ( nbases == capacity )
+        {
+            capacity = ( 0 == capacity ) ? 16 : 2 * capacity;
+            if ( NULL == ( bases = (uint64_t *) realloc(bases, capacity * sizeof(uint64_t)) ) )
+            {
+                fprintf(stderr, "out of memory for the segments\n");
+                exit(1);
+            }
+        }
+        bases[nbases++] = base;
+    }
+    closedir(d);
+
+    qsort(bases, nbases, sizeof(uint64_t), compare_bases);
+
+    for ( size_t i = 0; i < nbases; i++ )
+    {
+        struct segment *seg = open_segment(bases[i], 0);
+        if ( NULL == seg )
+            exit(1);
+
+        // last written then, as far as retention can tell
+        seg->rolled = seg->created;
+        add_segment(seg);
+
+        if ( seg->last_stream > last_stream )
+            last_stream = seg->last_stream;
+    }
+    free(bases);
+
+    if ( 0 == nsegments )
+    {
+        struct segment *seg = open_segment(0, 1);
+        if ( NULL == seg )
+            exit(1);
+
+        add_segment(seg);
+    }
+
+    // the last segment takes the appends again, from where its records end
+    struct segment *last = segments[nsegments - 1];
+    last->rolled = 0;
+    next_record = last->base + last->records;
+}
+
+// queues a connection that sent something to be acknowledged after the next commit
+// returns -1 if there is no memory to queue it
+static int wait_for_commit(struct connection_ctx *conn)
+{
+    if ( conn->flags & CONN_UNSYNCED )
+        return 0;
+
+    if ( nwaiting == waiting_capacity )
+    {
+        size_t capacity = ( 0 == waiting_capacity ) ? 64 : 2 * waiting_capacity;
+        struct connection_ctx **waiting = (struct connection_ctx **) realloc(wal_waiting, capacity * sizeof(struct connection_ctx *));
+        if ( NULL == waiting )
+            return -1;
+
+        wal_waiting = waiting;
+        waiting_capacity = capacity;
+    }
+
+    wal_waiting[nwaiting++] = conn;
+    conn->flags |= CONN_UNSYNCED;
+
+    if ( 0 != commit_window_us && !commit_timer_armed )
+    {
+        // the first one to wait opens the window
+        reactor_set_timer(&commit_timer, commit_window_us, 0);
+        commit_timer_armed = 1;
+    }
+
+    return 0;
+}
+
+// takes a connection that is closing off the queue; what it sent is still committed
+static void stop_waiting(struct connection_ctx *conn)
+{
+    for ( size_t i = 0; i < nwaiting; i++ )
+    {
+        if ( wal_waiting[i] == conn )
+        {
+            wal_waiting[i] = wal_waiting[--nwaiting];
+            break;
+        }
+    }
+
+    conn->flags &= ~CONN_UNSYNCED;
+}
+
+// hands everything the producer has published so far to the sink
+// With arm set, it spins for a while for more and then arms the doorbell before returning,
+// so that the next write of the producer wakes up the epoll.
+// returns -1 if the producer published a head the ring cannot hold
+static ssize_t shm_drain(struct shm_channel *chan, int arm)
+{
+    struct shm_ring *ring = chan->ring;
+    uint64_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    size_t total = 0;
+    int damaged = 0;
+
+    while ( 1 )
+    {
+        uint64_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+
+        // the head is written by the peer, which could have written anything; one behind the
+        // tail is as far off
+        if ( head - tail > chan->size )
+        {
+            damaged = 1;
+            break;
+        }
+
+        if ( head != tail )
+        {
+            while ( tail != head )
+            {
+                size_t offset = tail & (chan->size - 1);
+                size_t len = head - tail;
+                if ( len > chan->size - offset )
+                    len = chan->size - offset;
+
+                if ( -1 != wal_fd )
+                    wal_append(chan->conn, ring->data + offset, len);
+                else
+                    sink(&chan->line, chan->conn->ep.fd, ring->data + offset, len);
+
+                tail += len;
+                total += len;
+                chan->received += len;
+            }
+
+            if ( dedup_mode )
+                dedup_flush(chan->conn->stream);
+
+            atomic_store(&ring->tail, tail);
+            shm_doorbell(&ring->producer_waiting, chan->space_fd);
+        }
+
+        if ( !arm )
+            break;
+
+        if ( shm_spin(&ring->head, head, &chan->spin) )
+            continue;
+
+        if ( shm_arm(&ring->consumer_waiting, &ring->head, head) )
+            break;
+    }
+
+    chan->conn->flags |= CONN_STARTED;
+    stats.stream_bytes += total;
+    return damaged ? -1 : (ssize_t) total;
+}
+
+static void release_shm_channel(int epollfd, struct shm_channel *chan)
+{
+    reactor_close(epollfd, &chan->ep);
+    close(chan->space_fd);
+    munmap(chan->ring, chan->map_len);
+
+    chan->ring = NULL;
+}
+
+static void set_listener_events(int epollfd, uint32_t events)
+{
+    for ( int i = 0; i < nlisteners; i++ )
+        reactor_modify(epollfd, listeners[i], events);
+}
+
+static void pause_listeners(int epollfd)
+{
+    if ( listeners_paused )
+        return;
+
+    set_listener_events(epollfd, 0);
+    listeners_paused = 1;
+    stats.listener_pauses++;
+}
+
+// resumes accepting if the server has room for another connection again
+static void resume_listeners(int epollfd)
+{
+    if ( -1 == spare_fd )
+        spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+
+    if ( !listeners_paused || -1 == spare_fd )
+        return;
+
+    if ( 0 != max_connections && active_connections >= max_connections )
+        return;
+
+    set_listener_events(epollfd, EPOLLIN);
+    listeners_paused = 0;
+    reactor_set_timer(&accept_timer, 0, 0);
+}
+
+// Neither the kernel nor the server has memory for another connection. The listeners are
+// level-triggered, so they are paused until a connection closes and gives some back, or,
+// as there may be none to close, until the timer tries again.
+static void pause_listeners_for_memory(int epollfd)
+{
+    pause_listeners(epollfd);
+    reactor_set_timer(&accept_timer, ACCEPT_RETRY_US, 0);
+}
+
+static void handle_accept_timer(int epollfd, struct endpoint *ep, uint32_t events)
+{
+    (void) events;
+
+    if ( 0 == reactor_drain(ep) )
+        return;
+
+    resume_listeners(epollfd);
+}
+
+// lends an empty pipe, or a buffer if splice() is not to be used or no pipe can be had
+static struct echo_pipe *get_echo_pipe(void)
+{
+    struct echo_pipe *pipe = NULL;
+
+    if ( ECHO_SPLICE == echo_mode )
+    {
+        if ( NULL != ( pipe = free_pipes ) )
+        {
+            free_pipes = pipe->next;
+            return pipe;
+        }
+
+        int fds[2];
+        if ( -1 != pipe2(fds, O_NONBLOCK | O_CLOEXEC) )
+        {
+            if ( NULL != ( pipe = (struct echo_pipe *) calloc(1, sizeof(*pipe)) ) )
+            {
+                // a larger pipe moves more per splice(); the default of 64 KB will do otherwise
+                fcntl(fds[1], F_SETPIPE_SZ, ECHO_PIPE_SIZE);
+
+                pipe->fds[0] = fds[0];
+                pipe->fds[1] = fds[1];
+                pooled_pipes++;
+                return pipe;
+            }
+
+            close(fds[0]);
+            close(fds[1]);
+        }
+
+        // out of descriptors or memory; copying needs neither descriptors nor much else
+    }
+
+    if ( NULL != ( pipe = free_copies ) )
+    {
+        free_copies = pipe->next;
+        return pipe;
+    }
+
+    if ( NULL != ( pipe = (struct echo_pipe *) calloc(1, sizeof(*pipe)) ) )
+    {
+        if ( NULL == ( pipe->data = (char *) malloc(BUFLEN(ECHO_CLASS)) ) )
+        {
+            free(pipe);
+            return NULL;
+        }
+
+        pipe->fds[0] = pipe->fds[1] = -1;
+        pooled_copies++;
+    }
+
+    return pipe;
+}
+
+static void put_echo_pipe(struct echo_pipe *pipe)
+{
+    if ( 0 != pipe->queued && -1 != pipe->fds[0] )
+    {
+        // the bytes left in the pipe cannot be taken out cheaply; let the pipe go with them
+        close(pipe->fds[0]);
+        close(pipe->fds[1]);
+        free(pipe);
+        pooled_pipes--;
+        return;
+    }
+
+    pipe->queued = 0;
+    pipe->offset = 0;
+
+    if ( -1 != pipe->fds[0] )
+    {
+        pipe->next = free_pipes;
+        free_pipes = pipe;
+    }
+    else
+    {
+        pipe->next = free_copies;
+        free_copies = pipe;
+    }
+}
+
+// FNV-1a
+static uint32_t hash_name(const char *name, size_t len)
+{
+    uint32_t hash = 2166136261u;
+
+    for ( size_t i = 0; i < len; i++ )
+    {
+        hash ^= (unsigned char) name[i];
+        hash *= 16777619u;
+    }
+
+    return hash;
+}
+
+// the slot of the named channel in the index, or the empty slot where it would go
+static size_t channel_slot(uint32_t hash, const char *name, size_t len)
+{
+    size_t mask = channel_slots - 1;
+    size_t i = hash & mask;
+
+    while ( NULL != channel_index[i] )
+    {
+        struct channel *ch = channel_index[i];
+        if ( ch->hash == hash && 0 == memcmp(ch->name, name, len) && '\0' == ch->name[len] )
+            return i;
+
+        i = ( i + 1 ) & mask;
+    }
+
+    return i;
+}
+
+static int grow_channel_index(void)
+{
+    size_t slots = ( 0 == channel_slots ) ? 64 : 2 * channel_slots;
+    struct channel **index = (struct channel **) calloc(slots, sizeof(struct channel *));
+    if ( NULL == index )
+        return -1;
+
+    struct channel **old = channel_index;
+    size_t old_slots = channel_slots;
+
+    channel_index = index;
+    channel_slots = slots;
+
+    for ( size_t i = 0; i < old_slots; i++ )
+    {
+        if ( NULL != old[i] )
+            channel_index[channel_slot(old[i]->hash, old[i]->name, strlen(old[i]->name))] = old[i];
+    }
+
+    free(old);
+    return 0;
+}
+
+// returns the named channel, created if need be, or NULL if out of memory
+static struct channel *find_channel(const char *name, size_t len)
+{
+    if ( 4 * ( nchannels + 1 ) > 3 * channel_slots && -1 == grow_channel_index() )
+        return NULL;
+
+    uint32_t hash = hash_name(name, len);
+    size_t i = channel_slot(hash, name, len);
+
+    if ( NULL == channel_index[i] )
+    {
+        struct channel *ch = (struct channel *) calloc(1, sizeof(struct channel));
+        if ( NULL == ch )
+            return NULL;
+
+        ch->hash = hash;
+        memcpy(ch->name, name, len);
+
+        channel_index[i] = ch;
+        nchannels++;
+    }
+
+    return channel_index[i];
+}
+
+// Takes a channel without members out of the index. The entries after it that probed past
+// its slot move back, so that lookups never have to skip over deleted entries.
+static void remove_channel(struct channel *ch)
+{
+    size_t mask = channel_slots - 1;
+    size_t hole = channel_slot(ch->hash, ch->name, strlen(ch->name));
+    channel_index[hole] = NULL;
+
+    for ( size_t j = ( hole + 1 ) & mask; NULL != channel_index[j]; j = ( j + 1 ) & mask )
+    {
+        size_t home = channel_index[j]->hash & mask;
+
+        // an entry whose home lies cyclically in (hole, j] has to stay where it is
+        int stays = ( hole <= j ) ? ( hole < home && home <= j ) : ( hole < home || home <= j );
+        if ( !stays )
+        {
+            channel_index[hole] = channel_index[j];
+            channel_index[j] = NULL;
+            hole = j;
+        }
+    }
+
+    nchannels--;
+    free(ch->subscribers);
+    free(ch);
+}
+
+static void unref_message(struct message *msg)
+{
+    if ( 0 == --msg->refs )
+    {
+        messages_live--;
+        message_bytes_live -= msg->len;
+        free(msg);
+    }
+}
+
+// queue entries come from slabs of QUEUED_SLAB, like connection contexts
+static struct queued_message *get_queued(void)
+{
+    if ( NULL == free_queued )
+    {
+        struct queued_message *slab = (struct queued_message *) malloc(QUEUED_SLAB * sizeof(struct queued_message));
+        if ( NULL == slab )
+            return NULL;
+
+        for ( int i = 0; i < QUEUED_SLAB; i++ )
+        {
+            slab[i].next = free_queued;
+            free_queued = &slab[i];
+        }
+
+        queued_slabs++;
+    }
+
+    struct queued_message *q = free_queued;
+    free_queued = q->next;
+    return q;
+}
+
+static void put_queued(struct queued_message *q)
+{
+    q->next = free_queued;
+    free_queued = q;
+}
+
+// takes a connection out of its channel, dropping whatever was still queued to it
+static void leave_pubsub(struct connection_ctx *conn)
+{
+    struct member *m = conn->member;
+    struct channel *ch = m->channel;
+
+    while ( NULL != m->head )
+    {
+        struct queued_message *q = m->head;
+        m->head = q->next;
+
+        unref_message(q->msg);
+        put_queued(q);
+    }
+
+    if ( !m->publisher )
+    {
+        // the last subscriber takes the place of this one
+        struct connection_ctx *last = ch->subscribers[--ch->nsubscribers];
+        ch->subscribers[m->index] = last;
+        last->member->index = m->index;
+        nsubscribers--;
+    }
+
+    if ( 0 == --ch->members )
+        remove_channel(ch);
+
+    free(m);
+    conn->member = NULL;
+}
+
+// runs the flush timer while there are connections in bulk mode
+static void set_flush_timer(int armed)
+{
+    long period_us = armed ? BULK_FLUSH_MS * 1000L : 0;
+    reactor_set_timer(&flush_timer, period_us, period_us);
+}
+
+static void leave_bulk_mode(struct connection_ctx *conn)
+{
+    for ( int i = 0; i < nbulk; i++ )
+    {
+        if ( bulk_connections[i] == conn )
+        {
+            bulk_connections[i] = bulk_connections[--nbulk];
+            break;
+        }
+    }
+
+    conn->lowat_class = 0;
+
+    if ( 0 == nbulk )
+        set_flush_timer(0);
+}
+
+// queues a connection that used up its read budget, as nothing else would bring
+// an edge-triggered connection back to what is left in its socket
+// returns -1 if there is no memory for it
+static int read_later(struct connection_ctx *conn)
+{
+    if ( conn->flags & CONN_UNREAD )
+        return 0;
+
+    if ( nunread == unread_capacity )
+    {
+        size_t capacity = ( 0 == unread_capacity ) ? 64 : 2 * unread_capacity;
+        struct connection_ctx **unread = (struct connection_ctx **) realloc(unread_connections, capacity * sizeof(struct connection_ctx *));
+        if ( NULL == unread )
+            return -1;
+
+        unread_connections = unread;
+        unread_capacity = capacity;
+    }
+
+    unread_connections[nunread++] = conn;
+    conn->flags |= CONN_UNREAD;
+    stats.reads_cut++;
+    return 0;
+}
+
+static void stop_reading_later(struct connection_ctx *conn)
+{
+    for ( size_t i = 0; i < nunread; i++ )
+    {
+        if ( unread_connections[i] == conn )
+        {
+            unread_connections[i] = unread_connections[--nunread];
+            break;
+        }
+    }
+
+    conn->flags &= ~CONN_UNREAD;
+}
+
+// sets the low-water mark to half the read buffer of a connection that reads in bulk,
+// and back to a byte once it no longer does
+static void adjust_rcvlowat(struct connection_ctx *conn)
+{
+    int class = ( conn->buf_class >= BULK_CLASS ) ? conn->buf_class : 0;
+    if ( class == conn->lowat_class || ( 0 == conn->lowat_class && BULK_MAX == nbulk ) )
+        return;
+
+    int lowat = ( 0 == class ) ? 1 : (int) BUFLEN(class) / 2;
+    if ( -1 == setsockopt(conn->ep.fd, SOL_SOCKET, SO_RCVLOWAT, &lowat, sizeof(lowat)) )
+    {
+        // not worth closing the connection over; it keeps waking up as it did
+        return;
+    }
+
+    if ( 0 == class )
+    {
+        leave_bulk_mode(conn);
+        return;
+    }
+
+    if ( 0 == conn->lowat_class )
+    {
+        if ( 0 == nbulk )
+            set_flush_timer(1);
+        bulk_connections[nbulk++] = conn;
+    }
+
+    conn->lowat_class = class;
+}
+
+// releases everything held by the connection except its context,
+// which is freed with closed_connections after the current batch of events
+// err is the errno behind the reason, if any, and is reported.
+static void close_connection(int epollfd, struct connection_ctx *conn, enum close_reason reason, int err)
+{
+    if ( 0 != err )
+        fprintf(stderr, "sock:%d, closed on %s (%d)\n", conn->ep.fd, close_reason_names[reason], err);
+
+    stats.connections_closed[reason]++;
+
+    if ( ECHO_OFF != echo_mode )
+    {
+        // what the peer did not read back is dropped
+        if ( NULL != conn->pipe )
+            put_echo_pipe(conn->pipe);
+        conn->pipe = NULL;
+    }
+    else if ( PUBSUB_OFF != pubsub_policy )
+    {
+        if ( NULL != conn->member )
+            leave_pubsub(conn);
+    }
+    else if ( conn->flags & CONN_FETCH )
+    {
+        if ( NULL != conn->fetch )
+            end_fetch(conn);
+    }
+    else if ( conn->flags & CONN_UPLOAD )
+    {
+        // a batch that was not complete is dropped, as it was never acknowledged
+        if ( NULL != conn->upload )
+            end_upload(conn);
+    }
+    else if ( conn->flags & CONN_DELTA )
+    {
+        // and so is a file that was not complete
+        if ( NULL != conn->delta )
+            end_delta(conn);
+    }
+    else if ( conn->flags & CONN_QUERY )
+    {
+        // the workers drop the rest of a query that was not answered
+        if ( NULL != conn->query )
+            end_query(epollfd, conn);
+    }
+    else if ( conn->flags & CONN_FRAMED )
+    {
+        // a frame that was not complete is dropped, as it was never checked
+        if ( NULL != conn->framing )
+            end_framing(conn);
+    }
+    else if ( conn->flags & CONN_SHM )
+    {
+        // whatever the producer wrote before going away is still in the ring, unless the ring
+        // was damaged
+        shm_drain(conn->shm, 0);
+        if ( NULL != conn->shm->line )
+            sink_carry(&conn->shm->line, conn->ep.fd);
+        release_shm_channel(epollfd, conn->shm);
+    }
+    else if ( -1 == wal_fd && NULL != conn->line )
+        sink_carry(&conn->line, conn->ep.fd);
+
+    if ( 0 != conn->lowat_class )
+        leave_bulk_mode(conn);
+
+    if ( conn->flags & CONN_UNSYNCED )
+        stop_waiting(conn);
+
+    if ( conn->flags & CONN_UNREAD )
+        stop_reading_later(conn);
+
+    if ( -1 != wal_fd )
+        close_stream_file(conn->stream);
+
+    reactor_close(epollfd, &conn->ep);
+
+    if ( conn->flags & CONN_SHM )
+    {
+        conn->shm->next = closed_channels;
+        closed_channels = conn->shm;
+    }
+
+    // the context is done with whatever else it held
+    conn->next = closed_connections;
+    closed_connections = conn;
+
+    active_connections--;
+    resume_listeners(epollfd);
+}
+
+// writes the queue of a subscriber until it is empty or the socket is full
+static void flush_subscriber(int epollfd, struct connection_ctx *conn)
+{
+    struct member *m = conn->member;
+
+    while ( NULL != m->head )
+    {
+        struct iovec iov[PUBSUB_IOV];
+        int n = 0;
+
+        uint32_t offset = m->offset;
+        for ( struct queued_message *q = m->head; NULL != q && n < PUBSUB_IOV; q = q->next )
+        {
+            iov[n].iov_base = q->msg->data + offset;
+            iov[n].iov_len = q->msg->len - offset;
+            offset = 0;
+            n++;
+        }
+
+        ssize_t sent = writev(conn->ep.fd, iov, n);
+        stats.pubsub_writes++;
+
+        if ( -1 == sent )
+        {
+            switch ( errno )
+            {
+                case EINTR:
+                    continue;
+
+                case EAGAIN:
+                    // the rest waits for EPOLLOUT
+                    return;
+
+                case ECONNRESET:
+                case EPIPE:
+                    close_connection(epollfd, conn, CLOSE_RESET, 0);
+                    return;
+
+                case EBADF:
+                case EFAULT:
+                case EINVAL:
+                    // the server is broken, not the connection
+                    fprintf(stderr, "socket writev error (%d)\n", errno);
+                    exit(1);
+
+                default:
+                    close_connection(epollfd, conn, CLOSE_SEND_ERROR, errno);
+                    return;
+            }
+        }
+
+        m->queued -= sent;
+
+        // the messages sent in full leave the queue
+        while ( 0 < sent )
+        {
+            struct queued_message *q = m->head;
+            size_t rest = q->msg->len - m->offset;
+
+            if ( (size_t) sent < rest )
+            {
+                m->offset += sent;
+                break;
+            }
+
+            sent -= rest;
+            m->offset = 0;
+            m->head = q->next;
+
+            unref_message(q->msg);
+            put_queued(q);
+        }
+
+        if ( NULL == m->head )
+            m->tail = NULL;
+    }
+}
+
+// queues what a publisher has sent, as one message, to every subscriber of its channel
+static void publish(int epollfd, struct channel *ch, const char *data, size_t len)
+{
+    stats.messages_published++;
+
+    if ( 0 == ch->nsubscribers )
+        return;
+
+    struct message *msg = (struct message *) malloc(sizeof(struct message) + len);
+    if ( NULL == msg )
+    {
+        stats.messages_dropped += ch->nsubscribers;
+        return;
+    }
+
+    // held while fanning out, so that subscribers taking it at once do not free it
+    msg->refs = 1;
+    msg->len = len;
+    memcpy(msg->data, data, len);
+
+    messages_live++;
+    message_bytes_live += len;
+
+    // backwards, as a subscriber that is disconnected is replaced by the last one
+    for ( uint32_t i = ch->nsubscribers; 0 < i--; )
+    {
+        struct connection_ctx *conn = ch->subscribers[i];
+        struct member *m = conn->member;
+
+        if ( NULL != m->head )
+        {
+            // still writing earlier messages
+            if ( PUBSUB_DROP == pubsub_policy )
+            {
+                stats.messages_dropped++;
+                continue;
+            }
+
+            if ( PUBSUB_DISCONNECT == pubsub_policy || m->queued + len > PUBSUB_BACKLOG )
+            {
+                stats.subscribers_dropped++;
+                close_connection(epollfd, conn, CLOSE_SLOW, 0);
+                continue;
+            }
+        }
+
+        struct queued_message *q = get_queued();
+        if ( NULL == q )
+        {
+            stats.messages_dropped++;
+            continue;
+        }
+
+        q->msg = msg;
+        q->next = NULL;
+        msg->refs++;
+
+        if ( NULL == m->tail )
+            m->head = q;
+        else
+            m->tail->next = q;
+        m->tail = q;
+        m->queued += len;
+
+        stats.messages_queued++;
+
+        // one that was behind already waits for EPOLLOUT
+        if ( q == m->head )
+            flush_subscriber(epollfd, conn);
+    }
+
+    unref_message(msg);
+}
+
+// Reads the line a connection in fan-out mode starts with (see pubsub.h) and joins its channel.
+// Returns -1 if the connection has been closed, or if the line has not arrived in full yet.
+static int join_pubsub(int epollfd, struct connection_ctx *conn)
+{
+    char line[PUBSUB_VERB_LEN + CHANNEL_NAME_MAX + 1];
+
+    ssize_t n = recv(conn->ep.fd, line, sizeof(line), MSG_PEEK);
+    if ( -1 == n )
+    {
+        if ( EAGAIN == errno || EINTR == errno )
+            return -1;
+
+        close_connection(epollfd, conn, CLOSE_RECV_ERROR, errno);
+        return -1;
+    }
+
+    if ( 0 == n )
+    {
+        close_connection(epollfd, conn, CLOSE_ORDERLY, 0);
+        return -1;
+    }
+
+    int publisher = 0 == memcmp(line, PUBSUB_PUBLISH, n < PUBSUB_VERB_LEN ? n : PUBSUB_VERB_LEN);
+    int subscriber = 0 == memcmp(line, PUBSUB_SUBSCRIBE, n < PUBSUB_VERB_LEN ? n : PUBSUB_VERB_LEN);
+
+    char *eol = (char *) memchr(line, '\n', n);
+    if ( NULL == eol && (size_t) n < sizeof(line) && ( publisher || subscriber ) )
+    {
+        // the rest of the line comes with the next edge
+        return -1;
+    }
+
+    size_t len = ( NULL == eol ) ? 0 : eol - line - PUBSUB_VERB_LEN;
+    if ( NULL == eol || eol - line <= PUBSUB_VERB_LEN || !( publisher || subscriber )
+        || NULL != memchr(line + PUBSUB_VERB_LEN, '\0', len) )
+    {
+        fprintf(stderr, "sock:%d, not a publisher or a subscriber\n", conn->ep.fd);
+        close_connection(epollfd, conn, CLOSE_RECV_ERROR, EPROTO);
+        return -1;
+    }
+
+    // take the line off the socket
+    recv(conn->ep.fd, line, eol - line + 1, 0);
+
+    struct member *m = (struct member *) calloc(1, sizeof(struct member));
+    struct channel *ch = ( NULL == m ) ? NULL : find_channel(line + PUBSUB_VERB_LEN, len);
+
+    if ( NULL != ch && subscriber && ch->nsubscribers == ch->capacity )
+    {
+        uint32_t capacity = ( 0 == ch->capacity ) ? 16 : 2 * ch->capacity;
+        struct connection_ctx **subscribers = (struct connection_ctx **) realloc(ch->subscribers, capacity * sizeof(struct connection_ctx *));
+        if ( NULL == subscribers )
+        {
+            if ( 0 == ch->members )
+                remove_channel(ch);
+            ch = NULL;
+        }
+        else
+        {
+            ch->subscribers = subscribers;
+            ch->capacity = capacity;
+        }
+    }
+
+    if ( NULL == ch )
+    {
+        free(m);
+        close_connection(epollfd, conn, CLOSE_RECV_ERROR, ENOMEM);
+        return -1;
+    }
+
+    m->channel = ch;
+    m->publisher = publisher;
+    ch->members++;
+
+    if ( subscriber )
+    {
+        m->index = ch->nsubscribers;
+        ch->subscribers[ch->nsubscribers++] = conn;
+        nsubscribers++;
+    }
+
+    conn->member = m;
+    return 0;
+}
+
+// Contexts come from slabs of CONN_SLAB, which are never returned to the system;
+// a million connections then cost a million contexts, without a malloc() header each.
+static struct connection_ctx *alloc_context(void)
+{
+    if ( NULL == free_contexts )
+    {
+        struct connection_ctx *slab = (struct connection_ctx *) malloc(CONN_SLAB * sizeof(struct connection_ctx));
+        if ( NULL == slab )
+            return NULL;
+
+        for ( int i = 0; i < CONN_SLAB; i++ )
+        {
+            slab[i].next = free_contexts;
+            free_contexts = &slab[i];
+        }
+
+        context_slabs++;
+    }
+
+    struct connection_ctx *conn = free_contexts;
+    free_contexts = conn->next;
+
+    memset(conn, 0, sizeof(*conn));
+    return conn;
+}
+
+static void free_closed_connections(void)
+{
+    while ( NULL != closed_channels )
+    {
+        struct shm_channel *next = closed_channels->next;
+        free(closed_channels);
+        closed_channels = next;
+    }
+
+    while ( NULL != closed_connections )
+    {
+        struct connection_ctx *next = closed_connections->next;
+        closed_connections->next = free_contexts;
+        free_contexts = closed_connections;
+
+        closed_connections = next;
+    }
+
+    if ( NULL != ended_queries )
+    {
+        pthread_mutex_lock(&query_lock);
+        while ( NULL != ended_queries )
+        {
+            struct query *next = ended_queries->next;
+            put_query(ended_queries);
+            ended_queries = next;
+        }
+        pthread_mutex_unlock(&query_lock);
+    }
+}
+
+// the size class a connection that has just filled its buffer moves up to:
+// one that fits what is still queued, if the kernel says, or the next one
+static int grow_buffer_class(int fd, int class)
+{
+    int queued = 0;
+    int grown = class + 1;
+
+    if ( -1 != ioctl(fd, FIONREAD, &queued) )
+    {
+        while ( grown < BUF_CLASSES - 1 && BUFLEN(grown) < (size_t) queued )
+            grown++;
+    }
+
+    return ( grown < BUF_CLASSES ) ? grown : BUF_CLASSES - 1;
+}
+
+// creates a stream socket, binds it to the given address and starts listening on it
+static int open_listener(const struct sockaddr *addr, socklen_t addrlen)
+{
+    // non-blocking, so that handle_accept() can drain the backlog until EWOULDBLOCK
+    int listenfd = socket(addr->sa_family, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if ( -1 == listenfd )
+    {
+        switch ( errno )
+        {
+            case EACCES:
+            case EAFNOSUPPORT:
+            case EINVAL:
+            case ENFILE:
+            case ENOBUFS:
+            case ENOMEM:
+            case EPROTONOSUPPORT:
+            default:
+                fprintf(stderr, "socket creation error (%d)\n", errno);
+                exit(1);
+        }
+    }
+
+    if ( AF_INET == addr->sa_family )
+    {
+        int reuse = 1;
+        if ( -1 == setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse)) )
+        {
+            switch ( errno )
+            {
+                case EBADF:
+                case EDOM:
+                case EINVAL:
+                case EISCONN:
+                case ENOPROTOOPT:
+                case ENOTSOCK:
+                case ENOMEM:
+                case ENOBUFS:
+                default:
+                    fprintf(stderr, "socket setsockopt error (%d)\n", errno);
+                    exit(1);
+            }
+        }
+    }
+
+    // bind
+
+    if ( -1 == bind(listenfd, addr, addrlen) )
+    {
+        switch (errno )
+        {
+            case EADDRINUSE:
+                fprintf(stderr, "The given address is already in use.\n");
+                exit(1);
+
+            case EACCES:
+            case EBADF:
+            case EINVAL:
+            case ENOTSOCK:
+            default:
+                fprintf(stderr, "socket bind error (%d)\n", errno);
+                exit(1);
+        }
+    }
+
+    // listen
+
+    if ( -1 == listen(listenfd, MAX_BACKLOG) )
+    {
+        switch ( errno )
+        {
+            case EADDRINUSE:
+            case EBADF:
+            case ENOTSOCK:
+            case EOPNOTSUPP:
+            default:
+                fprintf(stderr, "socket listen error (%d)\n", errno);
+                exit(1);
+        }
+    }
+
+    return listenfd;
+}
+
+// creates a non-blocking datagram socket bound to the given address
+static int open_datagram_socket(const struct sockaddr *addr, socklen_t addrlen)
+{
+    int udpfd = socket(addr->sa_family, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+    if ( -1 == udpfd )
+    {
+        switch ( errno )
+        {
+            case EACCES:
+            case EAFNOSUPPORT:
+            case EINVAL:
+            case ENFILE:
+            case ENOBUFS:
+            case ENOMEM:
+            case EPROTONOSUPPORT:
+            default:
+                fprintf(stderr, "socket creation error (%d)\n", errno);
+                exit(1);
+        }
+    }
+
+    // have the kernel count the datagrams it drops for lack of receive buffer space
+    int on = 1;
+    if ( -1 == setsockopt(udpfd, SOL_SOCKET, SO_RXQ_OVFL, &on, sizeof(on)) )
+    {
+        fprintf(stderr, "socket setsockopt error (%d)\n", errno);
+        exit(1);
+    }
+
+    if ( -1 == bind(udpfd, addr, addrlen) )
+    {
+        switch (errno )
+        {
+            case EADDRINUSE:
+                fprintf(stderr, "The given address is already in use.\n");
+                exit(1);
+
+            case EACCES:
+            case EBADF:
+            case EINVAL:
+            case ENOTSOCK:
+            default:
+                fprintf(stderr, "socket bind error (%d)\n", errno);
+                exit(1);
+        }
+    }
+
+    return udpfd;
+}
+
+// takes up to DGRAM_BATCH datagrams with a single system call, sinks them and,
+// if requested, acknowledges them all with another
+// The socket is level-triggered, so whatever is left wakes up the next epoll_wait.
+static void handle_datagrams(int epollfd, struct endpoint *ep, uint32_t events)
+{
+    int udpfd = ep->fd;
+    (void) epollfd;
+    (void) events;
+
+    static char buffers[DGRAM_BATCH][DGRAM_MAX];
+    static char controls[DGRAM_BATCH][CMSG_SPACE(sizeof(uint32_t))];
+    static struct sockaddr_storage peers[DGRAM_BATCH];
+
+    struct iovec iovs[DGRAM_BATCH];
+    struct mmsghdr msgs[DGRAM_BATCH];
+
+    memset(msgs, 0, sizeof(msgs));
+    for ( int i = 0; i < DGRAM_BATCH; i++ )
+    {
+        iovs[i].iov_base = buffers[i];
+        iovs[i].iov_len = DGRAM_MAX;
+        msgs[i].msg_hdr.msg_name = &peers[i];
+        msgs[i].msg_hdr.msg_namelen = sizeof(peers[i]);
+        msgs[i].msg_hdr.msg_iov = &iovs[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+        msgs[i].msg_hdr.msg_control = controls[i];
+        msgs[i].msg_hdr.msg_controllen = sizeof(controls[i]);
+    }
+
+    int received = recvmmsg(udpfd, msgs, DGRAM_BATCH, MSG_DONTWAIT, NULL);
+    if ( -1 == received )
+    {
+        switch ( errno )
+        {
+            case EAGAIN:
+            case EINTR:
+                // no datagram right now, try again later...
+                return;
+
+            case ECONNREFUSED:
+                // an ICMP error for an acknowledgement sent to a peer that is gone
+                return;
+
+            case ENOMEM:
+                // the kernel is short of memory for now; the datagrams stay queued
+                return;
+
+            case EBADF:
+            case EFAULT:
+            case EINVAL:
+            case ENOTSOCK:
+            default:
+                fprintf(stderr, "socket recvmmsg error (%d)\n", errno);
+                exit(1);
+        }
+    }
+
+    for ( int i = 0; i < received; i++ )
+    {
+        if ( msgs[i].msg_hdr.msg_flags & MSG_TRUNC )
+            stats.datagrams_truncated++;
+
+        for ( struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msgs[i].msg_hdr); NULL != cmsg; cmsg = CMSG_NXTHDR(&msgs[i].msg_hdr, cmsg) )
+        {
+            if ( SOL_SOCKET == cmsg->cmsg_level && SO_RXQ_OVFL == cmsg->cmsg_type )
+            {
+                // a running total for the socket
+                uint32_t dropped;
+                memcpy(&dropped, CMSG_DATA(cmsg), sizeof(dropped));
+                stats.datagrams_dropped = dropped;
+            }
+        }
+
+        // a datagram is never continued by the next one
+        sink(NULL, udpfd, buffers[i], msgs[i].msg_len);
+
+        stats.datagram_bytes += msgs[i].msg_len;
+    }
+
+    stats.datagrams += received;
+
+    if ( ack_datagrams )
+    {
+        static char ack[] = "Ack\n";
+
+        struct iovec ack_iov;
+        ack_iov.iov_base = ack;
+        ack_iov.iov_len = sizeof(ack) - 1;
+
+        struct mmsghdr acks[DGRAM_BATCH];
+        memset(acks, 0, sizeof(acks));
+
+        for ( int i = 0; i < received; i++ )
+        {
+            acks[i].msg_hdr.msg_name = &peers[i];
+            acks[i].msg_hdr.msg_namelen = msgs[i].msg_hdr.msg_namelen;
+            acks[i].msg_hdr.msg_iov = &ack_iov;
+            acks[i].msg_hdr.msg_iovlen = 1;
+        }
+
+        // acknowledgements are best effort, just like the datagrams they acknowledge
+        int sent = sendmmsg(udpfd, acks, received, MSG_DONTWAIT);
+        if ( 0 < sent )
+            stats.datagram_acks += sent;
+    }
+}
+
+// prints the counters, with rates since the previous report
+static void report_stats(void)
+{
+    static struct server_stats last;
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    double elapsed = (now.tv_sec - stats_since.tv_sec) + (now.tv_nsec - stats_since.tv_nsec) / 1e9;
+    if ( elapsed <= 0 )
+        elapsed = 1e-9;
+
+    size_t stream_bytes = stats.stream_bytes - last.stream_bytes;
+    size_t recv_calls = stats.recv_calls - last.recv_calls;
+    fprintf(stderr, "stream: %zu bytes (%.1f MB/s), %zu recv calls (%.1f per MB)\n",
+        stats.stream_bytes, stream_bytes / elapsed / 1e6, stats.recv_calls,
+        0 == stream_bytes ? 0.0 : recv_calls * 1e6 / stream_bytes);
+    struct rusage usage;
+    static long last_switches = 0;
+    long switches = 0;
+    if ( 0 == getrusage(RUSAGE_SELF, &usage) )
+        switches = usage.ru_nvcsw + usage.ru_nivcsw;
+
+    fprintf(stderr, "wakeup: %zu connection wakeups (%.1f per MB), %ld context switches (%.1f per MB), %d in bulk mode, %zu tails flushed, %zu reads cut at the budget\n",
+        stats.stream_wakeups, 0 == stream_bytes ? 0.0 : (stats.stream_wakeups - last.stream_wakeups) * 1e6 / stream_bytes,
+        switches, 0 == stream_bytes ? 0.0 : (switches - last_switches) * 1e6 / stream_bytes,
+        nbulk, stats.bulk_flushes, stats.reads_cut);
+    last_switches = switches;
+
+    size_t echo_bytes = stats.echo_bytes - last.echo_bytes;
+    fprintf(stderr, "echo: %zu bytes (%.1f MB/s), %.1f calls per MB, %zu pipes, %zu copy buffers\n",
+        stats.echo_bytes, echo_bytes / elapsed / 1e6,
+        0 == echo_bytes ? 0.0 : (stats.echo_calls - last.echo_calls) * 1e6 / echo_bytes,
+        pooled_pipes, pooled_copies);
+
+    size_t published = stats.messages_published - last.messages_published;
+    fprintf(stderr, "pubsub: %zu channels, %zu subscribers, %zu messages in %zu KB, %zu queue slabs, "
+        "%zu published, %zu queued, %zu dropped, %zu subscribers dropped, %.1f writev per message\n",
+        nchannels, nsubscribers, messages_live, message_bytes_live / 1024, queued_slabs,
+        stats.messages_published, stats.messages_queued, stats.messages_dropped, stats.subscribers_dropped,
+        0 == published ? 0.0 : (double) (stats.pubsub_writes - last.pubsub_writes) / published);
+
+    size_t lines = stats.lines - last.lines;
+    fprintf(stderr, "line: %zu written (%.0f/s), %zu cut short, %.1f lines per writev\n",
+        stats.lines, lines / elapsed, stats.lines_cut,
+        0 == stats.line_writes - last.line_writes ? 0.0 : (double) lines / (stats.line_writes - last.line_writes));
+
+    size_t commits = stats.wal_commits - last.wal_commits;
+    fprintf(stderr, "wal: %zu bytes (%.1f MB/s), %zu writes, %zu commits (%.0f/s), %.1f acks per commit, %.0f us per fdatasync, "
+        "%zu segments from record %" PRIu64 " to %" PRIu64 ", %zu rolled, %zu retired\n",
+        stats.wal_bytes, (stats.wal_bytes - last.wal_bytes) / elapsed / 1e6, stats.wal_writes,
+        stats.wal_commits, commits / elapsed,
+        0 == commits ? 0.0 : (double) (stats.wal_acks - last.wal_acks) / commits,
+        0 == commits ? 0.0 : (stats.wal_sync_ns - last.wal_sync_ns) / 1e3 / commits,
+        nsegments, 0 == nsegments ? 0 : segments[0]->base, next_record,
+        stats.segments_rolled, stats.segments_retired);
+
+    size_t fetch_bytes = stats.fetch_bytes - last.fetch_bytes;
+    size_t sendfile_calls = stats.sendfile_calls - last.sendfile_calls;
+    fprintf(stderr, "fetch: %zu commands, %zu bytes (%.1f MB/s), %.0f KB per sendfile, %zu stream files opened\n",
+        stats.fetches, stats.fetch_bytes, fetch_bytes / elapsed / 1e6,
+        0 == sendfile_calls ? 0.0 : fetch_bytes / 1024.0 / sendfile_calls, stats.stream_opens);
+
+    fprintf(stderr, "store: %zu blocks, %zu bytes of streams stored as %zu (%.1f%%), %zu blocks read back, "
+        "%zu bloom filters written\n",
+        stats.store_blocks, stats.store_plain_bytes, stats.store_bytes,
+        0 == stats.store_plain_bytes ? 0.0 : stats.store_bytes * 100.0 / stats.store_plain_bytes,
+        stats.store_loads, stats.bloom_filters);
+
+    pthread_mutex_lock(&query_lock);
+    fprintf(stderr, "query: %zu commands, %zu files searched, %zu blocks ruled out by filters, %zu lines found, "
+        "%" PRIu64 " bytes (%.2f GB/s per core, %s, %d workers)\n",
+        stats.queries, stats.query_files, stats.query_skipped, stats.query_matches, stats.query_bytes,
+        0 == stats.query_ns ? 0.0 : (double) stats.query_bytes / stats.query_ns, search_name, nquery_workers);
+    pthread_mutex_unlock(&query_lock);
+
+    size_t hits = stats.cache_hit_bytes - last.cache_hit_bytes;
+    size_t misses = stats.cache_miss_bytes - last.cache_miss_bytes;
+    fprintf(stderr, "cache: %zu KB in %zu blocks (%zu small, %zu main), %.1f%% of fetched bytes hit, "
+        "%.1f%% decompressed into it, %zu evicted, %zu promoted, %zu ghost hits\n",
+        ( cache_small.blocks + cache_main.blocks ) * CACHE_BLOCK / 1024, cache_small.blocks + cache_main.blocks,
+        cache_small.blocks, cache_main.blocks, 0 == fetch_bytes ? 0.0 : hits * 100.0 / fetch_bytes,
+        0 == fetch_bytes ? 0.0 : misses * 100.0 / fetch_bytes,
+        stats.cache_evictions, stats.cache_promotions, stats.cache_ghost_hits);
+
+    size_t chunks = stats.dedup_chunks - last.dedup_chunks;
+    fprintf(stderr, "dedup: %zu chunks (%.0f bytes on average), %zu repeated (%.1f%% of the bytes), "
+        "%zu copied from older segments, %zu in an index of %zu, %.2f bytes sent per byte logged\n",
+        stats.dedup_chunks, 0 == chunks ? 0.0 : (double) (stats.dedup_bytes - last.dedup_bytes) / chunks,
+        stats.dedup_hits, 0 == stats.dedup_bytes ? 0.0 : stats.dedup_hit_bytes * 100.0 / stats.dedup_bytes,
+        stats.dedup_copies, dedup_entries, dedup_slots,
+        0 == stats.wal_bytes ? 0.0 : (double) stats.dedup_bytes / stats.wal_bytes);
+
+    size_t chunk_bytes = stats.upload_chunk_bytes - last.upload_chunk_bytes;
+    fprintf(stderr, "upload: %zu batches of %zu chunks in all, %.1f%% of their bytes sent, %zu answers, "
+        "%zu bytes received (%.1f MB/s of chunks); filter: %zu rejected, %zu false positives%s\n",
+        stats.upload_batches, stats.upload_chunks,
+        0 == stats.upload_chunk_bytes ? 0.0 : stats.upload_sent_bytes * 100.0 / stats.upload_chunk_bytes,
+        stats.upload_answers, stats.upload_bytes, chunk_bytes / elapsed / 1e6,
+        stats.filter_rejects, stats.filter_false, cuckoo_overflow ? ", bypassed" : "");
+
+    size_t rebuilt = stats.delta_block_bytes + stats.delta_literal_bytes;
+    fprintf(stderr, "delta: %zu files, %zu signatures sent (%.1f ms computing them), %zu bytes rebuilt, "
+        "%.1f%% from old versions, %zu bytes received (%.1f%% of those rebuilt)\n",
+        stats.delta_files, stats.delta_signatures, stats.delta_signature_ns / 1e6, rebuilt,
+        0 == rebuilt ? 0.0 : stats.delta_block_bytes * 100.0 / rebuilt,
+        stats.delta_bytes, 0 == rebuilt ? 0.0 : stats.delta_bytes * 100.0 / rebuilt);
+
+    fprintf(stderr, "frame: %zu checked with %s, %zu bytes (%.1f MB/s), %zu rejected, %zu files acknowledged with their digest, "
+        "%zu compressed (%zu bytes received for %zu, %.1f%%)\n",
+        stats.frames, crc32c_name, stats.frame_bytes, (stats.frame_bytes - last.frame_bytes) / elapsed / 1e6,
+        stats.frames_rejected, stats.frame_digests, stats.frames_lz, stats.frame_lz_bytes, stats.frame_lz_plain,
+        0 == stats.frame_lz_plain ? 0.0 : stats.frame_lz_bytes * 100.0 / stats.frame_lz_plain);
+
+    fprintf(stderr, "datagram: %zu received (%.0f/s, %.1f MB/s), %zu dropped, %zu truncated, %zu acked\n",
+        stats.datagrams, (stats.datagrams - last.datagrams) / elapsed,
+        (stats.datagram_bytes - last.datagram_bytes) / elapsed / 1e6,
+        stats.datagrams_dropped, stats.datagrams_truncated, stats.datagram_acks);
+    fprintf(stderr, "connection: %zu open, %zu accepted, %zu rejected, %zu listener pauses\n",
+        active_connections, stats.connections_accepted, stats.connections_rejected, stats.listener_pauses);
+    long pages = 0;
+    long resident = 0;
+    FILE *statm = fopen("/proc/self/statm", "r");
+    if ( NULL != statm )
+    {
+        if ( 2 != fscanf(statm, "%ld %ld", &pages, &resident) )
+            resident = 0;
+        fclose(statm);
+    }
+
+    size_t buffers = 0;
+    size_t buffer_bytes = 0;
+    for ( int i = 0; i < BUF_CLASSES; i++ )
+    {
+        buffers += pooled_buffers[i];
+        buffer_bytes += pooled_buffers[i] * BUFLEN(i);
+    }
+
+    size_t resident_bytes = resident * sysconf(_SC_PAGESIZE);
+    fprintf(stderr, "memory: %zu KB resident, %zu bytes per open connection, %zu context slabs of %zu bytes, %zu read buffers of %zu KB in all\n",
+        resident_bytes / 1024, 0 == active_connections ? 0 : resident_bytes / active_connections,
+        context_slabs, CONN_SLAB * sizeof(struct connection_ctx), buffers, buffer_bytes / 1024);
+
+    size_t batches = stats.loop_batches - last.loop_batches;
+    fprintf(stderr, "loop: %zu batches, %.1f events per batch, %.1f us per batch, %.1f us at most\n",
+        batches, 0 == batches ? 0.0 : (double) (stats.loop_events - last.loop_events) / batches,
+        0 == batches ? 0.0 : (stats.loop_busy_ns - last.loop_busy_ns) / 1e3 / batches,
+        stats.loop_busy_max_ns / 1e3);
+
+    fprintf(stderr, "closed:");
+    for ( int i = 0; i < CLOSE_REASONS; i++ )
+        fprintf(stderr, "%s %zu %s", 0 == i ? "" : ",", stats.connections_closed[i], close_reason_names[i]);
+    fprintf(stderr, "\n");
+
+    last = stats;
+    stats_since = now;
+    stats.loop_busy_max_ns = 0;
+}
+
+// The process or the system has run out of descriptors. The pending connection is
+// accepted with the spare descriptor and closed at once, so that the client gets an
+// answer and the level-triggered listener stops firing for it.
+static void shed_connection(int epollfd, int listenfd)
+{
+    if ( -1 != spare_fd )
+    {
+        close(spare_fd);
+
+        int connfd = accept(listenfd, NULL, NULL);
+        if ( -1 != connfd )
+        {
+            close(connfd);
+            stats.connections_rejected++;
+        }
+
+        spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    }
+
+    if ( -1 == spare_fd )
+    {
+        // another descriptor took the place of the spare one;
+        // stop accepting until a connection closes and gives one back
+        pause_listeners(epollfd);
+    }
+}
+
+// accepts the pending connections on either listener, up to ACCEPT_BATCH at a time so
+// that a flood of connects does not starve the established ones, and registers them to the epoll
+static void handle_accept(int epollfd, struct endpoint *ep, uint32_t events)
+{
+    int listenfd = ep->fd;
+
+    if ( !( events & EPOLLIN ) )
+        return;
+
+    for ( int i = 0; i < ACCEPT_BATCH && !listeners_paused; i++ )
+    {
+        struct sockaddr_storage client_addr;
+        socklen_t addr_size = sizeof(client_addr);
+
+        // non-blocking from the start, without another system call per connection
+        int connfd = accept4(listenfd, (struct sockaddr*) &client_addr, &addr_size, SOCK_NONBLOCK);
+        if ( -1 == connfd )
+        {
+            switch ( errno )
+            {
+                case EMFILE:
+                case ENFILE:
+                    shed_connection(epollfd, listenfd);
+                    return;
+
+                case EWOULDBLOCK:
+                    // the backlog is empty
+                    return;
+
+                case ECONNABORTED:
+                case EINTR:
+                case EPROTO:
+                    // the pending connection is gone; try the next one
+                    continue;
+
+                case ENOBUFS:
+                case ENOMEM:
+                    // the kernel is short of memory for now; leave the connections in the backlog
+                    pause_listeners_for_memory(epollfd);
+                    return;
+
+                case EBADF:
+                case EFAULT:
+                case EINVAL:
+                case ENOTSOCK:
+                case EOPNOTSUPP:
+                case EPERM:
+                default:
+                    fprintf(stderr, "socket accept error (%d)\n", errno);
+                    exit(1);
+            }
+        }
+
+        struct connection_ctx *conn = alloc_context();
+        if ( NULL == conn )
+        {
+            // turn the client away rather than take down every other connection
+            close(connfd);
+            stats.connections_rejected++;
+            pause_listeners_for_memory(epollfd);
+            return;
+        }
+
+        conn->ep.handle = handle_connection;
+        conn->ep.fd = connfd;
+        conn->stream = ++last_stream;
+        if ( AF_UNIX == client_addr.ss_family )
+            conn->flags |= CONN_UNIX;
+
+        // register the new connection to the rpoll
+
+        if ( -1 == reactor_add(epollfd, &conn->ep, EPOLLIN | EPOLLOUT | EPOLLET) )
+        {
+            close(connfd);
+            conn->next = free_contexts;
+            free_contexts = conn;
+            stats.connections_rejected++;
+            return;
+        }
+
+        stats.connections_accepted++;
+        active_connections++;
+
+        if ( 0 != max_connections && active_connections >= max_connections )
+            pause_listeners(epollfd);
+    }
+}
+
+// true if a descriptor handed over by a peer is an eventfd, which the server then makes
+// non-blocking, as a read or write of a doorbell must not hold the event loop up
+static int is_eventfd(int fd)
+{
+    char path[32];
+    char target[32];
+
+    snprintf(path, sizeof(path), "/proc/self/fd/%d", fd);
+    ssize_t len = readlink(path, target, sizeof(target) - 1);
+    if ( -1 == len )
+        return 0;
+    target[len] = '\0';
+
+    return 0 == strcmp(target, "anon_inode:[eventfd]") && 0 == reactor_nonblocking(fd);
+}
+
+// takes over the ring offered by a client (see shmring.h), or refuses the offer
+static void accept_shm_offer(int epollfd, struct connection_ctx *conn)
+{
+    char offer[SHM_OFFER_LEN];
+    int fds[3];
+    char control[CMSG_SPACE(sizeof(fds))];
+
+    struct iovec iov;
+    iov.iov_base = offer;
+    iov.iov_len = sizeof(offer);
+
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    ssize_t received = recvmsg(conn->ep.fd, &msg, MSG_CMSG_CLOEXEC);
+
+    int nfds = 0;
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    if ( 0 < received && NULL != cmsg && SOL_SOCKET == cmsg->cmsg_level && SCM_RIGHTS == cmsg->cmsg_type )
+    {
+        nfds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        memcpy(fds, CMSG_DATA(cmsg), nfds * sizeof(int));
+    }
+
+    struct shm_ring *ring = MAP_FAILED;
+    struct stat st;
+
+    // the memory has to be sealed at its size, or the peer could cut it from under the mapping;
+    // touching what is gone would kill the server with SIGBUS
+    int seals = ( 3 == nfds ) ? fcntl(fds[0], F_GET_SEALS) : -1;
+    if ( -1 != seals && (F_SEAL_SHRINK | F_SEAL_GROW) == ( seals & (F_SEAL_SHRINK | F_SEAL_GROW) )
+        && is_eventfd(fds[1]) && is_eventfd(fds[2])
+        && 0 == fstat(fds[0], &st) && (off_t) sizeof(struct shm_ring) < st.st_size )
+        ring = (struct shm_ring *) mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fds[0], 0);
+
+    uint32_t size = ( MAP_FAILED != ring ) ? ring->size : 0;
+
+    if ( MAP_FAILED == ring
+        || SHM_RING_MAGIC != ring->magic
+        || 0 == size || 0 != ( size & (size - 1) )
+        || (off_t) (sizeof(struct shm_ring) + size) != st.st_size )
+    {
+        if ( MAP_FAILED != ring )
+            munmap(ring, st.st_size);
+
+        for ( int i = 0; i < nfds; i++ )
+            close(fds[i]);
+
+        send(conn->ep.fd, SHM_REJECT, SHM_REPLY_LEN, MSG_NOSIGNAL);
+        return;
+    }
+
+    // the mapping keeps the memory alive
+    close(fds[0]);
+
+    // without memory for the channel, the connection goes on with the socket
+    struct shm_channel *chan = (struct shm_channel *) calloc(1, sizeof(struct shm_channel));
+    if ( NULL == chan )
+    {
+        munmap(ring, st.st_size);
+        close(fds[1]);
+        close(fds[2]);
+
+        send(conn->ep.fd, SHM_REJECT, SHM_REPLY_LEN, MSG_NOSIGNAL);
+        return;
+    }
+
+    chan->ep.handle = handle_doorbell;
+    chan->ep.fd = fds[1];
+    chan->space_fd = fds[2];
+    chan->ring = ring;
+    chan->map_len = st.st_size;
+    chan->size = size;
+    chan->spin = SHM_SPIN_MIN;
+    chan->conn = conn;
+
+    if ( -1 == reactor_add(epollfd, &chan->ep, EPOLLIN) )
+    {
+        close(chan->ep.fd);
+        close(chan->space_fd);
+        munmap(ring, chan->map_len);
+        free(chan);
+
+        send(conn->ep.fd, SHM_REJECT, SHM_REPLY_LEN, MSG_NOSIGNAL);
+        return;
+    }
+
+    conn->shm = chan;
+    conn->flags |= CONN_SHM;
+
+    send(conn->ep.fd, SHM_ACCEPT, SHM_REPLY_LEN, MSG_NOSIGNAL);
+}
+
+// true if the first bytes waiting on the connection are a shared-memory offer
+static int is_shm_offer(int connfd)
+{
+    char peek[SHM_OFFER_LEN];
+
+    ssize_t received = recv(connfd, peek, sizeof(peek), MSG_PEEK);
+
+    return ( SHM_OFFER_LEN == received && 0 == memcmp(peek, SHM_OFFER, SHM_OFFER_LEN) );
+}
+
+// the producer of a shared-memory ring has written something
+static void handle_doorbell(int epollfd, struct endpoint *ep, uint32_t events)
+{
+    struct shm_channel *chan = (struct shm_channel *) ep;
+    (void) events;
+
+    uint64_t count;
+    if ( -1 == read(chan->ep.fd, &count, sizeof(count)) )
+    {
+        switch ( errno )
+        {
+            case EAGAIN:
+            case EINTR:
+                // a spurious wake-up, the counter was read already
+                break;
+
+            case EBADF:
+            case EFAULT:
+            case EINVAL:
+            case EIO:
+            default:
+                // the descriptor came from the peer, which could have passed anything
+                close_connection(epollfd, chan->conn, CLOSE_SHM_ERROR, errno);
+                return;
+        }
+    }
+
+    ssize_t drained = shm_drain(chan, 1);
+
+    if ( -1 == drained )
+    {
+        fprintf(stderr, "sock:%d, shared-memory ring out of bounds\n", chan->conn->ep.fd);
+        close_connection(epollfd, chan->conn, CLOSE_SHM_ERROR, EPROTO);
+    }
+    else if ( 0 != drained && -1 != wal_fd )
+    {
+        // acknowledged once it is on disk
+        if ( -1 == wait_for_commit(chan->conn) )
+            close_connection(epollfd, chan->conn, CLOSE_SEND_ERROR, ENOMEM);
+    }
+    else if ( 0 != drained )
+    {
+        // with the count of bytes taken, as the producer cannot tell otherwise which of its
+        // writes an acknowledgement is for
+        char ack[32];
+        int len = snprintf(ack, sizeof(ack), "Ack %" PRIu64 "\n", chan->received) + 1;
+
+        if ( -1 == send(chan->conn->ep.fd, ack, len, MSG_NOSIGNAL) )
+        {
+            switch ( errno )
+            {
+                case EAGAIN:
+                    // the producer will be acknowledged after the next drain
+                    break;
+
+                case ECONNRESET:
+                    // the producer went away; close_connection() drains what is left
+                    close_connection(epollfd, chan->conn, CLOSE_RESET, 0);
+                    break;
+
+                case EBADF:
+                case EFAULT:
+                case EINVAL:
+                case ENOTSOCK:
+                    fprintf(stderr, "socket send error (%d)\n", errno);
+                    exit(1);
+
+                case EPIPE:
+                default:
+                    close_connection(epollfd, chan->conn, CLOSE_SEND_ERROR, errno);
+                    break;
+            }
+        }
+    }
+}
+
+// Sends back what a connection in echo mode sends. With splice(), the bytes move from the
+// socket to a pipe and from the pipe to the socket without being copied to user space.
+// A peer that does not read what comes back is not read from either.
+static void handle_echo(int epollfd, struct connection_ctx *conn)
+{
+    int fd = conn->ep.fd;
+
+    while ( 1 )
+    {
+        struct echo_pipe *pipe = conn->pipe;
+        if ( NULL == pipe && NULL == ( pipe = conn->pipe = get_echo_pipe() ) )
+        {
+            close_connection(epollfd, conn, CLOSE_RECV_ERROR, ENOMEM);
+            return;
+        }
+
+        ssize_t n;
+
+        if ( 0 < pipe->queued )
+        {
+            // send back what is queued
+            if ( -1 != pipe->fds[0] )
+                n = splice(pipe->fds[0], NULL, fd, NULL, pipe->queued, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            else
+                n = send(fd, pipe->data + pipe->offset, pipe->queued, MSG_NOSIGNAL);
+            stats.echo_calls++;
+
+            if ( -1 == n )
+            {
+                switch ( errno )
+                {
+                    case EINTR:
+                        continue;
+
+                    case EAGAIN:
+                        // the pipe stays with the connection until EPOLLOUT
+                        return;
+
+                    case ECONNRESET:
+                    case EPIPE:
+                        close_connection(epollfd, conn, CLOSE_RESET, 0);
+                        return;
+
+                    default:
+                        close_connection(epollfd, conn, CLOSE_SEND_ERROR, errno);
+                        return;
+                }
+            }
+
+            pipe->queued -= n;
+            pipe->offset += n;
+            stats.echo_bytes += n;
+            continue;
+        }
+
+        // the pipe is empty; read some more
+        pipe->offset = 0;
+        if ( -1 != pipe->fds[1] )
+            n = splice(fd, NULL, pipe->fds[1], NULL, ECHO_PIPE_SIZE, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        else
+            n = recv(fd, pipe->data, BUFLEN(ECHO_CLASS), 0);
+        stats.echo_calls++;
+
+        if ( 0 < n )
+        {
+            pipe->queued = n;
+            stats.stream_bytes += n;
+            continue;
+        }
+
+        // nothing more to send back; the pipe goes back to the pool until the next edge
+        put_echo_pipe(pipe);
+        conn->pipe = NULL;
+
+        if ( 0 == n )
+        {
+            // the peer has performed an orderly shutdown, and has all its bytes back
+            close_connection(epollfd, conn, CLOSE_ORDERLY, 0);
+            return;
+        }
+
+        switch ( errno )
+        {
+            case EINTR:
+                continue;
+
+            case EAGAIN:
+                return;
+
+            case EINVAL:
+                if ( ECHO_SPLICE == echo_mode )
+                {
+                    // this kind of socket cannot be spliced; copy from now on
+                    fprintf(stderr, "splice not supported (%d), copying instead\n", errno);
+                    echo_mode = ECHO_COPY;
+                    continue;
+                }
+                close_connection(epollfd, conn, CLOSE_RECV_ERROR, errno);
+                return;
+
+            case ECONNRESET:
+                close_connection(epollfd, conn, CLOSE_RESET, 0);
+                return;
+
+            default:
+                close_connection(epollfd, conn, CLOSE_RECV_ERROR, errno);
+                return;
+        }
+    }
+}
+
+static int is_fetch(int connfd)
+{
+    char peek[FETCH_VERB_LEN];
+
+    ssize_t received = recv(connfd, peek, sizeof(peek), MSG_PEEK);
+
+    return ( FETCH_VERB_LEN == received && 0 == memcmp(peek, FETCH_VERB, FETCH_VERB_LEN) );
+}
+
+// Sends the next bytes of the answer to a fetch command: without a cache, all of them with
+// sendfile(); with one, what is left of the block at the offset, from the cache if it holds
+// the block, and otherwise with sendfile(), after which the block is taken in. A stream stored
+// with -z has its blocks decompressed, into the cache if there is one, and otherwise into
+// store_plain, where the next send finds the block again.
+static ssize_t send_range(int sockfd, struct fetch *f)
+{
+    ssize_t sent;
+    int blocks = ( -1 != f->file.index_fd );
+
+    if ( 0 == cache_capacity && !blocks )
+    {
+        stats.sendfile_calls++;
+        return sendfile(sockfd, f->file.fd, &f->offset, f->remaining);
+    }
+
+    uint64_t block = f->offset / CACHE_BLOCK;
+    size_t start = f->offset % CACHE_BLOCK;
+    size_t len = ( f->remaining < CACHE_BLOCK - start ) ? f->remaining : CACHE_BLOCK - start;
+
+    struct cache_block *b = ( 0 == cache_capacity ) ? NULL : cache_find(f->file.stream, block);
+    if ( NULL != b && CACHE_GHOST == b->state )
+        b = NULL;
+
+    if ( block != f->last_block )
+    {
+        // counted once per answer, however many sends the block takes
+        f->missed = ( NULL == b );
+        if ( NULL != b && b->freq < CACHE_FREQ_MAX )
+            b->freq++;
+
+        // decompressed anyway, so taken in before it is sent; a block read once stays at a
+        // freq of 0, and leaves from the small FIFO
+        if ( NULL == b && blocks && 0 != cache_capacity )
+            b = cache_admit(&f->file, block);
+    }
+
+    if ( NULL != b && start < b->len )
+    {
+        sent = send(sockfd, b->data + start, ( len < b->len - start ) ? len : b->len - start, MSG_NOSIGNAL);
+        if ( 0 < sent )
+        {
+            f->offset += sent;
+            if ( f->missed )
+                stats.cache_miss_bytes += sent;
+            else
+                stats.cache_hit_bytes += sent;
+        }
+    }
+    else if ( blocks )
+    {
+        size_t held;
+        const char *data = scratch_block(&f->file, block, &held);
+        if ( NULL == data )
+        {
+            errno = EIO;
+            return -1;
+        }
+
+        sent = 0;
+        if ( start < held )
+            sent = send(sockfd, data + start, ( len < held - start ) ? len : held - start, MSG_NOSIGNAL);
+        if ( 0 < sent )
+            f->offset += sent;
+    }
+    else
+    {
+        sent = sendfile(sockfd, f->file.fd, &f->offset, len);
+        stats.sendfile_calls++;
+
+        if ( 0 < sent && NULL == b && block != f->last_block )
+            cache_admit(&f->file, block);
+    }
+
+    f->last_block = block;
+    return sent;
+}
+
+// Sends what is left of the answer to a fetch command, the bytes straight from the page cache
+// with sendfile(). Returns 0 once all of it is sent, and -1 if the socket is full, in which
+// case EPOLLOUT brings the connection back, or if the connection was closed.
+static int send_fetch(int epollfd, struct connection_ctx *conn)
+{
+    struct fetch *f = conn->fetch;
+
+    while ( f->header_sent < f->header_len || 0 != f->remaining )
+    {
+        ssize_t sent;
+
+        if ( f->header_sent < f->header_len )
+        {
+            sent = send(conn->ep.fd, f->header + f->header_sent, f->header_len - f->header_sent,
+                MSG_NOSIGNAL | ( 0 != f->remaining ? MSG_MORE : 0 ));
+            if ( 0 < sent )
+                f->header_sent += sent;
+        }
+        else
+        {
+            sent = send_range(conn->ep.fd, f);
+            if ( 0 < sent )
+            {
+                f->remaining -= sent;
+                stats.fetch_bytes += sent;
+            }
+            else if ( 0 == sent )
+            {
+                // the file is shorter than when the command was taken
+                close_connection(epollfd, conn, CLOSE_SEND_ERROR, EIO);
+                return -1;
+            }
+        }
+
+        if ( -1 == sent )
+        {
+            switch ( errno )
+            {
+                case EAGAIN:
+                    return -1;
+
+                case EINTR:
+                    continue;
+
+                case ECONNRESET:
+                    close_connection(epollfd, conn, CLOSE_RESET, 0);
+                    return -1;
+
+                case EBADF:
+                case EFAULT:
+                case EINVAL:
+                case EIO:
+                case ENOMEM:
+                case EOVERFLOW:
+                case EPIPE:
+                case ESPIPE:
+                default:
+                    close_connection(epollfd, conn, CLOSE_SEND_ERROR, errno);
+                    return -1;
+            }
+        }
+    }
+
+    end_fetch(conn);
+    return 0;
+}
+
+// takes the next fetch command off the socket and prepares its answer
+// returns -1 if there is none yet, or if the connection was closed
+static int start_fetch(int epollfd, struct connection_ctx *conn)
+{
+    char line[FETCH_LINE_MAX];
+
+    ssize_t n = recv(conn->ep.fd, line, sizeof(line) - 1, MSG_PEEK);
+    if ( -1 == n )
+    {
+        if ( EAGAIN == errno || EINTR == errno )
+            return -1;
+
+        close_connection(epollfd, conn, CLOSE_RECV_ERROR, errno);
+        return -1;
+    }
+
+    if ( 0 == n )
+    {
+        close_connection(epollfd, conn, CLOSE_ORDERLY, 0);
+        return -1;
+    }
+
+    char *eol = (char *) memchr(line, '\n', n);
+    if ( NULL == eol && (size_t) n < sizeof(line) - 1 )
+    {
+        // the rest of the line comes with the next edge
+        return -1;
+    }
+
+    uint32_t stream;
+    uint64_t offset;
+    uint64_t max;
+    int len = 0;
+
+    if ( NULL != eol )
+        *eol = '\0';
+
+    if ( NULL == eol || FETCH_VERB_LEN > n || 0 != memcmp(line, FETCH_VERB, FETCH_VERB_LEN)
+        || 3 != sscanf(line + FETCH_VERB_LEN, "%" SCNu32 " %" SCNu64 " %" SCNu64 "%n", &stream, &offset, &max, &len)
+        || '\0' != line[FETCH_VERB_LEN + len] )
+    {
+        fprintf(stderr, "sock:%d, not a fetch command\n", conn->ep.fd);
+        close_connection(epollfd, conn, CLOSE_RECV_ERROR, EPROTO);
+        return -1;
+    }
+
+    // take the line off the socket
+    recv(conn->ep.fd, line, eol - line + 1, 0);
+
+    struct fetch *f = (struct fetch *) calloc(1, sizeof(struct fetch));
+    if ( NULL == f )
+    {
+        close_connection(epollfd, conn, CLOSE_SEND_ERROR, ENOMEM);
+        return -1;
+    }
+
+    if ( 0 == open_stored(stream, &f->file) && offset < f->file.size )
+    {
+        f->offset = offset;
+        f->remaining = ( max < f->file.size - offset ) ? max : f->file.size - offset;
+    }
+
+    f->last_block = UINT64_MAX;
+    f->header_len = snprintf(f->header, sizeof(f->header), FETCH_REPLY "%zu\n", f->remaining);
+    conn->fetch = f;
+    stats.fetches++;
+
+    return 0;
+}
+
+// a connection that started with the fetch verb: answers its commands one after the other
+static void handle_fetch(int epollfd, struct connection_ctx *conn)
+{
+    while ( -1 != conn->ep.fd )
+    {
+        if ( NULL == conn->fetch && -1 == start_fetch(epollfd, conn) )
+            return;
+
+        if ( -1 == send_fetch(epollfd, conn) )
+            return;
+    }
+}
+
+static int is_upload(int connfd)
+{
+    char peek[UPLOAD_VERB_LEN];
+
+    ssize_t received = recv(connfd, peek, sizeof(peek), MSG_PEEK);
+
+    return ( UPLOAD_VERB_LEN == received && 0 == memcmp(peek, UPLOAD_VERB, UPLOAD_VERB_LEN) );
+}
+
+// takes the line that starts the next batch of an upload off the socket
+// returns -1 if it is not complete yet, or if the connection was closed
+static int start_batch(int epollfd, struct connection_ctx *conn)
+{
+    char line[UPLOAD_LINE_MAX];
+
+    ssize_t n = recv(conn->ep.fd, line, sizeof(line) - 1, MSG_PEEK);
+    if ( -1 == n )
+    {
+        if ( EAGAIN == errno || EINTR == errno )
+            return -1;
+
+        if ( ECONNRESET == errno )
+            close_connection(epollfd, conn, CLOSE_RESET, 0);
+        else
+            close_connection(epollfd, conn, CLOSE_RECV_ERROR, errno);
+        return -1;
+    }
+
+    if ( 0 == n )
+    {
+        close_connection(epollfd, conn, CLOSE_ORDERLY, 0);
+        return -1;
+    }
+
+    char *eol = (char *) memchr(line, '\n', n);
+    if ( NULL == eol && (size_t) n < sizeof(line) - 1 )
+        return -1;
+
+    unsigned count;
+    int len = 0;
+
+    if ( NULL != eol )
+        *eol = '\0';
+
+    if ( NULL == eol || UPLOAD_VERB_LEN > n || 0 != memcmp(line, UPLOAD_VERB, UPLOAD_VERB_LEN)
+        || 1 != sscanf(line + UPLOAD_VERB_LEN, "%u%n", &count, &len) || '\0' != line[UPLOAD_VERB_LEN + len]
+        || 0 == count || UPLOAD_CHUNKS < count )
+    {
+        fprintf(stderr, "sock:%d, not an upload batch\n", conn->ep.fd);
+        close_connection(epollfd, conn, CLOSE_RECV_ERROR, EPROTO);
+        return -1;
+    }
+
+    // take the line off the socket
+    recv(conn->ep.fd, line, eol - line + 1, 0);
+    stats.upload_bytes += eol - line + 1;
+
+    struct upload *u = conn->upload;
+    u->state = UPLOAD_LIST;
+    u->nchunks = count;
+    u->data_len = 0;
+    u->want = count * sizeof(struct upload_chunk);
+    u->got = 0;
+    return 0;
+}
+
+// receives the rest of the part of a batch on its way into dst
+// returns -1 if more is to come, or if the connection was closed
+static int receive_part(int epollfd, struct connection_ctx *conn, char *dst)
+{
+    struct upload *u = conn->upload;
+
+    while ( u->got < u->want )
+    {
+        ssize_t n = recv(conn->ep.fd, dst + u->got, u->want - u->got, 0);
+        stats.recv_calls++;
+
+        if ( 0 < n )
+        {
+            u->got += n;
+            stats.upload_bytes += n;
+            continue;
+        }
+
+        if ( 0 == n )
+        {
+            close_connection(epollfd, conn, CLOSE_ORDERLY, 0);
+            return -1;
+        }
+
+        switch ( errno )
+        {
+            case EINTR:
+                continue;
+
+            case EAGAIN:
+                return -1;
+
+            case ECONNRESET:
+                close_connection(epollfd, conn, CLOSE_RESET, 0);
+                return -1;
+
+            default:
+                close_connection(epollfd, conn, CLOSE_RECV_ERROR, errno);
+                return -1;
+        }
+    }
+
+    return 0;
+}
+
+// Asks for the chunks of a batch that the log does not hold and that have not been received,
+// or logs the batch if there are none. Room is made for all of it first, so that the segment is
+// not rolled halfway, which would leave references behind in the previous one, or retire the
+// segments that chunks are copied from; the chunks a roll now takes away are asked for.
+// The peer waits for the answer, so the answer fits the send buffer, or the peer misbehaves.
+// returns -1 if the connection was closed
+static int settle_batch(int epollfd, struct connection_ctx *conn, int listed)
+{
+    struct upload *u = conn->upload;
+
+    size_t bound = 0;
+    for ( uint32_t i = 0; i < u->nchunks; i++ )
+        bound += sizeof(struct wal_record) + u->chunks[i].len;
+    wal_room(bound);
+
+    // where the chunks asked for will go, one after the other
+    uint32_t end = u->data_len;
+    u->nmissing = 0;
+
+    for ( uint32_t i = 0; i < u->nchunks; i++ )
+    {
+        struct upload_chunk *c = &u->chunks[i];
+        if ( UPLOAD_NONE != u->held[i] || NULL != dedup_lookup(c->fingerprint, c->len) )
+            continue;
+
+        // a chunk that comes twice in the batch is asked for once
+        uint32_t j = 0;
+        while ( j < i && !( UPLOAD_NONE != u->held[j] && u->chunks[j].len == c->len
+            && u->chunks[j].fingerprint[0] == c->fingerprint[0] && u->chunks[j].fingerprint[1] == c->fingerprint[1] ) )
+            j++;
+
+        if ( j < i )
+            u->held[i] = u->held[j];
+        else
+        {
+            u->held[i] = end;
+            end += c->len;
+            u->missing[u->nmissing++] = i;
+        }
+    }
+
+    if ( 0 != u->nmissing )
+    {
+        char *data = (char *) realloc(u->data, end);
+        if ( NULL == data )
+        {
+            close_connection(epollfd, conn, CLOSE_RECV_ERROR, ENOMEM);
+            return -1;
+        }
+        u->data = data;
+    }
+
+    // a list is always answered, so that a client can tell a server that does not take
+    // uploads; the rounds after it only when something is still missing
+    if ( 0 != u->nmissing || listed )
+    {
+        char line[UPLOAD_LINE_MAX];
+        int len = snprintf(line, sizeof(line), UPLOAD_REPLY "%" PRIu32 "\n", u->nmissing);
+
+        struct iovec iov[2] = { { line, len }, { u->missing, u->nmissing * sizeof(uint32_t) } };
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = 2;
+
+        ssize_t sent = sendmsg(conn->ep.fd, &msg, MSG_NOSIGNAL);
+        if ( (ssize_t) ( iov[0].iov_len + iov[1].iov_len ) != sent )
+        {
+            close_connection(epollfd, conn, CLOSE_SEND_ERROR, -1 == sent ? errno : EAGAIN);
+            return -1;
+        }
+        stats.upload_answers++;
+    }
+
+    if ( 0 != u->nmissing )
+    {
+        stats.upload_sent_bytes += end - u->data_len;
+        u->state = UPLOAD_DATA;
+        u->want = end - u->data_len;
+        u->got = 0;
+        return 0;
+    }
+
+    for ( uint32_t i = 0; i < u->nchunks; i++ )
+    {
+        struct upload_chunk *c = &u->chunks[i];
+        struct dedup_entry *e = NULL;
+
+        if ( UPLOAD_NONE != u->held[i] )
+            dedup_chunk(conn->stream, u->data + u->held[i], c->len);
+        else if ( NULL == ( e = dedup_lookup(c->fingerprint, c->len) ) )
+        {
+            // gone since the batch was listed, with part of it logged already;
+            // the batch fails, and the client, without its acknowledgement, with it
+            close_connection(epollfd, conn, CLOSE_RECV_ERROR, ENOENT);
+            return -1;
+        }
+        else if ( e->record < segments[nsegments - 1]->base )
+        {
+            // held by an older segment only, and copied from there
+            struct segment *seg = segment_of(e->record);
+            dedup_chunk(conn->stream, seg->map + e->position + sizeof(struct wal_record), c->len);
+        }
+        else
+        {
+            stats.dedup_chunks++;
+            stats.dedup_bytes += c->len;
+            dedup_ref(conn->stream, e);
+        }
+        stats.upload_chunk_bytes += c->len;
+    }
+
+    stats.upload_batches++;
+    stats.upload_chunks += u->nchunks;
+    free(u->data);
+    u->data = NULL;
+    u->state = UPLOAD_LINE;
+
+    // acknowledged once it is on disk, after which the peer sends the next batch
+    if ( -1 == wait_for_commit(conn) )
+    {
+        close_connection(epollfd, conn, CLOSE_SEND_ERROR, ENOMEM);
+        return -1;
+    }
+
+    return 0;
+}
+
+// a connection that started with the upload verb: takes its batches one after the other
+static void handle_upload(int epollfd, struct connection_ctx *conn)
+{
+    while ( -1 != conn->ep.fd )
+    {
+        struct upload *u = conn->upload;
+
+        switch ( u->state )
+        {
+            case UPLOAD_LINE:
+                if ( -1 == start_batch(epollfd, conn) )
+                    return;
+                break;
+
+            case UPLOAD_LIST:
+            {
+                if ( -1 == receive_part(epollfd, conn, (char *) u->chunks) )
+                    return;
+
+                size_t bytes = 0;
+                for ( uint32_t i = 0; i < u->nchunks; i++ )
+                {
+                    if ( 0 == u->chunks[i].len || CDC_MAX < u->chunks[i].len )
+                        bytes = UPLOAD_BYTES + 1;
+                    else
+                        bytes += u->chunks[i].len;
+                    u->held[i] = UPLOAD_NONE;
+                }
+
+                if ( UPLOAD_BYTES < bytes )
+                {
+                    fprintf(stderr, "sock:%d, upload batch out of bounds\n", conn->ep.fd);
+                    close_connection(epollfd, conn, CLOSE_RECV_ERROR, EPROTO);
+                    return;
+                }
+
+                if ( -1 == settle_batch(epollfd, conn, 1) )
+                    return;
+                break;
+            }
+
+            case UPLOAD_DATA:
+                if ( -1 == receive_part(epollfd, conn, u->data + u->data_len) )
+                    return;
+
+                u->data_len += u->want;
+                if ( -1 == settle_batch(epollfd, conn, 0) )
+                    return;
+                break;
+        }
+    }
+}
+
+static int is_delta(int connfd)
+{
+    char peek[DELTA_VERB_LEN];
+
+    ssize_t received = recv(connfd, peek, sizeof(peek), MSG_PEEK);
+
+    return ( DELTA_VERB_LEN == received && 0 == memcmp(peek, DELTA_VERB, DELTA_VERB_LEN) );
+}
+
+// Prepares the signatures of the whole blocks of the old version, to be computed by
+// sign_blocks(). A stream that is not stored, or that is shorter than a block, has none, and
+// the client then sends all of it as literals.
+// returns -1 if there is no memory for them
+static int start_signing(struct delta *d, uint32_t stream)
+{
+    if ( -1 == open_stored(stream, &d->base) || d->base.size < d->block_len )
+        return 0;
+
+    uint64_t blocks = d->base.size / d->block_len;
+    if ( UINT32_MAX - 1 < blocks )
+        blocks = UINT32_MAX - 1;
+
+    // a plain file is mapped, and one stored with -z read a block at a time
+    if ( -1 == d->base.index_fd )
+    {
+        void *map = mmap(NULL, blocks * d->block_len, PROT_READ, MAP_PRIVATE, d->base.fd, 0);
+        if ( MAP_FAILED == map )
+        {
+            fprintf(stderr, "cannot map stream file %" PRIu32 " (%d)\n", stream, errno);
+            return 0;
+        }
+        d->signing = (unsigned char *) map;
+    }
+    else if ( NULL == ( d->signing = (unsigned char *) malloc(d->block_len) ) )
+        return -1;
+
+    d->blocks = (uint32_t) blocks;
+    d->signatures = (struct delta_signature *) calloc(blocks, sizeof(struct delta_signature));
+    if ( NULL == d->signatures )
+    {
+        end_signing(d);
+        d->blocks = 0;
+        return -1;
+    }
+
+    return 0;
+}
+
+// Computes the signatures of the next DELTA_SIGN_SLICE bytes of the old version, or of its next
+// block. A block that cannot be read is left unsigned, as are the ones after it: zeros, which
+// no block of the new version is expected to match.
+static void sign_blocks(struct delta *d)
+{
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    uint32_t from = d->signed_blocks;
+    uint32_t slice = ( d->block_len < DELTA_SIGN_SLICE ) ? DELTA_SIGN_SLICE / d->block_len : 1;
+    uint32_t to = ( d->blocks - from < slice ) ? d->blocks : from + slice;
+
+    for ( uint32_t i = from; i < to; i++ )
+    {
+        const unsigned char *block = d->signing;
+        uint32_t a, b;
+
+        if ( -1 == d->base.index_fd )
+            block = d->signing + (size_t) i * d->block_len;
+        else if ( (ssize_t) d->block_len != read_stored(&d->base, (char *) d->signing, d->block_len, (uint64_t) i * d->block_len) )
+        {
+            fprintf(stderr, "cannot read stream file %" PRIu32 " (%d)\n", d->base.stream, errno);
+            to = d->blocks;
+            break;
+        }
+
+        delta_sums(block, d->block_len, &a, &b);
+        d->signatures[i].weak = delta_weak(a, b);
+        cdc_fingerprint(block, d->block_len, d->signatures[i].strong);
+        stats.delta_signatures++;
+    }
+
+    d->signed_blocks = to;
+    if ( to == d->blocks )
+        end_signing(d);
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    stats.delta_signature_ns += (end.tv_sec - start.tv_sec) * 1000000000ull + end.tv_nsec - start.tv_nsec;
+}
+
+// takes the delta command off the socket and prepares to sign the old version
+// returns -1 if it is not complete yet, or if the connection was closed
+static int start_delta(int epollfd, struct connection_ctx *conn)
+{
+    char line[DELTA_LINE_MAX];
+
+    ssize_t n = recv(conn->ep.fd, line, sizeof(line) - 1, MSG_PEEK);
+    if ( -1 == n )
+    {
+        if ( EAGAIN == errno || EINTR == errno )
+            return -1;
+
+        close_connection(epollfd, conn, CLOSE_RECV_ERROR, errno);
+        return -1;
+    }
+
+    if ( 0 == n )
+    {
+        close_connection(epollfd, conn, CLOSE_ORDERLY, 0);
+        return -1;
+    }
+
+    char *eol = (char *) memchr(line, '\n', n);
+    if ( NULL == eol && (size_t) n < sizeof(line) - 1 )
+        return -1;
+
+    uint32_t stream;
+    uint32_t block_len;
+    int len = 0;
+
+    if ( NULL != eol )
+        *eol = '\0';
+
+    if ( NULL == eol || DELTA_VERB_LEN > n || 0 != memcmp(line, DELTA_VERB, DELTA_VERB_LEN)
+        || 2 != sscanf(line + DELTA_VERB_LEN, "%" SCNu32 " %" SCNu32 "%n", &stream, &block_len, &len)
+        || '\0' != line[DELTA_VERB_LEN + len] || DELTA_BLOCK_MIN > block_len || DELTA_BLOCK_MAX < block_len )
+    {
+        fprintf(stderr, "sock:%d, not a delta command\n", conn->ep.fd);
+        close_connection(epollfd, conn, CLOSE_RECV_ERROR, EPROTO);
+        return -1;
+    }
+
+    // take the line off the socket
+    recv(conn->ep.fd, line, eol - line + 1, 0);
+    stats.delta_bytes += eol - line + 1;
+
+    struct delta *d = conn->delta;
+    d->block_len = block_len;
+    if ( -1 == start_signing(d, stream) )
+    {
+        close_connection(epollfd, conn, CLOSE_SEND_ERROR, ENOMEM);
+        return -1;
+    }
+
+    d->header_len = snprintf(d->header, sizeof(d->header), DELTA_REPLY "%" PRIu32 " %" PRIu32 "\n", conn->stream, d->blocks);
+    d->state = DELTA_ANSWER;
+    return 0;
+}
+
+// Sends what is left of the signatures, signing a slice of the old version at a time. Returns
+// 0 once all of them are sent, and -1 if the socket is full, in which case EPOLLOUT brings the
+// connection back, if a slice was signed already, in which case its events are re-armed for
+// EPOLLOUT to bring it back after the others, or if the connection was closed.
+static int send_signatures(int epollfd, struct connection_ctx *conn)
+{
+    struct delta *d = conn->delta;
+    size_t total = d->header_len + (size_t) d->blocks * sizeof(struct delta_signature);
+    int sliced = 0;
+
+    while ( d->answer_sent < total )
+    {
+        struct iovec iov[2];
+        int iovcnt = 0;
+
+        if ( d->answer_sent == d->header_len + (size_t) d->signed_blocks * sizeof(struct delta_signature) )
+        {
+            if ( sliced++ )
+            {
+                // the socket has room, so this is reported again at once
+                reactor_modify(epollfd, &conn->ep, EPOLLIN | EPOLLOUT | EPOLLET);
+                return -1;
+            }
+            sign_blocks(d);
+        }
+
+        if ( d->answer_sent < d->header_len )
+        {
+            iov[iovcnt].iov_base = d->header + d->answer_sent;
+            iov[iovcnt++].iov_len = d->header_len - d->answer_sent;
+        }
+        size_t from = ( d->answer_sent < d->header_len ) ? 0 : d->answer_sent - d->header_len;
+        if ( 0 != d->signed_blocks )
+        {
+            iov[iovcnt].iov_base = (char *) d->signatures + from;
+            iov[iovcnt++].iov_len = (size_t) d->signed_blocks * sizeof(struct delta_signature) - from;
+        }
+
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = iovcnt;
+
+        ssize_t sent = sendmsg(conn->ep.fd, &msg, MSG_NOSIGNAL);
+        if ( 0 < sent )
+        {
+            d->answer_sent += sent;
+            continue;
+        }
+
+        switch ( errno )
+        {
+            case EINTR:
+                continue;
+
+            case EAGAIN:
+                return -1;
+
+            case ECONNRESET:
+                close_connection(epollfd, conn, CLOSE_RESET, 0);
+                return -1;
+
+            default:
+                close_connection(epollfd, conn, CLOSE_SEND_ERROR, errno);
+                return -1;
+        }
+    }
+
+    free(d->signatures);
+    d->signatures = NULL;
+    d->state = DELTA_OP;
+    return 0;
+}
+
+// receives up to len bytes of the delta into dst
+// returns how many arrived, or -1 if none is there yet, or if the connection was closed
+static ssize_t receive_delta(int epollfd, struct connection_ctx *conn, char *dst, size_t len)
+{
+    while ( 1 )
+    {
+        ssize_t n = recv(conn->ep.fd, dst, len, 0);
+        stats.recv_calls++;
+
+        if ( 0 < n )
+        {
+            stats.delta_bytes += n;
+            return n;
+        }
+
+        if ( 0 == n )
+        {
+            close_connection(epollfd, conn, CLOSE_ORDERLY, 0);
+            return -1;
+        }
+
+        switch ( errno )
+        {
+            case EINTR:
+                continue;
+
+            case EAGAIN:
+                return -1;
+
+            case ECONNRESET:
+                close_connection(epollfd, conn, CLOSE_RESET, 0);
+                return -1;
+
+            default:
+                close_connection(epollfd, conn, CLOSE_RECV_ERROR, errno);
+                return -1;
+        }
+    }
+}
+
+// appends a run of blocks of the old version to the new one, read back through buffer
+// returns -1 if the connection was closed
+static int copy_run(int epollfd, struct connection_ctx *conn, char *buffer)
+{
+    struct delta *d = conn->delta;
+    uint64_t offset = (uint64_t) d->op.block * d->block_len;
+    uint64_t left = (uint64_t) d->op.count * d->block_len;
+
+    while ( 0 != left )
+    {
+        ssize_t n = read_stored(&d->base, buffer, left < BUFLEN(DELTA_CLASS) ? left : BUFLEN(DELTA_CLASS), offset);
+        if ( -1 == n && EINTR == errno )
+            continue;
+
+        if ( 0 >= n )
+        {
+            // signed a moment ago, so the file is not what it was
+            close_connection(epollfd, conn, CLOSE_RECV_ERROR, -1 == n ? errno : EIO);
+            return -1;
+        }
+
+        wal_append(conn, buffer, n);
+        stats.delta_block_bytes += n;
+        offset += n;
+        left -= n;
+    }
+
+    return 0;
+}
+
+// takes the op just received, and returns -1 if the connection was closed
+static int apply_op(int epollfd, struct connection_ctx *conn, char *buffer)
+{
+    struct delta *d = conn->delta;
+
+    if ( 0 == d->op.count )
+    {
+        // the file is complete, and acknowledged once it is on disk
+        stats.delta_files++;
+        close_stored(&d->base);
+        d->state = DELTA_DONE;
+
+        if ( -1 == wait_for_commit(conn) )
+        {
+            close_connection(epollfd, conn, CLOSE_SEND_ERROR, ENOMEM);
+            return -1;
+        }
+        return 0;
+    }
+
+    if ( DELTA_LITERAL == d->op.block )
+    {
+        d->literal_left = d->op.count;
+        d->state = DELTA_BYTES;
+        return 0;
+    }
+
+    if ( d->blocks < d->op.block || d->blocks - d->op.block < d->op.count
+        || DELTA_RUN_MAX < (uint64_t) d->op.count * d->block_len )
+    {
+        fprintf(stderr, "sock:%d, delta op out of bounds\n", conn->ep.fd);
+        close_connection(epollfd, conn, CLOSE_RECV_ERROR, EPROTO);
+        return -1;
+    }
+
+    return copy_run(epollfd, conn, buffer);
+}
+
+// A connection that started with the delta verb: answers the command with the signatures, and
+// then rebuilds the file from the ops that follow, appended to the log as they come. What was
+// appended is cut into chunks before the next connection appends, as with any other reads.
+static void handle_delta(int epollfd, struct connection_ctx *conn)
+{
+    char *buffer = NULL;
+    int more = 1;
+
+    while ( more && -1 != conn->ep.fd )
+    {
+        struct delta *d = conn->delta;
+
+        if ( NULL == buffer && ( DELTA_OP == d->state || DELTA_BYTES == d->state ) )
+        {
+            buffer = get_buffer(DELTA_CLASS);
+            if ( NULL == buffer )
+            {
+                close_connection(epollfd, conn, CLOSE_RECV_ERROR, ENOMEM);
+                break;
+            }
+        }
+
+        switch ( d->state )
+        {
+            case DELTA_LINE:
+                more = ( -1 != start_delta(epollfd, conn) );
+                break;
+
+            case DELTA_ANSWER:
+                more = ( -1 != send_signatures(epollfd, conn) );
+                break;
+
+            case DELTA_OP:
+            {
+                ssize_t n = receive_delta(epollfd, conn, (char *) &d->op + d->op_got, sizeof(d->op) - d->op_got);
+                if ( -1 == n )
+                {
+                    more = 0;
+                    break;
+                }
+
+                d->op_got += n;
+                if ( sizeof(d->op) == d->op_got )
+                {
+                    d->op_got = 0;
+                    more = ( -1 != apply_op(epollfd, conn, buffer) );
+                }
+                break;
+            }
+
+            case DELTA_BYTES:
+            {
+                size_t want = ( d->literal_left < BUFLEN(DELTA_CLASS) ) ? d->literal_left : BUFLEN(DELTA_CLASS);
+                ssize_t n = receive_delta(epollfd, conn, buffer, want);
+                if ( -1 == n )
+                {
+                    more = 0;
+                    break;
+                }
+
+                wal_append(conn, buffer, n);
+                stats.delta_literal_bytes += n;
+                d->literal_left -= n;
+                if ( 0 == d->literal_left )
+                    d->state = DELTA_OP;
+                break;
+            }
+
+            case DELTA_DONE:
+            {
+                // nothing is expected but the end of the connection
+                char extra;
+                if ( -1 == receive_delta(epollfd, conn, &extra, 1) )
+                {
+                    more = 0;
+                    break;
+                }
+
+                fprintf(stderr, "sock:%d, data after the end of a delta\n", conn->ep.fd);
+                close_connection(epollfd, conn, CLOSE_RECV_ERROR, EPROTO);
+                break;
+            }
+        }
+    }
+
+    if ( NULL != buffer )
+    {
+        if ( dedup_mode )
+            dedup_flush(conn->stream);
+        put_buffer(buffer, DELTA_CLASS);
+    }
+}
+
+// returns the length of the frame verb line the connection starts with, 0 if it does not
+static size_t is_framed(int connfd)
+{
+    char peek[FRAME_LINE_MAX];
+
+    ssize_t received = recv(connfd, peek, sizeof(peek), MSG_PEEK);
+    if ( FRAME_VERB_LEN >= received || 0 != memcmp(peek, FRAME_VERB, FRAME_VERB_LEN) )
+        return 0;
+
+    // frames may follow at once, unless a codec was named
+    if ( '\n' == peek[FRAME_VERB_LEN] )
+        return FRAME_VERB_LEN + 1;
+
+    char *eol = (char *) memchr(peek, '\n', received);
+    return ( ' ' == peek[FRAME_VERB_LEN] && NULL != eol ) ? (size_t) ( eol - peek + 1 ) : 0;
+}
+
+// Takes the verb line of len bytes off the socket, and answers the codec it names, if any.
+// returns 0, or the error the connection is to be closed on
+static int start_framing(struct connection_ctx *conn, size_t len)
+{
+    char line[FRAME_LINE_MAX];
+
+    // already in, as the peek saw it
+    if ( (ssize_t) len != recv(conn->ep.fd, line, len, 0) )
+        return EPROTO;
+
+    conn->framing = (struct framing *) calloc(1, sizeof(struct framing));
+    if ( NULL == conn->framing )
+        return ENOMEM;
+
+    conn->flags |= CONN_FRAMED;
+
+    if ( FRAME_VERB_LEN + 1 == len )
+        return 0;
+
+    line[len - 1] = '\0';
+    const char *codec = "none";
+    if ( 0 == strcmp(line + FRAME_VERB_LEN + 1, FRAME_CODEC_LZ) )
+    {
+        conn->framing->plain = (char *) malloc(FRAME_PLAIN);
+        if ( NULL == conn->framing->plain )
+            return ENOMEM;
+        codec = FRAME_CODEC_LZ;
+    }
+
+    // the client sends nothing before the answer, so the socket has room for it
+    char reply[FRAME_LINE_MAX];
+    int n = snprintf(reply, sizeof(reply), FRAME_REPLY "%s\n", codec);
+
+    return ( n == send(conn->ep.fd, reply, n, MSG_NOSIGNAL) ) ? 0 : errno;
+}
+
+// checks the payload of the frame in f->header against its CRC
+// returns 0, or EBADMSG if the payload is not what the client sent
+static int check_frame(struct connection_ctx *conn, const char *payload, uint32_t len)
+{
+    struct framing *f = conn->framing;
+    uint32_t crc = crc32c(f->crc, payload, len);
+
+    if ( crc != f->header.crc )
+    {
+        fprintf(stderr, "sock:%d, frame of %" PRIu32 " bytes fails its CRC32C (%08" PRIx32 " rather than %08" PRIx32 ")\n",
+            conn->ep.fd, len, crc, f->header.crc);
+        stats.frames_rejected++;
+        return EBADMSG;
+    }
+
+    f->crc = crc;
+    stats.frames++;
+    stats.frame_bytes += len;
+    return 0;
+}
+
+// takes checked payloads as the bytes of any other connection
+static void take_frames(struct connection_ctx *conn, char *data, size_t len)
+{
+    if ( 0 == len )
+        return;
+
+    if ( -1 != wal_fd )
+        wal_append(conn, data, len);
+    else
+        sink(&conn->framing->line, conn->ep.fd, data, len);
+}
+
+// For a connection that compresses its frames, decompresses the payload of the frame into
+// f->plain, or copies it there if it was sent as it is, and checks it there.
+// returns 0, or the error the connection is to be closed on
+static int unpack_frame(struct connection_ctx *conn, const char *payload, uint32_t len)
+{
+    struct framing *f = conn->framing;
+
+    if ( FRAME_PLAIN - f->plain_len < FRAME_MAX )
+    {
+        take_frames(conn, f->plain, f->plain_len);
+        f->plain_len = 0;
+    }
+
+    char *plain = f->plain + f->plain_len;
+    long n = len;
+
+    if ( f->header.len & FRAME_LZ )
+    {
+        n = lz_decompress((const unsigned char *) payload, len, (unsigned char *) plain, FRAME_MAX);
+        if ( -1 == n )
+        {
+            fprintf(stderr, "sock:%d, compressed frame of %" PRIu32 " bytes is damaged\n", conn->ep.fd, len);
+            stats.frames_rejected++;
+            return EBADMSG;
+        }
+
+        stats.frames_lz++;
+        stats.frame_lz_bytes += len;
+        stats.frame_lz_plain += n;
+    }
+    else
+        memcpy(plain, payload, len);
+
+    int err = check_frame(conn, plain, (uint32_t) n);
+    if ( 0 == err )
+        f->plain_len += n;
+
+    return err;
+}
+
+// Takes the frames of what a framed connection received. The payloads found whole in data are
+// checked there and moved together over the headers between them, so that they are taken at
+// once, as the bytes of a read would be. Only a payload that spans two reads is copied aside.
+// Compressed frames are taken from f->plain instead, in the same order.
+// returns 0, or the error the connection is to be closed on; the frames before it are taken
+static int unframe(struct connection_ctx *conn, char *data, size_t len)
+{
+    struct framing *f = conn->framing;
+    char *run = data;               // the payloads checked and not taken yet
+    size_t run_len = 0;
+    int err = 0;
+
+    while ( 0 != len && 0 == err )
+    {
+        if ( f->header_got < sizeof(f->header) )
+        {
+            size_t n = sizeof(f->header) - f->header_got;
+            if ( n > len )
+                n = len;
+
+            memcpy((char *) &f->header + f->header_got, data, n);
+            f->header_got += n;
+            data += n;
+            len -= n;
+
+            if ( f->header_got < sizeof(f->header) )
+                break;
+
+            if ( f->ended || FRAME_MAX < ( f->header.len & ~FRAME_LZ )
+                || ( f->header.len & FRAME_LZ && NULL == f->plain ) )
+            {
+                fprintf(stderr, "sock:%d, %s\n", conn->ep.fd, f->ended ? "data after the end of a framed file"
+                    : f->header.len & FRAME_LZ ? "frame compressed without a codec" : "frame too long");
+                err = EPROTO;
+            }
+            else if ( 0 == f->header.len )
+            {
+                // the end of the file, with the digest of all of it
+                if ( f->header.crc != f->crc )
+                {
+                    fprintf(stderr, "sock:%d, file digest %08" PRIx32 " does not match %08" PRIx32 "\n",
+                        conn->ep.fd, f->header.crc, f->crc);
+                    stats.frames_rejected++;
+                    err = EBADMSG;
+                }
+
+                f->ended = 1;
+                f->header_got = 0;
+            }
+
+            f->payload_got = 0;
+            continue;
+        }
+
+        uint32_t frame_len = f->header.len & ~FRAME_LZ;
+        uint32_t want = frame_len - f->payload_got;
+
+        if ( 0 == f->payload_got && len >= want )
+        {
+            if ( NULL != f->plain )
+                err = unpack_frame(conn, data, want);
+            else if ( 0 == ( err = check_frame(conn, data, want) ) )
+            {
+                if ( run + run_len != data )
+                    memmove(run + run_len, data, want);
+                run_len += want;
+            }
+
+            data += want;
+            len -= want;
+        }
+        else
+        {
+            if ( NULL == f->payload && NULL == ( f->payload = (char *) malloc(FRAME_MAX) ) )
+            {
+                err = ENOMEM;
+                break;
+            }
+
+            uint32_t n = len < want ? (uint32_t) len : want;
+            memcpy(f->payload + f->payload_got, data, n);
+            f->payload_got += n;
+            data += n;
+            len -= n;
+
+            if ( f->payload_got < frame_len )
+                break;
+
+            if ( NULL != f->plain )
+                err = unpack_frame(conn, f->payload, frame_len);
+            else if ( 0 == ( err = check_frame(conn, f->payload, frame_len) ) )
+            {
+                // in order
+                take_frames(conn, run, run_len);
+                take_frames(conn, f->payload, frame_len);
+                run = data;
+                run_len = 0;
+            }
+        }
+
+        f->header_got = 0;
+    }
+
+    take_frames(conn, run, run_len);
+    if ( NULL != f->plain )
+    {
+        take_frames(conn, f->plain, f->plain_len);
+        f->plain_len = 0;
+    }
+
+    return err;
+}
+
+static int is_query(int connfd)
+{
+    char peek[QUERY_VERB_LEN];
+
+    ssize_t received = recv(connfd, peek, sizeof(peek), MSG_PEEK);
+
+    return ( QUERY_VERB_LEN == received
+        && ( 0 == memcmp(peek, QUERY_VERB, QUERY_VERB_LEN) || 0 == memcmp(peek, QUERY_TOKEN_VERB, QUERY_VERB_LEN) ) );
+}
+
+// wakes the event loop up for a query, from a worker
+static void wake_query(struct query *q)
+{
+    reactor_wake(&q->ep);
+}
+
+// Adds the lines a worker found to the output of the query, once the event loop has taken
+// enough of it.
+// returns -1 if the query was cancelled
+static int flush_found(struct query *q, struct query_worker *w)
+{
+    int wake = 0;
+
+    pthread_mutex_lock(&query_lock);
+    while ( QUERY_BACKLOG <= q->out_len && !q->cancelled )
+        pthread_cond_wait(&q->room, &query_lock);
+
+    int cancelled = q->cancelled;
+    if ( !cancelled )
+    {
+        wake = ( 0 == q->out_len );
+        memcpy(q->out + q->out_len, w->found, w->found_len);
+        q->out_len += w->found_len;
+    }
+    pthread_mutex_unlock(&query_lock);
+
+    w->found_len = 0;
+    if ( wake )
+        wake_query(q);
+
+    return cancelled ? -1 : 0;
+}
+
+// notes a line a worker found, at offset of the stream
+// returns -1 if the query was cancelled
+static int found_line(struct query *q, struct query_worker *w, uint32_t stream, uint64_t offset, const char *line, size_t len)
+{
+    if ( QUERY_FOUND - w->found_len < QUERY_HEADER_MAX + len && -1 == flush_found(q, w) )
+        return -1;
+
+    w->found_len += snprintf(w->found + w->found_len, QUERY_HEADER_MAX, QUERY_MATCH "%" PRIu32 " %" PRIu64 " %zu\n",
+        stream, offset, len);
+    memcpy(w->found + w->found_len, line, len);
+    w->found_len += len;
+    w->matches++;
+    return 0;
+}
+
+// Searches len bytes of a stream from offset, whole lines but for the first and the last,
+// which may be pieces of longer ones, for the strings that start in the first searched bytes;
+// the rest is only there for those to end in. Of a line longer than QUERY_LINE_MAX, up to that
+// many bytes around the string are answered, and the strings they hold whole with it. With the
+// token verb, the string must not start or end in the middle of a token.
+// returns -1 if the query was cancelled
+static int search_lines(struct query *q, struct query_worker *w, uint32_t stream, uint64_t offset,
+    const char *data, size_t len, size_t searched)
+{
+    const char *end = data + len;
+    const char *last = data + searched;
+    const char *p = data;
+    const char *m;
+
+    // a piece answered already may reach into what is left of a long line
+    if ( w->answered > offset )
+        p += ( w->answered - offset < searched ) ? w->answered - offset : searched;
+    const char *fresh = p;
+
+    while ( p < last && NULL != ( m = search_find(p, end - p, q->needle, q->needle_len) ) && m < last )
+    {
+        const unsigned char *u = (const unsigned char *) m;
+        unsigned char before = ( m == data ) ? w->before : u[-1];
+        if ( q->whole && ( ( bloom_token_byte[u[0]] && bloom_token_byte[before] )
+            || ( m + q->needle_len != end && bloom_token_byte[u[q->needle_len - 1]] && bloom_token_byte[u[q->needle_len]] ) ) )
+        {
+            p = m + 1;
+            continue;
+        }
+
+        const char *start = (const char *) memrchr(data, '\n', m - data);
+        start = ( NULL == start ) ? data : start + 1;
+        const char *stop = (const char *) memchr(m, '\n', end - m);
+        stop = ( NULL == stop ) ? end : stop + 1;
+
+        if ( stop - start > QUERY_LINE_MAX )
+        {
+            // the string in the middle, as far as the line lets it, and no string answered before
+            size_t lead = ( QUERY_LINE_MAX - q->needle_len ) / 2;
+            if ( start < fresh )
+                start = fresh;
+            if ( (size_t) ( m - start ) > lead )
+                start = m - lead;
+            if ( stop - start > QUERY_LINE_MAX )
+                stop = start + QUERY_LINE_MAX;
+        }
+
+        if ( -1 == found_line(q, w, stream, offset + ( start - data ), start, stop - start) )
+            return -1;
+
+        // a string that starts in a piece but does not end in it is answered with the next one
+        p = fresh = stop - ( q->needle_len - 1 );
+        w->answered = offset + ( p - data );
+    }
+
+    return 0;
+}
+
+// Whether the filters of a stream file let a block of the file, of nblocks, hold the tokens of a
+// query; the block the stream was appending to has its filter copied, possibly past the others.
+static int block_may_hold(const struct query *q, const struct query_file *file, int bloom_fd,
+    uint64_t nblocks, uint64_t block, unsigned char *filter)
+{
+    if ( NULL != file->bloom && block == file->bloom_block )
+        return !bloom_rules_out(file->bloom, q->tokens, q->ntokens);
+
+    if ( block >= nblocks )
+        return 0;
+
+    // a filter that was never written rules nothing out
+    if ( BLOOM_BYTES != pread(bloom_fd, filter, BLOOM_BYTES, block * BLOOM_BYTES) )
+        return 1;
+
+    return !bloom_rules_out(filter, q->tokens, q->ntokens);
+}
+
+// Searches a stream file of a query, a block at a time. The line a block ends in is carried
+// over to the next one, up to QUERY_LINE_MAX bytes of it, more than any string a match may
+// start in what was searched and end in the carry. A block is skipped if its filter
+// and those of the blocks on either side rule the tokens of the query out: a match it could
+// hold would have a token end in one of them, as would one in the line carried over to it.
+static void search_file(struct query *q, const struct query_file *file, struct query_worker *w)
+{
+    char name[32];
+    snprintf(name, sizeof(name), "%" PRIu32, file->stream);
+
+    // a file that went away since the query was taken is skipped
+    int fd = openat(streams_dirfd, name, O_RDONLY | O_CLOEXEC);
+    int index_fd = -1;
+    if ( -1 == fd )
+        return;
+
+    if ( file->blocks )
+    {
+        snprintf(name, sizeof(name), "%" PRIu32 STORE_INDEX, file->stream);
+        if ( -1 == ( index_fd = openat(streams_dirfd, name, O_RDONLY | O_CLOEXEC) ) )
+        {
+            close(fd);
+            return;
+        }
+    }
+
+    int bloom_fd = -1;
+    if ( 0 != q->ntokens && !file->unfiltered )
+    {
+        snprintf(name, sizeof(name), "%" PRIu32 BLOOM_FILE, file->stream);
+        bloom_fd = openat(streams_dirfd, name, O_RDONLY | O_CLOEXEC);
+    }
+
+    uint64_t nblocks = file->blocks ? file->size + ( 0 != file->tail_len ) : ( file->size + QUERY_BLOCK - 1 ) / QUERY_BLOCK;
+    int may_hold[3] = { 0, 1, 1 };  // the block before the one to read next, that one and the one after
+    if ( -1 != bloom_fd )
+    {
+        may_hold[1] = block_may_hold(q, file, bloom_fd, nblocks, 0, w->filter);
+        may_hold[2] = block_may_hold(q, file, bloom_fd, nblocks, 1, w->filter);
+    }
+
+    uint64_t offset = 0;            // of the stream, of the start of window
+    uint64_t next = 0;              // the block, or with a plain file the position, to read next
+    uint64_t block = 0;
+    size_t carry = 0;
+
+    w->answered = 0;
+    w->before = '\n';
+
+    while ( !__atomic_load_n(&q->cancelled, __ATOMIC_RELAXED) )
+    {
+        char *dst = w->window + carry;
+        ssize_t n = 0;
+
+        int skip = ( block < nblocks && !( may_hold[0] | may_hold[1] | may_hold[2] ) );
+        if ( -1 != bloom_fd )
+        {
+            may_hold[0] = may_hold[1];
+            may_hold[1] = may_hold[2];
+            may_hold[2] = block_may_hold(q, file, bloom_fd, nblocks, block + 2, w->filter);
+        }
+        block++;
+
+        if ( skip )
+        {
+            next = file->blocks ? next + 1 : ( file->size - next < QUERY_BLOCK ) ? file->size : next + QUERY_BLOCK;
+            offset = block * QUERY_BLOCK;
+            carry = 0;
+            w->before = '\n';
+            w->skipped++;
+            continue;
+        }
+
+        if ( !file->blocks )
+        {
+            size_t want = ( file->size - next < QUERY_BLOCK ) ? file->size - next : QUERY_BLOCK;
+            if ( 0 != want )
+                n = pread(fd, dst, want, next);
+            next += ( 0 < n ) ? n : 0;
+        }
+        else if ( next < file->size )
+            n = read_block(fd, index_fd, next++, dst, w->packed);
+        else if ( next++ == file->size && 0 != file->tail_len )
+        {
+            memcpy(dst, file->tail, file->tail_len);
+            n = file->tail_len;
+        }
+
+        if ( 0 >= n )
+        {
+            // as far as the file goes, or can be read
+            search_lines(q, w, file->stream, offset, w->window, carry, carry);
+            break;
+        }
+        w->scanned += n;
+
+        // the lines the block completes, and of a line that goes on, all but QUERY_LINE_MAX bytes
+        size_t len = carry + n;
+        const char *nl = (const char *) memrchr(w->window, '\n', len);
+        size_t complete = ( NULL == nl ) ? 0 : nl + 1 - w->window;
+        if ( len - complete > QUERY_LINE_MAX )
+            complete = len - QUERY_LINE_MAX;
+
+        if ( -1 == search_lines(q, w, file->stream, offset, w->window, len, complete) )
+            break;
+
+        if ( 0 != complete )
+            w->before = w->window[complete - 1];
+        carry = len - complete;
+        memmove(w->window, w->window + complete, carry);
+        offset += complete;
+    }
+
+    close(fd);
+    if ( -1 != index_fd )
+        close(index_fd);
+    if ( -1 != bloom_fd )
+        close(bloom_fd);
+}
+
+// a worker thread: searches the files of the queries, one at a time, oldest query first
+static void *query_worker(void *arg)
+{
+    struct query_worker *w = (struct query_worker *) arg;
+
+    pthread_mutex_lock(&query_lock);
+    while ( 1 )
+    {
+        while ( NULL == query_queue )
+            pthread_cond_wait(&query_work, &query_lock);
+
+        struct query *q = query_queue;
+        const struct query_file *file = &q->files[q->next_file++];
+        if ( q->next_file == q->nfiles )
+            query_queue = q->next;
+        q->refs++;
+        pthread_mutex_unlock(&query_lock);
+
+        struct timespec start, end;
+        clock_gettime(CLOCK_THREAD_CPUTIME_ID, &start);
+
+        w->scanned = 0;
+        w->matches = 0;
+        w->skipped = 0;
+        search_file(q, file, w);
+        if ( 0 != w->found_len )
+            flush_found(q, w);
+
+        clock_gettime(CLOCK_THREAD_CPUTIME_ID, &end);
+
+        pthread_mutex_lock(&query_lock);
+        q->scanned += w->scanned;
+        q->matches += w->matches;
+        stats.query_files++;
+        stats.query_bytes += w->scanned;
+        stats.query_matches += w->matches;
+        stats.query_skipped += w->skipped;
+        stats.query_ns += (end.tv_sec - start.tv_sec) * 1000000000ull + end.tv_nsec - start.tv_nsec;
+
+        if ( ++q->files_done == q->nfiles )
+            wake_query(q);
+        put_query(q);
+    }
+
+    return NULL;
+}
+
+// starts the workers of queries, one per CPU; signals are left to the event loop
+static void start_query_workers(void)
+{
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    nquery_workers = ( cpus < 1 ) ? 1 : ( cpus > QUERY_THREADS_MAX ) ? QUERY_THREADS_MAX : (int) cpus;
+
+    query_workers = (struct query_worker *) calloc(nquery_workers, sizeof(struct query_worker));
+    if ( NULL == query_workers )
+    {
+        fprintf(stderr, "out of memory for the query workers\n");
+        exit(1);
+    }
+
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+
+    for ( int i = 0; i < nquery_workers; i++ )
+    {
+        struct query_worker *w = &query_workers[i];
+        w->window = (char *) malloc(QUERY_LINE_MAX + QUERY_BLOCK);
+        w->packed = (unsigned char *) malloc(STORE_BLOCK);
+        w->found = (char *) malloc(QUERY_FOUND);
+
+        int err = ( NULL == w->window || NULL == w->packed || NULL == w->found )
+            ? ENOMEM : pthread_create(&w->thread, NULL, query_worker, w);
+        if ( 0 != err )
+        {
+            fprintf(stderr, "cannot start the query workers (%d)\n", err);
+            exit(1);
+        }
+    }
+
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+}
+
+// Copies the short block a stream file stored with -z ends in, for a query, if the stream is
+// not open: it takes the block back to append to as it opens again, and writes over it on file.
+// A block that cannot be read is left out, as the workers could not read it either.
+// returns -1 if there is no memory for it
+static int copy_last_block(struct query_file *file)
+{
+    char name[32];
+    snprintf(name, sizeof(name), "%" PRIu32, file->stream);
+    int fd = openat(streams_dirfd, name, O_RDONLY | O_CLOEXEC);
+    snprintf(name, sizeof(name), "%" PRIu32 STORE_INDEX, file->stream);
+    int index_fd = openat(streams_dirfd, name, O_RDONLY | O_CLOEXEC);
+
+    struct store_block last;
+    ssize_t got = -1;
+    if ( -1 != fd && -1 != index_fd
+        && sizeof(last) == pread(index_fd, &last, sizeof(last), ( file->size - 1 ) * sizeof(last)) )
+    {
+        if ( STORE_BLOCK <= last.plain )
+            got = 0;
+        else if ( NULL == ( file->tail = (char *) malloc(STORE_BLOCK) ) )
+            got = -2;
+        else
+            got = read_block(fd, index_fd, file->size - 1, file->tail, store_packed);
+    }
+
+    if ( -1 != fd )
+        close(fd);
+    if ( -1 != index_fd )
+        close(index_fd);
+
+    if ( -2 == got )
+    {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    if ( 0 != got )
+    {
+        file->size--;
+        file->tail_len = ( 0 < got ) ? got : 0;
+        stats.store_loads += ( 0 < got );
+    }
+
+    if ( 0 == file->tail_len )
+    {
+        free(file->tail);
+        file->tail = NULL;
+    }
+
+    return 0;
+}
+
+// Lists the stream files for a query, as they are: how far a plain file goes, and how many
+// blocks a file stored with -z has, and a copy of the block its stream is appending to, or
+// ends in short.
+// returns -1, with errno set, if they cannot be listed or there is no memory for them
+static int list_query_files(struct query *q)
+{
+    int dirfd = dup(streams_dirfd);
+    DIR *d = ( -1 == dirfd ) ? NULL : fdopendir(dirfd);
+    if ( NULL == d )
+    {
+        int err = errno;
+        if ( -1 != dirfd )
+            close(dirfd);
+        fprintf(stderr, "cannot list the stream files (%d)\n", err);
+        errno = err;
+        return -1;
+    }
+    rewinddir(d);
+
+    size_t capacity = 0;
+    struct dirent *entry;
+    while ( NULL != ( entry = readdir(d) ) )
+    {
+        uint32_t stream;
+        int len = 0;
+        struct stat st;
+
+        if ( 1 != sscanf(entry->d_name, "%" SCNu32 "%n", &stream, &len) || '\0' != entry->d_name[len]
+            || -1 == fstatat(streams_dirfd, entry->d_name, &st, 0) )
+            continue;
+
+        if ( q->nfiles == capacity )
+        {
+            capacity = ( 0 == capacity ) ? 64 : 2 * capacity;
+            struct query_file *files = (struct query_file *) realloc(q->files, capacity * sizeof(struct query_file));
+            if ( NULL == files )
+            {
+                closedir(d);
+                errno = ENOMEM;
+                return -1;
+            }
+            q->files = files;
+        }
+
+        struct query_file *file = &q->files[q->nfiles];
+        memset(file, 0, sizeof(*file));
+        file->stream = stream;
+        file->size = st.st_size;
+
+        char name[32];
+        snprintf(name, sizeof(name), "%" PRIu32 STORE_INDEX, stream);
+        if ( 0 == fstatat(streams_dirfd, name, &st, 0) )
+        {
+            int slot = stream % STREAM_FILES;
+            file->blocks = 1;
+            file->size = st.st_size / sizeof(struct store_block);
+
+            if ( stream_files[slot].stream == stream && -1 != stream_files[slot].fd && 0 != stream_files[slot].tail_len )
+            {
+                file->tail = (char *) malloc(stream_files[slot].tail_len);
+                if ( NULL == file->tail )
+                {
+                    closedir(d);
+                    errno = ENOMEM;
+                    return -1;
+                }
+                memcpy(file->tail, stream_files[slot].tail, stream_files[slot].tail_len);
+                file->tail_len = stream_files[slot].tail_len;
+            }
+            else if ( ( stream_files[slot].stream != stream || -1 == stream_files[slot].fd )
+                && 0 != file->size && -1 == copy_last_block(file) )
+            {
+                closedir(d);
+                return -1;
+            }
+        }
+
+        // the filter of the block the stream is appending to, with the token it ends in so far
+        int slot = stream % STREAM_FILES;
+        if ( stream_files[slot].stream == stream && -1 != stream_files[slot].fd )
+        {
+            struct bloom_token token = stream_files[slot].token;
+            file->unfiltered = ( -1 == stream_files[slot].bloom_fd );
+            file->bloom_block = stream_files[slot].size / STORE_BLOCK;
+
+            if ( !file->unfiltered && ( 0 != stream_files[slot].size % STORE_BLOCK || 0 != token.len ) )
+            {
+                file->bloom = (unsigned char *) malloc(BLOOM_BYTES);
+                if ( NULL == file->bloom )
+                {
+                    closedir(d);
+                    errno = ENOMEM;
+                    return -1;
+                }
+                memcpy(file->bloom, stream_files[slot].bloom, BLOOM_BYTES);
+                bloom_end_token(file->bloom, &token);
+            }
+        }
+
+        q->nfiles++;
+    }
+
+    closedir(d);
+    return 0;
+}
+
+// takes the next query off the socket, and hands its files to the workers
+// returns -1 if there is none yet, or if the connection was closed
+static int start_query(int epollfd, struct connection_ctx *conn)
+{
+    char line[QUERY_COMMAND_MAX];
+
+    ssize_t n = recv(conn->ep.fd, line, sizeof(line), MSG_PEEK);
+    if ( -1 == n )
+    {
+        if ( EAGAIN == errno || EINTR == errno )
+            return -1;
+
+        close_connection(epollfd, conn, CLOSE_RECV_ERROR, errno);
+        return -1;
+    }
+
+    if ( 0 == n )
+    {
+        close_connection(epollfd, conn, CLOSE_ORDERLY, 0);
+        return -1;
+    }
+
+    char *eol = (char *) memchr(line, '\n', n);
+    if ( NULL == eol && (size_t) n < sizeof(line) )
+    {
+        // the rest of the line comes with the next edge
+        return -1;
+    }
+
+    int whole = ( NULL != eol && 0 == memcmp(line, QUERY_TOKEN_VERB, QUERY_VERB_LEN) );
+    if ( NULL == eol || QUERY_VERB_LEN >= eol - line || ( !whole && 0 != memcmp(line, QUERY_VERB, QUERY_VERB_LEN) ) )
+    {
+        fprintf(stderr, "sock:%d, not a query command\n", conn->ep.fd);
+        close_connection(epollfd, conn, CLOSE_RECV_ERROR, EPROTO);
+        return -1;
+    }
+
+    // take the line off the socket
+    recv(conn->ep.fd, line, eol - line + 1, 0);
+
+    struct query *q = (struct query *) calloc(1, sizeof(struct query));
+    if ( NULL == q )
+    {
+        close_connection(epollfd, conn, CLOSE_SEND_ERROR, ENOMEM);
+        return -1;
+    }
+
+    int err = ( -1 == reactor_wakeup(&q->ep, handle_query_wakeup) ) ? errno : 0;
+    q->conn = conn;
+    q->refs = 1;
+    q->needle_len = eol - line - QUERY_VERB_LEN;
+    memcpy(q->needle, line + QUERY_VERB_LEN, q->needle_len);
+    q->whole = whole;
+    q->ntokens = bloom_tokens(q->needle, q->needle_len, whole, q->tokens, QUERY_TOKENS);
+    pthread_cond_init(&q->room, NULL);
+
+    // both hold what QUERY_BACKLOG lets through, and one more buffer of lines
+    q->out = (char *) malloc(QUERY_BACKLOG + QUERY_FOUND);
+    q->sending = (char *) malloc(QUERY_BACKLOG + QUERY_FOUND);
+
+    if ( 0 == err && ( NULL == q->out || NULL == q->sending ) )
+        err = ENOMEM;
+    if ( 0 == err && -1 == list_query_files(q) )
+        err = errno;
+    if ( 0 == err && -1 == reactor_add(epollfd, &q->ep, EPOLLIN | EPOLLET) )
+        err = errno;
+
+    if ( 0 != err )
+    {
+        pthread_mutex_lock(&query_lock);
+        put_query(q);
+        pthread_mutex_unlock(&query_lock);
+
+        close_connection(epollfd, conn, CLOSE_SEND_ERROR, err);
+        return -1;
+    }
+
+    conn->query = q;
+    stats.queries++;
+
+    if ( 0 != q->nfiles )
+    {
+        pthread_mutex_lock(&query_lock);
+        struct query **tail = &query_queue;
+        while ( NULL != *tail )
+            tail = &(*tail)->next;
+        *tail = q;
+        pthread_cond_broadcast(&query_work);
+        pthread_mutex_unlock(&query_lock);
+    }
+
+    return 0;
+}
+
+// Sends what the workers found so far, and once they have searched every file, the line that
+// ends the answer. Returns 0 once all of it is sent, and -1 if more is to come, in which case
+// the eventfd of the query brings the connection back, if the socket is full, in which case
+// EPOLLOUT does, or if the connection was closed.
+static int send_query(int epollfd, struct connection_ctx *conn)
+{
+    struct query *q = conn->query;
+
+    while ( 1 )
+    {
+        if ( q->sending_sent < q->sending_len )
+        {
+            ssize_t sent = send(conn->ep.fd, q->sending + q->sending_sent, q->sending_len - q->sending_sent, MSG_NOSIGNAL);
+            if ( -1 == sent )
+            {
+                switch ( errno )
+                {
+                    case EAGAIN:
+                        return -1;
+
+                    case EINTR:
+                        continue;
+
+                    case ECONNRESET:
+                        close_connection(epollfd, conn, CLOSE_RESET, 0);
+                        return -1;
+
+                    case EPIPE:
+                    default:
+                        close_connection(epollfd, conn, CLOSE_SEND_ERROR, errno);
+                        return -1;
+                }
+            }
+
+            q->sending_sent += sent;
+            continue;
+        }
+
+        if ( q->finished )
+            break;
+
+        // what the workers found since, in exchange for the buffer just sent
+        pthread_mutex_lock(&query_lock);
+        char *taken = NULL;
+        size_t taken_len = q->out_len;
+        int done = ( q->files_done == q->nfiles );
+        if ( 0 != taken_len )
+        {
+            taken = q->out;
+            q->out = q->sending;
+            q->out_len = 0;
+            pthread_cond_broadcast(&q->room);
+        }
+        pthread_mutex_unlock(&query_lock);
+
+        q->sending_sent = 0;
+        if ( NULL != taken )
+        {
+            q->sending = taken;
+            q->sending_len = taken_len;
+            continue;
+        }
+
+        if ( !done )
+        {
+            q->sending_len = 0;
+            return -1;
+        }
+
+        q->sending_len = snprintf(q->sending, QUERY_HEADER_MAX, QUERY_DONE "%zu %" PRIu64 "\n", q->matches, q->scanned);
+        q->finished = 1;
+    }
+
+    end_query(epollfd, conn);
+    return 0;
+}
+
+// a connection that started with the query verb: answers its queries one after the other
+static void handle_query(int epollfd, struct connection_ctx *conn)
+{
+    while ( -1 != conn->ep.fd )
+    {
+        if ( NULL == conn->query && -1 == start_query(epollfd, conn) )
+            return;
+
+        if ( -1 == send_query(epollfd, conn) )
+            return;
+    }
+}
+
+// the workers found lines for a query, or searched the last of its files
+static void handle_query_wakeup(int epollfd, struct endpoint *ep, uint32_t events)
+{
+    struct query *q = (struct query *) ep;
+    (void) events;
+
+    if ( NULL == q->conn )
+    {
+        // the query ended earlier in this batch of events
+        return;
+    }
+
+    reactor_drain(&q->ep);
+    handle_query(epollfd, q->conn);
+}
+
+// Tells the peer that what it sent so far has been taken care of. A connection that streams
+// its bytes is told how many of them in durable mode, or over a shared-memory ring, as an
+// acknowledgement sent after a commit or a drain may be for only part of what it sent.
+static void send_ack(int epollfd, struct connection_ctx *conn)
+{
+    static char ack[] = "Ack\n";
+    char counted[32];
+    char *reply = ack;
+    size_t len = sizeof(ack);
+
+    if ( conn->flags & CONN_FRAMED && conn->framing->ended )
+    {
+        // the whole file is in; the client compares the digest with its own
+        len = snprintf(counted, sizeof(counted), "Ack %08" PRIx32 "\n", conn->framing->crc) + 1;
+        reply = counted;
+        stats.frame_digests++;
+    }
+    else if ( conn->flags & CONN_SHM )
+    {
+        len = snprintf(counted, sizeof(counted), "Ack %" PRIu64 "\n", conn->shm->received) + 1;
+        reply = counted;
+    }
+    else if ( -1 != wal_fd && !( conn->flags & (CONN_UPLOAD | CONN_DELTA | CONN_FRAMED) ) )
+    {
+        len = snprintf(counted, sizeof(counted), "Ack %" PRIu64 "\n", conn->received) + 1;
+        reply = counted;
+    }
+
+    int sent = send(conn->ep.fd, reply, len, MSG_NOSIGNAL);
+
+    if ( -1 == sent )
+    {
+        switch ( errno )
+        {
+            case EAGAIN:
+                // the send buffer is full; the next batch will be acknowledged
+                break;
+
+            case ECONNRESET:
+                // connection reset by the peer
+                close_connection(epollfd, conn, CLOSE_RESET, 0);
+                break;
+
+            case EBADF:
+            case EDESTADDRREQ:
+            case EFAULT:
+            case EINVAL:
+            case EISCONN:
+            case EMSGSIZE:
+            case ENOTSOCK:
+            case EOPNOTSUPP:
+                // the server is broken, not the connection
+                fprintf(stderr, "socket send error (%d)\n", errno);
+                exit(1);
+
+            case EACCES:
+            case EALREADY:
+            case EINTR:
+            case ENOBUFS:
+            case ENOMEM:
+            case ENOTCONN:
+            case EPIPE:
+            default:
+                close_connection(epollfd, conn, CLOSE_SEND_ERROR, errno);
+                break;
+        }
+    }
+}
+
+// closes a connection that reported an error; a peer that went away while it was being
+// answered, which is what an acknowledgement sent after a commit can run into, is a reset
+static void close_failed_connection(int epollfd, struct connection_ctx *conn)
+{
+    int err = 0;
+    socklen_t len = sizeof(err);
+    getsockopt(conn->ep.fd, SOL_SOCKET, SO_ERROR, &err, &len);
+
+    if ( EPIPE == err || ECONNRESET == err )
+        close_connection(epollfd, conn, CLOSE_RESET, 0);
+    else
+        close_connection(epollfd, conn, CLOSE_RECV_ERROR, err);
+}
+
+static void handle_connection(int epollfd, struct endpoint *ep, uint32_t events)
+{
+    struct connection_ctx *conn = (struct connection_ctx *) ep;
+
+    if ( ECHO_OFF != echo_mode )
+    {
+        if ( events & (EPOLLIN | EPOLLOUT) )
+        {
+            conn->flags |= CONN_STARTED;
+            handle_echo(epollfd, conn);
+        }
+
+        if ( events & EPOLLERR && -1 != conn->ep.fd )
+            close_failed_connection(epollfd, conn);
+
+        return;
+    }
+
+    if ( conn->flags & (CONN_FETCH | CONN_UPLOAD | CONN_DELTA | CONN_QUERY) )
+    {
+        if ( conn->flags & CONN_UPLOAD )
+        {
+            // acknowledgements go out with the commits
+            if ( events & EPOLLIN )
+                handle_upload(epollfd, conn);
+        }
+        else if ( conn->flags & CONN_DELTA )
+        {
+            // the signatures may have to wait for room in the socket
+            if ( events & (EPOLLIN | EPOLLOUT) )
+                handle_delta(epollfd, conn);
+        }
+        else if ( conn->flags & CONN_QUERY )
+        {
+            // the lines found may have to wait for room in the socket
+            if ( events & (EPOLLIN | EPOLLOUT) )
+                handle_query(epollfd, conn);
+        }
+        else if ( events & (EPOLLIN | EPOLLOUT) )
+            handle_fetch(epollfd, conn);
+
+        if ( events & EPOLLERR && -1 != conn->ep.fd )
+            close_failed_connection(epollfd, conn);
+
+        return;
+    }
+
+    // This is declared here to pass it from EPOLLIN to EPOLLOUT in this test implementation.
+    // In most other cases, it would likely be placed inside EPOLLIN block.
+    size_t total_bytes_in = 0;
+
+    // The peer may shut down right after its last write, and both arrive with the same
+    // edge. Whatever came before the shutdown is acknowledged before closing.
+    int peer_closed = 0;
+
+    if ( events & EPOLLIN )
+    {
+        // socket has data to read
+
+        conn->flags |= CONN_WOKEN;
+        stats.stream_wakeups++;
+
+        if ( PUBSUB_OFF == pubsub_policy && CONN_UNIX == ( conn->flags & (CONN_UNIX | CONN_STARTED) )
+            && !( conn->flags & CONN_SHM ) && is_shm_offer(conn->ep.fd) )
+        {
+            accept_shm_offer(epollfd, conn);
+            return;
+        }
+
+        if ( -1 != wal_fd && !( conn->flags & CONN_STARTED ) && is_fetch(conn->ep.fd) )
+        {
+            conn->flags |= CONN_FETCH | CONN_STARTED;
+            handle_fetch(epollfd, conn);
+            return;
+        }
+
+        if ( -1 != wal_fd && !( conn->flags & CONN_STARTED ) && is_query(conn->ep.fd) )
+        {
+            conn->flags |= CONN_QUERY | CONN_STARTED;
+            handle_query(epollfd, conn);
+            return;
+        }
+
+        if ( -1 != wal_fd && !( conn->flags & CONN_STARTED ) && is_delta(conn->ep.fd) )
+        {
+            conn->delta = (struct delta *) calloc(1, sizeof(struct delta));
+            if ( NULL == conn->delta )
+            {
+                close_connection(epollfd, conn, CLOSE_RECV_ERROR, ENOMEM);
+                return;
+            }
 
-                case EBADF:
-                case EFAULT:
-                case EINVAL:
-                default:
-                    fprintf(stderr, "epoll_wait error (%d)\n", errno);
-                    exit(1);
+            conn->delta->base.fd = -1;
+            conn->delta->base.index_fd = -1;
+            conn->flags |= CONN_DELTA | CONN_STARTED;
+            handle_delta(epollfd, conn);
+            return;
+        }
+
+        if ( dedup_mode && !( conn->flags & CONN_STARTED ) && is_upload(conn->ep.fd) )
+        {
+            conn->upload = (struct upload *) calloc(1, sizeof(struct upload));
+            if ( NULL == conn->upload )
+            {
+                close_connection(epollfd, conn, CLOSE_RECV_ERROR, ENOMEM);
+                return;
+            }
+
+            conn->flags |= CONN_UPLOAD | CONN_STARTED;
+            handle_upload(epollfd, conn);
+            return;
+        }
+
+        size_t verb_len;
+        if ( PUBSUB_OFF == pubsub_policy && !( conn->flags & (CONN_STARTED | CONN_SHM) )
+            && 0 != ( verb_len = is_framed(conn->ep.fd) ) )
+        {
+            int err = start_framing(conn, verb_len);
+            if ( 0 != err )
+            {
+                close_connection(epollfd, conn, CLOSE_RECV_ERROR, err);
+                return;
             }
         }
 
-        for ( int i = 0; i < nfds; i++ )
+        if ( PUBSUB_OFF != pubsub_policy && NULL == conn->member && -1 == join_pubsub(epollfd, conn) )
+            return;
+
+        int class = conn->buf_class;
+        char *buffer = get_buffer(class);
+        if ( NULL == buffer )
         {
-            // This is declared here to pass it from EPOLLIN to EPOLLOUT in this test implementation.
-            // In most other cases, it would likely be placed inside EPOLLIN block.
-            size_t total_bytes_in = 0;
+            // the data stays queued in the kernel, but nothing brings
+            // an edge-triggered connection back here; let it go
+            close_connection(epollfd, conn, CLOSE_RECV_ERROR, ENOMEM);
+            return;
+        }
 
-            if ( events[i].data.fd == listenfd )
+        ssize_t received;
+        size_t largest = 0;
+
+        while ( total_bytes_in < READ_BUDGET
+            && ( stats.recv_calls++, 0 < ( received = recv(conn->ep.fd, buffer, BUFLEN(class), 0) )
+            || ( -1 == received && EINTR == errno ) ) )
+        {
+            if ( 0 < received )
             {
-                if ( events[i].events & EPOLLIN )
+                if ( conn->flags & CONN_FRAMED )
                 {
-                    socklen_t addr_size = sizeof(struct sockaddr_in);
-                    struct sockaddr_in client_addr;
-                    int connfd = accept(listenfd, (struct sockaddr*) &client_addr, &addr_size);
-                    if ( -1 == connfd )
+                    int err = unframe(conn, buffer, received);
+                    if ( 0 != err )
                     {
-                        switch ( errno )
-                        {
-                            case EWOULDBLOCK:
-                            case EBADF:
-                            case ECONNABORTED:
-                            case EFAULT:
-                            case EINTR:
-                            case EINVAL:
-                            case ENFILE:
-                            case ENOBUFS:
-                            case ENOMEM:
-                            case ENOTSOCK:
-                            case EOPNOTSUPP:
-                            case EPERM:
-                            case EPROTO:
-                            default:
-                                fprintf(stderr, "socket accept error (%d)\n", errno);
-                                exit(1);
-                        }
+                        // the frames checked before this one are kept
+                        if ( dedup_mode )
+                            dedup_flush(conn->stream);
+                        put_buffer(buffer, class);
+                        close_connection(epollfd, conn, CLOSE_RECV_ERROR, err);
+                        return;
                     }
+                }
+                else if ( -1 != wal_fd )
+                {
+                    wal_append(conn, buffer, received);
+                    if ( conn->flags & CONN_SHM )
+                        conn->shm->received += received;
+                    else
+                        conn->received += received;
+                }
+                else if ( PUBSUB_OFF == pubsub_policy )
+                    sink(( conn->flags & CONN_SHM ) ? &conn->shm->line : &conn->line, conn->ep.fd, buffer, received);
+                else if ( conn->member->publisher )
+                    publish(epollfd, conn->member->channel, buffer, received);
+                // and what subscribers send is of no interest
 
-                    // set non-blocking
+                total_bytes_in += received;
+                if ( (size_t) received > largest )
+                    largest = received;
 
-                    int flags = fcntl(connfd, F_GETFL, 0);
-                    if ( -1 == flags )
+                if ( (size_t) received == BUFLEN(class) && class < BUF_CLASSES - 1 )
+                {
+                    // a bulk transfer; carry on with a larger buffer if the pool can spare one
+                    int grown = grow_buffer_class(conn->ep.fd, class);
+                    char *larger = get_buffer(grown);
+                    if ( NULL != larger )
                     {
-                        switch ( errno )
-                        {
-                            case EACCES:
-                            case EAGAIN:
-                            case EBADF:
-                            case EINTR:
-                            case EINVAL:
-                            case EMFILE:
-                            case ENOLCK:
-                            case EOVERFLOW:
-                            default:
-                                fprintf(stderr, "select fcntl error (%d)\n", errno);
-                                exit(1);
-                        }
+                        put_buffer(buffer, class);
+                        buffer = larger;
+                        class = grown;
                     }
+                }
+            }
+        }
 
-                    if ( -1 == fcntl(connfd, F_SETFL, flags | O_NONBLOCK) )
-                    {
-                        switch ( errno )
-                        {
-                            case EACCES:
-                            case EAGAIN:
-                            case EBADF:
-                            case EINTR:
-                            case EINVAL:
-                            case EMFILE:
-                            case ENOLCK:
-                            case EOVERFLOW:
-                            default:
-                                fprintf(stderr, "select fcntl error (%d)\n", errno);
-                                exit(1);
-                        }
-                    }
+        // all of it in the log before it is acknowledged
+        if ( dedup_mode && 0 != total_bytes_in )
+            dedup_flush(conn->stream);
+
+        // a connection that no longer needs its buffer class steps down one at a time,
+        // so that a short pause in a bulk transfer costs little
+        if ( 0 < class && largest < BUFLEN(class) / 4 )
+            conn->buf_class = class - 1;
+        else if ( bulk_mode && class < BUF_CLASSES - 1 && largest >= BUFLEN(class) / 2 )
+        {
+            // woken up at the low-water mark of half a buffer, so the buffer never fills;
+            // reaching the mark is the sign to raise both
+            conn->buf_class = class + 1;
+        }
+        else
+            conn->buf_class = class;
 
-                    // register the new connection to the rpoll
+        if ( bulk_mode )
+            adjust_rcvlowat(conn);
 
-                    ev.events = EPOLLIN | EPOLLOUT | EPOLLET;
-                    ev.data.fd = connfd;
-                    if ( -1 == epoll_ctl(epollfd, EPOLL_CTL_ADD, connfd, &ev) )
-                    {
-                        switch ( errno )
-                        {
-                            case EBADF:
-                            case EEXIST:
-                            case EINVAL:
-                            case ENOENT:
-                            case ENOMEM:
-                            case ENOSPC:
-                            case EPERM:
-                            default:
-                                fprintf(stderr, "epoll_ctl error (%d)\n", errno);
-                                exit(1);
-                        }
-                    }
+        switch ( received )
+        {
+            case -1:
+                switch ( errno )
+                {
+                    case EAGAIN:
+                        // no data available right now, try again later...
+                        break;
+
+                    case ECONNRESET:
+                        // connection reset by the peer
+                        close_connection(epollfd, conn, CLOSE_RESET, 0);
+                        break;
+
+                    case EBADF:
+                    case EFAULT:
+                    case EINVAL:
+                    case ENOTSOCK:
+                        // the server is broken, not the connection
+                        fprintf(stderr, "socket recv error (%d)\n", errno);
+                        exit(1);
 
+                    case ECONNREFUSED:
+                    case EHOSTUNREACH:
+                    case ENETUNREACH:
+                    case ENOMEM:
+                    case ENOTCONN:
+                    case ETIMEDOUT:
+                    default:
+                        close_connection(epollfd, conn, CLOSE_RECV_ERROR, errno);
+                        break;
                 }
+                break;
 
-                continue;
-            }
+            case 0:
+                // The stream socket peer has performed an orderly shutdown.
+                // recv returning 0 is a socket-closed notification.
 
-            if ( events[i].events & EPOLLIN )
-            {
-                // socket has data to read
+                peer_closed = 1;
+                break;
 
-                char buffer[BUFLEN];
-                ssize_t received;
+            default:
+                // the budget ran out before the socket did
+                if ( -1 == read_later(conn) )
+                    close_connection(epollfd, conn, CLOSE_RECV_ERROR, ENOMEM);
+                break;
+        }
 
-                while ( 0 < ( received = recv(events[i].data.fd, buffer, sizeof(buffer), 0) ) )
-                {
-                    char *p = buffer;
-                    for ( int i = 0; i < received; i++ )
-                    {
-                        if ( *p < ' ' && *p != '\n' ) *p = '.';
-                        p++;
-                    }
-                    printf("%.*s", (int) received, buffer);
-                    fflush(stdout);
+        // nothing more to read; the buffer goes back to the pool until the next edge
+        put_buffer(buffer, class);
+
+        if ( 0 != total_bytes_in )
+            conn->flags |= CONN_STARTED;
+        stats.stream_bytes += total_bytes_in;
+    }
+
+    if ( events & EPOLLOUT && -1 != conn->ep.fd )
+    {
+        // socket is ready for writing
+
+        if ( PUBSUB_OFF != pubsub_policy && NULL != conn->member && !conn->member->publisher )
+        {
+            // a subscriber that fell behind catches up; it is not acknowledged
+            flush_subscriber(epollfd, conn);
+        }
+        else if ( 0 != total_bytes_in && -1 != wal_fd )
+        {
+            // acknowledged once it is on disk
+            if ( -1 == wait_for_commit(conn) )
+                close_connection(epollfd, conn, CLOSE_SEND_ERROR, ENOMEM);
+        }
+        else if ( conn->flags & CONN_UNREAD )
+        {
+            // a bare acknowledgement stands for everything sent, so it waits for the rest
+            if ( 0 != total_bytes_in )
+                conn->flags |= CONN_UNACKED;
+        }
+        else if ( 0 != total_bytes_in || conn->flags & CONN_UNACKED )
+        {
+            conn->flags &= ~CONN_UNACKED;
+            send_ack(epollfd, conn);
+        }
+    }
+
+    if ( events & EPOLLERR && -1 != conn->ep.fd )
+    {
+        // error condition
+        close_failed_connection(epollfd, conn);
+    }
+
+    if ( peer_closed && -1 != conn->ep.fd )
+        close_connection(epollfd, conn, CLOSE_ORDERLY, 0);
+}
+
+// reads the tails left below the low-water mark of the bulk connections
+// that have not woken up since the previous tick
+static void handle_flush_timer(int epollfd, struct endpoint *ep, uint32_t events)
+{
+    (void) events;
+
+    if ( 0 == reactor_drain(ep) )
+        return;
+
+    // backwards, as a connection that closes or leaves bulk mode is replaced by the last one
+    for ( int i = nbulk - 1; 0 <= i; i-- )
+    {
+        struct connection_ctx *conn = bulk_connections[i];
+
+        if ( conn->flags & CONN_WOKEN )
+        {
+            conn->flags &= ~CONN_WOKEN;
+            continue;
+        }
+
+        size_t before = stats.stream_bytes;
+        handle_connection(epollfd, &conn->ep, EPOLLIN | EPOLLOUT);
+        stats.stream_wakeups--;
+
+        if ( stats.stream_bytes != before )
+            stats.bulk_flushes++;
+
+        if ( -1 != conn->ep.fd )
+            conn->flags &= ~CONN_WOKEN;
+    }
+}
+
+// reads on the connections that used up their budget on the previous turn of the event loop
+static void read_unread_connections(int epollfd)
+{
+    // backwards, as a connection that closes is replaced by the last one, and one
+    // that uses up its budget again goes last, to wait for the next turn
+    for ( size_t i = nunread; 0 < i; i-- )
+    {
+        if ( i > nunread )
+            continue;
+
+        struct connection_ctx *conn = unread_connections[i - 1];
+        unread_connections[i - 1] = unread_connections[--nunread];
+        conn->flags &= ~CONN_UNREAD;
+
+        handle_connection(epollfd, &conn->ep, EPOLLIN | EPOLLOUT);
+        stats.stream_wakeups--;
+    }
+}
+
+// Group commit: makes everything appended to the log durable with a single fdatasync(),
+// then acknowledges every connection that was waiting for it.
+static void wal_commit(int epollfd)
+{
+    wal_write();
+    sync_segment(wal_fd);
+    stats.wal_commits++;
+    stats.wal_acks += nwaiting;
+
+    // taken off the queue first, as a failed send closes the connection
+    size_t n = nwaiting;
+    nwaiting = 0;
+
+    for ( size_t i = 0; i < n; i++ )
+    {
+        struct connection_ctx *conn = wal_waiting[i];
+        conn->flags &= ~CONN_UNSYNCED;
+        send_ack(epollfd, conn);
+    }
+
+    if ( 0 != keep_seconds )
+    {
+        // retention by age is only checked here, so an idle log keeps its segments
+        time_t now = time(NULL);
+        struct segment *seg = segments[nsegments - 1];
+
+        if ( 0 != seg->records && now - seg->created >= keep_seconds )
+            roll_segment();
+        else
+            retire_segments(now);
+    }
+}
+
+// the commit window opened by the first connection to wait has passed
+static void handle_commit_timer(int epollfd, struct endpoint *ep, uint32_t events)
+{
+    (void) events;
+
+    if ( 0 == reactor_drain(ep) )
+        return;
+
+    commit_timer_armed = 0;
+    if ( 0 != nwaiting )
+        wal_commit(epollfd);
+}
+
+int main(int argc, char* argv[])
+{
+    const char *unix_path = NULL;
+    const char *wal_path = NULL;
+    size_t cache_mb = 0;
+    int use_udp = 0;
 
-                    total_bytes_in += received;
+    int opt;
+    while ( -1 != ( opt = getopt(argc, argv, "u:dac:blLw:W:k:K:zM:De:p:") ) )
+    {
+        switch ( opt )
+        {
+            case 'u':
+                unix_path = optarg;
+                if ( sizeof(((struct sockaddr_un*) 0)->sun_path) <= strlen(unix_path) )
+                {
+                    fprintf(stderr, "socket path too long: %s\n", unix_path);
+                    exit(1);
                 }
+                break;
+
+            case 'd':
+                use_udp = 1;
+                break;
+
+            case 'a':
+                ack_datagrams = 1;
+                break;
+
+            case 'c':
+                max_connections = strtoul(optarg, NULL, 10);
+                break;
+
+            case 'b':
+                bulk_mode = 1;
+                break;
+
+            case 'l':
+                line_mode = 1;
+                break;
+
+            case 'L':
+                line_mode = 2;
+                break;
+
+            case 'w':
+                wal_path = optarg;
+                break;
+
+            case 'k':
+                keep_segments = strtoul(optarg, NULL, 10) * (1 << 20) / SEGMENT_SIZE;
+                if ( 0 == keep_segments )
+                    keep_segments = 1;
+                break;
+
+            case 'K':
+                keep_seconds = strtol(optarg, NULL, 10);
+                break;
+
+            case 'z':
+                store_compressed = 1;
+                break;
+
+            case 'M':
+                cache_mb = strtoul(optarg, NULL, 10);
+                break;
 
-                switch ( received )
+            case 'D':
+                dedup_mode = 1;
+                break;
+
+            case 'W':
+                commit_window_us = strtol(optarg, NULL, 10);
+                if ( commit_window_us < 0 )
                 {
-                    case -1:
-                        switch ( errno )
-                        {
-                            case EAGAIN:
-                                // no data available right now, try again later...
-                                break;
-
-                            case ECONNRESET:
-                                // connection reset by the peer
-                                handle_close(epollfd, events[i].data.fd);
-                                break;
-
-                            case EBADF:
-                            case ECONNREFUSED:
-                            case EFAULT:
-                            case EINTR:
-                            case EINVAL:
-                            case ENOMEM:
-                            case ENOTCONN:
-                            case ENOTSOCK:
-                            default:
-                                fprintf(stderr, "socket recv error (%d)\n", errno);
-                                exit(1);
-                        }
-                        break;
+                    fprintf(stderr, "commit window is a number of microseconds: %s\n", optarg);
+                    exit(1);
+                }
+                break;
 
-                    default:
-                        if ( 0 == total_bytes_in )
-                        {
-                            // The stream socket peer has performed an orderly shutdown.
-                            // recv returning 0 is a socket-closed notification.
+            case 'e':
+                if ( 0 == strcmp(optarg, "splice") )
+                    echo_mode = ECHO_SPLICE;
+                else if ( 0 == strcmp(optarg, "copy") )
+                    echo_mode = ECHO_COPY;
+                else
+                {
+                    fprintf(stderr, "echo mode is either splice or copy: %s\n", optarg);
+                    exit(1);
+                }
+                break;
 
-                            handle_close(epollfd, events[i].data.fd);
-                        }
+            case 'p':
+                if ( 0 == strcmp(optarg, "drop") )
+                    pubsub_policy = PUBSUB_DROP;
+                else if ( 0 == strcmp(optarg, "disconnect") )
+                    pubsub_policy = PUBSUB_DISCONNECT;
+                else if ( 0 == strcmp(optarg, "buffer") )
+                    pubsub_policy = PUBSUB_BUFFER;
+                else
+                {
+                    fprintf(stderr, "slow subscriber policy is drop, disconnect or buffer: %s\n", optarg);
+                    exit(1);
                 }
-            }
+                break;
+
+            default:
+                fprintf(stderr, "Usage: %s [-u socket_path] [-d [-a]] [-c max_connections] [-b] [-l | -L] [-w log_dir [-W usec] [-k MB] [-K seconds] [-z] [-M MB | -D]] [-e splice|copy | -p policy]\n", argv[0]);
+                exit(1);
+        }
+    }
+
+    if ( ECHO_OFF != echo_mode && PUBSUB_OFF != pubsub_policy )
+    {
+        fprintf(stderr, "-e and -p do not go together\n");
+        exit(1);
+    }
+
+    if ( NULL != wal_path && ( ECHO_OFF != echo_mode || PUBSUB_OFF != pubsub_policy ) )
+    {
+        fprintf(stderr, "-w goes with neither -e nor -p\n");
+        exit(1);
+    }
+
+    if ( dedup_mode && ( NULL == wal_path || 0 != cache_mb ) )
+    {
+        fprintf(stderr, "-D goes with -w, and not with -M, as it keeps no stream files to cache\n");
+        exit(1);
+    }
+
+    if ( store_compressed && ( NULL == wal_path || dedup_mode ) )
+    {
+        fprintf(stderr, "-z goes with -w, and not with -D, as it keeps no stream files to compress\n");
+        exit(1);
+    }
+
+    crc32c_init();
+    search_init();
+    bloom_init();
+
+    if ( NULL != wal_path )
+    {
+        open_log(wal_path);
+        start_query_workers();
+        cache_init(cache_mb);
+        if ( dedup_mode )
+            dedup_init();
+
+        wal_buffer = (char *) malloc(WAL_BUFLEN);
+        if ( NULL == wal_buffer )
+        {
+            fprintf(stderr, "out of memory for the log buffer\n");
+            exit(1);
+        }
+    }
+
+    signal(SIGINT,  signal_handler);
+    signal(SIGTERM, signal_handler);
+    signal(SIGUSR1, signal_handler);
+    signal(SIGUSR2, signal_handler);
+
+    // a peer that goes away must not take the process down with it;
+    // writing to it fails with EPIPE instead
+    signal(SIGPIPE, SIG_IGN);
+
+    // every connection is a descriptor, and the default soft limit of 1024 would cap
+    // the connections long before memory does; a privileged process may go on to fs.nr_open
+    struct rlimit nofile;
+    if ( 0 == getrlimit(RLIMIT_NOFILE, &nofile) )
+    {
+        long nr_open = 0;
+        FILE *f = fopen("/proc/sys/fs/nr_open", "r");
+        if ( NULL != f )
+        {
+            if ( 1 != fscanf(f, "%ld", &nr_open) )
+                nr_open = 0;
+            fclose(f);
+        }
+
+        struct rlimit raised = { nofile.rlim_max, nofile.rlim_max };
+        if ( (rlim_t) nr_open > nofile.rlim_max )
+            raised.rlim_cur = raised.rlim_max = nr_open;
+
+        if ( -1 == setrlimit(RLIMIT_NOFILE, &raised) && nofile.rlim_cur < nofile.rlim_max )
+        {
+            nofile.rlim_cur = nofile.rlim_max;
+            setrlimit(RLIMIT_NOFILE, &nofile);
+        }
+    }
+
+    // create the listener sockets
+
+    struct sockaddr_in servaddr;
+    servaddr.sin_family = AF_INET;
+    servaddr.sin_port = htons(PORT);
+    servaddr.sin_addr.s_addr = htonl(INADDR_ANY);
 
-            if ( events[i].events & EPOLLOUT )
+    int listenfd = open_listener((struct sockaddr*) &servaddr, sizeof(servaddr));
+
+    int unixfd = -1;
+    if ( NULL != unix_path )
+    {
+        struct sockaddr_un unixaddr;
+        unixaddr.sun_family = AF_UNIX;
+        strcpy(unixaddr.sun_path, unix_path);
+
+        // a socket file left behind by a previous run would make bind() fail with EADDRINUSE,
+        // but anything else at the path is not the server's to remove
+        struct stat st;
+        if ( 0 == lstat(unix_path, &st) )
+        {
+            if ( !S_ISSOCK(st.st_mode) )
             {
-                // socket is ready for writing
+                fprintf(stderr, "not a socket: %s\n", unix_path);
+                exit(1);
+            }
+            unlink(unix_path);
+        }
 
-                if ( 0 != total_bytes_in )
-                {
-                    static char ack[] = "Ack\n";
+        unixfd = open_listener((struct sockaddr*) &unixaddr, sizeof(unixaddr));
+    }
 
-                    int sent = send(events[i].data.fd, ack, sizeof(ack), 0);
+    int udpfd = -1;
+    if ( use_udp )
+        udpfd = open_datagram_socket((struct sockaddr*) &servaddr, sizeof(servaddr));
 
-                    if ( -1 == sent )
-                    {
-                        switch ( errno )
-                        {
-                            case EBADF:
-                                // bad file descriptor
-                                // the connection was already closed while reading
-                                break;
-
-                            case ECONNRESET:
-                                // connection reset by the peer
-                                handle_close(epollfd, events[i].data.fd);
-                                break;
-
-                            case EACCES:
-                            case EAGAIN:
-                            case EALREADY:
-                            case EDESTADDRREQ:
-                            case EFAULT:
-                            case EINTR:
-                            case EINVAL:
-                            case EISCONN:
-                            case EMSGSIZE:
-                            case ENOBUFS:
-                            case ENOMEM:
-                            case ENOTCONN:
-                            case ENOTSOCK:
-                            case EOPNOTSUPP:
-                            case EPIPE:
-                            default:
-                                fprintf(stderr, "socket send error (%d)", errno);
-                                exit(1);
-                        }
-                    }
+    // epoll
+
+    int epollfd = reactor_create();
+
+    // register listener sockets
+
+    struct endpoint tcp_listener = { handle_accept, listenfd };
+    if ( -1 == reactor_add(epollfd, &tcp_listener, EPOLLIN) )
+        exit(1);
+    listeners[nlisteners++] = &tcp_listener;
+
+    struct endpoint unix_listener = { handle_accept, unixfd };
+    if ( -1 != unixfd )
+    {
+        if ( -1 == reactor_add(epollfd, &unix_listener, EPOLLIN) )
+            exit(1);
+        listeners[nlisteners++] = &unix_listener;
+    }
+
+    spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+
+    if ( -1 == reactor_timer(&accept_timer, handle_accept_timer) || -1 == reactor_add(epollfd, &accept_timer, EPOLLIN) )
+        exit(1);
+
+    if ( bulk_mode )
+    {
+        if ( -1 == reactor_timer(&flush_timer, handle_flush_timer) || -1 == reactor_add(epollfd, &flush_timer, EPOLLIN) )
+            exit(1);
+    }
+
+    if ( -1 != wal_fd && 0 != commit_window_us )
+    {
+        if ( -1 == reactor_timer(&commit_timer, handle_commit_timer) || -1 == reactor_add(epollfd, &commit_timer, EPOLLIN) )
+            exit(1);
+    }
+
+    struct endpoint datagram_socket = { handle_datagrams, udpfd };
+    if ( -1 != udpfd && -1 == reactor_add(epollfd, &datagram_socket, EPOLLIN) )
+        exit(1);
+
+    clock_gettime(CLOCK_MONOTONIC, &stats_since);
+
+    struct epoll_event events[MAX_EVENTS];
+
+    // event loop
+
+    while ( 1 )
+    {
+        // A signal may arrive while a batch is being handled rather than in epoll_wait(),
+        // so the requests are checked on every iteration and not only on EINTR.
+        if ( stats_requested )
+        {
+            stats_requested = 0;
+            report_stats();
+        }
+
+        if ( shutdown_requested )
+        {
+            fprintf(stderr, "shutting down...\n");
+
+            // the connections still waiting are owed their acknowledgement
+            if ( -1 != wal_fd )
+            {
+                wal_commit(epollfd);
+                write_index(segments[nsegments - 1]);
+
+                // with -z, the blocks the streams are appending to
+                for ( int slot = 0; slot < STREAM_FILES; slot++ )
+                {
+                    if ( -1 != stream_files[slot].fd )
+                        release_stream_file(slot);
                 }
             }
 
-            if ( events[i].events & EPOLLERR )
+            report_stats();
+            if ( -1 == close(listenfd) )
+            {
+                switch ( errno )
+                {
+                    case EBADF:
+                    case EINTR:
+                    case EIO:
+                    default:
+                        fprintf(stderr, "socket close error (%d)", errno);
+                        exit(1);
+                }
+            }
+            if ( -1 != unixfd )
             {
-                // error condition
-                fprintf(stderr, "EPOLLERR\n");
+                close(unixfd);
+                unlink(unix_path);
             }
+            if ( -1 != udpfd )
+                close(udpfd);
+            exit(0);
         }
+
+        // a signal that was caught is handled at the top of the loop
+        // without sleeping while some connection has more to read
+        int nfds = reactor_wait(epollfd, events, MAX_EVENTS, 0 == nunread ? -1 : 0);
+        if ( -1 == nfds )
+            continue;
+
+        struct timespec batch_start;
+        clock_gettime(CLOCK_MONOTONIC, &batch_start);
+
+        read_unread_connections(epollfd);
+        reactor_dispatch(epollfd, events, nfds);
+
+        // everything the batch appended goes to disk together
+        if ( 0 == commit_window_us && 0 != nwaiting )
+            wal_commit(epollfd);
+
+        free_closed_connections();
+
+        struct timespec batch_end;
+        clock_gettime(CLOCK_MONOTONIC, &batch_end);
+
+        uint64_t busy = (batch_end.tv_sec - batch_start.tv_sec) * 1000000000ull
+            + batch_end.tv_nsec - batch_start.tv_nsec;
+        stats.loop_batches++;
+        stats.loop_events += nfds;
+        stats.loop_busy_ns += busy;
+        if ( busy > stats.loop_busy_max_ns )
+            stats.loop_busy_max_ns = busy;
     }
 }
@@ -0,0 +1,115 @@
+/*
+ * Copyright (c) Seungyeob Choi
+ *
+ * A single-producer single-consumer byte ring shared by the client and the server
+ * through a memfd, with an eventfd doorbell for each direction.
+ *
+ * The client creates the ring and offers it over an AF_UNIX connection, passing the
+ * memfd and both eventfds with SCM_RIGHTS. The memfd has to be sealed against shrinking
+ * and growing, and the server refuses it otherwise. File descriptors cannot travel over TCP,
+ * so the server refuses offers arriving any other way and the client falls back to
+ * writing the socket. Once accepted, the socket is still used for acknowledgements,
+ * "Ack" and the count of bytes taken from the ring so far, and to detect the end of
+ * the connection.
+ *
+ * Both sides spin for a while before going to sleep. The spin budget grows when
+ * spinning paid off and shrinks when it did not, so an idle peer costs no CPU.
+ */
+#ifndef SHMRING_H
+#define SHMRING_H
+
+#include <stdatomic.h>
+#include <stdint.h>
+#include <unistd.h>     // write()
+
+#define SHM_RING_MAGIC 0x53484d31   // "SHM1"
+
+// data capacity of the ring; must be a power of two
+#define SHM_RING_SIZE (1 << 20)
+
+// handshake exchanged over the socket right after connect()
+#define SHM_OFFER "\0SHM1\n"
+#define SHM_OFFER_LEN 6
+#define SHM_ACCEPT "Shm\n"
+#define SHM_REJECT "Nak\n"
+#define SHM_REPLY_LEN 4
+
+// bounds of the adaptive spin before a side arms its doorbell and sleeps in epoll_wait
+#define SHM_SPIN_MIN 16
+#define SHM_SPIN_MAX 4096
+
+struct shm_ring
+{
+    uint32_t magic;
+    uint32_t size;
+
+    // free-running byte counters; head is written by the producer only and
+    // tail by the consumer only, each on its own cache line
+    _Alignas(64) _Atomic uint64_t head;
+    _Alignas(64) _Atomic uint64_t tail;
+
+    // a side sets its flag right before sleeping; the other side clears it
+    // and rings the matching eventfd
+    _Alignas(64) _Atomic uint32_t consumer_waiting;
+    _Atomic uint32_t producer_waiting;
+
+    _Alignas(64) char data[];
+};
+
+static inline void shm_cpu_relax(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#endif
+}
+
+// spins until *pos moves away from seen, within the adaptive budget
+// returns 1 if it moved
+static inline int shm_spin(_Atomic uint64_t *pos, uint64_t seen, unsigned *budget)
+{
+    for ( unsigned i = 0; i < *budget; i++ )
+    {
+        if ( atomic_load_explicit(pos, memory_order_acquire) != seen )
+        {
+            if ( *budget < SHM_SPIN_MAX )
+                *budget *= 2;
+            return 1;
+        }
+        shm_cpu_relax();
+    }
+
+    if ( *budget > SHM_SPIN_MIN )
+        *budget /= 2;
+    return 0;
+}
+
+// announces that the caller is about to sleep waiting for *pos to move away from seen
+// returns 0 if it already moved, in which case the caller must not sleep
+static inline int shm_arm(_Atomic uint32_t *waiting, _Atomic uint64_t *pos, uint64_t seen)
+{
+    atomic_store(waiting, 1);
+
+    // pairs with the store to *pos followed by the load of *waiting in shm_doorbell()
+    if ( atomic_load(pos) != seen )
+    {
+        atomic_store(waiting, 0);
+        return 0;
+    }
+
+    return 1;
+}
+
+// wakes up the other side if it is sleeping
+static inline void shm_doorbell(_Atomic uint32_t *waiting, int eventfd)
+{
+    if ( 0 != atomic_load(waiting) && 0 != atomic_exchange(waiting, 0) )
+    {
+        uint64_t one = 1;
+
+        // EAGAIN means the counter is saturated, which already wakes the reader
+        if ( sizeof(one) != write(eventfd, &one, sizeof(one)) )
+            return;
+    }
+}
+
+#endif
@@ -0,0 +1,46 @@
+/*
+ * Copyright (c) Seungyeob Choi
+ *
+ * The dedup upload (client -D, server -w -D). Rather than sending a file, the client cuts it
+ * into chunks (see cdc.h) and sends their fingerprints first, in batches of up to
+ * UPLOAD_CHUNKS chunks and UPLOAD_BYTES bytes. The first batch starts the connection with
+ * a NUL byte, like the other handshakes:
+ *
+ *   "\0CHUNKS " count "\n"   then count upload_chunk entries
+ *
+ * The server answers with the chunks of the batch it does not hold, by their index in the
+ * batch, and the client sends the bytes of these chunks one after the other:
+ *
+ *   "Missing " count "\n"    then count uint32_t indexes, in increasing order
+ *
+ * The list is always answered, with a count of 0 if nothing is missing, so that a client can
+ * tell a server that took it for data. Another round follows only while something is still
+ * missing, as a chunk the server held when it answered may be gone by the time the others
+ * arrive. Once it has everything, the server logs the batch and
+ * acknowledges it with "Ack", after which the client sends the next one.
+ * Binary fields are in the byte order of the host, both ends being alike.
+ */
+#ifndef UPLOAD_H
+#define UPLOAD_H
+
+#include <stdint.h>
+
+#define UPLOAD_VERB "\0CHUNKS "
+#define UPLOAD_VERB_LEN 8
+#define UPLOAD_REPLY "Missing "
+#define UPLOAD_REPLY_LEN 8
+
+// longest command and answer line, newline included
+#define UPLOAD_LINE_MAX 32
+
+#define UPLOAD_CHUNKS 256
+#define UPLOAD_BYTES (2 << 20)
+
+struct upload_chunk
+{
+    uint64_t fingerprint[2];        // cdc_fingerprint()
+    uint32_t len;
+    uint32_t reserved;              // zero
+};
+
+#endif